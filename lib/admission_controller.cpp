@@ -0,0 +1,217 @@
+#include "libfilezilla/admission_controller.hpp"
+
+#include <algorithm>
+
+namespace fz {
+
+admission_ticket::admission_ticket(admission_ticket && op) noexcept
+	: controller_(op.controller_)
+{
+	op.controller_ = nullptr;
+}
+
+admission_ticket& admission_ticket::operator=(admission_ticket && op) noexcept
+{
+	if (this != &op) {
+		release();
+		controller_ = op.controller_;
+		op.controller_ = nullptr;
+	}
+	return *this;
+}
+
+void admission_ticket::release()
+{
+	if (controller_) {
+		auto * controller = controller_;
+		controller_ = nullptr;
+		controller->release_ticket();
+	}
+}
+
+void admission_controller::token_bucket::refill(monotonic_clock const& now, rate::type rate, rate::type burst)
+{
+	rate::type const capacity = std::max(burst, rate::type(1)) * 1000;
+	if (!last_ || rate == rate::unlimited) {
+		// Initially full
+		milli_tokens_ = capacity;
+		last_ = now;
+		return;
+	}
+
+	int64_t const ms = (now - last_).get_milliseconds();
+	if (ms <= 0) {
+		return;
+	}
+	last_ = now;
+
+	if (rate && static_cast<rate::type>(ms) > capacity / rate) {
+		milli_tokens_ = capacity;
+	}
+	else {
+		milli_tokens_ = std::min(capacity, milli_tokens_ + rate * static_cast<rate::type>(ms));
+	}
+}
+
+bool admission_controller::token_bucket::take(monotonic_clock const& now, rate::type rate, rate::type burst)
+{
+	refill(now, rate, burst);
+	if (milli_tokens_ < 1000) {
+		return false;
+	}
+	milli_tokens_ -= 1000;
+	return true;
+}
+
+duration admission_controller::token_bucket::wait(rate::type rate) const
+{
+	if (milli_tokens_ >= 1000) {
+		return duration();
+	}
+	if (!rate) {
+		return duration::from_seconds(1);
+	}
+	return duration::from_milliseconds(static_cast<int64_t>((1000 - milli_tokens_ + rate - 1) / rate));
+}
+
+admission_controller::admission_controller(event_loop & loop, thread_pool & pool, listen_socket & listener, event_handler * listen_handler, admission_limits const& limits)
+	: event_handler(loop)
+	, pool_(pool)
+	, listener_(listener)
+	, listen_handler_(listen_handler)
+{
+	set_limits(limits);
+}
+
+admission_controller::~admission_controller()
+{
+	remove_handler();
+}
+
+void admission_controller::set_limits(admission_limits const& limits)
+{
+	scoped_lock l(mtx_);
+	limits_ = limits;
+	if (!limits_.max_handshakes) {
+		limits_.max_handshakes = 1;
+	}
+	if (waiting_for_slot_ && handshakes_ < limits_.max_handshakes) {
+		waiting_for_slot_ = false;
+		retrigger();
+	}
+}
+
+std::unique_ptr<socket> admission_controller::accept(int& error, admission_ticket & ticket, event_handler * handler)
+{
+	ticket.release();
+
+	scoped_lock l(mtx_);
+
+	if (handshakes_ >= limits_.max_handshakes) {
+		waiting_for_slot_ = true;
+		error = EAGAIN;
+		return nullptr;
+	}
+
+	auto const now = monotonic_clock::now();
+	global_.refill(now, limits_.rate, limits_.burst);
+	if (global_.milli_tokens_ < 1000) {
+		if (!timer_) {
+			timer_ = add_timer(std::max(global_.wait(limits_.rate), duration::from_milliseconds(1)), true);
+		}
+		error = EAGAIN;
+		return nullptr;
+	}
+
+	socket_descriptor desc = listener_.fast_accept(error);
+	if (!desc) {
+		return nullptr;
+	}
+
+	if (limits_.per_address_rate != rate::unlimited) {
+		if (peers_.size() >= sweep_threshold_) {
+			sweep(now);
+		}
+		auto & bucket = peers_[desc.peer_ip(true)];
+		if (!bucket.take(now, limits_.per_address_rate, limits_.per_address_burst)) {
+			// Closes the connection as desc goes out of scope
+			++rejected_;
+			error = ECONNREFUSED;
+			return nullptr;
+		}
+	}
+
+	global_.take(now, limits_.rate, limits_.burst);
+
+	++handshakes_;
+	ticket.controller_ = this;
+
+	l.unlock();
+
+	auto ret = socket::from_descriptor(std::move(desc), pool_, error, handler);
+	if (!ret) {
+		ticket.release();
+	}
+	return ret;
+}
+
+size_t admission_controller::handshakes_in_progress() const
+{
+	scoped_lock l(mtx_);
+	return handshakes_;
+}
+
+uint64_t admission_controller::rejected() const
+{
+	scoped_lock l(mtx_);
+	return rejected_;
+}
+
+void admission_controller::release_ticket()
+{
+	scoped_lock l(mtx_);
+	if (handshakes_) {
+		--handshakes_;
+	}
+	if (waiting_for_slot_ && handshakes_ < limits_.max_handshakes) {
+		waiting_for_slot_ = false;
+		retrigger();
+	}
+}
+
+void admission_controller::retrigger()
+{
+	if (listen_handler_) {
+		listen_handler_->send_event<socket_event>(&listener_, socket_event_flag::connection, 0);
+	}
+}
+
+void admission_controller::operator()(event_base const& ev)
+{
+	dispatch<timer_event>(ev, this, &admission_controller::on_timer);
+}
+
+void admission_controller::on_timer(timer_id const&)
+{
+	scoped_lock l(mtx_);
+	timer_ = 0;
+	retrigger();
+}
+
+void admission_controller::sweep(monotonic_clock const& now)
+{
+	// Peers with full buckets are indistinguishable from new peers
+	rate::type const capacity = std::max(limits_.per_address_burst, rate::type(1)) * 1000;
+	for (auto it = peers_.begin(); it != peers_.end(); ) {
+		it->second.refill(now, limits_.per_address_rate, limits_.per_address_burst);
+		if (it->second.milli_tokens_ >= capacity) {
+			it = peers_.erase(it);
+		}
+		else {
+			++it;
+		}
+	}
+	sweep_threshold_ = std::max(size_t(1024), peers_.size() * 2);
+}
+
+}
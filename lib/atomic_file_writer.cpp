@@ -0,0 +1,350 @@
+#include "libfilezilla/libfilezilla.hpp"
+
+#include "libfilezilla/atomic_file_writer.hpp"
+#include "libfilezilla/encode.hpp"
+#include "libfilezilla/local_filesys.hpp"
+#include "libfilezilla/mutex.hpp"
+#include "libfilezilla/util.hpp"
+
+#ifndef FZ_WINDOWS
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+#endif
+
+#include <errno.h>
+
+#include <algorithm>
+#include <vector>
+
+namespace fz {
+
+namespace {
+struct request final
+{
+	native_string path;
+	buffer data;
+	file::creation_flags flags{};
+
+	event_handler * handler{};
+
+	// Only set for synchronous writes
+	condition * cond{};
+
+	bool done{};
+	result res{};
+};
+
+native_string parent_dir(native_string const& path)
+{
+#ifdef FZ_WINDOWS
+	auto pos = path.find_last_of(fzT("\\/"));
+#else
+	auto pos = path.rfind('/');
+#endif
+	if (pos == native_string::npos) {
+		return fzT(".");
+	}
+	if (!pos) {
+		return path.substr(0, 1);
+	}
+	return path.substr(0, pos);
+}
+
+result write_error()
+{
+#ifdef FZ_WINDOWS
+	DWORD const err = GetLastError();
+	if (err == ERROR_DISK_FULL) {
+		return {result::nospace, err};
+	}
+	return {result::other, err};
+#else
+	int const err = errno;
+	if (err == ENOSPC || err == EDQUOT) {
+		return {result::nospace, err};
+	}
+	return {result::other, err};
+#endif
+}
+}
+
+class atomic_file_writer_impl final
+{
+public:
+	atomic_file_writer_impl(thread_pool & pool, duration const& latency, size_t max_group);
+	~atomic_file_writer_impl();
+
+	void add(request & r, scoped_lock & l);
+
+	void remove_handler(event_handler & handler);
+
+	mutex mtx_{false};
+
+private:
+	void entry();
+	void commit(std::vector<request*> & group);
+
+	duration const latency_;
+	size_t const max_group_;
+
+	condition cond_;
+	std::vector<request*> pending_;
+	std::vector<request*> committing_;
+	monotonic_clock first_;
+	bool quit_{};
+
+	async_task task_;
+};
+
+atomic_file_writer_impl::atomic_file_writer_impl(thread_pool & pool, duration const& latency, size_t max_group)
+	: latency_(latency)
+	, max_group_(std::max(max_group, size_t(1)))
+{
+	task_ = pool.spawn([this]() { entry(); });
+}
+
+atomic_file_writer_impl::~atomic_file_writer_impl()
+{
+	{
+		scoped_lock l(mtx_);
+		quit_ = true;
+		cond_.signal(l);
+	}
+	task_.join();
+}
+
+void atomic_file_writer_impl::add(request & r, scoped_lock & l)
+{
+	if (!task_) {
+		r.res = result{result::other};
+		r.done = true;
+		if (!r.cond) {
+			if (r.handler) {
+				r.handler->send_event<atomic_file_write_event>(r.path, r.res);
+			}
+			delete &r;
+		}
+		return;
+	}
+
+	if (pending_.empty()) {
+		first_ = monotonic_clock::now();
+	}
+	pending_.push_back(&r);
+	if (pending_.size() == 1 || pending_.size() == max_group_) {
+		cond_.signal(l);
+	}
+}
+
+void atomic_file_writer_impl::remove_handler(event_handler & handler)
+{
+	scoped_lock l(mtx_);
+	for (auto * r : pending_) {
+		if (r->handler == &handler) {
+			r->handler = nullptr;
+		}
+	}
+	for (auto * r : committing_) {
+		if (r->handler == &handler) {
+			r->handler = nullptr;
+		}
+	}
+}
+
+void atomic_file_writer_impl::entry()
+{
+	scoped_lock l(mtx_);
+	while (true) {
+		if (pending_.empty()) {
+			if (quit_) {
+				break;
+			}
+			cond_.wait(l);
+			continue;
+		}
+
+		if (!quit_ && pending_.size() < max_group_) {
+			// Give further writes the chance to join the group
+			duration const wait = first_ + latency_ - monotonic_clock::now();
+			if (wait > duration()) {
+				cond_.wait(l, wait);
+				continue;
+			}
+		}
+
+		committing_ = std::move(pending_);
+		pending_.clear();
+
+		l.unlock();
+		commit(committing_);
+		l.lock();
+
+		for (auto * r : committing_) {
+			r->done = true;
+			if (r->cond) {
+				r->cond->signal(l);
+			}
+			else {
+				if (r->handler) {
+					r->handler->send_event<atomic_file_write_event>(r->path, r->res);
+				}
+				delete r;
+			}
+		}
+		committing_.clear();
+	}
+}
+
+void atomic_file_writer_impl::commit(std::vector<request*> & group)
+{
+	struct entry final
+	{
+		request * r{};
+		native_string tmp;
+		file f;
+	};
+	std::vector<entry> entries;
+	entries.reserve(group.size());
+
+	// Write all temporary files
+	for (auto * r : group) {
+		entry e;
+		e.r = r;
+		e.tmp = r->path + fzT(".") + to_native(hex_encode<std::string>(random_bytes(6))) + fzT(".tmp");
+
+		auto const flags = static_cast<file::creation_flags>(r->flags & (file::current_user_only | file::current_user_and_admins_only));
+		r->res = e.f.open(e.tmp, file::writing, file::empty | flags);
+		if (!r->res) {
+			continue;
+		}
+
+		unsigned char const* p = r->data.get();
+		size_t remaining = r->data.size();
+		while (remaining) {
+			int64_t const written = e.f.write(p, static_cast<int64_t>(remaining));
+			if (written <= 0) {
+				r->res = write_error();
+				break;
+			}
+			p += written;
+			remaining -= static_cast<size_t>(written);
+		}
+		r->data.clear();
+
+		if (!r->res) {
+			e.f.close();
+			remove_file(e.tmp);
+			continue;
+		}
+		entries.push_back(std::move(e));
+	}
+
+	// Flush their contents. Ideally with one syncfs per filesystem
+#if HAVE_SYNCFS
+	std::vector<dev_t> synced;
+#endif
+	for (auto & e : entries) {
+#if HAVE_SYNCFS
+		struct stat s;
+		if (!fstat(e.f.fd(), &s)) {
+			if (std::find(synced.cbegin(), synced.cend(), s.st_dev) != synced.cend()) {
+				continue;
+			}
+			if (!syncfs(e.f.fd())) {
+				synced.push_back(s.st_dev);
+				continue;
+			}
+		}
+#endif
+		if (!e.f.fsync()) {
+			e.r->res = write_error();
+		}
+	}
+
+	// Replace the targets
+	std::vector<native_string> dirs;
+	for (auto & e : entries) {
+		e.f.close();
+		if (e.r->res) {
+			e.r->res = rename_file(e.tmp, e.r->path, false);
+		}
+		if (!e.r->res) {
+			remove_file(e.tmp);
+			continue;
+		}
+#ifndef FZ_WINDOWS
+		auto dir = parent_dir(e.r->path);
+		if (std::find(dirs.cbegin(), dirs.cend(), dir) == dirs.cend()) {
+			dirs.push_back(std::move(dir));
+		}
+#endif
+	}
+
+#ifndef FZ_WINDOWS
+	// Persist the renames, once per directory
+	for (auto const& dir : dirs) {
+		result res{};
+		int fd = ::open(dir.c_str(), O_RDONLY | O_CLOEXEC);
+		if (fd == -1 || ::fsync(fd) != 0) {
+			res = result{result::other, errno};
+		}
+		if (fd != -1) {
+			::close(fd);
+		}
+		if (!res) {
+			for (auto & e : entries) {
+				if (e.r->res && parent_dir(e.r->path) == dir) {
+					e.r->res = res;
+				}
+			}
+		}
+	}
+#endif
+}
+
+atomic_file_writer::atomic_file_writer(thread_pool & pool, duration const& latency, size_t max_group)
+	: impl_(std::make_unique<atomic_file_writer_impl>(pool, latency, max_group))
+{
+}
+
+atomic_file_writer::~atomic_file_writer()
+{
+}
+
+result atomic_file_writer::write(native_string const& path, buffer && data, file::creation_flags flags)
+{
+	condition cond;
+
+	request r;
+	r.path = path;
+	r.data = std::move(data);
+	r.flags = flags;
+	r.cond = &cond;
+
+	scoped_lock l(impl_->mtx_);
+	impl_->add(r, l);
+	while (!r.done) {
+		cond.wait(l);
+	}
+	return r.res;
+}
+
+void atomic_file_writer::write(native_string const& path, buffer && data, event_handler & handler, file::creation_flags flags)
+{
+	auto * r = new request;
+	r->path = path;
+	r->data = std::move(data);
+	r->flags = flags;
+	r->handler = &handler;
+
+	scoped_lock l(impl_->mtx_);
+	impl_->add(*r, l);
+}
+
+void atomic_file_writer::remove_handler(event_handler & handler)
+{
+	impl_->remove_handler(handler);
+}
+
+}
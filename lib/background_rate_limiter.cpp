@@ -0,0 +1,152 @@
+#include "libfilezilla/background_rate_limiter.hpp"
+#include "libfilezilla/socket.hpp"
+
+#include <algorithm>
+
+namespace fz {
+
+namespace {
+auto const interval = duration::from_milliseconds(100);
+
+// Number of per-minute minima the base round-trip time is taken from
+size_t const base_history_size = 10;
+}
+
+background_rate_limiter::background_rate_limiter(event_loop & loop, rate::type max_rate, rate::type min_rate)
+	: event_handler(loop)
+	, min_rate_(min_rate ? min_rate : 1)
+	, max_rate_(std::max(max_rate, min_rate_))
+	, limits_{min_rate_, min_rate_}
+{
+	limiter_.set_limits(limits_[direction::inbound], limits_[direction::outbound]);
+}
+
+background_rate_limiter::~background_rate_limiter()
+{
+	remove_handler();
+}
+
+void background_rate_limiter::add_foreground(rate_limiter & foreground)
+{
+	scoped_lock l(mtx_);
+	if (std::find(foreground_.cbegin(), foreground_.cend(), &foreground) == foreground_.cend()) {
+		foreground_.push_back(&foreground);
+	}
+	update_timer();
+}
+
+void background_rate_limiter::remove_foreground(rate_limiter & foreground)
+{
+	scoped_lock l(mtx_);
+	foreground_.erase(std::remove(foreground_.begin(), foreground_.end(), &foreground), foreground_.end());
+	update_timer();
+}
+
+void background_rate_limiter::add_socket(socket & s)
+{
+	scoped_lock l(mtx_);
+	auto it = std::find_if(sockets_.cbegin(), sockets_.cend(), [&s](sample_source const& source) { return source.socket_ == &s; });
+	if (it == sockets_.cend()) {
+		sockets_.emplace_back();
+		sockets_.back().socket_ = &s;
+	}
+	update_timer();
+}
+
+void background_rate_limiter::remove_socket(socket & s)
+{
+	scoped_lock l(mtx_);
+	sockets_.erase(std::remove_if(sockets_.begin(), sockets_.end(), [&s](sample_source const& source) { return source.socket_ == &s; }), sockets_.end());
+	update_timer();
+}
+
+void background_rate_limiter::set_target_delay(duration const& target)
+{
+	scoped_lock l(mtx_);
+	target_delay_ = std::max(target, duration::from_milliseconds(1));
+}
+
+rate::type background_rate_limiter::limit(direction::type const d)
+{
+	scoped_lock l(mtx_);
+	return limits_[d ? 1 : 0];
+}
+
+void background_rate_limiter::update_timer()
+{
+	if (foreground_.empty() && sockets_.empty()) {
+		if (timer_) {
+			stop_timer(timer_);
+			timer_ = 0;
+		}
+	}
+	else if (!timer_) {
+		timer_ = add_timer(interval, false);
+	}
+}
+
+void background_rate_limiter::operator()(event_base const& ev)
+{
+	dispatch<timer_event>(ev, this, &background_rate_limiter::on_timer);
+}
+
+duration background_rate_limiter::queuing_delay(monotonic_clock const& now)
+{
+	// The largest delay of any socket, a single congested path suffices to back off
+	int delay{};
+	for (auto & source : sockets_) {
+		int const rtt = source.socket_->round_trip_time();
+		if (rtt < 0) {
+			continue;
+		}
+
+		if (source.base_history_.empty() || now - source.minute_start_ >= duration::from_minutes(1)) {
+			source.base_history_.push_back(rtt);
+			if (source.base_history_.size() > base_history_size) {
+				source.base_history_.erase(source.base_history_.begin());
+			}
+			source.minute_start_ = now;
+		}
+		else if (rtt < source.base_history_.back()) {
+			source.base_history_.back() = rtt;
+		}
+
+		int const base = *std::min_element(source.base_history_.cbegin(), source.base_history_.cend());
+		delay = std::max(delay, rtt - base);
+	}
+
+	return duration::from_milliseconds(delay / 1000);
+}
+
+void background_rate_limiter::on_timer(timer_id const&)
+{
+	scoped_lock l(mtx_);
+
+	duration const delay = queuing_delay(monotonic_clock::now());
+
+	for (auto const d : {direction::inbound, direction::outbound}) {
+		bool congested = delay > target_delay_;
+		for (auto * foreground : foreground_) {
+			if (foreground->waiting_buckets(d)) {
+				congested = true;
+				break;
+			}
+		}
+
+		rate::type & limit = limits_[d];
+		if (congested) {
+			// Multiplicative decrease, yield quickly
+			limit = std::max(min_rate_, limit / 2);
+		}
+		else if (limit < max_rate_ && limiter_.waiting_buckets(d)) {
+			// Additive increase, in proportion to how far below the target the delay is
+			double const off_target = 1.0 - static_cast<double>(delay.get_milliseconds()) / target_delay_.get_milliseconds();
+			rate::type const step = static_cast<rate::type>(std::max(min_rate_, limit / 8) * off_target);
+			limit = (max_rate_ - limit < step) ? max_rate_ : (limit + step);
+		}
+	}
+
+	limiter_.set_limits(limits_[direction::inbound], limits_[direction::outbound]);
+}
+
+}
@@ -0,0 +1,58 @@
+#include "libfilezilla/buffer_pool.hpp"
+
+namespace fz {
+
+buffer_pool::buffer_pool(size_t max_idle_memory, size_t max_buffer_size)
+	: max_idle_memory_(max_idle_memory)
+	, max_buffer_size_(max_buffer_size)
+{
+}
+
+buffer buffer_pool::acquire()
+{
+	scoped_lock l(mtx_);
+	++outstanding_;
+	if (idle_.empty()) {
+		return buffer();
+	}
+
+	// Most recently released first, its memory is the most likely to still be cached
+	buffer ret = std::move(idle_.back());
+	idle_.pop_back();
+	idle_memory_ -= ret.capacity();
+	return ret;
+}
+
+void buffer_pool::release(buffer && b)
+{
+	buffer tmp = std::move(b);
+	tmp.clear();
+
+	scoped_lock l(mtx_);
+	if (outstanding_) {
+		--outstanding_;
+	}
+
+	size_t const capacity = tmp.capacity();
+	if (!capacity || capacity > max_buffer_size_ || idle_memory_ + capacity > max_idle_memory_) {
+		// Freed once tmp goes out of scope
+		return;
+	}
+
+	idle_memory_ += capacity;
+	idle_.emplace_back(std::move(tmp));
+}
+
+size_t buffer_pool::idle_memory() const
+{
+	scoped_lock l(mtx_);
+	return idle_memory_;
+}
+
+size_t buffer_pool::outstanding() const
+{
+	scoped_lock l(mtx_);
+	return outstanding_;
+}
+
+}
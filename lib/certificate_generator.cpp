@@ -0,0 +1,279 @@
+#include "libfilezilla/certificate_generator.hpp"
+#include "libfilezilla/thread_pool.hpp"
+#include "tls_layer_impl.hpp"
+
+#include <algorithm>
+#include <deque>
+
+namespace fz {
+
+class tls_key_pool::impl final
+{
+public:
+	impl(thread_pool & pool, tls_key_type key_type, size_t size)
+		: pool_(pool)
+		, key_type_(key_type)
+		, size_(size)
+	{}
+
+	// Must be called with the mutex held
+	void refill();
+	void entry();
+
+	thread_pool & pool_;
+	tls_key_type const key_type_;
+	size_t const size_;
+
+	mutable mutex mtx_{false};
+	std::deque<std::string> keys_;
+	async_task task_;
+	bool active_{};
+	bool quit_{};
+};
+
+void tls_key_pool::impl::refill()
+{
+	if (active_ || quit_ || keys_.size() >= size_) {
+		return;
+	}
+
+	// An inactive task has left its loop already, joining does not block for long.
+	task_.join();
+	task_ = pool_.spawn([this] { entry(); });
+	active_ = static_cast<bool>(task_);
+}
+
+void tls_key_pool::impl::entry()
+{
+	scoped_lock l(mtx_);
+	while (!quit_ && keys_.size() < size_) {
+		l.unlock();
+		auto key = tls_layer_impl::generate_key(key_type_);
+		l.lock();
+
+		if (key.empty()) {
+			break;
+		}
+		keys_.emplace_back(std::move(key));
+	}
+	active_ = false;
+}
+
+tls_key_pool::tls_key_pool(thread_pool & pool, tls_key_type key_type, size_t size)
+	: impl_(std::make_unique<impl>(pool, key_type, size))
+{
+	scoped_lock l(impl_->mtx_);
+	impl_->refill();
+}
+
+tls_key_pool::~tls_key_pool()
+{
+	{
+		scoped_lock l(impl_->mtx_);
+		impl_->quit_ = true;
+	}
+	impl_->task_.join();
+}
+
+tls_key_type tls_key_pool::key_type() const
+{
+	return impl_->key_type_;
+}
+
+std::string tls_key_pool::take()
+{
+	{
+		scoped_lock l(impl_->mtx_);
+		if (!impl_->keys_.empty()) {
+			std::string key = std::move(impl_->keys_.front());
+			impl_->keys_.pop_front();
+			impl_->refill();
+			return key;
+		}
+		impl_->refill();
+	}
+
+	return tls_layer_impl::generate_key(impl_->key_type_);
+}
+
+size_t tls_key_pool::available() const
+{
+	scoped_lock l(impl_->mtx_);
+	return impl_->keys_.size();
+}
+
+class certificate_generator::impl final
+{
+public:
+	impl(certificate_generator & parent, thread_pool & pool, tls_key_pool * key_pool, size_t max_concurrency)
+		: parent_(parent)
+		, pool_(pool)
+		, key_pool_(key_pool)
+		, workers_(max_concurrency ? max_concurrency : 1)
+	{}
+
+	struct request final
+	{
+		uint64_t id_{};
+		event_handler* handler_{};
+		native_string password_;
+		std::string distinguished_name_;
+		std::vector<std::string> hostnames_;
+		tls_key_type key_type_{};
+		bool csr_{};
+		bool csr_as_pem_{};
+	};
+
+	uint64_t queue(request && r);
+	void entry(size_t worker);
+
+	struct worker final
+	{
+		async_task task_;
+		event_handler* handler_{}; // Of the request in progress, reset if cancelled
+		bool active_{};
+	};
+
+	certificate_generator & parent_;
+	thread_pool & pool_;
+	tls_key_pool * key_pool_{};
+
+	mutex mtx_{false};
+	std::deque<request> requests_;
+	std::vector<worker> workers_;
+	uint64_t next_id_{1};
+	bool quit_{};
+};
+
+uint64_t certificate_generator::impl::queue(request && r)
+{
+	scoped_lock l(mtx_);
+	if (quit_) {
+		return 0;
+	}
+
+	r.id_ = next_id_++;
+	requests_.emplace_back(std::move(r));
+
+	// Workers leave once the queue is empty, start another one unless all are busy.
+	bool running{};
+	bool spawned{};
+	for (size_t i = 0; i < workers_.size(); ++i) {
+		auto & w = workers_[i];
+		if (w.active_) {
+			running = true;
+		}
+		else if (!spawned) {
+			w.task_.join();
+			w.task_ = pool_.spawn([this, i] { entry(i); });
+			if (w.task_) {
+				w.active_ = true;
+				spawned = true;
+			}
+		}
+	}
+
+	if (!running && !spawned) {
+		requests_.pop_back();
+		return 0;
+	}
+
+	return next_id_ - 1;
+}
+
+void certificate_generator::impl::entry(size_t worker)
+{
+	scoped_lock l(mtx_);
+	while (!quit_ && !requests_.empty()) {
+		request r = std::move(requests_.front());
+		requests_.pop_front();
+		workers_[worker].handler_ = r.handler_;
+
+		l.unlock();
+		std::string key;
+		if (key_pool_ && key_pool_->key_type() == r.key_type_) {
+			key = key_pool_->take();
+		}
+		auto result = r.csr_
+			? tls_layer_impl::generate_csr(r.password_, r.distinguished_name_, r.hostnames_, r.csr_as_pem_, r.key_type_, key)
+			: tls_layer_impl::generate_selfsigned_certificate(r.password_, r.distinguished_name_, r.hostnames_, r.key_type_, key);
+		std::fill(r.password_.begin(), r.password_.end(), 0);
+		std::fill(key.begin(), key.end(), 0);
+		l.lock();
+
+		if (workers_[worker].handler_) {
+			workers_[worker].handler_->send_event<certificate_generation_event>(&parent_, r.id_, std::move(result));
+			workers_[worker].handler_ = nullptr;
+		}
+	}
+	workers_[worker].active_ = false;
+}
+
+certificate_generator::certificate_generator(thread_pool & pool, tls_key_pool * key_pool, size_t max_concurrency)
+	: impl_(std::make_unique<impl>(*this, pool, key_pool, max_concurrency))
+{
+}
+
+certificate_generator::~certificate_generator()
+{
+	{
+		scoped_lock l(impl_->mtx_);
+		impl_->quit_ = true;
+		impl_->requests_.clear();
+	}
+
+	for (auto & w : impl_->workers_) {
+		w.task_.join();
+	}
+}
+
+uint64_t certificate_generator::generate_selfsigned_certificate(event_handler & handler, native_string const& password, std::string const& distinguished_name, std::vector<std::string> const& hostnames, tls_key_type key_type)
+{
+	impl::request r;
+	r.handler_ = &handler;
+	r.password_ = password;
+	r.distinguished_name_ = distinguished_name;
+	r.hostnames_ = hostnames;
+	r.key_type_ = key_type;
+	return impl_->queue(std::move(r));
+}
+
+uint64_t certificate_generator::generate_csr(event_handler & handler, native_string const& password, std::string const& distinguished_name, std::vector<std::string> const& hostnames, bool csr_as_pem, tls_key_type key_type)
+{
+	impl::request r;
+	r.handler_ = &handler;
+	r.password_ = password;
+	r.distinguished_name_ = distinguished_name;
+	r.hostnames_ = hostnames;
+	r.key_type_ = key_type;
+	r.csr_ = true;
+	r.csr_as_pem_ = csr_as_pem;
+	return impl_->queue(std::move(r));
+}
+
+void certificate_generator::cancel(event_handler & handler)
+{
+	scoped_lock l(impl_->mtx_);
+
+	auto & requests = impl_->requests_;
+	requests.erase(std::remove_if(requests.begin(), requests.end(), [&](impl::request const& r) { return r.handler_ == &handler; }), requests.end());
+
+	for (auto & w : impl_->workers_) {
+		if (w.handler_ == &handler) {
+			w.handler_ = nullptr;
+		}
+	}
+
+	auto filter = [&](event_loop::Events::value_type const& ev) -> bool {
+		if (ev.first != &handler) {
+			return false;
+		}
+		else if (ev.second->derived_type() != certificate_generation_event::type()) {
+			return false;
+		}
+		return std::get<0>(static_cast<certificate_generation_event const&>(*ev.second).v_) == this;
+	};
+	handler.event_loop_.filter_events(filter);
+}
+
+}
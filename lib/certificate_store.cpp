@@ -0,0 +1,152 @@
+#include "libfilezilla/certificate_store.hpp"
+#include "libfilezilla/local_filesys.hpp"
+#include "libfilezilla/logger.hpp"
+#include "libfilezilla/thread_pool.hpp"
+#include "libfilezilla/translate.hpp"
+
+#include <atomic>
+
+namespace fz {
+
+bool certificate_store::add(x509_certificate const& cert)
+{
+	return add(x509_certificate(cert));
+}
+
+bool certificate_store::add(x509_certificate && cert)
+{
+	if (!cert) {
+		return false;
+	}
+
+	auto const& fingerprint = cert.get_fingerprint_sha256();
+	if (fingerprint.empty() || by_fingerprint_.find(fingerprint) != by_fingerprint_.end()) {
+		return false;
+	}
+
+	auto const& c = certificates_.emplace_back(std::move(cert));
+	by_fingerprint_.emplace(c.get_fingerprint_sha256(), &c);
+	by_subject_.emplace(c.get_subject(), &c);
+	by_issuer_.emplace(c.get_issuer(), &c);
+
+	return true;
+}
+
+size_t certificate_store::load_files(thread_pool & pool, std::vector<native_string> const& files, bool pem, size_t concurrency, logger_interface * logger)
+{
+	std::vector<std::vector<x509_certificate>> loaded(files.size());
+
+	std::atomic<size_t> next{};
+	auto worker = [&]() {
+		for (size_t i = next++; i < files.size(); i = next++) {
+			auto certs = load_certificates_file(files[i], pem, false, nullptr);
+
+			// Extract the indexed fields while still running in parallel
+			for (auto const& cert : certs) {
+				cert.get_fingerprint_sha256();
+				cert.get_subject();
+				cert.get_issuer();
+			}
+			loaded[i] = std::move(certs);
+		}
+	};
+
+	{
+		std::vector<async_task> tasks;
+		size_t const threads = std::min(concurrency, files.size());
+		for (size_t i = 1; i < threads; ++i) {
+			auto task = pool.spawn(worker);
+			if (!task) {
+				break;
+			}
+			tasks.emplace_back(std::move(task));
+		}
+
+		worker();
+	}
+
+	size_t added{};
+	for (size_t i = 0; i < files.size(); ++i) {
+		if (loaded[i].empty()) {
+			if (logger) {
+				logger->log(logmsg::debug_warning, fztranslate("Could not load certificates from %s"), files[i]);
+			}
+			continue;
+		}
+		for (auto & cert : loaded[i]) {
+			if (add(std::move(cert))) {
+				++added;
+			}
+		}
+	}
+
+	return added;
+}
+
+size_t certificate_store::load_directory(thread_pool & pool, native_string const& path, bool pem, size_t concurrency, logger_interface * logger)
+{
+	native_string dir = path;
+	if (!dir.empty() && dir.back() != local_filesys::path_separator) {
+		dir += local_filesys::path_separator;
+	}
+
+	std::vector<native_string> files;
+
+	local_filesys fs;
+	if (!fs.begin_find_files(dir)) {
+		if (logger) {
+			logger->log(logmsg::error, fztranslate("Could not list certificate directory %s"), path);
+		}
+		return 0;
+	}
+
+	native_string name;
+	bool is_link{};
+	local_filesys::type t{};
+	while (fs.get_next_file(name, is_link, t, nullptr, nullptr, nullptr)) {
+		if (t == local_filesys::file) {
+			files.emplace_back(dir + name);
+		}
+	}
+	fs.end_find_files();
+
+	return load_files(pool, files, pem, concurrency, logger);
+}
+
+std::vector<x509_certificate const*> certificate_store::find(index const& idx, std::string_view const& key)
+{
+	std::vector<x509_certificate const*> ret;
+
+	auto range = idx.equal_range(key);
+	for (auto it = range.first; it != range.second; ++it) {
+		ret.push_back(it->second);
+	}
+
+	return ret;
+}
+
+x509_certificate const* certificate_store::find_by_fingerprint(std::string_view const& fingerprint_sha256) const
+{
+	auto it = by_fingerprint_.find(fingerprint_sha256);
+	return it != by_fingerprint_.end() ? it->second : nullptr;
+}
+
+std::vector<x509_certificate const*> certificate_store::find_by_subject(std::string_view const& subject) const
+{
+	return find(by_subject_, subject);
+}
+
+std::vector<x509_certificate const*> certificate_store::find_by_issuer(std::string_view const& issuer) const
+{
+	return find(by_issuer_, issuer);
+}
+
+void certificate_store::clear()
+{
+	by_fingerprint_.clear();
+	by_subject_.clear();
+	by_issuer_.clear();
+	certificates_.clear();
+}
+
+}
@@ -0,0 +1,370 @@
+#include "libfilezilla/chunk_store.hpp"
+#include "libfilezilla/hash.hpp"
+
+#ifdef FZ_WINDOWS
+#include "libfilezilla/glue/windows.hpp"
+#endif
+
+#include <errno.h>
+#include <string.h>
+
+namespace fz {
+
+namespace {
+uint8_t const index_magic[] = {'F', 'Z', 'C', 'I', 1};
+
+size_t const record_size = 32 + 8 + 4;
+
+// Size of the pieces files are read in when storing them
+size_t const read_size = 256 * 1024;
+
+void append_be(buffer & out, uint64_t v, size_t bytes)
+{
+	uint8_t * p = out.get(bytes);
+	for (size_t i = 0; i < bytes; ++i) {
+		p[i] = static_cast<uint8_t>(v >> ((bytes - i - 1) * 8));
+	}
+	out.add(bytes);
+}
+
+uint64_t read_be(uint8_t const* p, size_t bytes)
+{
+	uint64_t ret{};
+	for (size_t i = 0; i < bytes; ++i) {
+		ret = (ret << 8) | p[i];
+	}
+	return ret;
+}
+
+result io_error()
+{
+#ifdef FZ_WINDOWS
+	DWORD const err = GetLastError();
+	if (err == ERROR_DISK_FULL) {
+		return {result::nospace, err};
+	}
+	return {result::other, err};
+#else
+	int const err = errno;
+	if (err == ENOSPC || err == EDQUOT) {
+		return {result::nospace, err};
+	}
+	return {result::other, err};
+#endif
+}
+
+bool write_all(file & f, uint8_t const* data, size_t size)
+{
+	while (size) {
+		int64_t const written = f.write(data, static_cast<int64_t>(size));
+		if (written <= 0) {
+			return false;
+		}
+		data += written;
+		size -= static_cast<size_t>(written);
+	}
+	return true;
+}
+}
+
+size_t chunk_store::id_hash::operator()(id const& chunk) const
+{
+	// The id already is a cryptographic hash
+	size_t ret;
+	memcpy(&ret, chunk.data(), sizeof(ret));
+	return ret;
+}
+
+chunk_store::~chunk_store()
+{
+	close();
+}
+
+result chunk_store::open(native_string const& dir)
+{
+	close();
+
+	native_string const data_name = dir + fzT("/data");
+	native_string const index_name = dir + fzT("/index");
+
+	result res = data_writer_.open(data_name, file::writing, file::existing);
+	if (res) {
+		res = data_reader_.open(data_name, file::reading);
+	}
+	if (res) {
+		res = index_writer_.open(index_name, file::writing, file::existing);
+	}
+	if (res) {
+		res = load_index(index_name);
+	}
+
+	if (!res) {
+		entries_.clear();
+		data_writer_.close();
+		data_reader_.close();
+		index_writer_.close();
+	}
+	return res;
+}
+
+result chunk_store::load_index(native_string const& name)
+{
+	int64_t const data_file_size = data_writer_.size();
+	if (data_file_size < 0) {
+		return io_error();
+	}
+
+	buffer index;
+	{
+		file f;
+		result res = f.open(name, file::reading);
+		if (!res) {
+			return res;
+		}
+		while (true) {
+			int64_t const read = f.read(index.get(read_size), static_cast<int64_t>(read_size));
+			if (read < 0) {
+				return io_error();
+			}
+			if (!read) {
+				break;
+			}
+			index.add(static_cast<size_t>(read));
+		}
+	}
+
+	if (index.empty()) {
+		if (!write_all(index_writer_, index_magic, sizeof(index_magic))) {
+			return io_error();
+		}
+	}
+	else if (index.size() < sizeof(index_magic) || memcmp(index.get(), index_magic, sizeof(index_magic))) {
+		return {result::invalid};
+	}
+
+	// Only entries pointing at data that made it to disk are valid. Anything after
+	// the last valid entry is a remnant of an interrupted flush.
+	uint64_t data_end{};
+	size_t valid = sizeof(index_magic);
+	for (; valid + record_size <= index.size(); valid += record_size) {
+		uint8_t const* p = index.get() + valid;
+		entry e;
+		e.offset = read_be(p + 32, 8);
+		e.size = static_cast<uint32_t>(read_be(p + 40, 4));
+		if (e.offset > static_cast<uint64_t>(data_file_size) || e.size > static_cast<uint64_t>(data_file_size) - e.offset) {
+			break;
+		}
+
+		id chunk;
+		memcpy(chunk.data(), p, chunk.size());
+		if (entries_.emplace(chunk, e).second) {
+			data_size_ += e.size;
+		}
+		if (e.offset + e.size > data_end) {
+			data_end = e.offset + e.size;
+		}
+	}
+
+	if (index_writer_.seek(static_cast<int64_t>(valid), file::begin) < 0 || !index_writer_.truncate()) {
+		return io_error();
+	}
+	if (data_writer_.seek(static_cast<int64_t>(data_end), file::begin) < 0 || !data_writer_.truncate()) {
+		return io_error();
+	}
+
+	return {};
+}
+
+void chunk_store::close()
+{
+	if (opened()) {
+		flush();
+	}
+
+	data_writer_.close();
+	data_reader_.close();
+	index_writer_.close();
+	entries_.clear();
+	pending_.clear();
+	data_size_ = 0;
+	deduplicated_ = 0;
+}
+
+chunk_store::id chunk_store::compute_id(uint8_t const* data, size_t size)
+{
+	hash_accumulator acc(hash_algorithm::sha256);
+	acc.update(data, size);
+	auto const digest = acc.digest();
+
+	id ret;
+	memcpy(ret.data(), digest.data(), ret.size());
+	return ret;
+}
+
+result chunk_store::add(uint8_t const* data, size_t size, id & out, bool * added)
+{
+	if (added) {
+		*added = false;
+	}
+	if (!opened() || size > 0xffffffffu) {
+		return {result::invalid};
+	}
+
+	out = compute_id(data, size);
+	if (contains(out)) {
+		deduplicated_ += size;
+		return {};
+	}
+
+	int64_t const offset = data_writer_.position();
+	if (offset < 0) {
+		return io_error();
+	}
+	if (!write_all(data_writer_, data, size)) {
+		result res = io_error();
+		// Do not leave a partial chunk behind
+		data_writer_.seek(offset, file::begin);
+		data_writer_.truncate();
+		return res;
+	}
+
+	entries_[out] = entry{static_cast<uint64_t>(offset), static_cast<uint32_t>(size)};
+	pending_.push_back(out);
+	data_size_ += size;
+	if (added) {
+		*added = true;
+	}
+
+	return {};
+}
+
+bool chunk_store::contains(id const& chunk) const
+{
+	return entries_.find(chunk) != entries_.cend();
+}
+
+std::vector<chunk_store::id> chunk_store::missing(std::vector<id> const& chunks) const
+{
+	std::vector<id> ret;
+	for (auto const& chunk : chunks) {
+		if (!contains(chunk)) {
+			ret.push_back(chunk);
+		}
+	}
+	return ret;
+}
+
+result chunk_store::get(id const& chunk, buffer & out)
+{
+	auto it = entries_.find(chunk);
+	if (it == entries_.cend()) {
+		return {result::nofile};
+	}
+
+	if (data_reader_.seek(static_cast<int64_t>(it->second.offset), file::begin) < 0) {
+		return io_error();
+	}
+
+	size_t const start = out.size();
+	size_t remaining = it->second.size;
+	while (remaining) {
+		int64_t const read = data_reader_.read(out.get(remaining), static_cast<int64_t>(remaining));
+		if (read <= 0) {
+			out.resize(start);
+			return read ? io_error() : result{result::other};
+		}
+		out.add(static_cast<size_t>(read));
+		remaining -= static_cast<size_t>(read);
+	}
+
+	if (compute_id(out.get() + start, it->second.size) != chunk) {
+		out.resize(start);
+		return {result::other};
+	}
+
+	return {};
+}
+
+result chunk_store::flush()
+{
+	if (pending_.empty()) {
+		return {};
+	}
+
+	// Data first, so that the index never refers to data that is not on disk
+	if (!data_writer_.fsync()) {
+		return io_error();
+	}
+
+	buffer records;
+	for (auto const& chunk : pending_) {
+		auto const& e = entries_[chunk];
+		records.append(chunk.data(), chunk.size());
+		append_be(records, e.offset, 8);
+		append_be(records, e.size, 4);
+	}
+
+	int64_t const offset = index_writer_.position();
+	if (offset < 0) {
+		return io_error();
+	}
+	if (!write_all(index_writer_, records.get(), records.size()) || !index_writer_.fsync()) {
+		result res = io_error();
+		index_writer_.seek(offset, file::begin);
+		index_writer_.truncate();
+		return res;
+	}
+
+	pending_.clear();
+	return {};
+}
+
+result chunk_store::store_file(file & f, std::vector<id> & chunks, content_chunker & chunker)
+{
+	chunker.reset();
+
+	buffer in;
+	bool eof{};
+	while (!eof) {
+		int64_t const read = f.read(in.get(read_size), static_cast<int64_t>(read_size));
+		if (read < 0) {
+			return io_error();
+		}
+		if (!read) {
+			eof = true;
+		}
+		in.add(static_cast<size_t>(read));
+
+		size_t len;
+		while ((len = chunker.next(in.get(), in.size(), eof))) {
+			id chunk;
+			result res = add(in.get(), len, chunk);
+			if (!res) {
+				return res;
+			}
+			chunks.push_back(chunk);
+			in.consume(len);
+		}
+	}
+
+	return {};
+}
+
+result chunk_store::restore_file(std::vector<id> const& chunks, file & f)
+{
+	buffer data;
+	for (auto const& chunk : chunks) {
+		data.clear();
+		result res = get(chunk, data);
+		if (!res) {
+			return res;
+		}
+		if (!write_all(f, data.get(), data.size())) {
+			return io_error();
+		}
+	}
+
+	return {};
+}
+
+}
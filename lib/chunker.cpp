@@ -0,0 +1,110 @@
+#include "libfilezilla/chunker.hpp"
+
+#include <array>
+
+namespace fz {
+
+namespace {
+// Pseudo-random gear table, fixed so that boundaries are the same everywhere
+constexpr std::array<uint64_t, 256> make_gear()
+{
+	std::array<uint64_t, 256> gear{};
+	uint64_t state = 0x6c696266696c657aull;
+	for (auto & g : gear) {
+		// splitmix64
+		state += 0x9e3779b97f4a7c15ull;
+		uint64_t z = state;
+		z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9ull;
+		z = (z ^ (z >> 27)) * 0x94d049bb133111ebull;
+		g = z ^ (z >> 31);
+	}
+	return gear;
+}
+
+constexpr std::array<uint64_t, 256> gear = make_gear();
+
+// Each shift moves older bytes towards the top, so the top bits depend on the most
+// bytes. The masks therefore select the top bits.
+uint64_t top_mask(unsigned int bits)
+{
+	return ~uint64_t(0) << (64 - bits);
+}
+}
+
+content_chunker::content_chunker(size_t average_size)
+{
+	unsigned int bits = 8;
+	while (bits < 24 && (size_t(1) << bits) < average_size) {
+		++bits;
+	}
+
+	average_size_ = size_t(1) << bits;
+	min_size_ = average_size_ / 4;
+	max_size_ = average_size_ * 8;
+
+	// Normalization level 2 from the FastCDC paper
+	mask_small_ = top_mask(bits + 2);
+	mask_large_ = top_mask(bits - 2);
+}
+
+void content_chunker::reset()
+{
+	scanned_ = 0;
+	hash_ = 0;
+}
+
+size_t content_chunker::next(uint8_t const* data, size_t size, bool final)
+{
+	size_t const limit = (size < max_size_) ? size : max_size_;
+
+	// Boundaries before the minimum size are not possible, no need to look at that data
+	size_t i = scanned_;
+	if (i < min_size_) {
+		i = (min_size_ < limit) ? min_size_ : limit;
+	}
+
+	// The hash after a byte only depends on that byte and the 63 preceding it, so hashes
+	// at distant positions could be computed in separate vector lanes. But every byte
+	// needs a lookup in the gear table, without a fast gather that gains nothing over
+	// this loop, which is only limited by the latency of the shift and add.
+	uint64_t h = hash_;
+	size_t const normal = (average_size_ < limit) ? average_size_ : limit;
+	for (; i < normal; ++i) {
+		h = (h << 1) + gear[data[i]];
+		if (!(h & mask_small_)) {
+			reset();
+			return i + 1;
+		}
+	}
+	for (; i < limit; ++i) {
+		h = (h << 1) + gear[data[i]];
+		if (!(h & mask_large_)) {
+			reset();
+			return i + 1;
+		}
+	}
+
+	if (limit == max_size_ || (final && size)) {
+		reset();
+		return limit;
+	}
+
+	scanned_ = i;
+	hash_ = h;
+	return 0;
+}
+
+bool content_chunker::next(buffer & in, buffer & chunk, bool final)
+{
+	size_t const len = next(in.get(), in.size(), final);
+	if (!len) {
+		return false;
+	}
+
+	chunk.clear();
+	chunk.append(in.get(), len);
+	in.consume(len);
+	return true;
+}
+
+}
@@ -0,0 +1,532 @@
+#include "libfilezilla/compression_layer.hpp"
+#include "libfilezilla/buffer.hpp"
+
+#include <zlib.h>
+
+#include <string.h>
+
+namespace fz {
+
+namespace {
+// Upper limit of uncompressed data consumed by a single call to write
+size_t const max_write_chunk = 64 * 1024;
+
+// Amount of compressed data read from the next layer at once
+size_t const read_chunk = 64 * 1024;
+
+// Window of uncompressed data after which the level gets re-evaluated
+uint64_t const adapt_window = 1024 * 1024;
+
+// Compressed data exceeding this fraction of the input is considered incompressible
+double const incompressible_ratio = 0.9;
+
+// Number of windows to stay disabled before probing again
+int const probe_interval = 16;
+}
+
+class compression_layer_impl final
+{
+public:
+	compression_layer_impl(compression_layer& layer, int level, bool adaptive)
+		: layer_(layer)
+		, max_level_(level < 1 ? 1 : (level > 9 ? 9 : level))
+		, level_(max_level_)
+		, adaptive_(adaptive)
+	{
+		memset(&deflate_, 0, sizeof(deflate_));
+		memset(&inflate_, 0, sizeof(inflate_));
+		deflate_ok_ = deflateInit(&deflate_, level_) == Z_OK;
+		inflate_ok_ = inflateInit(&inflate_) == Z_OK;
+	}
+
+	~compression_layer_impl()
+	{
+		if (deflate_ok_) {
+			deflateEnd(&deflate_);
+		}
+		if (inflate_ok_) {
+			inflateEnd(&inflate_);
+		}
+	}
+
+	int read(void* buffer, unsigned int size, int& error);
+	int write(void const* buffer, unsigned int size, int& error);
+	int shutdown();
+	int shutdown_read();
+
+	void on_socket_event(socket_event_source* s, socket_event_flag t, int error);
+	void forward_hostaddress_event(socket_event_source* source, std::string const& address) {
+		layer_.forward_hostaddress_event(source, address);
+	}
+	void on_write();
+	void set_event_handler(event_handler* handler, socket_event_flag retrigger_block);
+
+	// Returns 0 if all pending compressed data has been passed on, EAGAIN or any other error otherwise.
+	int flush();
+
+	void adapt();
+
+	compression_layer& layer_;
+
+	z_stream deflate_;
+	z_stream inflate_;
+	bool deflate_ok_{};
+	bool inflate_ok_{};
+
+	buffer send_buffer_;
+	buffer recv_buffer_;
+
+	int const max_level_;
+	int level_;
+	int applied_level_{-1};
+	bool const adaptive_;
+
+	// Adaptivity state for the current window
+	uint64_t window_in_{};
+	uint64_t window_out_{};
+	bool window_blocked_{};
+	int disabled_windows_{};
+	int last_enabled_level_{};
+
+	uint64_t written_{};
+	uint64_t compressed_written_{};
+	uint64_t read_{};
+	uint64_t compressed_read_{};
+
+	bool can_read_from_socket_{};
+	bool can_write_to_socket_{};
+	bool write_blocked_{};
+
+	// The handler has not been told yet that it can write
+	bool initial_write_{true};
+
+	bool deflate_finished_{};
+	bool shutting_down_{};
+	bool inflate_finished_{};
+
+	int socket_error_{};
+};
+
+int compression_layer_impl::flush()
+{
+	while (!send_buffer_.empty()) {
+		int error;
+		int written = layer_.next_layer_.write(send_buffer_.get(), static_cast<unsigned int>(send_buffer_.size()), error);
+		if (written < 0) {
+			if (error == EAGAIN) {
+				can_write_to_socket_ = false;
+				window_blocked_ = true;
+			}
+			else {
+				socket_error_ = error;
+			}
+			return error;
+		}
+		send_buffer_.consume(static_cast<size_t>(written));
+		compressed_written_ += static_cast<size_t>(written);
+	}
+
+	return 0;
+}
+
+void compression_layer_impl::adapt()
+{
+	if (!adaptive_ || window_in_ < adapt_window) {
+		return;
+	}
+
+	if (level_) {
+		if (window_out_ > window_in_ * incompressible_ratio) {
+			// Not worth the CPU time. Stored blocks are still valid deflate data.
+			last_enabled_level_ = level_;
+			level_ = 0;
+			disabled_windows_ = 0;
+		}
+		else if (window_blocked_) {
+			// Network is the bottleneck, trade CPU for bandwidth
+			if (level_ < max_level_) {
+				++level_;
+			}
+		}
+		else if (level_ > 1) {
+			// Compression is the bottleneck
+			--level_;
+		}
+	}
+	else if (++disabled_windows_ >= probe_interval) {
+		level_ = last_enabled_level_ ? last_enabled_level_ : 1;
+	}
+
+	window_in_ = 0;
+	window_out_ = 0;
+	window_blocked_ = false;
+}
+
+int compression_layer_impl::write(void const* buffer, unsigned int size, int& error)
+{
+	if (socket_error_) {
+		error = socket_error_;
+		return -1;
+	}
+	if (!deflate_ok_ || shutting_down_ || deflate_finished_) {
+		error = ENOTCONN;
+		return -1;
+	}
+	if (!size) {
+		return 0;
+	}
+
+	error = flush();
+	if (error) {
+		if (error == EAGAIN) {
+			write_blocked_ = true;
+		}
+		return -1;
+	}
+
+	if (applied_level_ != level_) {
+		// With all previous data flushed, changing the parameters needs little output space.
+		deflate_.next_in = nullptr;
+		deflate_.avail_in = 0;
+		deflate_.next_out = send_buffer_.get(64);
+		deflate_.avail_out = 64;
+		int res = deflateParams(&deflate_, level_, Z_DEFAULT_STRATEGY);
+		send_buffer_.add(64 - deflate_.avail_out);
+		if (res == Z_OK) {
+			applied_level_ = level_;
+		}
+	}
+
+	size_t const chunk = (size > max_write_chunk) ? max_write_chunk : size;
+
+	deflate_.next_in = const_cast<Bytef*>(static_cast<Bytef const*>(buffer));
+	deflate_.avail_in = static_cast<uInt>(chunk);
+
+	size_t const before = send_buffer_.size();
+	int res;
+	do {
+		// Account for the sync flush marker and block headers
+		size_t const avail = deflateBound(&deflate_, deflate_.avail_in) + 16;
+		deflate_.next_out = send_buffer_.get(avail);
+		deflate_.avail_out = static_cast<uInt>(avail);
+		res = deflate(&deflate_, Z_SYNC_FLUSH);
+		send_buffer_.add(avail - deflate_.avail_out);
+	} while (res == Z_OK && (deflate_.avail_in || !deflate_.avail_out));
+
+	if (res != Z_OK && res != Z_BUF_ERROR) {
+		socket_error_ = EINVAL;
+		error = socket_error_;
+		return -1;
+	}
+
+	written_ += chunk;
+	window_in_ += chunk;
+	window_out_ += send_buffer_.size() - before;
+
+	error = flush();
+	if (error && error != EAGAIN) {
+		return -1;
+	}
+	error = 0;
+
+	adapt();
+
+	return static_cast<int>(chunk);
+}
+
+int compression_layer_impl::read(void* buffer, unsigned int size, int& error)
+{
+	if (socket_error_) {
+		error = socket_error_;
+		return -1;
+	}
+	if (!inflate_ok_) {
+		error = ENOTCONN;
+		return -1;
+	}
+	if (!size) {
+		// Returning 0 would look like the end of the stream
+		error = EINVAL;
+		return -1;
+	}
+	if (inflate_finished_) {
+		return 0;
+	}
+
+	while (true) {
+		inflate_.next_in = recv_buffer_.get();
+		inflate_.avail_in = static_cast<uInt>(recv_buffer_.size());
+		inflate_.next_out = static_cast<Bytef*>(buffer);
+		inflate_.avail_out = size;
+
+		int res = inflate(&inflate_, Z_SYNC_FLUSH);
+		recv_buffer_.consume(recv_buffer_.size() - inflate_.avail_in);
+
+		if (res == Z_STREAM_END) {
+			inflate_finished_ = true;
+		}
+		else if (res != Z_OK && res != Z_BUF_ERROR) {
+			socket_error_ = EINVAL;
+			error = socket_error_;
+			return -1;
+		}
+
+		unsigned int const produced = size - inflate_.avail_out;
+		if (produced) {
+			read_ += produced;
+			return static_cast<int>(produced);
+		}
+		if (inflate_finished_) {
+			return 0;
+		}
+
+		int r = layer_.next_layer_.read(recv_buffer_.get(read_chunk), static_cast<unsigned int>(read_chunk), error);
+		if (r < 0) {
+			if (error == EAGAIN) {
+				can_read_from_socket_ = false;
+			}
+			return -1;
+		}
+		if (!r) {
+			if (compressed_read_ || !recv_buffer_.empty()) {
+				// Peer closed the connection without finishing the compressed stream
+				socket_error_ = ECONNABORTED;
+				error = socket_error_;
+				return -1;
+			}
+			inflate_finished_ = true;
+			return 0;
+		}
+		recv_buffer_.add(static_cast<size_t>(r));
+		compressed_read_ += static_cast<size_t>(r);
+	}
+}
+
+int compression_layer_impl::shutdown()
+{
+	if (socket_error_) {
+		return socket_error_;
+	}
+	if (!deflate_ok_) {
+		return ENOTCONN;
+	}
+
+	shutting_down_ = true;
+	if (!deflate_finished_) {
+		int res;
+		do {
+			size_t const avail = deflateBound(&deflate_, 0) + 16;
+			deflate_.next_in = nullptr;
+			deflate_.avail_in = 0;
+			deflate_.next_out = send_buffer_.get(avail);
+			deflate_.avail_out = static_cast<uInt>(avail);
+			res = deflate(&deflate_, Z_FINISH);
+			send_buffer_.add(avail - deflate_.avail_out);
+		} while (res == Z_OK);
+
+		if (res != Z_STREAM_END) {
+			socket_error_ = EINVAL;
+			return socket_error_;
+		}
+		deflate_finished_ = true;
+	}
+
+	int error = flush();
+	if (error) {
+		return error;
+	}
+
+	return layer_.next_layer_.shutdown();
+}
+
+int compression_layer_impl::shutdown_read()
+{
+	if (socket_error_) {
+		return socket_error_;
+	}
+	if (!recv_buffer_.empty()) {
+		// Trailing garbage after the end of the compressed stream
+		return ENODATA;
+	}
+
+	// Make sure the next layer has reached EOF as well
+	unsigned char tmp;
+	int error;
+	int r = layer_.next_layer_.read(&tmp, 1, error);
+	if (r < 0) {
+		if (error == EAGAIN) {
+			can_read_from_socket_ = false;
+		}
+		return error;
+	}
+	if (r) {
+		return ENODATA;
+	}
+
+	return layer_.next_layer_.shutdown_read();
+}
+
+void compression_layer_impl::on_socket_event(socket_event_source* s, socket_event_flag t, int error)
+{
+	if (t == socket_event_flag::connection_next) {
+		layer_.forward_socket_event(s, t, error);
+		return;
+	}
+
+	if (error) {
+		socket_error_ = error;
+		if (layer_.event_handler_) {
+			layer_.event_handler_->send_event<socket_event>(&layer_, t, error);
+		}
+		return;
+	}
+
+	switch (t) {
+	case socket_event_flag::read:
+		can_read_from_socket_ = true;
+		if (layer_.event_handler_) {
+			layer_.event_handler_->send_event<socket_event>(&layer_, socket_event_flag::read, 0);
+		}
+		break;
+	case socket_event_flag::write:
+		on_write();
+		break;
+	case socket_event_flag::connection:
+		can_write_to_socket_ = true;
+		initial_write_ = false;
+		if (layer_.event_handler_) {
+			layer_.event_handler_->send_event<socket_event>(&layer_, socket_event_flag::connection, 0);
+		}
+		break;
+	default:
+		break;
+	}
+}
+
+void compression_layer_impl::on_write()
+{
+	can_write_to_socket_ = true;
+
+	int error = flush();
+	if (error == EAGAIN) {
+		return;
+	}
+
+	if (shutting_down_) {
+		if (!error) {
+			error = layer_.next_layer_.shutdown();
+			if (error == EAGAIN) {
+				return;
+			}
+		}
+		if (layer_.event_handler_) {
+			layer_.event_handler_->send_event<socket_event>(&layer_, socket_event_flag::write, error);
+		}
+	}
+	else if (write_blocked_ || initial_write_ || error) {
+		write_blocked_ = false;
+		initial_write_ = false;
+		if (layer_.event_handler_) {
+			layer_.event_handler_->send_event<socket_event>(&layer_, socket_event_flag::write, error);
+		}
+	}
+}
+
+void compression_layer_impl::set_event_handler(event_handler* handler, socket_event_flag retrigger_block)
+{
+	write_blocked_ = false;
+
+	socket_event_flag const pending = change_socket_event_handler(layer_.event_handler_, handler, &layer_, retrigger_block);
+	layer_.event_handler_ = handler;
+
+	if (handler) {
+		if (can_write_to_socket_ && !shutting_down_ && !(pending & (socket_event_flag::write | socket_event_flag::connection)) && !(retrigger_block & socket_event_flag::write)) {
+			initial_write_ = false;
+			handler->send_event<socket_event>(&layer_, socket_event_flag::write, 0);
+		}
+		if (can_read_from_socket_ && !(pending & socket_event_flag::read) && !(retrigger_block & socket_event_flag::read)) {
+			handler->send_event<socket_event>(&layer_, socket_event_flag::read, 0);
+		}
+	}
+}
+
+compression_layer::compression_layer(event_loop& loop, event_handler* handler, socket_interface& next_layer, int level, bool adaptive)
+	: event_handler(loop)
+	, socket_layer(handler, next_layer, false)
+	, impl_(std::make_unique<compression_layer_impl>(*this, level, adaptive))
+{
+	next_layer.set_event_handler(this);
+}
+
+compression_layer::~compression_layer()
+{
+	remove_handler();
+}
+
+void compression_layer::operator()(event_base const& ev)
+{
+	dispatch<socket_event, hostaddress_event>(ev, impl_.get()
+		, &compression_layer_impl::on_socket_event
+		, &compression_layer_impl::forward_hostaddress_event);
+}
+
+int compression_layer::read(void* buffer, unsigned int size, int& error)
+{
+	return impl_->read(buffer, size, error);
+}
+
+int compression_layer::write(void const* buffer, unsigned int size, int& error)
+{
+	return impl_->write(buffer, size, error);
+}
+
+int compression_layer::shutdown()
+{
+	return impl_->shutdown();
+}
+
+int compression_layer::shutdown_read()
+{
+	return impl_->shutdown_read();
+}
+
+socket_state compression_layer::get_state() const
+{
+	socket_state s = next_layer_.get_state();
+	if (s == socket_state::connected && impl_->shutting_down_) {
+		s = socket_state::shutting_down;
+	}
+	return s;
+}
+
+void compression_layer::set_event_handler(event_handler* handler, socket_event_flag retrigger_block)
+{
+	impl_->set_event_handler(handler, retrigger_block);
+}
+
+int compression_layer::get_level() const
+{
+	return impl_->level_;
+}
+
+uint64_t compression_layer::get_written_bytes() const
+{
+	return impl_->written_;
+}
+
+uint64_t compression_layer::get_compressed_written_bytes() const
+{
+	return impl_->compressed_written_;
+}
+
+uint64_t compression_layer::get_read_bytes() const
+{
+	return impl_->read_;
+}
+
+uint64_t compression_layer::get_compressed_read_bytes() const
+{
+	return impl_->compressed_read_;
+}
+
+}
@@ -0,0 +1,577 @@
+#include "libfilezilla/delta.hpp"
+
+#include <algorithm>
+#include <cmath>
+
+#include <string.h>
+
+namespace fz {
+
+namespace {
+uint8_t const signature_magic[] = {'F', 'Z', 'D', 'S', 1};
+uint8_t const delta_magic[] = {'F', 'Z', 'D', 'D', 1};
+
+size_t const max_block_size = 1024 * 1024 * 16;
+
+// Literals get flushed once this long, bounding the generator's memory use. Longer
+// literals get split, so the applier does not need to buffer more than this either.
+size_t const max_literal = 256 * 1024;
+
+size_t const npos = static_cast<size_t>(-1);
+
+void append_be(buffer & out, uint64_t v, size_t bytes)
+{
+	uint8_t * p = out.get(bytes);
+	for (size_t i = 0; i < bytes; ++i) {
+		p[i] = static_cast<uint8_t>(v >> ((bytes - i - 1) * 8));
+	}
+	out.add(bytes);
+}
+
+uint64_t read_be(uint8_t const* p, size_t bytes)
+{
+	uint64_t ret{};
+	for (size_t i = 0; i < bytes; ++i) {
+		ret = (ret << 8) | p[i];
+	}
+	return ret;
+}
+
+// The weak checksum from rsync: a is the sum of the bytes, b the sum of the prefix sums.
+// Both are used modulo 2^16.
+void weak_sums(uint8_t const* p, size_t len, uint32_t & a, uint32_t & b)
+{
+	a = 0;
+	b = 0;
+	for (size_t i = 0; i < len; ++i) {
+		a += p[i];
+		b += static_cast<uint32_t>(len - i) * p[i];
+	}
+}
+
+uint32_t weak_checksum(uint32_t a, uint32_t b)
+{
+	return (a & 0xffff) | (b << 16);
+}
+
+size_t filter_bit(uint32_t weak, unsigned int shift)
+{
+	// Multiplicative hashing, mixes both halves of the checksum into the top bits
+	return static_cast<size_t>((weak * 0x9e3779b1u) >> shift);
+}
+
+void strong_hash(hash_accumulator & acc, uint8_t const* data, size_t size, uint8_t * out)
+{
+	acc.update(data, size);
+	auto const digest = acc.digest();
+	memcpy(out, digest.data(), delta_signature::strong_size);
+}
+}
+
+size_t delta_signature::default_block_size(uint64_t file_size)
+{
+	// Square root of the size keeps both the signature and the granularity of matches reasonable
+	auto bs = static_cast<size_t>(std::sqrt(static_cast<double>(file_size)));
+	bs = (bs + 1023) & ~size_t(1023);
+	return std::clamp(bs, size_t(2048), size_t(128 * 1024));
+}
+
+void delta_signature::add_block(uint8_t const* data, size_t size, hash_accumulator & acc)
+{
+	block b;
+	uint32_t a{};
+	uint32_t s{};
+	weak_sums(data, size, a, s);
+	b.weak = weak_checksum(a, s);
+	strong_hash(acc, data, size, b.strong);
+	blocks_.push_back(b);
+	size_ += size;
+}
+
+bool delta_signature::compute(file & f, size_t block_size)
+{
+	blocks_.clear();
+	sorted_.clear();
+	sorted_weak_.clear();
+	filter_.clear();
+	size_ = 0;
+
+	if (!block_size) {
+		int64_t const pos = f.position();
+		int64_t const size = f.size();
+		block_size = default_block_size((pos >= 0 && size > pos) ? static_cast<uint64_t>(size - pos) : 0);
+	}
+	block_size_ = std::min(block_size, max_block_size);
+
+	hash_accumulator acc(hash_algorithm::sha256);
+	buffer buf;
+	bool eof{};
+	while (!eof) {
+		while (buf.size() < block_size_) {
+			int64_t const read = f.read(buf.get(block_size_ - buf.size()), static_cast<int64_t>(block_size_ - buf.size()));
+			if (read < 0) {
+				return false;
+			}
+			if (!read) {
+				eof = true;
+				break;
+			}
+			buf.add(static_cast<size_t>(read));
+		}
+		if (!buf.empty()) {
+			add_block(buf.get(), buf.size(), acc);
+			buf.clear();
+		}
+	}
+
+	build_index();
+	return true;
+}
+
+void delta_signature::compute(uint8_t const* data, size_t size, size_t block_size)
+{
+	blocks_.clear();
+	sorted_.clear();
+	sorted_weak_.clear();
+	filter_.clear();
+	size_ = 0;
+
+	if (!block_size) {
+		block_size = default_block_size(size);
+	}
+	block_size_ = std::min(block_size, max_block_size);
+
+	hash_accumulator acc(hash_algorithm::sha256);
+	for (size_t pos = 0; pos < size; pos += block_size_) {
+		add_block(data + pos, std::min(block_size_, size - pos), acc);
+	}
+
+	build_index();
+}
+
+void delta_signature::build_index()
+{
+	sorted_.resize(blocks_.size());
+	for (size_t i = 0; i < blocks_.size(); ++i) {
+		sorted_[i] = static_cast<uint32_t>(i);
+	}
+	std::stable_sort(sorted_.begin(), sorted_.end(), [this](uint32_t lhs, uint32_t rhs) {
+		return blocks_[lhs].weak < blocks_[rhs].weak;
+	});
+
+	sorted_weak_.resize(sorted_.size());
+	for (size_t i = 0; i < sorted_.size(); ++i) {
+		sorted_weak_[i] = blocks_[sorted_[i]].weak;
+	}
+
+	// About 16 bits per block keeps false positives rare, within bounds of 64 KiB to 2 MiB
+	unsigned int bits = 16;
+	while (bits < 24 && (size_t(1) << bits) < blocks_.size() * 16) {
+		++bits;
+	}
+	filter_shift_ = 32 - bits;
+	filter_.assign((size_t(1) << bits) / 64, 0);
+	for (auto const& b : blocks_) {
+		size_t const bit = filter_bit(b.weak, filter_shift_);
+		filter_[bit / 64] |= uint64_t(1) << (bit % 64);
+	}
+}
+
+size_t delta_signature::find(uint32_t weak, uint8_t const* data, size_t size, hash_accumulator & acc) const
+{
+	if (filter_.empty()) {
+		return npos;
+	}
+	size_t const bit = filter_bit(weak, filter_shift_);
+	if (!(filter_[bit / 64] & (uint64_t(1) << (bit % 64)))) {
+		return npos;
+	}
+
+	uint8_t strong[strong_size];
+	bool have_strong{};
+	for (size_t i = std::lower_bound(sorted_weak_.cbegin(), sorted_weak_.cend(), weak) - sorted_weak_.cbegin(); i < sorted_.size() && sorted_weak_[i] == weak; ++i) {
+		uint32_t const idx = sorted_[i];
+		size_t const len = (idx + 1 == blocks_.size()) ? static_cast<size_t>(size_ - uint64_t(idx) * block_size_) : block_size_;
+		if (len != size) {
+			continue;
+		}
+		if (!have_strong) {
+			strong_hash(acc, data, size, strong);
+			have_strong = true;
+		}
+		if (!memcmp(strong, blocks_[idx].strong, strong_size)) {
+			return idx;
+		}
+	}
+
+	return npos;
+}
+
+void delta_signature::append_to(buffer & out) const
+{
+	out.append(signature_magic, sizeof(signature_magic));
+	append_be(out, block_size_, 4);
+	append_be(out, size_, 8);
+	for (auto const& b : blocks_) {
+		append_be(out, b.weak, 4);
+		out.append(b.strong, strong_size);
+	}
+}
+
+bool delta_signature::load(uint8_t const* data, size_t size)
+{
+	blocks_.clear();
+	sorted_.clear();
+	sorted_weak_.clear();
+	filter_.clear();
+	block_size_ = 0;
+	size_ = 0;
+
+	size_t const header = sizeof(signature_magic) + 12;
+	if (size < header || memcmp(data, signature_magic, sizeof(signature_magic))) {
+		return false;
+	}
+	data += sizeof(signature_magic);
+
+	size_t const block_size = static_cast<size_t>(read_be(data, 4));
+	uint64_t const file_size = read_be(data + 4, 8);
+	data += 12;
+	size -= header;
+
+	if (!block_size || block_size > max_block_size) {
+		return false;
+	}
+	uint64_t const count = file_size / block_size + ((file_size % block_size) ? 1 : 0);
+	if (count != size / (4 + strong_size) || size % (4 + strong_size)) {
+		return false;
+	}
+
+	blocks_.resize(static_cast<size_t>(count));
+	for (auto & b : blocks_) {
+		b.weak = static_cast<uint32_t>(read_be(data, 4));
+		memcpy(b.strong, data + 4, strong_size);
+		data += 4 + strong_size;
+	}
+	block_size_ = block_size;
+	size_ = file_size;
+
+	build_index();
+	return true;
+}
+
+delta_generator::delta_generator(delta_signature const& sig)
+	: sig_(sig)
+{
+}
+
+void delta_generator::update(uint8_t const* data, size_t size, buffer & out)
+{
+	if (!size) {
+		return;
+	}
+	total_acc_.update(data, size);
+	data_.append(data, size);
+	process(out, false);
+}
+
+void delta_generator::finalize(buffer & out)
+{
+	process(out, true);
+	flush_copy(out);
+
+	out.append(static_cast<unsigned char>('E'));
+	auto const digest = total_acc_.digest();
+	out.append(digest.data(), digest.size());
+}
+
+bool delta_generator::generate(file & f, buffer & out)
+{
+	buffer buf;
+	while (true) {
+		int64_t const read = f.read(buf.get(max_literal), static_cast<int64_t>(max_literal));
+		if (read < 0) {
+			return false;
+		}
+		if (!read) {
+			break;
+		}
+		update(buf.get(), static_cast<size_t>(read), out);
+	}
+	finalize(out);
+	return true;
+}
+
+void delta_generator::process(buffer & out, bool final)
+{
+	if (!header_) {
+		out.append(delta_magic, sizeof(delta_magic));
+		append_be(out, sig_.block_size_, 4);
+		header_ = true;
+	}
+
+	size_t const bs = sig_.block_size_;
+	if (!bs || sig_.blocks_.empty()) {
+		// Nothing to match against
+		if (!data_.empty()) {
+			emit_literal(data_.size(), out);
+		}
+	}
+	else {
+		uint8_t const* p = data_.get();
+		while (data_.size() - pos_ >= bs) {
+			if (!rolling_) {
+				weak_sums(p + pos_, bs, a_, b_);
+				rolling_ = true;
+			}
+
+			uint32_t const weak = weak_checksum(a_, b_);
+
+			// Prefer continuing the current run of blocks, relevant for repetitive data
+			size_t idx = npos;
+			size_t const next = copy_count_ ? (copy_start_ + copy_count_) : npos;
+			if (next < sig_.blocks_.size() && sig_.blocks_[next].weak == weak && (next + 1 < sig_.blocks_.size() || !(sig_.size_ % bs))) {
+				uint8_t strong[delta_signature::strong_size];
+				strong_hash(strong_acc_, p + pos_, bs, strong);
+				if (!memcmp(strong, sig_.blocks_[next].strong, delta_signature::strong_size)) {
+					idx = next;
+				}
+			}
+			if (idx == npos) {
+				idx = sig_.find(weak, p + pos_, bs, strong_acc_);
+			}
+
+			if (idx != npos) {
+				if (pos_) {
+					emit_literal(pos_, out);
+				}
+				emit_copy(idx, out);
+				data_.consume(bs);
+				matched_ += bs;
+				p = data_.get();
+				rolling_ = false;
+				continue;
+			}
+
+			if (data_.size() - pos_ == bs) {
+				// Need more data to roll on
+				break;
+			}
+
+			uint32_t const out_byte = p[pos_];
+			uint32_t const in_byte = p[pos_ + bs];
+			a_ = a_ - out_byte + in_byte;
+			b_ = b_ - static_cast<uint32_t>(bs) * out_byte + a_;
+			++pos_;
+
+			if (pos_ >= max_literal) {
+				// Window is unaffected, rolling state stays valid
+				emit_literal(pos_, out);
+				p = data_.get();
+			}
+		}
+	}
+
+	if (final) {
+		size_t const remaining = data_.size() - pos_;
+		if (remaining && bs && (sig_.size_ % bs) == remaining) {
+			// Might match the short last block
+			uint32_t a{};
+			uint32_t b{};
+			weak_sums(data_.get() + pos_, remaining, a, b);
+			size_t const idx = sig_.find(weak_checksum(a, b), data_.get() + pos_, remaining, strong_acc_);
+			if (idx != npos) {
+				if (pos_) {
+					emit_literal(pos_, out);
+				}
+				emit_copy(idx, out);
+				data_.consume(remaining);
+				matched_ += remaining;
+			}
+		}
+		if (!data_.empty()) {
+			emit_literal(data_.size(), out);
+		}
+		rolling_ = false;
+	}
+}
+
+void delta_generator::emit_literal(size_t len, buffer & out)
+{
+	flush_copy(out);
+
+	while (len) {
+		size_t const piece = std::min(len, max_literal);
+		out.append(static_cast<unsigned char>('L'));
+		append_be(out, piece, 4);
+		out.append(data_.get(), piece);
+		data_.consume(piece);
+		pos_ -= std::min(pos_, piece);
+		literal_ += piece;
+		len -= piece;
+	}
+}
+
+void delta_generator::emit_copy(size_t block, buffer & out)
+{
+	if (copy_count_ && copy_start_ + copy_count_ == block && copy_count_ < 0xffffffffu) {
+		++copy_count_;
+		return;
+	}
+	flush_copy(out);
+	copy_start_ = block;
+	copy_count_ = 1;
+}
+
+void delta_generator::flush_copy(buffer & out)
+{
+	if (copy_count_) {
+		out.append(static_cast<unsigned char>('C'));
+		append_be(out, copy_start_, 8);
+		append_be(out, copy_count_, 4);
+		copy_count_ = 0;
+	}
+}
+
+delta_applier::delta_applier(file & base, file & out)
+	: base_(base)
+	, out_(out)
+{
+}
+
+bool delta_applier::write(uint8_t const* data, size_t size)
+{
+	total_acc_.update(data, size);
+	while (size) {
+		int64_t const written = out_.write(data, static_cast<int64_t>(size));
+		if (written <= 0) {
+			return false;
+		}
+		data += written;
+		size -= static_cast<size_t>(written);
+	}
+	return true;
+}
+
+bool delta_applier::update(uint8_t const* data, size_t size)
+{
+	if (failed_) {
+		return false;
+	}
+	if (done_) {
+		failed_ = size != 0;
+		return !failed_;
+	}
+
+	pending_.append(data, size);
+
+	while (!pending_.empty() && !failed_) {
+		uint8_t const* p = pending_.get();
+		size_t const avail = pending_.size();
+
+		if (!header_) {
+			size_t const header = sizeof(delta_magic) + 4;
+			if (avail < header) {
+				break;
+			}
+			block_size_ = read_be(p + sizeof(delta_magic), 4);
+			if (memcmp(p, delta_magic, sizeof(delta_magic)) || block_size_ > max_block_size) {
+				failed_ = true;
+				break;
+			}
+			header_ = true;
+			pending_.consume(header);
+			continue;
+		}
+
+		if (done_) {
+			// Trailing garbage
+			failed_ = true;
+			break;
+		}
+
+		if (p[0] == 'L') {
+			if (avail < 5) {
+				break;
+			}
+			size_t const len = static_cast<size_t>(read_be(p + 1, 4));
+			if (len > max_literal) {
+				failed_ = true;
+				break;
+			}
+			if (avail < 5 + len) {
+				break;
+			}
+			if (!write(p + 5, len)) {
+				failed_ = true;
+				break;
+			}
+			pending_.consume(5 + len);
+		}
+		else if (p[0] == 'C') {
+			if (avail < 13) {
+				break;
+			}
+			uint64_t const block = read_be(p + 1, 8);
+			uint64_t const count = read_be(p + 9, 4);
+			pending_.consume(13);
+
+			if (!block_size_ || block > static_cast<uint64_t>(INT64_MAX) / block_size_ || count > (static_cast<uint64_t>(INT64_MAX) / block_size_) - block) {
+				failed_ = true;
+				break;
+			}
+
+			auto const offset = static_cast<int64_t>(block * block_size_);
+			uint64_t len = count * block_size_;
+			if (base_.seek(offset, file::begin) != offset) {
+				failed_ = true;
+				break;
+			}
+			while (len) {
+				size_t const chunk = static_cast<size_t>(std::min(len, uint64_t(256 * 1024)));
+				int64_t const read = base_.read(copy_buffer_.get(chunk), static_cast<int64_t>(chunk));
+				if (read < 0) {
+					failed_ = true;
+					break;
+				}
+				if (!read) {
+					// The last block of the base may be short
+					break;
+				}
+				if (!write(copy_buffer_.get(), static_cast<size_t>(read))) {
+					failed_ = true;
+					break;
+				}
+				len -= static_cast<uint64_t>(read);
+			}
+		}
+		else if (p[0] == 'E') {
+			if (avail < 33) {
+				break;
+			}
+			auto const digest = total_acc_.digest();
+			if (digest.size() != 32 || memcmp(digest.data(), p + 1, 32)) {
+				failed_ = true;
+				break;
+			}
+			pending_.consume(33);
+			done_ = true;
+		}
+		else {
+			failed_ = true;
+		}
+	}
+
+	return !failed_;
+}
+
+bool delta_applier::finalize()
+{
+	return !failed_ && done_ && pending_.empty();
+}
+
+bool delta_applier::apply(buffer const& delta)
+{
+	return update(delta.get(), delta.size()) && finalize();
+}
+
+}
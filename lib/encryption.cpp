@@ -7,6 +7,7 @@
 #include <cstring>
 
 #include <nettle/aes.h>
+#include <nettle/chacha-poly1305.h>
 #include <nettle/ctr.h>
 #include <nettle/curve25519.h>
 #include <nettle/gcm.h>
@@ -14,8 +15,125 @@
 #include <nettle/sha2.h>
 #include <nettle/version.h>
 
+#if defined(__x86_64__) || defined(__i386__) || defined(_M_X64) || defined(_M_IX86)
+#define FZ_X86 1
+#ifdef _MSC_VER
+#include <intrin.h>
+#else
+#include <cpuid.h>
+#endif
+#elif defined(__aarch64__) || defined(_M_ARM64)
+#define FZ_ARM64 1
+#ifdef FZ_WINDOWS
+#include "libfilezilla/glue/windows.hpp"
+#elif defined(__linux__)
+#include <sys/auxv.h>
+#include <asm/hwcap.h>
+#endif
+#endif
+
 namespace fz {
 
+namespace {
+bool has_aes_acceleration()
+{
+#if FZ_X86
+	// AES-NI and PCLMULQDQ, the latter is what makes GCM fast
+	unsigned int ecx{};
+#ifdef _MSC_VER
+	int regs[4]{};
+	__cpuid(regs, 1);
+	ecx = static_cast<unsigned int>(regs[2]);
+#else
+	unsigned int eax{}, ebx{}, edx{};
+	if (!__get_cpuid(1, &eax, &ebx, &ecx, &edx)) {
+		return false;
+	}
+#endif
+	return (ecx & (1u << 25)) && (ecx & (1u << 1));
+#elif FZ_ARM64
+#if defined(FZ_MAC)
+	return true;
+#elif defined(FZ_WINDOWS)
+	return IsProcessorFeaturePresent(PF_ARM_V8_CRYPTO_INSTRUCTIONS_AVAILABLE);
+#elif defined(__linux__)
+	unsigned long const caps = getauxval(AT_HWCAP);
+	return (caps & HWCAP_AES) && (caps & HWCAP_PMULL);
+#else
+	return false;
+#endif
+#else
+	return false;
+#endif
+}
+
+aead_cipher select_cipher(aead_cipher cipher)
+{
+	return (cipher == aead_cipher::automatic) ? preferred_aead_cipher() : cipher;
+}
+
+// Prefix of ciphertexts in the versioned format: magic, format version and cipher.
+// Ciphertexts produced with AES256-GCM keep the original, unversioned format.
+uint8_t const versioned_header[] = {'F', 'Z', 'E', 1, 2};
+size_t const versioned_header_size = sizeof(versioned_header);
+
+bool is_versioned(uint8_t const* cipher, size_t size)
+{
+	return size >= versioned_header_size && !memcmp(cipher, versioned_header, versioned_header_size);
+}
+
+// Writes C' || T to out
+void chacha_seal(std::vector<uint8_t> const& key, std::vector<uint8_t> const& nonce, uint8_t const* authenticated_data, size_t authenticated_data_size, uint8_t const* plain, size_t size, uint8_t * out)
+{
+	chacha_poly1305_ctx ctx;
+	nettle_chacha_poly1305_set_key(&ctx, key.data());
+	nettle_chacha_poly1305_set_nonce(&ctx, nonce.data());
+
+	nettle_chacha_poly1305_update(&ctx, versioned_header_size, versioned_header);
+	if (authenticated_data_size) {
+		nettle_chacha_poly1305_update(&ctx, authenticated_data_size, authenticated_data);
+	}
+
+	if (size) {
+		nettle_chacha_poly1305_encrypt(&ctx, size, out, plain);
+	}
+	nettle_chacha_poly1305_digest(&ctx, CHACHA_POLY1305_DIGEST_SIZE, out + size);
+}
+
+// Decrypts C' || T, returns false if the tag does not match
+bool chacha_open(std::vector<uint8_t> const& key, std::vector<uint8_t> const& nonce, uint8_t const* authenticated_data, size_t authenticated_data_size, uint8_t const* cipher, size_t size, std::vector<uint8_t> & out)
+{
+	chacha_poly1305_ctx ctx;
+	nettle_chacha_poly1305_set_key(&ctx, key.data());
+	nettle_chacha_poly1305_set_nonce(&ctx, nonce.data());
+
+	nettle_chacha_poly1305_update(&ctx, versioned_header_size, versioned_header);
+	if (authenticated_data_size) {
+		nettle_chacha_poly1305_update(&ctx, authenticated_data_size, authenticated_data);
+	}
+
+	size_t const message_size = size - CHACHA_POLY1305_DIGEST_SIZE;
+	out.resize(message_size);
+	if (message_size) {
+		nettle_chacha_poly1305_decrypt(&ctx, message_size, out.data(), cipher);
+	}
+
+	uint8_t tag[CHACHA_POLY1305_DIGEST_SIZE];
+	nettle_chacha_poly1305_digest(&ctx, CHACHA_POLY1305_DIGEST_SIZE, tag);
+	if (!nettle_memeql_sec(tag, cipher + message_size, CHACHA_POLY1305_DIGEST_SIZE)) {
+		out.clear();
+		return false;
+	}
+	return true;
+}
+}
+
+aead_cipher preferred_aead_cipher()
+{
+	static aead_cipher const cipher = has_aes_acceleration() ? aead_cipher::aes256_gcm : aead_cipher::chacha20_poly1305;
+	return cipher;
+}
+
 std::string public_key::to_base64(bool pad) const
 {
 	auto raw = std::string(key_.cbegin(), key_.cend());
@@ -141,7 +259,7 @@ std::vector<uint8_t> private_key::shared_secret(public_key const& pub) const
 }
 
 namespace {
-std::vector<uint8_t> encrypt(uint8_t const* plain, size_t size, public_key const& pub, uint8_t const* authenticated_data, size_t authenticated_data_size, bool authenticated)
+std::vector<uint8_t> encrypt(uint8_t const* plain, size_t size, public_key const& pub, uint8_t const* authenticated_data, size_t authenticated_data_size, bool authenticated, aead_cipher cipher)
 {
 	std::vector<uint8_t> ret;
 
@@ -152,6 +270,23 @@ std::vector<uint8_t> encrypt(uint8_t const* plain, size_t size, public_key const
 		// Generate shared secret from pub and ephemeral
 		std::vector<uint8_t> secret = ephemeral.shared_secret(pub);
 
+		if (authenticated && select_cipher(cipher) == aead_cipher::chacha20_poly1305) {
+			// Derive ChaCha20 key and nonce from shared secret
+			std::vector<uint8_t> const key = hash_accumulator(hash_algorithm::sha256) << ephemeral_pub.salt_ << 5 << secret << ephemeral_pub.key_ << pub.key_ << pub.salt_;
+			std::vector<uint8_t> nonce = hash_accumulator(hash_algorithm::sha256) << ephemeral_pub.salt_ << 6 << secret << ephemeral_pub.key_ << pub.key_ << pub.salt_;
+			nonce.resize(CHACHA_POLY1305_NONCE_SIZE);
+
+			// Return header||ephemeral_pub.key_||ephemeral_pub.salt_||ciphertext||tag
+			size_t const prefix = versioned_header_size + public_key::key_size + public_key::salt_size;
+			ret.resize(prefix + size + CHACHA_POLY1305_DIGEST_SIZE);
+			memcpy(ret.data(), versioned_header, versioned_header_size);
+			memcpy(ret.data() + versioned_header_size, ephemeral_pub.key_.data(), public_key::key_size);
+			memcpy(ret.data() + versioned_header_size + public_key::key_size, ephemeral_pub.salt_.data(), public_key::salt_size);
+			chacha_seal(key, nonce, authenticated_data, authenticated_data_size, plain, size, ret.data() + prefix);
+
+			return ret;
+		}
+
 		// Derive AES2556 key and CTR nonce from shared secret
 		std::vector<uint8_t> const aes_key = hash_accumulator(hash_algorithm::sha256) << ephemeral_pub.salt_ << 0 << secret << ephemeral_pub.key_ << pub.key_ << pub.salt_;
 
@@ -203,41 +338,77 @@ std::vector<uint8_t> encrypt(uint8_t const* plain, size_t size, public_key const
 
 std::vector<uint8_t> encrypt(uint8_t const* plain, size_t size, public_key const& pub, bool authenticated)
 {
-	return encrypt(plain, size, pub, nullptr, 0, authenticated);
+	return encrypt(plain, size, pub, nullptr, 0, authenticated, aead_cipher::automatic);
 }
 
 std::vector<uint8_t> encrypt(std::vector<uint8_t> const& plain, public_key const& pub, bool authenticated)
 {
-	return encrypt(plain.data(), plain.size(), pub, nullptr, 0, authenticated);
+	return encrypt(plain.data(), plain.size(), pub, nullptr, 0, authenticated, aead_cipher::automatic);
 }
 
 std::vector<uint8_t> encrypt(std::string_view const& plain, public_key const& pub, bool authenticated)
 {
-	return encrypt(reinterpret_cast<uint8_t const*>(plain.data()), plain.size(), pub, nullptr, 0, authenticated);
+	return encrypt(reinterpret_cast<uint8_t const*>(plain.data()), plain.size(), pub, nullptr, 0, authenticated, aead_cipher::automatic);
 }
 
 std::vector<uint8_t> encrypt(uint8_t const* plain, size_t size, public_key const& pub, uint8_t const* authenticated_data, size_t authenticated_data_size)
 {
-	return encrypt(plain, size, pub, authenticated_data, authenticated_data_size, true);
+	return encrypt(plain, size, pub, authenticated_data, authenticated_data_size, true, aead_cipher::automatic);
+}
+
+std::vector<uint8_t> encrypt(uint8_t const* plain, size_t size, public_key const& pub, uint8_t const* authenticated_data, size_t authenticated_data_size, aead_cipher cipher)
+{
+	return encrypt(plain, size, pub, authenticated_data, authenticated_data_size, true, cipher);
 }
 
 std::vector<uint8_t> encrypt(std::vector<uint8_t> const& plain, public_key const& pub, std::vector<uint8_t> const& authenticated_data)
 {
-	return encrypt(plain.data(), plain.size(), pub, authenticated_data.data(), authenticated_data.size(), true);
+	return encrypt(plain.data(), plain.size(), pub, authenticated_data.data(), authenticated_data.size(), true, aead_cipher::automatic);
 }
 
 std::vector<uint8_t> encrypt(std::string_view const& plain, public_key const& pub, std::string_view const& authenticated_data)
 {
-	return encrypt(reinterpret_cast<uint8_t const*>(plain.data()), plain.size(), pub, reinterpret_cast<uint8_t const*>(authenticated_data.data()), authenticated_data.size(), true);
+	return encrypt(reinterpret_cast<uint8_t const*>(plain.data()), plain.size(), pub, reinterpret_cast<uint8_t const*>(authenticated_data.data()), authenticated_data.size(), true, aead_cipher::automatic);
 }
 
 namespace {
+std::vector<uint8_t> decrypt_versioned(uint8_t const* cipher, size_t size, private_key const& priv, uint8_t const* authenticated_data, size_t authenticated_data_size)
+{
+	std::vector<uint8_t> ret;
+
+	size_t const prefix = versioned_header_size + public_key::key_size + public_key::salt_size;
+	if (size >= prefix + CHACHA_POLY1305_DIGEST_SIZE) {
+		public_key ephemeral_pub;
+		ephemeral_pub.key_.assign(cipher + versioned_header_size, cipher + versioned_header_size + public_key::key_size);
+		ephemeral_pub.salt_.assign(cipher + versioned_header_size + public_key::key_size, cipher + prefix);
+
+		std::vector<uint8_t> const secret = priv.shared_secret(ephemeral_pub);
+
+		public_key const pub = priv.pubkey();
+		std::vector<uint8_t> const key = hash_accumulator(hash_algorithm::sha256) << ephemeral_pub.salt_ << 5 << secret << ephemeral_pub.key_ << pub.key_ << pub.salt_;
+		std::vector<uint8_t> nonce = hash_accumulator(hash_algorithm::sha256) << ephemeral_pub.salt_ << 6 << secret << ephemeral_pub.key_ << pub.key_ << pub.salt_;
+		nonce.resize(CHACHA_POLY1305_NONCE_SIZE);
+
+		chacha_open(key, nonce, authenticated_data, authenticated_data_size, cipher + prefix, size - prefix, ret);
+	}
+
+	return ret;
+}
+
 std::vector<uint8_t> decrypt(uint8_t const* cipher, size_t size, private_key const& priv, uint8_t const* authenticated_data, size_t authenticated_data_size, bool authenticated)
 {
 	size_t const overhead = public_key::key_size + public_key::salt_size + (authenticated ? GCM_DIGEST_SIZE : 0);
 
 	std::vector<uint8_t> ret;
 
+	if (priv && authenticated && cipher && is_versioned(cipher, size)) {
+		ret = decrypt_versioned(cipher, size, priv, authenticated_data, authenticated_data_size);
+		if (!ret.empty()) {
+			return ret;
+		}
+		// Could still be an unversioned ciphertext that happens to start with the header
+	}
+
 	if (priv && size >= overhead && cipher) {
 		size_t const message_size = size - overhead;
 
@@ -437,10 +608,18 @@ bool operator==(symmetric_key const& lhs, symmetric_key const& rhs)
 
 size_t symmetric_key::encryption_overhead()
 {
+	return encryption_overhead(aead_cipher::aes256_gcm);
+}
+
+size_t symmetric_key::encryption_overhead(aead_cipher cipher)
+{
+	if (select_cipher(cipher) == aead_cipher::chacha20_poly1305) {
+		return versioned_header_size + symmetric_key::salt_size + CHACHA_POLY1305_DIGEST_SIZE;
+	}
 	return symmetric_key::salt_size + GCM_DIGEST_SIZE;
 }
 
-std::vector<uint8_t> encrypt(uint8_t const* plain, size_t size, symmetric_key const& key, uint8_t const* authenticated_data, size_t authenticated_data_size)
+std::vector<uint8_t> encrypt(uint8_t const* plain, size_t size, symmetric_key const& key, uint8_t const* authenticated_data, size_t authenticated_data_size, aead_cipher cipher)
 {
 	std::vector<uint8_t> ret;
 
@@ -448,6 +627,22 @@ std::vector<uint8_t> encrypt(uint8_t const* plain, size_t size, symmetric_key co
 		// Generate per-message nonce
 		auto nonce = random_bytes(symmetric_key::salt_size);
 
+		if (select_cipher(cipher) == aead_cipher::chacha20_poly1305) {
+			// Derive ChaCha20 key and nonce from symmetric key and nonce
+			std::vector<uint8_t> const chacha_key = hash_accumulator(hash_algorithm::sha256) << key.salt() << 7 << key.key() << nonce;
+			std::vector<uint8_t> chacha_nonce = hash_accumulator(hash_algorithm::sha256) << key.salt() << 8 << key.key() << nonce;
+			chacha_nonce.resize(CHACHA_POLY1305_NONCE_SIZE);
+
+			// Return header||nonce||ciphertext||tag
+			size_t const prefix = versioned_header_size + symmetric_key::salt_size;
+			ret.resize(prefix + size + CHACHA_POLY1305_DIGEST_SIZE);
+			memcpy(ret.data(), versioned_header, versioned_header_size);
+			memcpy(ret.data() + versioned_header_size, nonce.data(), symmetric_key::salt_size);
+			chacha_seal(chacha_key, chacha_nonce, authenticated_data, authenticated_data_size, plain, size, ret.data() + prefix);
+
+			return ret;
+		}
+
 		// Derive AES2556 key and IV from symmetric key and nonce
 		std::vector<uint8_t> const aes_key = hash_accumulator(hash_algorithm::sha256) << key.salt() << 3 << key.key() << nonce;
 		std::vector<uint8_t> iv = hash_accumulator(hash_algorithm::sha256) << key.salt() << 4 << key.key() << nonce;
@@ -476,6 +671,11 @@ std::vector<uint8_t> encrypt(uint8_t const* plain, size_t size, symmetric_key co
 	return ret;
 }
 
+std::vector<uint8_t> encrypt(uint8_t const* plain, size_t size, symmetric_key const& key, uint8_t const* authenticated_data, size_t authenticated_data_size)
+{
+	return encrypt(plain, size, key, authenticated_data, authenticated_data_size, aead_cipher::automatic);
+}
+
 std::vector<uint8_t> encrypt(uint8_t const* plain, size_t size, symmetric_key const& key)
 {
 	return encrypt(plain, size, key, nullptr, 0);
@@ -506,7 +706,21 @@ std::vector<uint8_t> decrypt(uint8_t const* cipher, size_t size, symmetric_key c
 {
 	std::vector<uint8_t> ret;
 
-	size_t const overhead = symmetric_key::encryption_overhead();
+	if (key && cipher && size >= symmetric_key::encryption_overhead(aead_cipher::chacha20_poly1305) && is_versioned(cipher, size)) {
+		std::basic_string_view<uint8_t> const nonce(cipher + versioned_header_size, symmetric_key::salt_size);
+
+		std::vector<uint8_t> const chacha_key = hash_accumulator(hash_algorithm::sha256) << key.salt() << 7 << key.key() << nonce;
+		std::vector<uint8_t> chacha_nonce = hash_accumulator(hash_algorithm::sha256) << key.salt() << 8 << key.key() << nonce;
+		chacha_nonce.resize(CHACHA_POLY1305_NONCE_SIZE);
+
+		size_t const prefix = versioned_header_size + symmetric_key::salt_size;
+		if (chacha_open(chacha_key, chacha_nonce, authenticated_data, authenticated_data_size, cipher + prefix, size - prefix, ret)) {
+			return ret;
+		}
+		// Could still be an unversioned ciphertext that happens to start with the header
+	}
+
+	size_t const overhead = symmetric_key::encryption_overhead(aead_cipher::aes256_gcm);
 	if (key && size >= overhead && cipher) {
 		size_t const message_size = size - overhead;
 
@@ -37,7 +37,7 @@ event_loop::~event_loop()
 	stop(true);
 }
 
-void event_loop::send_event(event_handler* handler, event_base* evt)
+void event_loop::send_event(event_handler* handler, event_base* evt, bool deletable)
 {
 	event_assert(handler);
 	event_assert(evt);
@@ -45,6 +45,12 @@ void event_loop::send_event(event_handler* handler, event_base* evt)
 	{
 		scoped_lock lock(sync_);
 		if (!handler->removing_) {
+			if (!deletable) {
+				if (!persistent_events_.insert(evt).second) {
+					// Still pending, must not be queued twice
+					return;
+				}
+			}
 			if (pending_events_.empty()) {
 				cond_.signal(lock);
 			}
@@ -53,7 +59,22 @@ void event_loop::send_event(event_handler* handler, event_base* evt)
 		}
 	}
 
-	delete evt;
+	if (deletable) {
+		delete evt;
+	}
+}
+
+void event_loop::release_event(event_base * evt)
+{
+	if (persistent_events_.empty() || !persistent_events_.erase(evt)) {
+		delete evt;
+	}
+}
+
+bool event_loop::persistent_event_pending(event_base const* evt)
+{
+	scoped_lock l(sync_);
+	return persistent_events_.count(evt) != 0;
 }
 
 void event_loop::remove_handler(event_handler* handler)
@@ -66,7 +87,7 @@ void event_loop::remove_handler(event_handler* handler)
 		std::remove_if(pending_events_.begin(), pending_events_.end(),
 			[&](Events::value_type const& v) {
 				if (v.first == handler) {
-					delete v.second;
+					release_event(v.second);
 				}
 				return v.first == handler;
 			}
@@ -106,7 +127,7 @@ void event_loop::filter_events(std::function<bool(Events::value_type &)> const&
 			[&](Events::value_type & v) {
 				bool const remove = filter(v);
 				if (remove) {
-					delete v.second;
+					release_event(v.second);
 				}
 				return remove;
 			}
@@ -174,11 +195,20 @@ bool event_loop::process_event(scoped_lock & l)
 
 	active_handler_ = ev.first;
 
+	// Persistent events remain pending until processed
+	bool const persistent = !persistent_events_.empty() && persistent_events_.count(ev.second);
+
 	l.unlock();
 	(*ev.first)(*ev.second);
-	delete ev.second;
+	if (!persistent) {
+		delete ev.second;
+	}
 	l.lock();
 
+	if (persistent) {
+		release_event(ev.second);
+	}
+
 	active_handler_ = nullptr;
 
 	return true;
@@ -302,7 +332,7 @@ void event_loop::stop(bool join)
 
 		scoped_lock lock(sync_);
 		for (auto & v : pending_events_) {
-			delete v.second;
+			release_event(v.second);
 		}
 		pending_events_.clear();
 
@@ -0,0 +1,639 @@
+#include "libfilezilla/libfilezilla.hpp"
+
+#include "libfilezilla/fs_watcher.hpp"
+#include "libfilezilla/local_filesys.hpp"
+#include "libfilezilla/mutex.hpp"
+
+#if HAVE_INOTIFY_INIT1
+#include "libfilezilla/glue/unix.hpp"
+
+#include <sys/inotify.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <map>
+
+#include <string.h>
+#endif
+
+#include <errno.h>
+
+namespace fz {
+
+#if HAVE_INOTIFY_INIT1
+namespace {
+uint32_t const watch_mask = IN_CREATE | IN_DELETE | IN_MODIFY | IN_ATTRIB | IN_MOVED_FROM | IN_MOVED_TO | IN_DELETE_SELF | IN_MOVE_SELF | IN_EXCL_UNLINK;
+
+// Beyond this, changes are discarded in favor of a single overflow entry
+size_t const max_pending_changes = 16384;
+
+void close_fd(int & fd)
+{
+	if (fd != -1) {
+		::close(fd);
+		fd = -1;
+	}
+}
+}
+
+class fs_watcher_impl final
+{
+public:
+	fs_watcher_impl(fs_watcher & owner, thread_pool & pool, event_handler & handler, duration const& coalesce_delay, size_t max_watches);
+	~fs_watcher_impl();
+
+	int add(native_string const& path, bool recursive);
+	void remove(native_string const& path);
+
+	size_t watch_count() const;
+
+	std::vector<fs_change> fetch_changes();
+
+private:
+	struct watch final
+	{
+		native_string path;
+
+		// Subdirectories are watched as well, either because this path or one of
+		// its ancestors has been added recursively
+		bool recursive{};
+
+		// Explicitly passed to add
+		bool added{};
+		bool added_recursive{};
+	};
+
+	bool init();
+	void entry();
+
+	int add_watch(native_string const& path, bool recursive, bool follow, bool added);
+	int add_subdirs(native_string const& path);
+	void remove_watch(int wd);
+
+	// Re-evaluates the watches for the path and everything below it after watches
+	// have been removed or moved. Keeps those added explicitly or covered by a
+	// recursively watched parent, removes all others.
+	void prune(native_string const& path);
+
+	// Updates the paths of the watches for a moved directory and everything below it
+	void rename(native_string const& from, native_string const& to);
+
+	// Returns the watches for the path and everything below it
+	std::vector<int> subtree(native_string const& path) const;
+
+	void process(char const* p, size_t len);
+	void record(native_string const& path, unsigned int changes);
+	void record_overflow();
+
+	fs_watcher & owner_;
+	thread_pool & pool_;
+	event_handler & handler_;
+	duration const coalesce_delay_;
+	size_t const max_watches_;
+
+	mutable mutex mtx_{false};
+
+	int fd_{-1};
+	int quit_fds_[2]{-1, -1};
+	async_task task_;
+
+	std::map<int, watch> watches_;
+	std::map<native_string, int> paths_;
+
+	// Watched directories moved away, by cookie of the move, until the other half of the move arrives
+	std::map<uint32_t, native_string> moves_;
+
+	// Watched directories moved within the watched tree, until their own move event arrives
+	std::vector<int> moved_wds_;
+
+	std::map<native_string, unsigned int> changes_;
+	bool overflow_{};
+	monotonic_clock first_change_;
+	monotonic_clock last_change_;
+	bool signalled_{};
+};
+
+fs_watcher_impl::fs_watcher_impl(fs_watcher & owner, thread_pool & pool, event_handler & handler, duration const& coalesce_delay, size_t max_watches)
+	: owner_(owner)
+	, pool_(pool)
+	, handler_(handler)
+	, coalesce_delay_(coalesce_delay)
+	, max_watches_(max_watches)
+{
+}
+
+fs_watcher_impl::~fs_watcher_impl()
+{
+	if (quit_fds_[1] != -1) {
+		char const c = 0;
+		ssize_t res;
+		do {
+			res = ::write(quit_fds_[1], &c, 1);
+		} while (res == -1 && errno == EINTR);
+	}
+	task_.join();
+
+	auto event_filter = [this](event_loop::Events::value_type const& ev) -> bool {
+		if (ev.first != &handler_ || ev.second->derived_type() != fs_watcher_event::type()) {
+			return false;
+		}
+		return std::get<0>(static_cast<fs_watcher_event const&>(*ev.second).v_) == &owner_;
+	};
+	handler_.event_loop_.filter_events(event_filter);
+
+	close_fd(fd_);
+	close_fd(quit_fds_[0]);
+	close_fd(quit_fds_[1]);
+}
+
+bool fs_watcher_impl::init()
+{
+	if (fd_ != -1) {
+		return true;
+	}
+
+	fd_ = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+	if (fd_ == -1) {
+		return false;
+	}
+	if (!create_pipe(quit_fds_)) {
+		int const error = errno;
+		close_fd(fd_);
+		errno = error;
+		return false;
+	}
+	task_ = pool_.spawn([this]() { entry(); });
+	if (!task_) {
+		close_fd(fd_);
+		close_fd(quit_fds_[0]);
+		close_fd(quit_fds_[1]);
+		errno = EAGAIN;
+		return false;
+	}
+	return true;
+}
+
+int fs_watcher_impl::add(native_string const& path, bool recursive)
+{
+	if (path.empty()) {
+		return EINVAL;
+	}
+
+	native_string p = path;
+	while (p.size() > 1 && p.back() == '/') {
+		p.pop_back();
+	}
+
+	scoped_lock l(mtx_);
+	if (!init()) {
+		return errno;
+	}
+
+	int error = add_watch(p, recursive, true, true);
+	if (!error && recursive) {
+		error = add_subdirs(p);
+	}
+	return error;
+}
+
+int fs_watcher_impl::add_watch(native_string const& path, bool recursive, bool follow, bool added)
+{
+	auto it = paths_.find(path);
+	if (it != paths_.end()) {
+		auto & w = watches_[it->second];
+		w.recursive |= recursive;
+		if (added) {
+			w.added = true;
+			w.added_recursive |= recursive;
+		}
+		return 0;
+	}
+
+	if (watches_.size() >= max_watches_) {
+		return ENOSPC;
+	}
+
+	int const wd = inotify_add_watch(fd_, path.c_str(), watch_mask | (follow ? 0 : IN_DONT_FOLLOW));
+	if (wd == -1) {
+		return errno;
+	}
+
+	// Same inode under a different path, e.g. through a symlink. Keep the first path.
+	auto const wit = watches_.find(wd);
+	if (wit != watches_.end()) {
+		wit->second.recursive |= recursive;
+		if (added) {
+			wit->second.added = true;
+			wit->second.added_recursive |= recursive;
+		}
+		return 0;
+	}
+
+	watches_[wd] = watch{path, recursive, added, added && recursive};
+	paths_[path] = wd;
+	return 0;
+}
+
+int fs_watcher_impl::add_subdirs(native_string const& path)
+{
+	std::vector<native_string> dirs{path};
+	while (!dirs.empty()) {
+		native_string const dir = std::move(dirs.back());
+		dirs.pop_back();
+
+		local_filesys fs;
+		if (!fs.begin_find_files(dir, true, false)) {
+			// Might have vanished in the meantime
+			continue;
+		}
+
+		native_string name;
+		bool is_link{};
+		local_filesys::type t{};
+		while (fs.get_next_file(name, is_link, t, nullptr, nullptr, nullptr)) {
+			if (is_link || t != local_filesys::dir) {
+				continue;
+			}
+			native_string sub = (dir == "/") ? (dir + name) : (dir + '/' + name);
+			int const error = add_watch(sub, true, false, false);
+			if (error == ENOSPC) {
+				return error;
+			}
+			if (!error) {
+				dirs.push_back(std::move(sub));
+			}
+		}
+	}
+	return 0;
+}
+
+void fs_watcher_impl::remove(native_string const& path)
+{
+	native_string p = path;
+	while (p.size() > 1 && p.back() == '/') {
+		p.pop_back();
+	}
+
+	scoped_lock l(mtx_);
+
+	auto it = paths_.find(p);
+	if (it == paths_.end()) {
+		return;
+	}
+
+	auto & w = watches_[it->second];
+	w.added = false;
+	w.added_recursive = false;
+	prune(p);
+}
+
+void fs_watcher_impl::remove_watch(int wd)
+{
+	auto it = watches_.find(wd);
+	if (it != watches_.end()) {
+		auto pit = paths_.find(it->second.path);
+		if (pit != paths_.end() && pit->second == wd) {
+			paths_.erase(pit);
+		}
+		watches_.erase(it);
+	}
+}
+
+std::vector<int> fs_watcher_impl::subtree(native_string const& path) const
+{
+	std::vector<int> ret;
+
+	// Parents sort before their children
+	native_string const prefix = (path == "/") ? path : (path + '/');
+	for (auto it = paths_.lower_bound(path); it != paths_.end(); ++it) {
+		if (it->first != path && it->first.compare(0, prefix.size(), prefix)) {
+			if (it->first > prefix) {
+				break;
+			}
+			// Siblings like path-suffix sort between path and path/
+			continue;
+		}
+		ret.push_back(it->second);
+	}
+	return ret;
+}
+
+void fs_watcher_impl::prune(native_string const& path)
+{
+	for (int wd : subtree(path)) {
+		auto & w = watches_[wd];
+
+		bool covered{};
+		size_t const pos = w.path.rfind('/');
+		if (pos != native_string::npos && w.path != "/") {
+			auto const pit = paths_.find(pos ? w.path.substr(0, pos) : native_string("/"));
+			covered = pit != paths_.end() && watches_[pit->second].recursive;
+		}
+
+		if (!covered && !w.added) {
+			inotify_rm_watch(fd_, wd);
+			remove_watch(wd);
+		}
+		else {
+			w.recursive = covered || w.added_recursive;
+		}
+	}
+}
+
+void fs_watcher_impl::rename(native_string const& from, native_string const& to)
+{
+	for (int wd : subtree(from)) {
+		auto & w = watches_[wd];
+		native_string const path = to + w.path.substr(from.size());
+
+		auto pit = paths_.find(w.path);
+		if (pit != paths_.end() && pit->second == wd) {
+			paths_.erase(pit);
+		}
+		w.path = path;
+		// Anything previously at the target path is gone, its watch receives IN_IGNORED.
+		paths_[path] = wd;
+	}
+}
+
+size_t fs_watcher_impl::watch_count() const
+{
+	scoped_lock l(mtx_);
+	return watches_.size();
+}
+
+std::vector<fs_change> fs_watcher_impl::fetch_changes()
+{
+	std::vector<fs_change> ret;
+
+	scoped_lock l(mtx_);
+	signalled_ = false;
+	if (overflow_) {
+		ret.push_back(fs_change{native_string(), fs_change::overflow});
+		overflow_ = false;
+	}
+	ret.reserve(ret.size() + changes_.size());
+	for (auto & c : changes_) {
+		ret.push_back(fs_change{c.first, c.second});
+	}
+	changes_.clear();
+
+	return ret;
+}
+
+void fs_watcher_impl::record(native_string const& path, unsigned int changes)
+{
+	if (overflow_) {
+		return;
+	}
+	if (changes_.empty()) {
+		first_change_ = monotonic_clock::now();
+	}
+	last_change_ = monotonic_clock::now();
+
+	auto it = changes_.find(path);
+	if (it != changes_.end()) {
+		it->second |= changes;
+	}
+	else if (changes_.size() < max_pending_changes) {
+		changes_.emplace(path, changes);
+	}
+	else {
+		record_overflow();
+	}
+}
+
+void fs_watcher_impl::record_overflow()
+{
+	// Individual changes are meaningless now
+	changes_.clear();
+	if (!overflow_) {
+		overflow_ = true;
+		first_change_ = monotonic_clock::now();
+	}
+	last_change_ = monotonic_clock::now();
+}
+
+void fs_watcher_impl::process(char const* p, size_t len)
+{
+	scoped_lock l(mtx_);
+
+	while (len >= sizeof(inotify_event)) {
+		inotify_event ev;
+		memcpy(&ev, p, sizeof(inotify_event));
+		size_t const size = sizeof(inotify_event) + ev.len;
+		if (size > len) {
+			break;
+		}
+		char const* name = p + sizeof(inotify_event);
+		p += size;
+		len -= size;
+
+		if (ev.mask & IN_Q_OVERFLOW) {
+			record_overflow();
+			continue;
+		}
+
+		auto it = watches_.find(ev.wd);
+		if (it == watches_.end()) {
+			continue;
+		}
+
+		if (ev.mask & IN_IGNORED) {
+			// Watched entry is gone, or the watch got removed
+			remove_watch(ev.wd);
+			continue;
+		}
+
+		native_string path = it->second.path;
+		if (ev.len && *name) {
+			if (path != "/") {
+				path += '/';
+			}
+			path += name;
+		}
+
+		if (ev.mask & IN_MOVE_SELF) {
+			auto const wit = std::find(moved_wds_.begin(), moved_wds_.end(), ev.wd);
+			if (wit != moved_wds_.end()) {
+				// Moved within the watched tree, already reported through its parents
+				moved_wds_.erase(wit);
+				continue;
+			}
+
+			// Moved out of sight, the path no longer refers to it
+			record(path, fs_change::removed);
+			for (auto mit = moves_.begin(); mit != moves_.end(); ) {
+				if (mit->second == path) {
+					mit = moves_.erase(mit);
+				}
+				else {
+					++mit;
+				}
+			}
+			for (int wd : subtree(path)) {
+				inotify_rm_watch(fd_, wd);
+				remove_watch(wd);
+			}
+			continue;
+		}
+
+		unsigned int changes{};
+		if (ev.mask & (IN_CREATE | IN_MOVED_TO)) {
+			changes |= fs_change::created;
+		}
+		if (ev.mask & (IN_DELETE | IN_MOVED_FROM | IN_DELETE_SELF)) {
+			changes |= fs_change::removed;
+		}
+		if (ev.mask & IN_MODIFY) {
+			changes |= fs_change::modified;
+		}
+		if (ev.mask & IN_ATTRIB) {
+			changes |= fs_change::attributes;
+		}
+		if (changes) {
+			record(path, changes);
+		}
+
+		// Directories keep their watches when moved, but their paths change. Moves within the
+		// watched tree get reported as a pair of events sharing a cookie, followed by
+		// IN_MOVE_SELF for the moved directory itself.
+		bool const parent_recursive = it->second.recursive;
+		if ((ev.mask & IN_ISDIR) && (ev.mask & IN_MOVED_FROM) && paths_.find(path) != paths_.end()) {
+			moves_[ev.cookie] = path;
+		}
+		if ((ev.mask & IN_ISDIR) && (ev.mask & IN_MOVED_TO)) {
+			auto const mit = moves_.find(ev.cookie);
+			if (mit != moves_.end()) {
+				auto const pit = paths_.find(mit->second);
+				if (pit != paths_.end()) {
+					moved_wds_.push_back(pit->second);
+				}
+				rename(mit->second, path);
+				moves_.erase(mit);
+				prune(path);
+			}
+		}
+		if ((ev.mask & IN_ISDIR) && (ev.mask & (IN_CREATE | IN_MOVED_TO)) && parent_recursive) {
+			// Anything created in the new directory before its watch got added is missed,
+			// the reported creation of the directory covers it.
+			int error = add_watch(path, true, false, false);
+			if (!error) {
+				error = add_subdirs(path);
+			}
+			if (error == ENOSPC) {
+				record_overflow();
+			}
+		}
+	}
+}
+
+void fs_watcher_impl::entry()
+{
+	pollfd fds[2]{};
+	fds[0].fd = fd_;
+	fds[0].events = POLLIN;
+	fds[1].fd = quit_fds_[0];
+	fds[1].events = POLLIN;
+
+	alignas(inotify_event) char buf[16384];
+
+	while (true) {
+		int timeout = -1;
+		{
+			scoped_lock l(mtx_);
+			if (!signalled_ && (overflow_ || !changes_.empty())) {
+				auto const now = monotonic_clock::now();
+				duration max_delay = coalesce_delay_;
+				max_delay *= 10;
+				auto const deadline = std::min(last_change_ + coalesce_delay_, first_change_ + max_delay);
+				if (deadline <= now) {
+					signalled_ = true;
+					handler_.send_event<fs_watcher_event>(&owner_);
+				}
+				else {
+					timeout = static_cast<int>((deadline - now).get_milliseconds()) + 1;
+				}
+			}
+		}
+
+		int res = poll(fds, 2, timeout);
+		if (res == -1) {
+			if (errno == EINTR) {
+				continue;
+			}
+			break;
+		}
+		if (fds[1].revents) {
+			break;
+		}
+		if (fds[0].revents & POLLIN) {
+			while (true) {
+				ssize_t const read = ::read(fd_, buf, sizeof(buf));
+				if (read > 0) {
+					process(buf, static_cast<size_t>(read));
+				}
+				else if (read == -1 && errno == EINTR) {
+					continue;
+				}
+				else {
+					break;
+				}
+			}
+		}
+		else if (fds[0].revents) {
+			break;
+		}
+	}
+}
+
+#else
+
+class fs_watcher_impl final
+{
+public:
+	fs_watcher_impl(fs_watcher &, thread_pool &, event_handler &, duration const&, size_t)
+	{}
+
+	int add(native_string const&, bool) { return ENOSYS; }
+	void remove(native_string const&) {}
+
+	size_t watch_count() const { return 0; }
+
+	std::vector<fs_change> fetch_changes() { return {}; }
+};
+
+#endif
+
+fs_watcher::fs_watcher(thread_pool & pool, event_handler & handler, duration const& coalesce_delay, size_t max_watches)
+	: impl_(std::make_unique<fs_watcher_impl>(*this, pool, handler, coalesce_delay, max_watches))
+{
+}
+
+fs_watcher::~fs_watcher()
+{
+}
+
+int fs_watcher::add(native_string const& path, bool recursive)
+{
+	return impl_->add(path, recursive);
+}
+
+void fs_watcher::remove(native_string const& path)
+{
+	impl_->remove(path);
+}
+
+size_t fs_watcher::watch_count() const
+{
+	return impl_->watch_count();
+}
+
+std::vector<fs_change> fs_watcher::fetch_changes()
+{
+	return impl_->fetch_changes();
+}
+
+}
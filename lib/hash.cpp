@@ -4,6 +4,7 @@
 
 #include <nettle/hmac.h>
 #include <nettle/md5.h>
+#include <nettle/memops.h>
 #include <nettle/pbkdf2.h>
 
 // Undo Nettle's horrible namespace mangling fuckery
@@ -13,6 +14,8 @@
 
 #include <nettle/sha2.h>
 
+#include <algorithm>
+
 namespace fz {
 
 class hash_accumulator::impl
@@ -186,6 +189,186 @@ std::vector<uint8_t> hash_accumulator::digest()
 	return impl_->digest();
 }
 
+class hmac_accumulator::impl
+{
+public:
+	virtual ~impl() = default;
+
+	virtual impl* clone() const = 0;
+	virtual void update(uint8_t const* data, size_t size) = 0;
+	virtual void reinit() = 0;
+	virtual size_t digest_size() const = 0;
+	virtual void digest(uint8_t * out, size_t size) = 0;
+};
+
+namespace {
+template<typename Ctx, size_t DigestSize,
+         void (*SetKey)(Ctx*, size_t, uint8_t const*),
+         void (*Update)(Ctx*, size_t, uint8_t const*),
+         void (*Digest)(Ctx*, size_t, uint8_t*)>
+class hmac_accumulator_impl final : public hmac_accumulator::impl
+{
+public:
+	hmac_accumulator_impl(uint8_t const* key, size_t size)
+	{
+		SetKey(&keyed_, size, key);
+		ctx_ = keyed_;
+	}
+
+	virtual impl* clone() const override
+	{
+		return new hmac_accumulator_impl(*this);
+	}
+
+	virtual void update(uint8_t const* data, size_t size) override
+	{
+		Update(&ctx_, size, data);
+	}
+
+	virtual void reinit() override
+	{
+		ctx_ = keyed_;
+	}
+
+	virtual size_t digest_size() const override
+	{
+		return DigestSize;
+	}
+
+	virtual void digest(uint8_t * out, size_t size) override
+	{
+		// Also resets the context to its keyed state
+		Digest(&ctx_, size, out);
+	}
+
+private:
+	// Copy of the context right after keying, restored by reinit
+	Ctx keyed_;
+	Ctx ctx_;
+};
+
+typedef hmac_accumulator_impl<hmac_md5_ctx, MD5_DIGEST_SIZE, nettle_hmac_md5_set_key, nettle_hmac_md5_update, nettle_hmac_md5_digest> hmac_accumulator_md5;
+typedef hmac_accumulator_impl<hmac_sha1_ctx, SHA1_DIGEST_SIZE, nettle_hmac_sha1_set_key, nettle_hmac_sha1_update, nettle_hmac_sha1_digest> hmac_accumulator_sha1;
+typedef hmac_accumulator_impl<hmac_sha256_ctx, SHA256_DIGEST_SIZE, nettle_hmac_sha256_set_key, nettle_hmac_sha256_update, nettle_hmac_sha256_digest> hmac_accumulator_sha256;
+typedef hmac_accumulator_impl<hmac_sha512_ctx, SHA512_DIGEST_SIZE, nettle_hmac_sha512_set_key, nettle_hmac_sha512_update, nettle_hmac_sha512_digest> hmac_accumulator_sha512;
+}
+
+hmac_accumulator::hmac_accumulator(hash_algorithm algorithm, std::basic_string_view<uint8_t> const& key)
+{
+	switch (algorithm) {
+	case hash_algorithm::md5:
+		impl_ = new hmac_accumulator_md5(key.data(), key.size());
+		break;
+	case hash_algorithm::sha1:
+		impl_ = new hmac_accumulator_sha1(key.data(), key.size());
+		break;
+	case hash_algorithm::sha256:
+		impl_ = new hmac_accumulator_sha256(key.data(), key.size());
+		break;
+	case hash_algorithm::sha512:
+		impl_ = new hmac_accumulator_sha512(key.data(), key.size());
+		break;
+	}
+}
+
+hmac_accumulator::hmac_accumulator(hash_algorithm algorithm, std::string_view const& key)
+	: hmac_accumulator(algorithm, std::basic_string_view<uint8_t>(reinterpret_cast<uint8_t const*>(key.data()), key.size()))
+{
+}
+
+hmac_accumulator::hmac_accumulator(hash_algorithm algorithm, std::vector<uint8_t> const& key)
+	: hmac_accumulator(algorithm, std::basic_string_view<uint8_t>(key.data(), key.size()))
+{
+}
+
+hmac_accumulator::~hmac_accumulator()
+{
+	delete impl_;
+}
+
+hmac_accumulator::hmac_accumulator(hmac_accumulator const& op)
+	: impl_(op.impl_->clone())
+{
+}
+
+hmac_accumulator& hmac_accumulator::operator=(hmac_accumulator const& op)
+{
+	if (this != &op) {
+		impl* copy = op.impl_->clone();
+		delete impl_;
+		impl_ = copy;
+	}
+	return *this;
+}
+
+void hmac_accumulator::reinit()
+{
+	impl_->reinit();
+}
+
+void hmac_accumulator::update(std::string_view const& data)
+{
+	if (!data.empty()) {
+		impl_->update(reinterpret_cast<uint8_t const*>(data.data()), data.size());
+	}
+}
+
+void hmac_accumulator::update(std::basic_string_view<uint8_t> const& data)
+{
+	if (!data.empty()) {
+		impl_->update(data.data(), data.size());
+	}
+}
+
+void hmac_accumulator::update(std::vector<uint8_t> const& data)
+{
+	if (!data.empty()) {
+		impl_->update(data.data(), data.size());
+	}
+}
+
+void hmac_accumulator::update(uint8_t const* data, size_t size)
+{
+	impl_->update(data, size);
+}
+
+size_t hmac_accumulator::digest_size() const
+{
+	return impl_->digest_size();
+}
+
+void hmac_accumulator::digest(uint8_t * out, size_t size)
+{
+	impl_->digest(out, std::min(size, impl_->digest_size()));
+}
+
+std::vector<uint8_t> hmac_accumulator::digest()
+{
+	std::vector<uint8_t> ret;
+	ret.resize(impl_->digest_size());
+	impl_->digest(ret.data(), ret.size());
+	return ret;
+}
+
+bool hmac_accumulator::verify(uint8_t const* mac, size_t size)
+{
+	return verify(mac, size, impl_->digest_size());
+}
+
+bool hmac_accumulator::verify(uint8_t const* mac, size_t size, size_t min_size)
+{
+	uint8_t computed[SHA512_DIGEST_SIZE];
+	size_t const digest_size = impl_->digest_size();
+	impl_->digest(computed, digest_size);
+
+	// The size usually comes with the MAC, it must not allow guessing short MACs
+	min_size = std::max({min_size, (digest_size + 1) / 2, size_t(10)});
+	if (size < min_size || size > digest_size) {
+		return false;
+	}
+	return nettle_memeql_sec(computed, mac, size);
+}
+
 namespace {
 // In C++17, require ContiguousContainer
 template<typename DataContainer>
@@ -0,0 +1,83 @@
+#include "libfilezilla/hashing_layer.hpp"
+
+namespace fz {
+
+namespace {
+void update(std::vector<hash_accumulator*> const& hashes, void const* data, size_t size)
+{
+	for (auto * h : hashes) {
+		h->update(static_cast<uint8_t const*>(data), size);
+	}
+}
+}
+
+hashing_layer::hashing_layer(event_handler* handler, socket_interface& next_layer)
+	: socket_layer(handler, next_layer, true)
+{
+}
+
+hashing_layer::~hashing_layer()
+{
+}
+
+void hashing_layer::add_read_hash(hash_accumulator & acc)
+{
+	read_hashes_.push_back(&acc);
+}
+
+void hashing_layer::add_write_hash(hash_accumulator & acc)
+{
+	write_hashes_.push_back(&acc);
+}
+
+int hashing_layer::read(void* buffer, unsigned int size, int& error)
+{
+	int const read = next_layer_.read(buffer, size, error);
+	if (read > 0) {
+		update(read_hashes_, buffer, static_cast<size_t>(read));
+		read_bytes_ += static_cast<uint64_t>(read);
+	}
+	return read;
+}
+
+int hashing_layer::write(void const* buffer, unsigned int size, int& error)
+{
+	int const written = next_layer_.write(buffer, size, error);
+	if (written > 0) {
+		update(write_hashes_, buffer, static_cast<size_t>(written));
+		written_bytes_ += static_cast<uint64_t>(written);
+	}
+	return written;
+}
+
+hashing_file::hashing_file(file & f)
+	: file_(f)
+{
+}
+
+void hashing_file::add_hash(hash_accumulator & acc)
+{
+	hashes_.push_back(&acc);
+}
+
+int64_t hashing_file::read(void *buf, int64_t count)
+{
+	int64_t const read = file_.read(buf, count);
+	if (read > 0) {
+		update(hashes_, buf, static_cast<size_t>(read));
+		bytes_ += static_cast<uint64_t>(read);
+	}
+	return read;
+}
+
+int64_t hashing_file::write(void const* buf, int64_t count)
+{
+	int64_t const written = file_.write(buf, count);
+	if (written > 0) {
+		update(hashes_, buf, static_cast<size_t>(written));
+		bytes_ += static_cast<uint64_t>(written);
+	}
+	return written;
+}
+
+}
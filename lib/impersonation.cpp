@@ -1,9 +1,15 @@
 #include "libfilezilla/impersonation.hpp"
+#include "libfilezilla/thread_pool.hpp"
+
+#include <algorithm>
+#include <deque>
 
 #if FZ_UNIX || FZ_MAC
 
 #include "libfilezilla/buffer.hpp"
+#include "libfilezilla/mutex.hpp"
 
+#include <map>
 #include <optional>
 #include <tuple>
 
@@ -103,6 +109,12 @@ public:
 		return t.impl_.get();
 	}
 
+	static impersonation_token make(std::unique_ptr<impersonation_token_impl> && impl) {
+		impersonation_token ret;
+		ret.impl_ = std::move(impl);
+		return ret;
+	}
+
 	fz::native_string name_;
 	fz::native_string home_;
 	uid_t uid_{};
@@ -193,37 +205,144 @@ bool check_auth(fz::native_string const& username, fz::native_string const& pass
 }
 }
 
-impersonation_token::impersonation_token(fz::native_string const& username, fz::native_string const& password)
+namespace {
+struct user_record final
 {
-	auto pwd = get_passwd(username);
-	if (pwd.pwd_) {
-		if (check_auth(username, password)) {
-			impl_ = std::make_unique<impersonation_token_impl>();
-			impl_->name_ = username;
-			if (pwd.pwd_->pw_dir) {
-				impl_->home_ = pwd.pwd_->pw_dir;
+	fz::native_string home_;
+	uid_t uid_{};
+	gid_t gid_{};
+	std::vector<gid_t> sup_groups_;
+	monotonic_clock expiry_;
+};
+}
+
+// Caches passwd and group lookups, keyed by username
+class user_db_cache final
+{
+public:
+	explicit user_db_cache(duration const& ttl)
+		: ttl_(ttl)
+	{}
+
+	std::optional<user_record> get(fz::native_string const& username)
+	{
+		scoped_lock l(mtx_);
+		auto it = records_.find(username);
+		if (it == records_.end()) {
+			return {};
+		}
+		if (it->second.expiry_ <= monotonic_clock::now()) {
+			records_.erase(it);
+			return {};
+		}
+		return it->second;
+	}
+
+	void put(fz::native_string const& username, user_record & record)
+	{
+		if (!ttl_) {
+			return;
+		}
+
+		auto const now = monotonic_clock::now();
+		record.expiry_ = now + ttl_;
+
+		scoped_lock l(mtx_);
+		records_[username] = record;
+
+		// Expired entries are dropped on lookup. Entries never looked up again are swept
+		// once the cache has doubled in size since the last sweep, keeping it amortized O(1).
+		if (records_.size() >= sweep_at_) {
+			for (auto it = records_.begin(); it != records_.end(); ) {
+				if (it->second.expiry_ <= now) {
+					it = records_.erase(it);
+				}
+				else {
+					++it;
+				}
 			}
-			impl_->uid_ = pwd.pwd_->pw_uid;
-			impl_->gid_ = pwd.pwd_->pw_gid;
-			impl_->sup_groups_ = get_supplementary(username, pwd.pwd_->pw_gid);
+			sweep_at_ = std::max(min_sweep_size, records_.size() * 2);
 		}
 	}
+
+	void clear()
+	{
+		scoped_lock l(mtx_);
+		records_.clear();
+		sweep_at_ = min_sweep_size;
+	}
+
+private:
+	static constexpr size_t min_sweep_size = 64;
+
+	mutex mtx_{false};
+	duration const ttl_;
+	std::map<fz::native_string, user_record> records_;
+	size_t sweep_at_{min_sweep_size};
+};
+
+namespace {
+std::optional<user_record> lookup_user(fz::native_string const& username, user_db_cache* cache)
+{
+	if (cache) {
+		auto cached = cache->get(username);
+		if (cached) {
+			return cached;
+		}
+	}
+
+	auto pwd = get_passwd(username);
+	if (!pwd.pwd_) {
+		return {};
+	}
+
+	user_record ret;
+	if (pwd.pwd_->pw_dir) {
+		ret.home_ = pwd.pwd_->pw_dir;
+	}
+	ret.uid_ = pwd.pwd_->pw_uid;
+	ret.gid_ = pwd.pwd_->pw_gid;
+	ret.sup_groups_ = get_supplementary(username, pwd.pwd_->pw_gid);
+
+	if (cache) {
+		cache->put(username, ret);
+	}
+
+	return ret;
+}
+
+// Password is only checked if non-null
+std::unique_ptr<impersonation_token_impl> create_impl(fz::native_string const& username, fz::native_string const* password, user_db_cache* cache)
+{
+	auto record = lookup_user(username, cache);
+	if (!record || (password && !check_auth(username, *password))) {
+		return nullptr;
+	}
+
+	auto impl = std::make_unique<impersonation_token_impl>();
+	impl->name_ = username;
+	impl->home_ = std::move(record->home_);
+	impl->uid_ = record->uid_;
+	impl->gid_ = record->gid_;
+	impl->sup_groups_ = std::move(record->sup_groups_);
+	return impl;
+}
+
+impersonation_token create_token(fz::native_string const& username, fz::native_string const* password, user_db_cache& cache)
+{
+	return impersonation_token_impl::make(create_impl(username, password, &cache));
+}
+}
+
+impersonation_token::impersonation_token(fz::native_string const& username, fz::native_string const& password)
+	: impl_(create_impl(username, &password, nullptr))
+{
 }
 
 impersonation_token::impersonation_token(fz::native_string const& username, impersonation_flag flag)
 {
 	if (flag == impersonation_flag::pwless) {
-		auto pwd = get_passwd(username);
-		if (pwd.pwd_) {
-			impl_ = std::make_unique<impersonation_token_impl>();
-			impl_->name_ = username;
-			if (pwd.pwd_->pw_dir) {
-				impl_->home_ = pwd.pwd_->pw_dir;
-			}
-			impl_->uid_ = pwd.pwd_->pw_uid;
-			impl_->gid_ = pwd.pwd_->pw_gid;
-			impl_->sup_groups_ = get_supplementary(username, pwd.pwd_->pw_gid);
-		}
+		impl_ = create_impl(username, nullptr, nullptr);
 	}
 }
 
@@ -433,6 +552,24 @@ HANDLE get_handle(impersonation_token const& t) {
 	return impersonation_token_impl::get_handle(t);
 }
 
+// There is no user database to cache lookups from, LogonUser does everything at once.
+class user_db_cache final
+{
+public:
+	explicit user_db_cache(duration const&) {}
+	void clear() {}
+};
+
+namespace {
+impersonation_token create_token(fz::native_string const& username, fz::native_string const* password, user_db_cache&)
+{
+	if (!password) {
+		return impersonation_token();
+	}
+	return impersonation_token(username, *password);
+}
+}
+
 }
 
 #elif 0
@@ -463,3 +600,178 @@ bool set_process_impersonation(impersonation_token const&)
 
 }
 #endif
+
+#if FZ_UNIX || FZ_MAC || FZ_WINDOWS
+namespace fz {
+class impersonation_service::impl final
+{
+public:
+	impl(impersonation_service & parent, thread_pool & pool, size_t max_concurrency, duration const& cache_ttl)
+		: parent_(parent)
+		, pool_(pool)
+		, workers_(max_concurrency ? max_concurrency : 1)
+		, cache_(cache_ttl)
+	{}
+
+	uint64_t queue(event_handler & handler, fz::native_string const& username, fz::native_string const* password);
+	void entry(size_t worker);
+
+	struct request final
+	{
+		uint64_t id_{};
+		event_handler* handler_{};
+		fz::native_string username_;
+		fz::native_string password_;
+		bool pwless_{};
+	};
+
+	struct worker final
+	{
+		async_task task_;
+		event_handler* handler_{}; // Of the request in progress, reset if cancelled
+		bool active_{};
+	};
+
+	impersonation_service & parent_;
+	thread_pool & pool_;
+
+	mutex mtx_{false};
+	std::deque<request> requests_;
+	std::vector<worker> workers_;
+	uint64_t next_id_{1};
+	bool quit_{};
+
+	user_db_cache cache_;
+};
+
+uint64_t impersonation_service::impl::queue(event_handler & handler, fz::native_string const& username, fz::native_string const* password)
+{
+	scoped_lock l(mtx_);
+	if (quit_) {
+		return 0;
+	}
+
+	request r;
+	r.id_ = next_id_++;
+	r.handler_ = &handler;
+	r.username_ = username;
+	if (password) {
+		r.password_ = *password;
+	}
+	else {
+		r.pwless_ = true;
+	}
+	requests_.emplace_back(std::move(r));
+
+	// Workers leave once the queue is empty, start another one unless all are busy.
+	bool running{};
+	bool spawned{};
+	for (size_t i = 0; i < workers_.size(); ++i) {
+		auto & w = workers_[i];
+		if (w.active_) {
+			running = true;
+		}
+		else if (!spawned) {
+			// An inactive worker has left its loop already, joining does not block for long.
+			w.task_.join();
+			w.task_ = pool_.spawn([this, i] { entry(i); });
+			if (w.task_) {
+				w.active_ = true;
+				spawned = true;
+			}
+		}
+	}
+
+	if (!running && !spawned) {
+		requests_.pop_back();
+		return 0;
+	}
+
+	return next_id_ - 1;
+}
+
+void impersonation_service::impl::entry(size_t worker)
+{
+	scoped_lock l(mtx_);
+	while (!quit_ && !requests_.empty()) {
+		request r = std::move(requests_.front());
+		requests_.pop_front();
+		workers_[worker].handler_ = r.handler_;
+
+		l.unlock();
+		auto token = create_token(r.username_, r.pwless_ ? nullptr : &r.password_, cache_);
+		std::fill(r.password_.begin(), r.password_.end(), 0);
+		l.lock();
+
+		if (workers_[worker].handler_) {
+			workers_[worker].handler_->send_event<impersonation_event>(&parent_, r.id_, std::make_unique<impersonation_token>(std::move(token)));
+			workers_[worker].handler_ = nullptr;
+		}
+	}
+	workers_[worker].active_ = false;
+}
+
+impersonation_service::impersonation_service(thread_pool & pool, size_t max_concurrency, duration const& cache_ttl)
+	: impl_(std::make_unique<impl>(*this, pool, max_concurrency, cache_ttl))
+{
+}
+
+impersonation_service::~impersonation_service()
+{
+	{
+		scoped_lock l(impl_->mtx_);
+		impl_->quit_ = true;
+		impl_->requests_.clear();
+	}
+
+	for (auto & w : impl_->workers_) {
+		w.task_.join();
+	}
+}
+
+uint64_t impersonation_service::authenticate(event_handler & handler, fz::native_string const& username, fz::native_string const& password)
+{
+	return impl_->queue(handler, username, &password);
+}
+
+#if !FZ_WINDOWS
+uint64_t impersonation_service::authenticate(event_handler & handler, fz::native_string const& username, impersonation_flag flag)
+{
+	if (flag != impersonation_flag::pwless) {
+		return 0;
+	}
+	return impl_->queue(handler, username, nullptr);
+}
+#endif
+
+void impersonation_service::cancel(event_handler & handler)
+{
+	scoped_lock l(impl_->mtx_);
+
+	auto & requests = impl_->requests_;
+	requests.erase(std::remove_if(requests.begin(), requests.end(), [&](impl::request const& r) { return r.handler_ == &handler; }), requests.end());
+
+	for (auto & w : impl_->workers_) {
+		if (w.handler_ == &handler) {
+			w.handler_ = nullptr;
+		}
+	}
+
+	auto filter = [&](event_loop::Events::value_type const& ev) -> bool {
+		if (ev.first != &handler) {
+			return false;
+		}
+		else if (ev.second->derived_type() != impersonation_event::type()) {
+			return false;
+		}
+		return std::get<0>(static_cast<impersonation_event const&>(*ev.second).v_) == this;
+	};
+	handler.event_loop_.filter_events(filter);
+}
+
+void impersonation_service::clear_cache()
+{
+	impl_->cache_.clear();
+}
+}
+#endif
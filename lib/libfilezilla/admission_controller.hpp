@@ -0,0 +1,161 @@
+#ifndef LIBFILEZILLA_ADMISSION_CONTROLLER_HEADER
+#define LIBFILEZILLA_ADMISSION_CONTROLLER_HEADER
+
+/** \file
+ * \brief Admission control for incoming connections
+ */
+
+#include "event_handler.hpp"
+#include "rate_limiter.hpp"
+#include "socket.hpp"
+
+#include <unordered_map>
+
+namespace fz {
+
+class admission_controller;
+
+/**
+ * \brief Holds one of the handshake slots of an \ref admission_controller
+ *
+ * Release it, or let it go out of scope, once the expensive part of setting up the connection,
+ * such as the TLS handshake and login, has completed.
+ *
+ * Must not outlive the admission_controller it got obtained from.
+ */
+class FZ_PUBLIC_SYMBOL admission_ticket final
+{
+public:
+	admission_ticket() = default;
+	~admission_ticket() { release(); }
+
+	admission_ticket(admission_ticket const&) = delete;
+	admission_ticket& operator=(admission_ticket const&) = delete;
+
+	admission_ticket(admission_ticket && op) noexcept;
+	admission_ticket& operator=(admission_ticket && op) noexcept;
+
+	void release();
+
+	explicit operator bool() const { return controller_ != nullptr; }
+
+private:
+	friend class admission_controller;
+	admission_controller* controller_{};
+};
+
+/// Limits of an \ref admission_controller
+struct admission_limits final
+{
+	/// Connections admitted per second over all peers
+	rate::type rate{rate::unlimited};
+
+	/// Number of connections that can be admitted at once after a period of inactivity
+	rate::type burst{16};
+
+	/// Connections admitted per second from a single peer address
+	rate::type per_address_rate{rate::unlimited};
+	rate::type per_address_burst{4};
+
+	/// Maximum number of handshakes in progress, see \ref admission_ticket
+	size_t max_handshakes{static_cast<size_t>(-1)};
+};
+
+/**
+ * \brief Admission control for a \ref listen_socket
+ *
+ * Protects against overload if many clients connect at the same time, e.g. when reconnecting
+ * after an outage. Call \ref accept instead of \ref listen_socket::accept.
+ *
+ * Connections are admitted subject to token buckets limiting the rate of connections overall
+ * and per peer address, and to a limit on the number of connections still in their handshakes.
+ *
+ * Peers exceeding their per-address rate are rejected cheaply: Their connections get closed
+ * right after accepting them, without creating a socket, let alone performing TLS handshakes.
+ *
+ * If the global rate or the number of handshakes in progress is exceeded, connections are left
+ * pending in the listen backlog. Once they can be admitted, a socket_event with the connection
+ * flag and the listen socket as source is sent to the listen handler again.
+ *
+ * The listen socket must outlive the admission_controller.
+ */
+class FZ_PUBLIC_SYMBOL admission_controller final : private event_handler
+{
+public:
+	/**
+	 * \brief Creates an admission_controller for a listen socket
+	 *
+	 * Accepted sockets use the passed thread pool. The listen handler receives the connection
+	 * events once connections previously left pending can be admitted, usually it is the
+	 * handler of the listen socket itself.
+	 */
+	admission_controller(event_loop & loop, thread_pool & pool, listen_socket & listener, event_handler * listen_handler, admission_limits const& limits = admission_limits());
+	virtual ~admission_controller();
+
+	void set_limits(admission_limits const& limits);
+
+	/**
+	 * \brief Accepts a connection subject to the limits
+	 *
+	 * On success, the ticket holds a handshake slot.
+	 *
+	 * If no socket is returned, error contains the reason:
+	 * - EAGAIN if no connection is pending or if it cannot be admitted yet.
+	 * - ECONNREFUSED if the connection got rejected. Call accept again for further connections.
+	 * - Any other errors from \ref listen_socket::accept.
+	 */
+	std::unique_ptr<socket> accept(int& error, admission_ticket & ticket, event_handler * handler = nullptr);
+
+	/// Number of handshake slots currently held by tickets
+	size_t handshakes_in_progress() const;
+
+	/// Number of connections rejected so far
+	uint64_t rejected() const;
+
+private:
+	friend class admission_ticket;
+
+	/// A token bucket refilled lazily based on elapsed time, in thousandths of tokens.
+	struct token_bucket final
+	{
+		bool take(monotonic_clock const& now, rate::type rate, rate::type burst);
+
+		/// Time until take can succeed
+		duration wait(rate::type rate) const;
+
+		void refill(monotonic_clock const& now, rate::type rate, rate::type burst);
+
+		rate::type milli_tokens_{};
+		monotonic_clock last_;
+	};
+
+	virtual void operator()(event_base const& ev) override;
+	void on_timer(timer_id const&);
+
+	void release_ticket();
+	void retrigger();
+
+	void sweep(monotonic_clock const& now);
+
+	mutable mutex mtx_{false};
+
+	thread_pool & pool_;
+	listen_socket & listener_;
+	event_handler * const listen_handler_;
+
+	admission_limits limits_;
+
+	token_bucket global_;
+	std::unordered_map<std::string, token_bucket> peers_;
+	size_t sweep_threshold_{1024};
+
+	size_t handshakes_{};
+	bool waiting_for_slot_{};
+	timer_id timer_{};
+
+	uint64_t rejected_{};
+};
+
+}
+
+#endif
@@ -0,0 +1,89 @@
+#ifndef LIBFILEZILLA_ATOMIC_FILE_WRITER_HEADER
+#define LIBFILEZILLA_ATOMIC_FILE_WRITER_HEADER
+
+/** \file
+ * \brief Durable replacement of whole files, with group commit
+ */
+
+#include "buffer.hpp"
+#include "event_handler.hpp"
+#include "file.hpp"
+#include "fsresult.hpp"
+#include "thread_pool.hpp"
+#include "time.hpp"
+
+#include <memory>
+
+namespace fz {
+
+class atomic_file_writer_impl;
+
+/// \private
+struct atomic_file_write_event_type{};
+
+/**
+ * \brief Sent by \ref atomic_file_writer once a file has been written, or writing it failed.
+ *
+ * Carries the path and the result.
+ */
+typedef simple_event<atomic_file_write_event_type, native_string, result> atomic_file_write_event;
+
+/**
+ * \brief Atomically and durably replaces the contents of files
+ *
+ * Each file is written to a temporary file next to it, which then gets flushed to disk
+ * and renamed over the target. Once the containing directory has been flushed, the
+ * write is durable: After a crash, the file has either its old or its new contents.
+ *
+ * Flushing is what makes this expensive. Writes are therefore committed in groups:
+ * A background thread picks up all writes issued while the previous group was committed,
+ * or within the latency target, and flushes them together. Where available, a single
+ * syncfs per filesystem flushes all temporary files of a group, and each directory is
+ * only flushed once per group, no matter how many of its files have been replaced.
+ *
+ * Writes to the same path are applied in the order they were issued.
+ */
+class FZ_PUBLIC_SYMBOL atomic_file_writer final
+{
+public:
+	/**
+	 * \param pool Used to spawn the thread committing the writes
+	 * \param latency Upper bound on how long a write is held back waiting for further
+	 *                writes to join its group.
+	 * \param max_group Once this many writes are pending, they are committed right away.
+	 */
+	explicit atomic_file_writer(thread_pool & pool, duration const& latency = duration::from_milliseconds(10), size_t max_group = 256);
+
+	/// Commits all outstanding writes before returning.
+	~atomic_file_writer();
+
+	atomic_file_writer(atomic_file_writer const&) = delete;
+	atomic_file_writer& operator=(atomic_file_writer const&) = delete;
+
+	/**
+	 * \brief Replaces the file's contents, returns once durable.
+	 *
+	 * Can be called from any number of threads concurrently. Calls from different
+	 * threads get committed as a group.
+	 *
+	 * \param flags Only the permission-related flags are used, see \ref file::creation_flags.
+	 */
+	result write(native_string const& path, buffer && data, file::creation_flags flags = file::empty);
+
+	/**
+	 * \brief Replaces the file's contents asynchronously
+	 *
+	 * Once done, the handler receives an \ref atomic_file_write_event.
+	 */
+	void write(native_string const& path, buffer && data, event_handler & handler, file::creation_flags flags = file::empty);
+
+	/// Stops delivering events to the handler. Writes already issued still complete.
+	void remove_handler(event_handler & handler);
+
+private:
+	std::unique_ptr<atomic_file_writer_impl> impl_;
+};
+
+}
+
+#endif
@@ -0,0 +1,94 @@
+#ifndef LIBFILEZILLA_BACKGROUND_RATE_LIMITER_HEADER
+#define LIBFILEZILLA_BACKGROUND_RATE_LIMITER_HEADER
+
+/** \file
+ * \brief Adaptive rate-limiting for background transfers
+ */
+
+#include "rate_limiter.hpp"
+
+#include <vector>
+
+namespace fz {
+
+class socket;
+
+/**
+ * \brief A \ref rate_limiter whose limits adapt to yield to other traffic
+ *
+ * Intended for background transfers, such as replication, that should use all spare
+ * bandwidth yet get out of the way of foreground traffic as soon as there is any.
+ *
+ * Similar to LEDBAT, the round-trip times of the added sockets are sampled periodically
+ * and compared to the lowest round-trip time observed on them in the last minutes. Any
+ * increase is attributed to queuing. If the queuing delay exceeds the target delay, or if
+ * any of the foreground limiters are saturated, the limit is cut in half. Otherwise, and
+ * if the background transfers are making use of their current limit, it is raised in
+ * proportion to how far the queuing delay is below the target.
+ *
+ * Add \ref limiter() to the rate-limiting tree like any other limiter and attach the
+ * background buckets to it. The foreground limiters usually are its siblings.
+ *
+ * Sockets and foreground limiters must be removed before they are destroyed.
+ */
+class FZ_PUBLIC_SYMBOL background_rate_limiter final : private event_handler
+{
+public:
+	/**
+	 * \brief Constructs the limiter
+	 *
+	 * The limits never go below min_rate and never exceed max_rate.
+	 */
+	explicit background_rate_limiter(event_loop & loop, rate::type max_rate = rate::unlimited, rate::type min_rate = 16 * 1024);
+	virtual ~background_rate_limiter();
+
+	/// The limiter the background buckets need to be added to
+	rate_limiter& limiter() { return limiter_; }
+
+	/// Adds a limiter of foreground traffic. If it is saturated, background traffic yields.
+	void add_foreground(rate_limiter & foreground);
+	void remove_foreground(rate_limiter & foreground);
+
+	/// Adds a socket of the background transfers whose round-trip time gets sampled.
+	void add_socket(socket & s);
+	void remove_socket(socket & s);
+
+	/// Sets the queuing delay the background traffic may cause, defaults to 100 milliseconds.
+	void set_target_delay(duration const& target);
+
+	/// Returns the current limit
+	rate::type limit(direction::type const d);
+
+private:
+	virtual void operator()(event_base const& ev) override;
+	void on_timer(timer_id const&);
+
+	void update_timer();
+	duration queuing_delay(monotonic_clock const& now);
+
+	struct sample_source {
+		socket * socket_{};
+
+		// Lowest round-trip time per minute, most recent last
+		std::vector<int> base_history_;
+		monotonic_clock minute_start_;
+	};
+
+	mutex mtx_{false};
+
+	rate_limiter limiter_;
+	std::vector<rate_limiter*> foreground_;
+	std::vector<sample_source> sockets_;
+
+	rate::type const min_rate_;
+	rate::type const max_rate_;
+	rate::type limits_[2];
+
+	duration target_delay_{duration::from_milliseconds(100)};
+
+	timer_id timer_{};
+};
+
+}
+
+#endif
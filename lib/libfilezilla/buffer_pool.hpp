@@ -0,0 +1,60 @@
+#ifndef LIBFILEZILLA_BUFFER_POOL_HEADER
+#define LIBFILEZILLA_BUFFER_POOL_HEADER
+
+/** \file
+ * \brief Declares \ref fz::buffer_pool
+ */
+
+#include "buffer.hpp"
+#include "mutex.hpp"
+
+#include <vector>
+
+namespace fz {
+
+/**
+ * \brief A pool of reusable \ref buffer "buffers"
+ *
+ * Intended for buffers that are only needed while data is pending, e.g. the staging buffers
+ * of many mostly idle connections. Instead of each connection keeping its own allocation around,
+ * connections acquire a buffer when needed and release it once it has been drained.
+ *
+ * Released buffers are kept for reuse as long as the total capacity of the idle buffers stays
+ * within max_idle_memory. Buffers whose capacity has grown beyond max_buffer_size are freed
+ * on release, so that a single burst cannot pin large allocations.
+ *
+ * This class is thread-safe.
+ */
+class FZ_PUBLIC_SYMBOL buffer_pool final
+{
+public:
+	explicit buffer_pool(size_t max_idle_memory = 4 * 1024 * 1024, size_t max_buffer_size = 64 * 1024);
+
+	buffer_pool(buffer_pool const&) = delete;
+	buffer_pool& operator=(buffer_pool const&) = delete;
+
+	/// Returns an empty buffer, reusing the memory of a previously released buffer if possible.
+	buffer acquire();
+
+	/// Returns a buffer to the pool. Its contents are discarded.
+	void release(buffer && b);
+
+	/// Total capacity of the buffers currently held for reuse
+	size_t idle_memory() const;
+
+	/// Number of buffers acquired and not yet released
+	size_t outstanding() const;
+
+private:
+	mutable mutex mtx_{false};
+	std::vector<buffer> idle_;
+	size_t idle_memory_{};
+	size_t outstanding_{};
+
+	size_t const max_idle_memory_;
+	size_t const max_buffer_size_;
+};
+
+}
+
+#endif
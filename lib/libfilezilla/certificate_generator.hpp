@@ -0,0 +1,114 @@
+#ifndef LIBFILEZILLA_CERTIFICATE_GENERATOR_HEADER
+#define LIBFILEZILLA_CERTIFICATE_GENERATOR_HEADER
+
+/** \file
+ * \brief Asynchronous generation of private keys, certificates and certificate signing requests
+ */
+
+#include "event_handler.hpp"
+#include "tls_layer.hpp"
+
+namespace fz {
+
+class thread_pool;
+
+/**
+ * \brief A pool of pregenerated private keys
+ *
+ * Keeps up to the given number of keys of a single type ready, so that they can be handed
+ * out instantly. Used keys are replaced in the background using a single thread from
+ * the passed pool.
+ */
+class FZ_PUBLIC_SYMBOL tls_key_pool final
+{
+public:
+	explicit tls_key_pool(thread_pool& pool, tls_key_type key_type = tls_key_type::ecdsa_p256, size_t size = 4);
+
+	/// Waits for the key currently being generated
+	~tls_key_pool();
+
+	tls_key_pool(tls_key_pool const&) = delete;
+	tls_key_pool& operator=(tls_key_pool const&) = delete;
+
+	tls_key_type key_type() const;
+
+	/**
+	 * \brief Takes a key out of the pool
+	 *
+	 * Returns an unencrypted private key in PEM. If the pool is exhausted, a key is generated on
+	 * the calling thread. Returns an empty string on failure.
+	 */
+	std::string take();
+
+	/// Number of keys ready to be taken
+	size_t available() const;
+
+private:
+	class impl;
+	std::unique_ptr<impl> impl_;
+};
+
+/**
+ * \brief Creates self-signed certificates and certificate signing requests asynchronously
+ *
+ * Works like \ref tls_layer::generate_selfsigned_certificate and \ref tls_layer::generate_csr,
+ * except that the work is done using at most \c max_concurrency threads taken from the
+ * passed pool. Further requests are queued.
+ *
+ * If a \ref tls_key_pool is passed, requests for its key type use keys taken from the pool.
+ *
+ * Once a request has been processed, a \ref certificate_generation_event is sent to
+ * the handler that made the request.
+ */
+class FZ_PUBLIC_SYMBOL certificate_generator final
+{
+public:
+	explicit certificate_generator(thread_pool& pool, tls_key_pool* key_pool = nullptr, size_t max_concurrency = 2);
+
+	/// Waits for requests currently being processed, queued requests are discarded
+	~certificate_generator();
+
+	certificate_generator(certificate_generator const&) = delete;
+	certificate_generator& operator=(certificate_generator const&) = delete;
+
+	/**
+	 * \brief Queues a request to create a new key and a self-signed certificate.
+	 *
+	 * Returns a non-zero request id that is passed in the corresponding \ref certificate_generation_event,
+	 * or 0 if the request could not be queued.
+	 */
+	uint64_t generate_selfsigned_certificate(event_handler& handler, native_string const& password, std::string const& distinguished_name, std::vector<std::string> const& hostnames, tls_key_type key_type = tls_key_type::ecdsa_p256);
+
+	/// Queues a request to create a new key and a certificate signing request, see \ref generate_selfsigned_certificate
+	uint64_t generate_csr(event_handler& handler, native_string const& password, std::string const& distinguished_name, std::vector<std::string> const& hostnames, bool csr_as_pem = true, tls_key_type key_type = tls_key_type::ecdsa_p256);
+
+	/**
+	 * \brief Cancels all requests of the passed handler
+	 *
+	 * No further \ref certificate_generation_event from this generator will be delivered to the handler,
+	 * including those already pending in its event loop.
+	 *
+	 * Must be called before a handler with outstanding requests is destroyed.
+	 */
+	void cancel(event_handler& handler);
+
+private:
+	class impl;
+	std::unique_ptr<impl> impl_;
+};
+
+/// \private
+struct certificate_generation_event_type{};
+
+/**
+ * \brief Result of a \ref certificate_generator request.
+ *
+ * Arguments are the generator, the request id and the generated key and certificate
+ * or CSR, as returned by \ref tls_layer::generate_selfsigned_certificate. Both
+ * are empty if the request failed.
+ */
+typedef simple_event<certificate_generation_event_type, certificate_generator*, uint64_t, std::pair<std::string, std::string>> certificate_generation_event;
+
+}
+
+#endif
@@ -0,0 +1,92 @@
+#ifndef LIBFILEZILLA_CERTIFICATE_STORE_HEADER
+#define LIBFILEZILLA_CERTIFICATE_STORE_HEADER
+
+/** \file
+ * \brief Declares \ref fz::certificate_store
+ */
+
+#include "tls_info.hpp"
+
+#include <deque>
+#include <map>
+#include <string_view>
+
+namespace fz {
+class thread_pool;
+
+/**
+ * \brief An indexed collection of X.509 certificates
+ *
+ * Certificates can be looked up by subject, issuer and SHA-256 fingerprint.
+ * Each certificate is only stored once, duplicates are identified by their fingerprint.
+ *
+ * Large numbers of certificates, e.g. CA bundles or directories of certificates,
+ * can be loaded in parallel using \ref load_files and \ref load_directory.
+ *
+ * Returned pointers remain valid until the store is cleared or destroyed.
+ *
+ * Not thread-safe.
+ */
+class FZ_PUBLIC_SYMBOL certificate_store final
+{
+public:
+	certificate_store() = default;
+
+	certificate_store(certificate_store const&) = delete;
+	certificate_store& operator=(certificate_store const&) = delete;
+
+	/// Adds the certificate. Returns false if it is invalid or already contained in the store.
+	bool add(x509_certificate const& cert);
+	bool add(x509_certificate && cert);
+
+	/**
+	 * \brief Loads the certificates in the passed files
+	 *
+	 * Files are read and parsed by up to \c concurrency threads, one of which is the calling
+	 * thread, the others are taken from the passed pool. Returns once all files have been
+	 * processed. Files that cannot be loaded are skipped.
+	 *
+	 * Certificates are added in order of the passed files.
+	 *
+	 * \return The number of certificates added.
+	 */
+	size_t load_files(thread_pool & pool, std::vector<native_string> const& files, bool pem, size_t concurrency = 4, logger_interface * logger = nullptr);
+
+	/// Like \ref load_files, for all files in the passed directory. Subdirectories are ignored.
+	size_t load_directory(thread_pool & pool, native_string const& path, bool pem, size_t concurrency = 4, logger_interface * logger = nullptr);
+
+	/// Looks up a certificate by its hex-encoded fingerprint as returned by \ref x509_certificate::get_fingerprint_sha256
+	x509_certificate const* find_by_fingerprint(std::string_view const& fingerprint_sha256) const;
+
+	/// Finds all certificates with the passed subject, see \ref x509_certificate::get_subject
+	std::vector<x509_certificate const*> find_by_subject(std::string_view const& subject) const;
+
+	/// Finds all certificates with the passed issuer, see \ref x509_certificate::get_issuer
+	std::vector<x509_certificate const*> find_by_issuer(std::string_view const& issuer) const;
+
+	/// Finds all certificates whose subject matches the issuer of the passed certificate
+	std::vector<x509_certificate const*> find_issuers(x509_certificate const& cert) const {
+		return find_by_subject(cert.get_issuer());
+	}
+
+	/// All certificates, in the order they were added.
+	std::deque<x509_certificate> const& certificates() const { return certificates_; }
+
+	size_t size() const { return certificates_.size(); }
+	bool empty() const { return certificates_.empty(); }
+
+	void clear();
+
+private:
+	typedef std::multimap<std::string, x509_certificate const*, std::less<>> index;
+	static std::vector<x509_certificate const*> find(index const& idx, std::string_view const& key);
+
+	std::deque<x509_certificate> certificates_;
+
+	std::map<std::string, x509_certificate const*, std::less<>> by_fingerprint_;
+	index by_subject_;
+	index by_issuer_;
+};
+}
+
+#endif
@@ -0,0 +1,126 @@
+#ifndef LIBFILEZILLA_CHUNK_STORE_HEADER
+#define LIBFILEZILLA_CHUNK_STORE_HEADER
+
+/** \file
+ * \brief Deduplicating storage of data chunks
+ */
+
+#include "buffer.hpp"
+#include "chunker.hpp"
+#include "file.hpp"
+#include "fsresult.hpp"
+
+#include <array>
+#include <unordered_map>
+#include <vector>
+
+namespace fz {
+
+/**
+ * \brief Stores chunks of data indexed by their SHA-256, each distinct chunk only once
+ *
+ * Together with \ref content_chunker, files sharing data only take up the space of the
+ * data they do not have in common. For transfers, the sender can send the list of chunk
+ * ids first; the receiver then only needs to request the chunks it does not contain yet.
+ *
+ * The store is a directory with two files: The chunks are appended to a data file, and
+ * an index file maps each chunk id to the chunk's location in the data file. Index
+ * entries are only written by \ref flush, after the data they refer to has been flushed
+ * to disk. After a crash, chunks added since the last flush are lost, but the store
+ * stays consistent.
+ *
+ * Not thread-safe.
+ */
+class FZ_PUBLIC_SYMBOL chunk_store final
+{
+public:
+	/// The SHA-256 of a chunk
+	typedef std::array<uint8_t, 32> id;
+
+	chunk_store() = default;
+
+	/// Flushes the store
+	~chunk_store();
+
+	chunk_store(chunk_store const&) = delete;
+	chunk_store& operator=(chunk_store const&) = delete;
+
+	/// Opens the store in the given directory, creating it if it does not exist. The directory itself must exist.
+	result open(native_string const& dir);
+
+	/// Flushes and closes the store
+	void close();
+
+	bool opened() const { return data_writer_.opened(); }
+
+	/// Computes the id of a chunk
+	static id compute_id(uint8_t const* data, size_t size);
+
+	/**
+	 * \brief Adds a chunk to the store unless already contained.
+	 *
+	 * \param out Receives the chunk's id
+	 * \param added If not null, set to whether the chunk was not contained before
+	 */
+	result add(uint8_t const* data, size_t size, id & out, bool * added = nullptr);
+
+	bool contains(id const& chunk) const;
+
+	/// Filters the passed ids, returning those not contained in the store
+	std::vector<id> missing(std::vector<id> const& chunks) const;
+
+	/// Reads a chunk, appending it to out. The chunk's data is verified against its id.
+	result get(id const& chunk, buffer & out);
+
+	/// Makes all added chunks durable
+	result flush();
+
+	/**
+	 * \brief Splits a file into chunks, reading it from the current position to its end, and adds them.
+	 *
+	 * \param chunks Receives the ids of the file's chunks, in order.
+	 */
+	result store_file(file & f, std::vector<id> & chunks, content_chunker & chunker);
+
+	/// Writes the passed chunks to a file
+	result restore_file(std::vector<id> const& chunks, file & f);
+
+	/// Number of distinct chunks
+	size_t count() const { return entries_.size(); }
+
+	/// Size of all distinct chunks
+	uint64_t stored_bytes() const { return data_size_; }
+
+	/// Size of the data passed to add that was already contained
+	uint64_t deduplicated_bytes() const { return deduplicated_; }
+
+private:
+	struct entry final
+	{
+		uint64_t offset{};
+		uint32_t size{};
+	};
+
+	struct id_hash final
+	{
+		size_t operator()(id const& chunk) const;
+	};
+
+	result load_index(native_string const& name);
+
+	file data_writer_;
+	file data_reader_;
+	file index_writer_;
+
+	std::unordered_map<id, entry, id_hash> entries_;
+
+	// Chunks without index entry yet
+	std::vector<id> pending_;
+
+	uint64_t data_size_{};
+	uint64_t deduplicated_{};
+};
+
+}
+
+#endif
@@ -0,0 +1,78 @@
+#ifndef LIBFILEZILLA_CHUNKER_HEADER
+#define LIBFILEZILLA_CHUNKER_HEADER
+
+/** \file
+ * \brief Content-defined chunking of data streams
+ */
+
+#include "buffer.hpp"
+
+namespace fz {
+
+/**
+ * \brief Splits a stream of data into chunks at content-defined boundaries
+ *
+ * Implements FastCDC: A gear hash is rolled over the data and a boundary is declared
+ * wherever the hash matches a mask. Since boundaries only depend on the preceding few
+ * dozen bytes, inserting or removing data only changes the chunks around the edit,
+ * all other chunks stay identical. This makes the chunks suitable for deduplication,
+ * see \ref chunk_store.
+ *
+ * Chunk sizes are normalized around the average size: Before reaching the average,
+ * a stricter mask is used than after it. No chunk is smaller than a quarter of the
+ * average size, nor larger than eight times it, except for the final chunk of the
+ * stream, which can be smaller.
+ *
+ * Boundaries do not depend on how the stream is split into pieces when it is passed
+ * to the chunker.
+ */
+class FZ_PUBLIC_SYMBOL content_chunker final
+{
+public:
+	/// The average chunk size gets rounded to a power of two between 256 bytes and 16 MiB.
+	explicit content_chunker(size_t average_size = 8192);
+
+	/**
+	 * \brief Finds the end of the next chunk
+	 *
+	 * data has to start at the beginning of the current chunk. If 0 is returned, the
+	 * chunk does not end within the passed data. In that case, call again once more
+	 * data is available, passing the same data followed by the new data. Data already
+	 * looked at is not scanned again.
+	 *
+	 * \param final If set, there is no more data following and the remaining data
+	 *              forms the last chunk.
+	 * \return The length of the next chunk, or 0 if more data is needed.
+	 */
+	size_t next(uint8_t const* data, size_t size, bool final);
+
+	/**
+	 * \brief Convenience function, extracts the next chunk from the front of in.
+	 *
+	 * \return false if more data is needed, chunk is left unchanged in that case.
+	 */
+	bool next(buffer & in, buffer & chunk, bool final);
+
+	/// Resets the state to the start of a new stream
+	void reset();
+
+	size_t min_size() const { return min_size_; }
+	size_t average_size() const { return average_size_; }
+	size_t max_size() const { return max_size_; }
+
+private:
+	size_t min_size_{};
+	size_t average_size_{};
+	size_t max_size_{};
+
+	uint64_t mask_small_{};
+	uint64_t mask_large_{};
+
+	// State of the chunk currently being scanned
+	size_t scanned_{};
+	uint64_t hash_{};
+};
+
+}
+
+#endif
@@ -0,0 +1,79 @@
+#ifndef LIBFILEZILLA_COMPRESSION_LAYER_HEADER
+#define LIBFILEZILLA_COMPRESSION_LAYER_HEADER
+
+/** \file
+ * \brief A socket layer compressing and decompressing data on the fly
+ */
+
+#include "event_handler.hpp"
+#include "socket.hpp"
+
+namespace fz {
+
+class compression_layer_impl;
+
+/**
+ * \brief A socket layer transparently compressing written data and decompressing read data
+ *
+ * Uses a single deflate stream in the zlib format per direction, compatible with
+ * FTP's MODE Z. Each write is flushed to a byte boundary so that the peer can
+ * decompress it without waiting for further data.
+ *
+ * If adaptive, the compression level is adjusted based on throughput: If the next
+ * layer cannot keep up with the compressed data, the level is raised, up to the
+ * configured level. If the next layer is never the bottleneck, CPU time is the limiting
+ * factor and the level gets lowered.
+ *
+ * If data turns out to be incompressible, compression is disabled and data is sent as
+ * stored deflate blocks, which remain decodable by the peer. From time to time the layer
+ * probes whether data has become compressible again.
+ *
+ * Calling shutdown finishes the compressed stream before shutting down the next layer.
+ */
+class FZ_PUBLIC_SYMBOL compression_layer final : protected event_handler, public socket_layer
+{
+public:
+	/**
+	 * \brief Constructs the layer
+	 *
+	 * The level is the maximum level from 1 to 9. If adaptive is not set, this level is
+	 * always used.
+	 */
+	compression_layer(event_loop& loop, event_handler* handler, socket_interface& next_layer, int level = 6, bool adaptive = true);
+	virtual ~compression_layer();
+
+	virtual int read(void* buffer, unsigned int size, int& error) override;
+	virtual int write(void const* buffer, unsigned int size, int& error) override;
+
+	virtual int shutdown() override;
+	virtual int shutdown_read() override;
+
+	virtual socket_state get_state() const override;
+
+	virtual void set_event_handler(event_handler* handler, socket_event_flag retrigger_block = socket_event_flag{}) override;
+
+	/// The compression level currently in use, 0 if compression has been disabled due to incompressible data.
+	int get_level() const;
+
+	/// Bytes passed to write
+	uint64_t get_written_bytes() const;
+
+	/// Compressed bytes passed on to the next layer
+	uint64_t get_compressed_written_bytes() const;
+
+	/// Bytes returned by read
+	uint64_t get_read_bytes() const;
+
+	/// Compressed bytes read from the next layer
+	uint64_t get_compressed_read_bytes() const;
+
+private:
+	virtual void FZ_PRIVATE_SYMBOL operator()(event_base const& ev) override;
+
+	friend class compression_layer_impl;
+	std::unique_ptr<compression_layer_impl> impl_;
+};
+
+}
+
+#endif
@@ -0,0 +1,193 @@
+#ifndef LIBFILEZILLA_DELTA_HEADER
+#define LIBFILEZILLA_DELTA_HEADER
+
+/** \file
+ * \brief rsync-style delta transfer of files
+ *
+ * Transfers a new version of a file to a peer holding an older version, the base, by
+ * only sending the parts that changed:
+ *
+ * 1. The side holding the base computes a \ref delta_signature of it and sends it over.
+ * 2. The side holding the new file feeds it through a \ref delta_generator, which finds
+ *    blocks of the base in the new file and emits a delta consisting of references to
+ *    those blocks and of literal data.
+ * 3. The side holding the base reconstructs the new file from the base and the delta
+ *    through a \ref delta_applier.
+ */
+
+#include "buffer.hpp"
+#include "file.hpp"
+#include "hash.hpp"
+
+#include <vector>
+
+namespace fz {
+
+/**
+ * \brief Block signatures of a base file
+ *
+ * The base is split into blocks of equal size. For each block, a weak rolling checksum
+ * and a strong hash are stored.
+ */
+class FZ_PUBLIC_SYMBOL delta_signature final
+{
+public:
+	/// Length of the truncated SHA-256 stored per block
+	static constexpr size_t strong_size = 16;
+
+	delta_signature() = default;
+
+	/**
+	 * \brief Computes the signature of the file, reading it from the current position to its end.
+	 *
+	 * If block_size is 0, a block size depending on the file size is chosen.
+	 *
+	 * \return false on read errors.
+	 */
+	bool compute(file & f, size_t block_size = 0);
+
+	/// Computes the signature of data in memory
+	void compute(uint8_t const* data, size_t size, size_t block_size = 0);
+
+	/// Serializes the signature to be sent to the peer
+	void append_to(buffer & out) const;
+
+	/// Loads a serialized signature, returns false if invalid.
+	bool load(uint8_t const* data, size_t size);
+
+	size_t block_size() const { return block_size_; }
+	size_t block_count() const { return blocks_.size(); }
+
+	/// Size of the base the signature was computed from
+	uint64_t size() const { return size_; }
+
+	/// Chooses a block size such that large files do not end up with too many blocks
+	static size_t default_block_size(uint64_t file_size);
+
+private:
+	friend class delta_generator;
+
+	struct block final
+	{
+		uint32_t weak{};
+		uint8_t strong[strong_size]{};
+	};
+
+	void add_block(uint8_t const* data, size_t size, hash_accumulator & acc);
+	void build_index();
+
+	// Returns the index of the matching block, or -1
+	size_t find(uint32_t weak, uint8_t const* data, size_t size, hash_accumulator & acc) const;
+
+	size_t block_size_{};
+	uint64_t size_{};
+	std::vector<block> blocks_;
+
+	// Block indexes sorted by weak checksum, the checksums in the same order, and a
+	// bitmap of hashed checksums to rule out most candidate positions without any lookup.
+	std::vector<uint32_t> sorted_;
+	std::vector<uint32_t> sorted_weak_;
+	std::vector<uint64_t> filter_;
+	unsigned int filter_shift_{};
+};
+
+/**
+ * \brief Generates a delta from a \ref delta_signature and the new data
+ *
+ * The new data can be passed in pieces of any size, the generator keeps at most a few
+ * blocks of data in memory. Matching uses a rolling checksum, so blocks are found at any
+ * offset, not just at multiples of the block size.
+ *
+ * The delta ends with the SHA-256 of the new data, which \ref delta_applier verifies.
+ */
+class FZ_PUBLIC_SYMBOL delta_generator final
+{
+public:
+	/// The signature must outlive the generator.
+	explicit delta_generator(delta_signature const& sig);
+
+	/// Processes new data, appending the resulting delta to out
+	void update(uint8_t const* data, size_t size, buffer & out);
+
+	/// Processes the remaining data and appends the end of the delta to out
+	void finalize(buffer & out);
+
+	/**
+	 * \brief Convenience function, generates the delta of the file, reading it from the
+	 * current position to its end.
+	 *
+	 * \return false on read errors.
+	 */
+	bool generate(file & f, buffer & out);
+
+	/// Bytes of the new data that were found in the base
+	uint64_t matched_bytes() const { return matched_; }
+
+	/// Bytes of the new data that are sent literally
+	uint64_t literal_bytes() const { return literal_; }
+
+private:
+	void process(buffer & out, bool final);
+	void emit_literal(size_t len, buffer & out);
+	void emit_copy(size_t block, buffer & out);
+	void flush_copy(buffer & out);
+
+	delta_signature const& sig_;
+	hash_accumulator strong_acc_{hash_algorithm::sha256};
+	hash_accumulator total_acc_{hash_algorithm::sha256};
+
+	// Pending data: literal bytes followed by the window
+	buffer data_;
+	size_t pos_{};
+
+	uint32_t a_{};
+	uint32_t b_{};
+	bool rolling_{};
+
+	// Run of consecutive blocks not yet emitted
+	size_t copy_start_{};
+	size_t copy_count_{};
+
+	uint64_t matched_{};
+	uint64_t literal_{};
+	bool header_{};
+};
+
+/**
+ * \brief Reconstructs the new file from the base and a delta
+ *
+ * The delta can be passed in pieces of any size.
+ */
+class FZ_PUBLIC_SYMBOL delta_applier final
+{
+public:
+	/// The base is read through random access, the output written sequentially. Both must outlive the applier.
+	delta_applier(file & base, file & out);
+
+	/// Processes the next piece of the delta. Returns false on error.
+	bool update(uint8_t const* data, size_t size);
+
+	/// Returns true if the delta was complete and the output verified successfully.
+	bool finalize();
+
+	/// Convenience function, applies a complete delta
+	bool apply(buffer const& delta);
+
+private:
+	bool write(uint8_t const* data, size_t size);
+
+	file & base_;
+	file & out_;
+	hash_accumulator total_acc_{hash_algorithm::sha256};
+
+	buffer pending_;
+	buffer copy_buffer_;
+	uint64_t block_size_{};
+	bool header_{};
+	bool done_{};
+	bool failed_{};
+};
+
+}
+
+#endif
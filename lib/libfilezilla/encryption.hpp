@@ -106,6 +106,24 @@ private:
 	std::vector<uint8_t> salt_;
 };
 
+/// Ciphers for authenticated encryption
+enum class aead_cipher
+{
+	/// Chooses the fastest cipher for the CPU, see \ref preferred_aead_cipher
+	automatic,
+
+	aes256_gcm,
+	chacha20_poly1305
+};
+
+/** \brief Returns the cipher used by \ref encrypt if not specified otherwise
+ *
+ * AES256-GCM if the CPU has instructions accelerating AES and GCM, ChaCha20-Poly1305
+ * otherwise. Without hardware support, ChaCha20-Poly1305 is several times faster and
+ * not prone to cache-timing attacks.
+ */
+aead_cipher FZ_PUBLIC_SYMBOL preferred_aead_cipher();
+
 /** \brief Encrypt the plaintext to the given public key.
  *
  * \param authenticated if true, authenticated encryption is used.
@@ -126,6 +144,15 @@ private:
  *   <tt>C' := AES256-CTR(K, IV, P)</tt> T:='' otherwise
  * - The ciphertext \e C is returned, containing \e E_pub, \e S_e and \e T: \n
  *     <tt>C := E_pub || S_e || C' || T</tt>
+ *
+ * If authenticated and ChaCha20-Poly1305 is used, see \ref aead_cipher, the ciphertext is
+ * versioned through a header \e H := <tt>'F' || 'Z' || 'E' || 1 || 2</tt>, and instead:
+ *   * <tt>K := SHA256(S_e || 5 || S || E_pub || M_pub || S_m)</tt>
+ *   * <tt>IV := SHA256(S_e || 6 || S || E_pub || M_pub || S_m)</tt> truncated to 12 octets
+ *   * <tt>C', T := ChaCha20-Poly1305(K, IV, P)</tt>, with \e H prepended to the authenticated data
+ *   * <tt>C := H || E_pub || S_e || C' || T</tt>
+ *
+ * \ref decrypt handles either format.
  */
 std::vector<uint8_t> FZ_PUBLIC_SYMBOL encrypt(std::vector<uint8_t> const& plain, public_key const& pub, bool authenticated = true);
 std::vector<uint8_t> FZ_PUBLIC_SYMBOL encrypt(std::string_view const& plain, public_key const& pub, bool authenticated = true);
@@ -133,6 +160,7 @@ std::vector<uint8_t> FZ_PUBLIC_SYMBOL encrypt(uint8_t const* plain, size_t size,
 std::vector<uint8_t> FZ_PUBLIC_SYMBOL encrypt(std::vector<uint8_t> const& plain, public_key const& pub, std::vector<uint8_t> const& authenticated_data);
 std::vector<uint8_t> FZ_PUBLIC_SYMBOL encrypt(std::string_view const& plain, public_key const& pub, std::string_view const& authenticated_data);
 std::vector<uint8_t> FZ_PUBLIC_SYMBOL encrypt(uint8_t const* plain, size_t size, public_key const& pub, uint8_t const* authenticated_data, size_t authenticated_data_size);
+std::vector<uint8_t> FZ_PUBLIC_SYMBOL encrypt(uint8_t const* plain, size_t size, public_key const& pub, uint8_t const* authenticated_data, size_t authenticated_data_size, aead_cipher cipher);
 
 /** \brief Decrypt the ciphertext using the given private key.
  *
@@ -212,7 +240,17 @@ public:
 
 	std::vector<uint8_t> const& key() const;
 
+	/**
+	 * \brief Overhead of the ciphertext produced by \ref encrypt using AES256-GCM
+	 *
+	 * Regardless of the cipher chosen automatically on this machine. Ciphertexts may
+	 * use a different cipher with a different overhead, use \ref encryption_overhead(aead_cipher)
+	 * or the size of the decrypted data instead.
+	 */
 	static size_t encryption_overhead();
+
+	/// Overhead of the ciphertext produced by \ref encrypt using the passed cipher, aead_cipher::automatic for the one chosen on this machine
+	static size_t encryption_overhead(aead_cipher cipher);
 private:
 	std::vector<uint8_t> key_;
 	std::vector<uint8_t> salt_;
@@ -237,6 +275,15 @@ inline bool FZ_PUBLIC_SYMBOL operator!=(symmetric_key const& lhs, symmetric_key
  *   <tt>C', T := AES256-GCM(K, IV, P)</tt>
  * - The ciphertext \e C is returned, containing \e N and \e T: \n
  *     <tt>C := N || C' || T</tt>
+ *
+ * If ChaCha20-Poly1305 is used, see \ref aead_cipher, the ciphertext is versioned through
+ * a header \e H := <tt>'F' || 'Z' || 'E' || 1 || 2</tt>, and instead:
+ *   * <tt>K := SHA256(S || 7 || M || N)</tt>
+ *   * <tt>IV := SHA256(S || 8 || M || N)</tt> truncated to 12 octets
+ *   * <tt>C', T := ChaCha20-Poly1305(K, IV, P)</tt>, with \e H prepended to the authenticated data
+ *   * <tt>C := H || N || C' || T</tt>
+ *
+ * \ref decrypt handles either format.
  */
 std::vector<uint8_t> FZ_PUBLIC_SYMBOL encrypt(std::vector<uint8_t> const& plain, symmetric_key const& key);
 std::vector<uint8_t> FZ_PUBLIC_SYMBOL encrypt(std::string_view const& plain, symmetric_key const& key);
@@ -244,6 +291,7 @@ std::vector<uint8_t> FZ_PUBLIC_SYMBOL encrypt(uint8_t const* plain, size_t size,
 std::vector<uint8_t> FZ_PUBLIC_SYMBOL encrypt(std::vector<uint8_t> const& plain, symmetric_key const& key, std::vector<uint8_t> const& authenticated_data);
 std::vector<uint8_t> FZ_PUBLIC_SYMBOL encrypt(std::string_view const& plain, symmetric_key const& key, std::string_view const& authenticated_data);
 std::vector<uint8_t> FZ_PUBLIC_SYMBOL encrypt(uint8_t const* plain, size_t size, symmetric_key const& key, uint8_t const* authenticated_data, size_t authenticated_data_size);
+std::vector<uint8_t> FZ_PUBLIC_SYMBOL encrypt(uint8_t const* plain, size_t size, symmetric_key const& key, uint8_t const* authenticated_data, size_t authenticated_data_size, aead_cipher cipher);
 
 /** \brief Decrypt the ciphertext using the given symmetric key.
  *
@@ -86,12 +86,25 @@ public:
 	 */
 	template<typename T, typename... Args>
 	void send_event(Args&&... args) {
-		event_loop_.send_event(this, new T(std::forward<Args>(args)...));
+		event_loop_.send_event(this, new T(std::forward<Args>(args)...), true);
 	}
 
 	template<typename T>
 	void send_event(T* evt) {
-		event_loop_.send_event(this, evt);
+		event_loop_.send_event(this, evt, true);
+	}
+
+	/** \brief Sends an event the event loop does not take ownership of.
+	 *
+	 * Useful for frequently sent events, the event can be reused instead of being allocated each time.
+	 *
+	 * Be careful with lifetime: The event must outlive its processing or its removal from the queue.
+	 * Sending it again while it is still queued or being processed has no effect, use
+	 * event_loop::persistent_event_pending before modifying and resending it.
+	 */
+	template<typename T>
+	void send_persistent_event(T* evt) {
+		event_loop_.send_event(this, evt, false);
 	}
 
 	/** \brief Adds a timer, returns the timer id.
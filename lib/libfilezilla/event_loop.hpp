@@ -10,6 +10,7 @@
 #include <deque>
 #include <functional>
 #include <memory>
+#include <unordered_set>
 #include <vector>
 
 /** \file
@@ -58,7 +59,8 @@ public:
 	 * Puts all queued events through the filter function.
 	 * The filter function can freely change the passed events.
 	 * If the filter function returns true, the corresponding event
-	 * gets removed.
+	 * gets removed. Removed events are deleted unless they have been sent
+	 * through event_handler::send_persistent_event.
 	 *
 	 * The filter function must not call any function of event_loop.
 	 *
@@ -74,6 +76,13 @@ public:
 	 */
 	void stop(bool join = false);
 
+	/** \brief Checks whether an event sent through event_handler::send_persistent_event is in use
+	 *
+	 * Returns true while the event is queued or being processed. Only once this returns false,
+	 * the event may be modified and sent again.
+	 */
+	bool persistent_event_pending(event_base const* evt);
+
 	 /// Starts the loop in the caller's thread.
 	void run();
 
@@ -85,7 +94,10 @@ private:
 	timer_id FZ_PRIVATE_SYMBOL add_timer(event_handler* handler, duration const& interval, bool one_shot);
 	void FZ_PRIVATE_SYMBOL stop_timer(timer_id id);
 
-	void send_event(event_handler* handler, event_base* evt);
+	void send_event(event_handler* handler, event_base* evt, bool deletable);
+
+	// Deletes the event, unless it is persistent. Must be called with sync_ locked.
+	void FZ_PRIVATE_SYMBOL release_event(event_base * evt);
 
 	// Process the next (if any) event. Returns true if an event has been processed
 	bool FZ_PRIVATE_SYMBOL process_event(scoped_lock & l);
@@ -108,6 +120,10 @@ private:
 	Events pending_events_;
 	Timers timers_;
 
+	// Events in pending_events_ or being processed that are not owned by the loop.
+	// Every socket has its own, so there can be many.
+	std::unordered_set<event_base const*> persistent_events_;
+
 	mutex sync_;
 	condition cond_;
 
@@ -0,0 +1,117 @@
+#ifndef LIBFILEZILLA_FS_WATCHER_HEADER
+#define LIBFILEZILLA_FS_WATCHER_HEADER
+
+/** \file
+ * \brief Notifications about changes in the local filesystem
+ */
+
+#include "event_handler.hpp"
+#include "thread_pool.hpp"
+#include "time.hpp"
+
+#include <memory>
+#include <vector>
+
+namespace fz {
+
+class fs_watcher;
+class fs_watcher_impl;
+
+/// \private
+struct fs_watcher_event_type{};
+
+/**
+ * \brief Sent by \ref fs_watcher once changes are ready to be fetched.
+ *
+ * Not sent again until the changes have been fetched with \ref fs_watcher::fetch_changes
+ */
+typedef simple_event<fs_watcher_event_type, fs_watcher*> fs_watcher_event;
+
+/// A change to a file or directory, as returned by \ref fs_watcher::fetch_changes
+struct fs_change final
+{
+	enum type : unsigned int {
+		created = 0x1,
+
+		/// Also set if the entry has been moved away
+		removed = 0x2,
+
+		modified = 0x4,
+		attributes = 0x8,
+
+		/**
+		 * Changes have been lost, e.g. because there were too many of them.
+		 * The path is empty, everything watched needs to be rescanned.
+		 */
+		overflow = 0x10
+	};
+
+	native_string path;
+
+	/// Bitmask of all changes to the path since the changes were last fetched
+	unsigned int changes{};
+};
+
+/**
+ * \brief Watches files and directories for changes
+ *
+ * Changes are delivered through the event loop: Once changes are pending, the handler
+ * receives an \ref fs_watcher_event and then calls \ref fetch_changes.
+ *
+ * Bursts of changes are coalesced: The event is only sent once no further changes have
+ * arrived for the coalescing delay, but no later than 10 times the delay after the first
+ * change. All changes to the same path get merged into a single \ref fs_change.
+ *
+ * Directories can be watched recursively, including subdirectories created later on.
+ * As every directory needs its own watch, the total number of watches is bounded.
+ * Subdirectories moved within the watched tree keep being watched under their new path,
+ * those moved elsewhere are no longer watched.
+ *
+ * Implemented using inotify. On other platforms, \ref add fails with ENOSYS.
+ */
+class FZ_PUBLIC_SYMBOL fs_watcher final
+{
+public:
+	/**
+	 * \param pool Used to spawn the thread waiting for notifications.
+	 * \param handler Receives the \ref fs_watcher_event. Must outlive the watcher.
+	 * \param coalesce_delay How long to wait for further changes before notifying the handler.
+	 * \param max_watches Upper bound on the number of watched directories and files.
+	 */
+	fs_watcher(thread_pool & pool, event_handler & handler, duration const& coalesce_delay = duration::from_milliseconds(100), size_t max_watches = 8192);
+	~fs_watcher();
+
+	fs_watcher(fs_watcher const&) = delete;
+	fs_watcher& operator=(fs_watcher const&) = delete;
+
+	/**
+	 * \brief Starts watching the passed file or directory.
+	 *
+	 * If recursive, all subdirectories of a directory are watched as well.
+	 *
+	 * \return 0 on success, otherwise an errno value. ENOSPC if the number of watches would
+	 * exceed the limit, in which case the watches added so far remain in place.
+	 */
+	int add(native_string const& path, bool recursive = false);
+
+	/**
+	 * \brief Stops watching the path, including its subdirectories if it was added recursively.
+	 *
+	 * Subdirectories that have been added separately remain watched, as does the path itself
+	 * if it is below another path added recursively.
+	 */
+	void remove(native_string const& path);
+
+	/// The number of watches in use
+	size_t watch_count() const;
+
+	/// Returns and clears the pending changes.
+	std::vector<fs_change> fetch_changes();
+
+private:
+	std::unique_ptr<fs_watcher_impl> impl_;
+};
+
+}
+
+#endif
@@ -60,6 +60,81 @@ private:
 	impl* impl_;
 };
 
+/**
+ * \brief Accumulator for HMACs, keyed once and reused for many messages
+ *
+ * Keying computes the inner and outer hash states of the padded key. Unlike
+ * \ref hmac_sha256, which redoes this for every call, the accumulator keeps them, so
+ * each subsequent MAC only costs hashing the message itself.
+ *
+ * Copies share nothing with the original and start out in the same state, e.g. to
+ * hand a keyed accumulator to each thread, or to compute MACs of several messages
+ * sharing a prefix.
+ */
+class FZ_PUBLIC_SYMBOL hmac_accumulator final
+{
+public:
+	/// Creates an accumulator keyed for the passed algorithm
+	hmac_accumulator(hash_algorithm algorithm, std::basic_string_view<uint8_t> const& key);
+	hmac_accumulator(hash_algorithm algorithm, std::string_view const& key);
+	hmac_accumulator(hash_algorithm algorithm, std::vector<uint8_t> const& key);
+	~hmac_accumulator();
+
+	hmac_accumulator(hmac_accumulator const& op);
+	hmac_accumulator& operator=(hmac_accumulator const& op);
+
+	/// Discards all data passed since keying or the last digest
+	void reinit();
+
+	void update(std::string_view const& data);
+	void update(std::basic_string_view<uint8_t> const& data);
+	void update(std::vector<uint8_t> const& data);
+	void update(uint8_t const* data, size_t size);
+	void update(uint8_t in) {
+		update(&in, 1);
+	}
+
+	/// Size of the MAC in octets
+	size_t digest_size() const;
+
+	/**
+	 * \brief Writes the MAC to out and reinitializes the accumulator for the next message.
+	 *
+	 * If size is smaller than \ref digest_size, the MAC is truncated to its first size
+	 * octets. Larger sizes are clamped to the digest size.
+	 */
+	void digest(uint8_t * out, size_t size);
+
+	/// Returns the MAC and reinitializes the accumulator for the next message.
+	std::vector<uint8_t> digest();
+
+	/**
+	 * \brief Compares the MAC in constant time with the passed one.
+	 *
+	 * Reinitializes the accumulator for the next message. Only a MAC of the full
+	 * \ref digest_size is accepted.
+	 */
+	bool verify(uint8_t const* mac, size_t size);
+
+	/**
+	 * \brief Like \ref verify, but also accepts a MAC truncated to at least min_size octets.
+	 *
+	 * Per RFC 2104, truncated MACs shorter than half the digest size or than 80 bits are
+	 * never accepted, regardless of min_size.
+	 */
+	bool verify(uint8_t const* mac, size_t size, size_t min_size);
+
+	template<typename T>
+	hmac_accumulator& operator<<(T && in) {
+		update(std::forward<T>(in));
+		return *this;
+	}
+
+	class impl;
+private:
+	impl* impl_;
+};
+
 /** \brief Standard MD5
  *
  * Insecure, avoid using this
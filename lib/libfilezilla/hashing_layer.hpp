@@ -0,0 +1,92 @@
+#ifndef LIBFILEZILLA_HASHING_LAYER_HEADER
+#define LIBFILEZILLA_HASHING_LAYER_HEADER
+
+/** \file
+ * \brief Computing hashes of data as it passes through sockets and files
+ */
+
+#include "file.hpp"
+#include "hash.hpp"
+#include "socket.hpp"
+
+#include <vector>
+
+namespace fz {
+
+/**
+ * \brief A socket layer feeding all data passing through it into hash accumulators
+ *
+ * Computes checksums of transferred data on the fly, so that they do not need to be
+ * computed in a second pass over the data. Any number of accumulators can be attached
+ * to either direction, e.g. to compute both SHA-256 and MD5 at once.
+ *
+ * The accumulators are not owned by the layer. Once read has returned 0, or after
+ * shutdown has succeeded, all data has been hashed and the digest can be taken.
+ *
+ * The layer passes events through unchanged.
+ */
+class FZ_PUBLIC_SYMBOL hashing_layer final : public socket_layer
+{
+public:
+	hashing_layer(event_handler* handler, socket_interface& next_layer);
+	virtual ~hashing_layer();
+
+	/// Hashes all data subsequently returned by read. The accumulator must outlive the layer.
+	void add_read_hash(hash_accumulator & acc);
+
+	/// Hashes all data subsequently accepted by write. The accumulator must outlive the layer.
+	void add_write_hash(hash_accumulator & acc);
+
+	virtual int read(void* buffer, unsigned int size, int& error) override;
+	virtual int write(void const* buffer, unsigned int size, int& error) override;
+
+	/// Bytes returned by read
+	uint64_t get_read_bytes() const { return read_bytes_; }
+
+	/// Bytes accepted by write
+	uint64_t get_written_bytes() const { return written_bytes_; }
+
+private:
+	std::vector<hash_accumulator*> read_hashes_;
+	std::vector<hash_accumulator*> write_hashes_;
+
+	uint64_t read_bytes_{};
+	uint64_t written_bytes_{};
+};
+
+/**
+ * \brief The equivalent of \ref hashing_layer for files
+ *
+ * Wraps a \ref file and feeds all data read from or written to it into hash accumulators.
+ * Hashing assumes sequential access, if seeking, the digest is that of the data as it
+ * was read or written, not that of the file.
+ */
+class FZ_PUBLIC_SYMBOL hashing_file final
+{
+public:
+	/// Does not take ownership of the file, it must outlive the wrapper.
+	explicit hashing_file(file & f);
+
+	/// The accumulator must outlive the wrapper.
+	void add_hash(hash_accumulator & acc);
+
+	/// Same as \ref file::read, hashing the data read.
+	int64_t read(void *buf, int64_t count);
+
+	/// Same as \ref file::write, hashing the data written.
+	int64_t write(void const* buf, int64_t count);
+
+	/// Bytes read or written
+	uint64_t get_bytes() const { return bytes_; }
+
+	file & get_file() { return file_; }
+
+private:
+	file & file_;
+	std::vector<hash_accumulator*> hashes_;
+	uint64_t bytes_{};
+};
+
+}
+
+#endif
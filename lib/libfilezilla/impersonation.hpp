@@ -2,10 +2,12 @@
 #define LIBFILEZILLA_IMPERSONATION_HEADER
 
 /** \file
-* \brief Declares \ref fz::impersonation_token
+* \brief Declares \ref fz::impersonation_token and \ref fz::impersonation_service
 */
 
+#include "event_handler.hpp"
 #include "string.hpp"
+#include "time.hpp"
 
 #include <memory>
 #include <functional>
@@ -73,6 +75,80 @@ private:
 bool FZ_PUBLIC_SYMBOL set_process_impersonation(impersonation_token const& token);
 #endif
 
+class thread_pool;
+
+/**
+ * \brief Creates \ref fz::impersonation_token "impersonation tokens" asynchronously
+ *
+ * Verifying credentials can be slow, in particular modern password hashes
+ * are designed to be expensive to compute. Instead of blocking the calling
+ * thread, the service builds the tokens using at most \c max_concurrency
+ * threads taken from the passed pool. Further requests are queued.
+ *
+ * Once a request has been processed, an \ref impersonation_event is sent to
+ * the handler that made the request.
+ *
+ * Under *nix, the results of user and group database lookups are cached for
+ * the given time to live, keyed by username. Passwords are always verified,
+ * only the account information is cached: Each login with a password still
+ * looks up the shadow entry and hashes the password, so that password changes
+ * and locked accounts take effect immediately and no password hashes are kept
+ * in memory. The cost of that is dominated by the deliberately slow hash, which
+ * the max_concurrency limit keeps in check.
+ */
+class FZ_PUBLIC_SYMBOL impersonation_service final
+{
+public:
+	explicit impersonation_service(thread_pool& pool, size_t max_concurrency = 2, duration const& cache_ttl = duration::from_minutes(5));
+
+	/// Waits for requests currently being processed, queued requests are discarded
+	~impersonation_service();
+
+	impersonation_service(impersonation_service const&) = delete;
+	impersonation_service& operator=(impersonation_service const&) = delete;
+
+	/**
+	 * \brief Queues a request to create a token, verifying credentials in the process.
+	 *
+	 * Returns a non-zero request id that is passed in the corresponding \ref impersonation_event,
+	 * or 0 if the request could not be queued.
+	 */
+	uint64_t authenticate(event_handler& handler, fz::native_string const& username, fz::native_string const& password);
+
+#if !FZ_WINDOWS
+	/// Doesn't verify credentials
+	uint64_t authenticate(event_handler& handler, fz::native_string const& username, impersonation_flag flag);
+#endif
+
+	/**
+	 * \brief Cancels all requests of the passed handler
+	 *
+	 * No further \ref impersonation_event from this service will be delivered to the handler,
+	 * including those already pending in its event loop.
+	 *
+	 * Must be called before a handler with outstanding requests is destroyed.
+	 */
+	void cancel(event_handler& handler);
+
+	/// Drops all cached user database entries.
+	void clear_cache();
+
+private:
+	class impl;
+	std::unique_ptr<impl> impl_;
+};
+
+/// \private
+struct impersonation_event_type{};
+
+/**
+ * \brief Result of a \ref impersonation_service request.
+ *
+ * Arguments are the service, the request id and the token. The token is never null, but
+ * evaluates to false if the request failed. The receiving handler may move it out of the event.
+ */
+typedef simple_event<impersonation_event_type, impersonation_service*, uint64_t, std::unique_ptr<impersonation_token>> impersonation_event;
+
 }
 
 namespace std {
@@ -0,0 +1,195 @@
+#ifndef LIBFILEZILLA_LAYER_STACK_HEADER
+#define LIBFILEZILLA_LAYER_STACK_HEADER
+
+/** \file
+ * \brief Statically composed stacks of socket layers
+ *
+ * Declares \ref fz::layer_stack and the layer tags it can be instantiated with.
+ */
+
+#include "rate_limited_layer.hpp"
+#include "tls_layer.hpp"
+
+#include <memory>
+#include <tuple>
+
+namespace fz {
+
+/**
+ * \brief Tags to compose a \ref fz::layer_stack with
+ *
+ * Each tag names the layer type to use for a given next layer, and how to
+ * construct it from the arguments passed to the stack.
+ */
+namespace layers {
+
+/// Adds a \ref fz::basic_rate_limited_layer, constructed from an optional \c rate_limiter*
+struct rate_limited
+{
+	template<typename Next>
+	using layer = basic_rate_limited_layer<Next>;
+
+	template<typename Next>
+	static layer<Next> create(event_handler* handler, Next& next, rate_limiter* limiter = nullptr) {
+		return layer<Next>(handler, next, limiter);
+	}
+};
+
+/// Adds a \ref fz::compound_rate_limited_layer, constructed without arguments
+struct compound_rate_limited
+{
+	template<typename Next>
+	using layer = compound_rate_limited_layer;
+
+	template<typename Next>
+	static layer<Next> create(event_handler* handler, Next& next) {
+		return layer<Next>(handler, next);
+	}
+};
+
+/// Adds a \ref fz::tls_layer, constructed from event_loop&, tls_system_trust_store* and logger_interface&
+struct tls
+{
+	template<typename Next>
+	using layer = tls_layer;
+
+	template<typename Next>
+	static layer<Next> create(event_handler* handler, Next& next, event_loop& loop, tls_system_trust_store* system_trust_store, logger_interface& logger) {
+		return layer<Next>(loop, handler, next, system_trust_store, logger);
+	}
+};
+}
+
+/// \private
+namespace detail {
+template<typename Next, typename... Tags>
+struct layer_chain
+{
+	explicit layer_chain(event_handler*, Next& next)
+		: top_(next)
+	{}
+
+	using top_type = Next;
+	top_type& top() { return top_; }
+
+	Next& top_;
+};
+
+template<typename Next, typename Tag, typename... Tags>
+struct layer_chain<Next, Tag, Tags...>
+{
+	using layer_type = typename Tag::template layer<Next>;
+	using rest_type = layer_chain<layer_type, Tags...>;
+
+	template<typename Args, typename... RestArgs>
+	layer_chain(event_handler* handler, Next& next, Args && args, RestArgs &&... rest)
+		: layer_(std::apply([&](auto &&... a) { return Tag::template create<Next>(handler, next, std::forward<decltype(a)>(a)...); }, std::forward<Args>(args)))
+		, rest_(handler, layer_, std::forward<RestArgs>(rest)...)
+	{}
+
+	using top_type = typename rest_type::top_type;
+	top_type& top() { return rest_.top(); }
+
+	template<size_t I>
+	auto& get() {
+		if constexpr (I == 0) {
+			return layer_;
+		}
+		else {
+			return rest_.template get<I - 1>();
+		}
+	}
+
+	// Members are destroyed in reverse order, upper layers go first.
+	layer_type layer_;
+	rest_type rest_;
+};
+}
+
+/**
+ * \brief A stack of socket layers composed at compile-time.
+ *
+ * Owns the bottom-most socket and constructs the layers named by the tags
+ * in \c Tags on top of it, in the given order. The layers are stored inline
+ * and destroyed in reverse order, as required by \ref fz::socket_layer.
+ *
+ * As the type of each layer's next layer is known, layers supporting it,
+ * e.g. \ref fz::basic_rate_limited_layer, call into their next layer without
+ * virtual dispatch. Likewise calls through \ref top do not need virtual
+ * dispatch if the topmost layer type is final.
+ *
+ * Example:
+ * \code
+ * using stack = fz::layer_stack<fz::socket, fz::layers::rate_limited, fz::layers::tls>;
+ * stack s(handler, std::make_unique<fz::socket>(pool, handler),
+ *         std::forward_as_tuple(&limiter),
+ *         std::forward_as_tuple(loop, nullptr, logger));
+ * s.top().client_handshake(nullptr);
+ * s.top().connect(host, port);
+ * \endcode
+ *
+ * Each layer gets constructed with the passed handler, upper layers redirect
+ * events of the lower layers to themselves as needed.
+ *
+ * The top of the stack is a \ref fz::socket_interface and can be used as such.
+ */
+template<typename Bottom, typename... Tags>
+class layer_stack final
+{
+public:
+	using chain_type = detail::layer_chain<Bottom, Tags...>;
+	using top_type = typename chain_type::top_type;
+
+	/**
+	 * \brief Builds the stack on top of the passed socket.
+	 *
+	 * For each tag, a tuple with the arguments for the corresponding layer
+	 * needs to be passed, see \ref fz::layers.
+	 */
+	template<typename... Args>
+	layer_stack(event_handler* handler, std::unique_ptr<Bottom> && bottom, Args &&... args)
+		: bottom_(std::move(bottom))
+		, chain_(handler, *bottom_, std::forward<Args>(args)...)
+	{
+		static_assert(sizeof...(Args) == sizeof...(Tags), "Need exactly one argument tuple per layer");
+	}
+
+	layer_stack(layer_stack const&) = delete;
+	layer_stack& operator=(layer_stack const&) = delete;
+
+	/// The topmost layer
+	top_type& top() { return chain_.top(); }
+
+	/// The bottom-most socket
+	Bottom& bottom() { return *bottom_; }
+
+	/// Returns the layer at the given index, 0 being the bottom-most socket
+	template<size_t I>
+	auto& get() {
+		if constexpr (I == 0) {
+			return *bottom_;
+		}
+		else {
+			return chain_.template get<I - 1>();
+		}
+	}
+
+	/// Number of layers, including the bottom-most socket
+	static constexpr size_t size() { return sizeof...(Tags) + 1; }
+
+	int read(void* buffer, unsigned int size, int& error) {
+		return top().read(buffer, size, error);
+	}
+
+	int write(void const* buffer, unsigned int size, int& error) {
+		return top().write(buffer, size, error);
+	}
+
+private:
+	std::unique_ptr<Bottom> bottom_;
+	chain_type chain_;
+};
+
+}
+
+#endif
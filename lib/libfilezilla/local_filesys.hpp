@@ -183,10 +183,20 @@ result FZ_PUBLIC_SYMBOL remove_dir(native_string const& absolute_path);
  *
  * param allow_copy If true, files, but not directories, can be moved across
  *                  file system boundaries. It first copies the file before
- *                  deleting the old one.
+ *                  deleting the old one, using \ref copy_file.
  */
 result FZ_PUBLIC_SYMBOL rename_file(native_string const& source, native_string const& dest, bool allow_copy = true);
 
+/**
+ * \brief Copies the passed file
+ *
+ * The target file is overwritten.
+ *
+ * Sparse files stay sparse: Where the filesystem supports SEEK_DATA/SEEK_HOLE, only the data
+ * extents get read and copied, holes are recreated by seeking over them.
+ */
+result FZ_PUBLIC_SYMBOL copy_file(native_string const& source, native_string const& dest);
+
 }
 
 #endif
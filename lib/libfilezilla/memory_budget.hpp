@@ -0,0 +1,154 @@
+#ifndef LIBFILEZILLA_MEMORY_BUDGET_HEADER
+#define LIBFILEZILLA_MEMORY_BUDGET_HEADER
+
+/** \file
+ * \brief Accounting of buffer memory against a budget
+ */
+
+#include "buffer.hpp"
+#include "mutex.hpp"
+
+#include <atomic>
+#include <vector>
+
+namespace fz {
+
+/// Categories memory can be accounted under
+struct memory_category final
+{
+	enum type : size_t {
+		general,
+		socket,
+		tls,
+		file,
+
+		/// First category free for use by applications
+		user,
+
+		count = 16
+	};
+};
+
+/**
+ * \brief Interface for objects waiting for memory pressure to subside.
+ *
+ * \sa memory_budget::wait
+ */
+class FZ_PUBLIC_SYMBOL memory_waiter
+{
+public:
+	virtual ~memory_waiter() = default;
+
+protected:
+	friend class memory_budget;
+
+	/**
+	 * \brief Called once memory pressure has subsided.
+	 *
+	 * Called with the budget's mutex held, from whichever thread released memory.
+	 * Must not call back into the memory_budget.
+	 */
+	virtual void on_memory_relief() = 0;
+};
+
+/**
+ * \brief Tracks how much buffer memory is in use and signals memory pressure
+ *
+ * Accounting is opt-in: Whoever owns buffers charges their capacity to the budget, usually
+ * through a \ref memory_charge. Counters are kept per \ref memory_category and are lock-free.
+ *
+ * Once the total exceeds the limit, the budget is under pressure until the total has fallen
+ * to 7/8 of the limit again. While under pressure, layers such as \ref tls_layer and
+ * \ref rate_limited_layer stop reading from their sockets, so that slow consumers do not
+ * cause ever more memory to be buffered. Writes are not affected, they drain buffers.
+ *
+ * Typically a single budget is shared by all connections of a process.
+ */
+class FZ_PUBLIC_SYMBOL memory_budget final
+{
+public:
+	explicit memory_budget(size_t limit = static_cast<size_t>(-1));
+
+	memory_budget(memory_budget const&) = delete;
+	memory_budget& operator=(memory_budget const&) = delete;
+
+	void set_limit(size_t limit);
+	size_t limit() const { return limit_; }
+
+	void charge(size_t bytes, memory_category::type c = memory_category::general);
+	void release(size_t bytes, memory_category::type c = memory_category::general);
+
+	/// Total memory charged
+	size_t usage() const { return usage_; }
+
+	/// Memory charged under the passed category
+	size_t usage(memory_category::type c) const;
+
+	bool under_pressure() const { return pressure_; }
+
+	/**
+	 * \brief Registers a waiter to be notified once pressure subsides.
+	 *
+	 * Returns false without registering if not under pressure. Each registration is
+	 * notified at most once.
+	 */
+	bool wait(memory_waiter & w);
+
+	/// Removes a pending registration. Must be called before the waiter gets destroyed.
+	void remove_waiter(memory_waiter & w);
+
+private:
+	void relieve();
+
+	std::atomic<size_t> usage_{};
+	std::atomic<size_t> categories_[memory_category::count]{};
+
+	std::atomic<size_t> limit_;
+	std::atomic<bool> pressure_{};
+
+	mutex mtx_{false};
+	std::vector<memory_waiter*> waiters_;
+};
+
+/**
+ * \brief Charges memory to a \ref memory_budget for as long as it exists
+ *
+ * Update it whenever the accounted memory changes, e.g. with \ref track after a buffer
+ * has grown or shrunk. The budget must outlive the charge.
+ */
+class FZ_PUBLIC_SYMBOL memory_charge final
+{
+public:
+	memory_charge() = default;
+	explicit memory_charge(memory_budget * budget, memory_category::type c = memory_category::general)
+		: budget_(budget)
+		, category_(c)
+	{}
+
+	~memory_charge() { update(0); }
+
+	memory_charge(memory_charge const&) = delete;
+	memory_charge& operator=(memory_charge const&) = delete;
+
+	memory_charge(memory_charge && op) noexcept;
+	memory_charge& operator=(memory_charge && op) noexcept;
+
+	/// Changes the amount charged.
+	void update(size_t bytes);
+
+	/// Charges the capacity of the passed buffer
+	void track(buffer const& b) { update(b.capacity()); }
+
+	size_t charged() const { return charged_; }
+
+	memory_budget * budget() const { return budget_; }
+
+private:
+	memory_budget * budget_{};
+	memory_category::type category_{memory_category::general};
+	size_t charged_{};
+};
+
+}
+
+#endif
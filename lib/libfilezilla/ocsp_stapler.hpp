@@ -0,0 +1,95 @@
+#ifndef LIBFILEZILLA_OCSP_STAPLER_HEADER
+#define LIBFILEZILLA_OCSP_STAPLER_HEADER
+
+/** \file
+ * \brief OCSP stapling for TLS servers
+ *
+ * Declares the \ref fz::ocsp_stapler class.
+ */
+
+#include "time.hpp"
+
+#include <functional>
+#include <memory>
+#include <string_view>
+
+namespace fz {
+class logger_interface;
+class ocsp_stapler_impl;
+class thread_pool;
+
+/**
+ * \brief Keeps OCSP responses for server certificates, refreshing them in the background
+ *
+ * Once a certificate has been added, an OCSP request for it is created and passed to the
+ * fetch function on a background thread. The fetch function is responsible for contacting
+ * the responder, typically through an HTTP POST of the request to the passed URL, and returns
+ * the DER-encoded OCSP response.
+ *
+ * Responses are only cached if they are well-formed and are about the added certificate.
+ * They are refreshed after half of their validity period has passed, but no later than after
+ * the configured refresh interval. Expired responses are discarded. If a fetch fails, it gets
+ * retried after a minute.
+ *
+ * Responses are only cached if they are signed by the issuer of the certificate, or by a
+ * responder the issuer has delegated OCSP signing to. Clients would reject any other response.
+ *
+ * Pass the stapler to \ref tls_layer::set_ocsp_stapler to staple the cached responses during
+ * server handshakes. Handshakes never wait for a response to be fetched.
+ *
+ * This class is thread-safe and can be passed concurrently to multiple instances of
+ * \ref fz::tls_layer. It must outlive all layers using it.
+ */
+class FZ_PUBLIC_SYMBOL ocsp_stapler final
+{
+public:
+	/**
+	 * \brief Fetches an OCSP response
+	 *
+	 * Gets the URL of the OCSP responder and the DER-encoded request. Returns the DER-encoded
+	 * response, or nothing on failure.
+	 *
+	 * Gets called on a background thread, it may block.
+	 */
+	typedef std::function<std::vector<uint8_t>(std::string const& responder_url, std::vector<uint8_t> const& request)> fetch_function;
+
+	ocsp_stapler(thread_pool & pool, fetch_function const& fetch, logger_interface & logger, duration const& refresh_interval = duration::from_hours(1));
+
+	/// Waits for a fetch in progress to complete.
+	~ocsp_stapler();
+
+	ocsp_stapler(ocsp_stapler const&) = delete;
+	ocsp_stapler& operator=(ocsp_stapler const&) = delete;
+
+	/**
+	 * \brief Adds a certificate to fetch responses for
+	 *
+	 * The chain must contain the certificate followed by its issuer.
+	 * If the pem flag is set, the input is assumed to be in PEM, otherwise DER.
+	 *
+	 * If no responder URL is passed, the OCSP responder from the
+	 * certificate's authority information access extension is used.
+	 *
+	 * Returns false if the chain cannot be loaded or if there is no responder.
+	 */
+	bool add_certificate(std::string_view const& certs, bool pem = true, std::string const& responder_url = std::string());
+
+	/**
+	 * \brief Removes a certificate
+	 *
+	 * Takes the same input as \ref add_certificate, only the first certificate of the chain is used.
+	 */
+	void remove_certificate(std::string_view const& certs, bool pem = true);
+
+	/// Returns the cached DER-encoded OCSP response for the passed DER-encoded certificate, if any.
+	std::vector<uint8_t> get_response(std::vector<uint8_t> const& certificate) const;
+
+	/// Refreshes all responses now, regardless of their validity
+	void refresh();
+
+private:
+	std::unique_ptr<ocsp_stapler_impl> impl_;
+};
+}
+
+#endif
@@ -5,31 +5,130 @@
  * \brief A rate-limited socket layer
  */
 
+#include "memory_budget.hpp"
 #include "rate_limiter.hpp"
 #include "socket.hpp"
 
 namespace fz {
 
 /**
- * \brief A rate-limited socket layer.
+ * \brief Common implementation of \ref basic_rate_limited_layer
  *
- * This socket layer is a bucket that can be added to a \sa rate_limiter.
+ * Does not depend on the type of the next layer, the calls into the next layer
+ * are left to the derived class.
  */
-class FZ_PUBLIC_SYMBOL rate_limited_layer final : public socket_layer, private bucket
+class FZ_PUBLIC_SYMBOL rate_limited_layer_base : public socket_layer, private bucket, private memory_waiter
 {
 public:
-	rate_limited_layer(event_handler* handler, socket_interface& next_layer, rate_limiter * limiter = nullptr);
-	virtual ~rate_limited_layer();
-
-	virtual int read(void* buffer, unsigned int size, int& error) override;
-	virtual int write(void const* buffer, unsigned int size, int& error) override;
-
 	virtual void set_event_handler(event_handler* handler, socket_event_flag retrigger_block = socket_event_flag{}) override;
 
+	/**
+	 * \brief Stop reading while the passed budget is under memory pressure
+	 *
+	 * Reads fail with EAGAIN until the pressure subsides, then a read event is sent.
+	 * The budget must outlive the layer.
+	 */
+	void set_memory_budget(memory_budget * budget);
+
 protected:
+	rate_limited_layer_base(event_handler* handler, socket_interface& next_layer, rate_limiter * limiter);
+	virtual ~rate_limited_layer_base();
+
+	/**
+	 * \brief Limits size to what may currently be transferred in the given direction
+	 *
+	 * Returns the limit to pass to \ref transferred, or 0 if nothing may be transferred,
+	 * in which case error is set to EAGAIN.
+	 */
+	rate::type limit(direction::type d, unsigned int & size, int & error);
+
+	/// Accounts for data transferred after calling \ref limit
+	void transferred(direction::type d, rate::type max, int amount) {
+		if (amount > 0 && max != rate::unlimited) {
+			consume(d, amount);
+		}
+	}
+
 	virtual void wakeup(direction::type d) override;
+
+private:
+	virtual void on_memory_relief() override;
+
+	memory_budget * memory_budget_{};
+	std::atomic<bool> memory_waiting_{};
 };
 
+/**
+ * \brief A rate-limited socket layer bound to the type of its next layer
+ *
+ * This socket layer is a bucket that can be added to a \sa rate_limiter.
+ *
+ * Calls into the next layer are resolved at compile-time, allowing the compiler
+ * to devirtualize and inline them if the next layer's type is final.
+ *
+ * Events from the next layer are passed through directly to the event handler.
+ *
+ * \sa fz::layer_stack
+ */
+template<typename Next>
+class basic_rate_limited_layer final : public rate_limited_layer_base
+{
+public:
+	basic_rate_limited_layer(event_handler* handler, Next& next_layer, rate_limiter * limiter = nullptr)
+		: rate_limited_layer_base(handler, next_layer, limiter)
+		, next_(next_layer)
+	{
+	}
+
+	virtual int read(void* buffer, unsigned int size, int& error) override
+	{
+		auto const max = limit(direction::inbound, size, error);
+		if (!max) {
+			return -1;
+		}
+
+		int read = next_.read(buffer, size, error);
+		transferred(direction::inbound, max, read);
+		return read;
+	}
+
+	virtual int write(void const* buffer, unsigned int size, int& error) override
+	{
+		auto const max = limit(direction::outbound, size, error);
+		if (!max) {
+			return -1;
+		}
+
+		int written = next_.write(buffer, size, error);
+		transferred(direction::outbound, max, written);
+		return written;
+	}
+
+	virtual native_string peer_host() const override { return next_.peer_host(); }
+	virtual int peer_port(int& error) const override { return next_.peer_port(error); }
+
+	virtual int connect(native_string const& host, unsigned int port, address_type family = address_type::unknown) override {
+		return next_.connect(host, port, family);
+	}
+
+	virtual int shutdown() override { return next_.shutdown(); }
+	virtual int shutdown_read() override { return next_.shutdown_read(); }
+
+	virtual socket_state get_state() const override { return next_.get_state(); }
+
+	Next& next() { return next_; }
+
+private:
+	Next& next_;
+};
+
+/**
+ * \brief A rate-limited socket layer.
+ *
+ * This socket layer is a bucket that can be added to a \sa rate_limiter.
+ */
+typedef basic_rate_limited_layer<socket_interface> rate_limited_layer;
+
 /**
  * \brief A compound rate-limited socket layer.
  *
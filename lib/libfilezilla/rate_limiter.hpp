@@ -41,11 +41,19 @@ class rate_limiter;
  * This class implements the timer that periodically adds tokens to buckets.
  * This timer is started and stopped automatically, it does not run when
  * there is no activity to avoid unneeded CPU wakeups.
+ *
+ * In tickless mode, buckets instead refill themselves lazily based on the
+ * time elapsed since they were last accessed, at the rate of their fair share.
+ * The timer then only runs while there is contention, that is while buckets
+ * are waiting for tokens, to recompute the shares and to distribute overflow.
+ * This avoids periodic wakeups while traffic stays below the limits, which
+ * matters if there are many limiters.
  */
 class FZ_PUBLIC_SYMBOL rate_limit_manager final : public event_handler
 {
 public:
 	explicit rate_limit_manager(event_loop & loop);
+	rate_limit_manager(event_loop & loop, bool tickless);
 	virtual ~rate_limit_manager();
 
 	/**
@@ -59,6 +67,9 @@ public:
 	/// Burst tolerance, a multiplier to bucket size, helps achieving the average rate on bursty connections.
 	void set_burst_tolerance(rate::type tolerance);
 
+	/// Whether the timer refilling or, in tickless mode, rebalancing the buckets is currently running.
+	bool timer_running() const;
+
 private:
 	friend class rate_limiter;
 	friend class bucket_base;
@@ -78,6 +89,8 @@ private:
 	std::atomic<timer_id> timer_{};
 
 	std::atomic<rate::type> burst_tolerance_{1};
+
+	bool const tickless_{};
 };
 
 /// Base class for buckets
@@ -208,6 +221,14 @@ public:
 	/// Returns current limit
 	rate::type limit(direction::type const d);
 
+	/**
+	 * \brief Returns the number of buckets wanting more tokens than they got
+	 *
+	 * As determined during the last distribution of tokens, including buckets of
+	 * sub-limiters. A non-zero value indicates that this limiter is saturated.
+	 */
+	size_t waiting_buckets(direction::type const d);
+
 private:
 	friend class bucket_base;
 	friend class rate_limit_manager;
@@ -236,7 +257,7 @@ private:
 
 	struct data_t {
 		rate::type limit_{rate::unlimited};
-		rate::type merged_tokens_;
+		rate::type merged_tokens_{rate::unlimited};
 		rate::type overflow_{};
 		rate::type debt_{};
 		rate::type unused_capacity_{};
@@ -292,12 +313,26 @@ private:
 
 	virtual std::array<rate::type, 2> gather_unspent_for_removal() override;
 
+	/// In tickless mode, adds the tokens accrued since the last refill. Call with the mutex locked.
+	void refill(direction::type const d, monotonic_clock const& now);
+
 	struct data_t {
 		rate::type available_{rate::unlimited};
 		rate::type overflow_multiplier_{1};
 		rate::type bucket_size_{rate::unlimited};
+
+		// Tickless mode: Fair share in octets per second, time of last refill and
+		// tokens lost to a full bucket since the last tick
+		rate::type rate_{};
+		rate::type refill_carry_{};
+		rate::type discarded_{};
+		monotonic_clock last_refill_;
+
 		bool waiting_{};
 		bool unsaturated_{};
+
+		// Tickless mode: Consumer used up all tokens since the last update_stats
+		bool drained_{};
 	} data_[2];
 };
 
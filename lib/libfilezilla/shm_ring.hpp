@@ -0,0 +1,189 @@
+#ifndef LIBFILEZILLA_SHM_RING_HEADER
+#define LIBFILEZILLA_SHM_RING_HEADER
+
+/** \file
+ * \brief A single-producer/single-consumer ring buffer in shared memory
+ */
+
+#include "event_handler.hpp"
+#include "nonowning_buffer.hpp"
+#include "thread_pool.hpp"
+
+#ifndef FZ_WINDOWS
+
+#include <atomic>
+
+namespace fz {
+
+class shm_ring;
+
+/// \private
+struct shm_ring_event_type{};
+
+/**
+ * \brief Sent by \ref shm_ring if the consumer may be able to read, or the producer may be able to write.
+ *
+ * Also sent once the peer has closed its end or its process has gone away.
+ */
+typedef simple_event<shm_ring_event_type, shm_ring*> shm_ring_event;
+
+/**
+ * \brief Moves bulk data between two processes through shared memory
+ *
+ * One process creates the ring, passes it to the other process over a Unix domain
+ * socket and then both map the same memory. One side writes, the other reads.
+ *
+ * Data is handed off without copying: The producer obtains a span of free space
+ * through \ref get_write_buffer, fills it and calls \ref commit. The consumer obtains
+ * the committed data through \ref get_read_buffer and calls \ref release once done with it.
+ * The data area is mapped twice back to back, so spans are contiguous even where
+ * they wrap around the end of the ring.
+ *
+ * Neither side makes system calls while data flows. Only if a span is empty, the side
+ * asks to be notified, and then receives a \ref shm_ring_event once the other side has
+ * committed or released data. Notifications use pipes, which also tell if the peer's
+ * process has gone away without closing its end, e.g. because it crashed.
+ *
+ * The memory is backed by a memfd where available, by an unlinked POSIX shared memory
+ * object otherwise.
+ *
+ * The positions in the shared header are validated before use, a misbehaving peer can
+ * only garble the data, not cause accesses outside the mapping. Once inconsistent
+ * positions are detected, the ring is considered broken: No more data can be
+ * transferred and \ref peer_closed returns true.
+ */
+class FZ_PUBLIC_SYMBOL shm_ring final
+{
+public:
+	enum class role {
+		producer,
+		consumer
+	};
+
+	/**
+	 * \brief Creates a new ring
+	 *
+	 * The capacity gets rounded up to a power of two that is a multiple of the page size.
+	 *
+	 * On failure, returns null and sets error.
+	 */
+	static std::unique_ptr<shm_ring> create(thread_pool & pool, event_handler * handler, size_t capacity, role r, int & error);
+
+	/**
+	 * \brief Sends the ring to the other process
+	 *
+	 * Call once on a ring obtained from \ref create. The peer takes on the opposite role.
+	 *
+	 * The socket must be a blocking Unix domain socket, see \ref send_fd.
+	 */
+	int send(int socket);
+
+	/**
+	 * \brief Receives a ring sent by the other process through \ref send
+	 *
+	 * The socket must be a blocking Unix domain socket.
+	 *
+	 * On failure, returns null and sets error.
+	 */
+	static std::unique_ptr<shm_ring> receive(thread_pool & pool, event_handler * handler, int socket, int & error);
+
+	~shm_ring();
+
+	shm_ring(shm_ring const&) = delete;
+	shm_ring& operator=(shm_ring const&) = delete;
+
+	role get_role() const { return role_; }
+
+	/// The size of the data area
+	size_t capacity() const { return capacity_; }
+
+	/**
+	 * \brief Producer only: Returns the free space
+	 *
+	 * The returned buffer is empty, its capacity is the contiguous free space.
+	 * If there is no free space, wait for a \ref shm_ring_event.
+	 */
+	nonowning_buffer get_write_buffer();
+
+	/**
+	 * \brief Producer only: Makes the first bytes of the free space available to the consumer.
+	 *
+	 * Committing more than the capacity of the buffer last returned by \ref get_write_buffer
+	 * aborts the process.
+	 *
+	 * Returns EPROTO if the ring is broken, 0 otherwise.
+	 */
+	int commit(size_t bytes);
+
+	/**
+	 * \brief Consumer only: Returns the committed data
+	 *
+	 * If the returned buffer is empty, wait for a \ref shm_ring_event.
+	 */
+	nonowning_buffer get_read_buffer();
+
+	/**
+	 * \brief Consumer only: Releases the first bytes of the committed data, making room for the producer.
+	 *
+	 * Releasing more than the size of the buffer last returned by \ref get_read_buffer
+	 * aborts the process.
+	 *
+	 * Returns EPROTO if the ring is broken, 0 otherwise.
+	 */
+	int release(size_t bytes);
+
+	/// Whether the other side has destroyed its end of the ring, its process has gone away, or the ring is broken.
+	bool peer_closed() const;
+
+	/// Whether the peer has left the shared positions in an inconsistent state.
+	bool broken() const;
+
+private:
+	struct header;
+
+	shm_ring(thread_pool & pool, event_handler * handler, role r);
+
+	int map(int fd, bool init);
+	bool start();
+	void entry();
+	void notify();
+	void set_broken();
+
+	role const role_;
+	event_handler * const handler_;
+	thread_pool & pool_;
+
+	header * header_{};
+	uint8_t * data_{};
+	void * mapping_{};
+	size_t mapping_size_{};
+	size_t capacity_{};
+
+	int mem_fd_{-1};
+
+	// wait_fd_ is signalled by the peer, notify_fd_ signals the peer
+	int wait_fd_{-1};
+	int notify_fd_{-1};
+
+	// The peer's counterparts of wait_fd_ and notify_fd_, until sent
+	int peer_wait_fd_{-1};
+	int peer_notify_fd_{-1};
+
+	int quit_fds_[2]{-1, -1};
+	async_task task_;
+
+	std::atomic<bool> signalled_{};
+	std::atomic<bool> peer_gone_{};
+
+	// Size of the span last handed out and not yet committed or released
+	size_t offered_{};
+	bool broken_{};
+};
+
+}
+
+#else
+#error This file is not for Windows
+#endif
+
+#endif
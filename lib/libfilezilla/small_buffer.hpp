@@ -0,0 +1,334 @@
+#ifndef LIBFILEZILLA_SMALL_BUFFER_HEADER
+#define LIBFILEZILLA_SMALL_BUFFER_HEADER
+
+#include "buffer.hpp"
+
+#include <algorithm>
+#include <cstdlib>
+#include <string_view>
+
+#include <string.h>
+
+/** \file
+* \brief Declares fz::small_buffer
+*/
+
+namespace fz {
+
+/**
+ * \brief Like fz::buffer, but with inline storage for up to N bytes.
+ *
+ * As long as the data fits into the inline storage, no memory gets allocated. This
+ * makes it suitable for the many short-lived small buffers, such as protocol replies
+ * or short tokens. Once the data outgrows the inline storage, it spills over into an
+ * fz::buffer and stays there.
+ *
+ * Offers the same get/add/consume/append interface as fz::buffer.
+ *
+ * Converting into an fz::buffer through \ref to_buffer copies at most N bytes, or none
+ * at all when moving out of a spilled small_buffer.
+ */
+template<size_t N>
+class small_buffer final
+{
+	static_assert(N > 0, "small_buffer needs inline storage");
+
+public:
+	typedef unsigned char value_type;
+
+	small_buffer() noexcept = default;
+
+	small_buffer(small_buffer const& op)
+		: heap_(op.heap_)
+		, spilled_(op.spilled_)
+	{
+		if (!spilled_ && op.size_) {
+			memcpy(inline_, op.inline_ + op.pos_, op.size_);
+			size_ = op.size_;
+		}
+	}
+
+	small_buffer(small_buffer && op) noexcept
+		: heap_(std::move(op.heap_))
+		, spilled_(op.spilled_)
+	{
+		if (!spilled_ && op.size_) {
+			memcpy(inline_, op.inline_ + op.pos_, op.size_);
+			size_ = op.size_;
+		}
+		op.clear();
+		op.spilled_ = false;
+	}
+
+	small_buffer& operator=(small_buffer const& op)
+	{
+		if (this != &op) {
+			clear();
+			append(op.get(), op.size());
+		}
+		return *this;
+	}
+
+	small_buffer& operator=(small_buffer && op) noexcept
+	{
+		if (this != &op) {
+			heap_ = std::move(op.heap_);
+			spilled_ = op.spilled_;
+			pos_ = 0;
+			size_ = 0;
+			if (!spilled_ && op.size_) {
+				memcpy(inline_, op.inline_ + op.pos_, op.size_);
+				size_ = op.size_;
+			}
+			op.clear();
+			op.spilled_ = false;
+		}
+		return *this;
+	}
+
+	/// Undefined if buffer is empty
+	unsigned char const* get() const { return spilled_ ? heap_.get() : (inline_ + pos_); }
+	unsigned char* get() { return spilled_ ? heap_.get() : (inline_ + pos_); }
+
+	/// Same as get()
+	unsigned char* data() { return get(); }
+
+	/// \brief Returns a writable buffer guaranteed to be large enough for write_size bytes, call add when done.
+	/// \sa buffer::get(size_t)
+	unsigned char* get(size_t write_size)
+	{
+		if (!spilled_) {
+			if (N - pos_ - size_ >= write_size) {
+				return inline_ + pos_ + size_;
+			}
+			if (N - size_ >= write_size) {
+				memmove(inline_, inline_ + pos_, size_);
+				pos_ = 0;
+				return inline_ + size_;
+			}
+			spill(write_size);
+		}
+		return heap_.get(write_size);
+	}
+
+	/// Increase size by the passed amount. Call this after having obtained a writable buffer with get(size_t write_size)
+	void add(size_t added)
+	{
+		if (spilled_) {
+			heap_.add(added);
+		}
+		else {
+			if (N - pos_ - size_ < added) {
+				std::abort();
+			}
+			size_ += added;
+		}
+	}
+
+	/// \brief Overload of add for signed types, only adds if value is positive.
+	template<typename T, std::enable_if_t<std::is_signed_v<T>, int> = 0>
+	void add(T added) {
+		if (added > 0) {
+			add(static_cast<size_t>(added));
+		}
+	}
+
+	/** \brief Removes consumed bytes from the beginning of the buffer.
+	 *
+	 * Undefined if consumed > size()
+	 */
+	void consume(size_t consumed)
+	{
+		if (spilled_) {
+			heap_.consume(consumed);
+		}
+		else {
+			if (consumed > size_) {
+				std::abort();
+			}
+			size_ -= consumed;
+			pos_ = size_ ? (pos_ + consumed) : 0;
+		}
+	}
+
+	size_t size() const { return spilled_ ? heap_.size() : size_; }
+
+	/**
+	 * Does not release the memory.
+	 */
+	void clear()
+	{
+		heap_.clear();
+		pos_ = 0;
+		size_ = 0;
+	}
+
+	/** \brief Appends the passed data to the buffer.
+	 *
+	 * The data may point into the buffer itself.
+	 */
+	void append(unsigned char const* data, size_t len)
+	{
+		if (spilled_) {
+			heap_.append(data, len);
+			return;
+		}
+
+		if (N - pos_ - size_ < len) {
+			if (N - size_ >= len) {
+				// Also offset data in case of self-assignment
+				if (data >= inline_ + pos_ && data < inline_ + pos_ + size_) {
+					data -= pos_;
+				}
+				memmove(inline_, inline_ + pos_, size_);
+				pos_ = 0;
+			}
+			else {
+				// The inline storage remains untouched, data stays valid even if it points into it
+				spill(len);
+				heap_.append(data, len);
+				return;
+			}
+		}
+
+		if (len) {
+			memcpy(inline_ + pos_ + size_, data, len);
+			size_ += len;
+		}
+	}
+	void append(std::string_view const& str) { append(reinterpret_cast<unsigned char const*>(str.data()), str.size()); }
+	void append(std::vector<uint8_t> const& data) { append(reinterpret_cast<unsigned char const*>(data.data()), data.size()); }
+	void append(fz::buffer const& b) { append(b.get(), b.size()); }
+	void append(unsigned char v) { append(&v, 1); }
+	void append(size_t len, unsigned char c)
+	{
+		memset(get(len), c, len);
+		add(len);
+	}
+
+	small_buffer& operator+=(unsigned char v) {
+		append(v);
+		return *this;
+	}
+	small_buffer& operator+=(std::string_view const& str) {
+		append(str);
+		return *this;
+	}
+	small_buffer& operator+=(std::vector<uint8_t> const& data) {
+		append(data);
+		return *this;
+	}
+	small_buffer& operator+=(fz::buffer const& b) {
+		append(b);
+		return *this;
+	}
+
+	bool empty() const { return size() == 0; }
+	explicit operator bool() const {
+		return size() != 0;
+	}
+
+	size_t capacity() const { return spilled_ ? heap_.capacity() : N; }
+
+	/// Whether the data has outgrown the inline storage
+	bool spilled() const { return spilled_; }
+
+	void reserve(size_t capacity)
+	{
+		if (spilled_) {
+			heap_.reserve(capacity);
+		}
+		else if (capacity > N) {
+			spill(capacity - size_);
+		}
+	}
+
+	void resize(size_t size)
+	{
+		if (spilled_) {
+			heap_.resize(size);
+		}
+		else if (size <= size_) {
+			size_ = size;
+			if (!size_) {
+				pos_ = 0;
+			}
+		}
+		else {
+			append(size - size_, 0);
+		}
+	}
+
+	/// Gets element at offset i. Does not do bounds checking
+	unsigned char operator[](size_t i) const { return get()[i]; }
+	unsigned char & operator[](size_t i) { return get()[i]; }
+
+	std::string_view to_view() const
+	{
+		if (empty()) {
+			return {};
+		}
+		return {reinterpret_cast<char const*>(get()), size()};
+	}
+
+	bool operator==(std::string_view const& rhs) const { return to_view() == rhs; }
+	bool operator==(fz::buffer const& rhs) const { return to_view() == rhs.to_view(); }
+	template<size_t M>
+	bool operator==(small_buffer<M> const& rhs) const { return to_view() == rhs.to_view(); }
+
+	template<typename T>
+	bool operator!=(T const& rhs) const { return !(*this == rhs); }
+
+	/// Returns a copy of the data as fz::buffer
+	fz::buffer to_buffer() const&
+	{
+		if (spilled_) {
+			return heap_;
+		}
+		fz::buffer ret;
+		if (size_) {
+			ret.append(inline_ + pos_, size_);
+		}
+		return ret;
+	}
+
+	/// Moves the data into an fz::buffer, without copying if spilled. Leaves this buffer empty.
+	fz::buffer to_buffer() &&
+	{
+		fz::buffer ret;
+		if (spilled_) {
+			ret = std::move(heap_);
+			spilled_ = false;
+		}
+		else if (size_) {
+			ret.append(inline_ + pos_, size_);
+		}
+		clear();
+		return ret;
+	}
+
+private:
+	void spill(size_t write_size)
+	{
+		heap_.reserve(std::max(N * 2, size_ + write_size));
+		if (size_) {
+			heap_.append(inline_ + pos_, size_);
+		}
+		spilled_ = true;
+		pos_ = 0;
+		size_ = 0;
+	}
+
+	// Only used while not spilled.
+	// Invariants: pos_ + size_ <= N
+	unsigned char inline_[N];
+	size_t pos_{};
+	size_t size_{};
+
+	fz::buffer heap_;
+	bool spilled_{};
+};
+
+}
+
+#endif
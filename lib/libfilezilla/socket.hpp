@@ -25,7 +25,10 @@ class thread_pool;
 
 /** \brief The type of a socket event
  *
- * In received events, exactly a single bit is always set.
+ * In received events, exactly a single bit is always set, unless
+ * coalescing of readiness events has been requested through
+ * \ref fz::socket::set_event_handler, in which case read and write can be
+ * received together.
  *
  * Flag combinations are used when changing event handlers,
  * \sa f::socket::set_event_handler
@@ -270,6 +273,13 @@ public:
 
 	explicit operator bool() const { return fd_ != -1; }
 
+	/**
+	 * \brief Returns the IP address of the connected peer
+	 *
+	 * Allows deciding on accepted connections before creating a socket from the descriptor.
+	 */
+	std::string peer_ip(bool strip_zone_index = false) const;
+
 private:
 	socket_base::socket_t fd_{-1};
 };
@@ -534,6 +544,15 @@ public:
 	 */
 	int ideal_send_buffer_size();
 
+	/**
+	 * On a connected socket, gets the smoothed round-trip time in
+	 * microseconds as estimated by the operating system, or -1 if it
+	 * cannot be determined.
+	 *
+	 * Currently only implemented on platforms supporting TCP_INFO.
+	 */
+	int round_trip_time();
+
 	virtual int shutdown() override;
 
 	/**
@@ -550,6 +569,22 @@ public:
 	 */
 	virtual void set_event_handler(event_handler* pEvtHandler, fz::socket_event_flag retrigger_block = fz::socket_event_flag{}) override;
 
+	/**
+	 * \brief Changes the associated event handler, optionally coalescing readiness events.
+	 *
+	 * Same as the other overload, but if coalesce_events is set, the socket becoming readable
+	 * and writable at the same time results in a single event with both the read and write
+	 * flags set, instead of two separate events. The handler must be prepared to handle such
+	 * combined flags.
+	 *
+	 * Changing the handler again through the other overload disables coalescing.
+	 *
+	 * This is not part of \ref socket_interface: Layers stacked on top of the socket always
+	 * set their handler through the other overload, so coalescing only applies if the handler
+	 * is attached to a bare socket.
+	 */
+	void set_event_handler(event_handler* pEvtHandler, fz::socket_event_flag retrigger_block, bool coalesce_events);
+
 	enum
 	{
 		/// flag_nodelay disables Nagle's algorithm
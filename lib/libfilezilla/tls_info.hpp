@@ -7,13 +7,23 @@
 
 #include "time.hpp"
 
+#include <memory>
+
 namespace fz {
 class logger_interface;
 
+/// \private
+class x509_certificate_fields;
+
 /**
  * \brief Represents all relevant information of a X.509 certificate as used by TLS.
+ *
+ * Certificates obtained through \ref load_certificates and \ref load_certificates_file
+ * extract fingerprints, subject, issuer and alternative subject names only on first use.
+ * Copies share the extracted fields. Concurrently accessing the same certificate from
+ * multiple threads is safe.
  */
-class x509_certificate final
+class FZ_PUBLIC_SYMBOL x509_certificate final
 {
 public:
 	/// A subject name, typically a DNS hostname
@@ -76,22 +86,22 @@ public:
 	std::string const& get_signature_algorithm() const { return signalgoname_; }
 
 	/// Gets fingerprint as hex-encoded sha256
-	std::string const& get_fingerprint_sha256() const { return fingerprint_sha256_; }
+	std::string const& get_fingerprint_sha256() const;
 
 	/// Gets fingerprint as hex-encoded sha1
-	std::string const& get_fingerprint_sha1() const { return fingerprint_sha1_; }
+	std::string const& get_fingerprint_sha1() const;
 
 	/** \brief Gets the subject of the certificate as RDN as described in RFC4514
 	 *
 	 * Never use the CN field to compare it against a hostname, that's what the SANs are for.
 	 */
-	std::string const& get_subject() const { return subject_; }
+	std::string const& get_subject() const;
 
 	/// Gets the issuer of the certificate as RDN as described in RFC4514
-	std::string const& get_issuer() const { return issuer_; }
+	std::string const& get_issuer() const;
 
 	/// Gets the alternative subject names (SANSs) of the certificated, usually hostnames
-	std::vector<subject_name> const& get_alt_subject_names() const { return alt_subject_names_; }
+	std::vector<subject_name> const& get_alt_subject_names() const;
 
 	explicit operator bool() const { return !raw_cert_.empty(); }
 
@@ -119,6 +129,11 @@ private:
 	std::vector<subject_name> alt_subject_names_;
 
 	bool self_signed_{};
+
+	friend class tls_layer_impl;
+
+	// If set, the fields above extracted on first use are taken from here instead.
+	std::shared_ptr<x509_certificate_fields> deferred_;
 };
 
 /**
@@ -6,14 +6,22 @@
  */
 
 #include "socket.hpp"
+#include "time.hpp"
+#include "tls_metrics.hpp"
+
+#include <functional>
 
 namespace fz {
+class buffer_pool;
+class memory_budget;
 class logger_interface;
+class ocsp_stapler;
 class tls_system_trust_store;
 class tls_session_info;
 
 class tls_layer;
 class tls_layer_impl;
+class tls_anti_replay_impl;
 
 struct certificate_verification_event_type;
 
@@ -46,6 +54,54 @@ inline tls_server_flags operator|(tls_server_flags lhs, tls_server_flags rhs) {
 	return static_cast<tls_server_flags>(static_cast<std::underlying_type_t<tls_server_flags>>(lhs) | static_cast<std::underlying_type_t<tls_server_flags>>(rhs));
 }
 
+/// Type of private keys to generate
+enum class tls_key_type
+{
+	/// ECDSA using the NIST P-256 curve, fast to generate and widely supported
+	ecdsa_p256,
+
+	/// ECDSA using the NIST P-384 curve
+	ecdsa_p384,
+
+	/// Ed25519, fastest to generate, but not supported by all peers
+	ed25519,
+
+	/// 3072 bit RSA, very slow to generate. Only use it if peers do not support anything else.
+	rsa
+};
+
+/**
+ * \brief Replay protection for TLS 1.3 early data
+ *
+ * Early data sent by clients as part of a resumed session is not protected against replay
+ * by TLS itself. This class remembers the ClientHello messages carrying early data seen
+ * within the given time window and rejects the early data of duplicates. Early data that is
+ * rejected still gets delivered by the client once the handshake has completed.
+ *
+ * By default ClientHellos are remembered in memory. If multiple servers share session tickets,
+ * a store function can be passed to use a shared database instead. It gets passed a key
+ * identifying the ClientHello and the time after which the key may be forgotten, and
+ * must return false if the key has been stored before.
+ *
+ * This class is thread-safe and can be passed concurrently to multiple instances of
+ * \ref fz::tls_layer. It must outlive all layers using it.
+ */
+class FZ_PUBLIC_SYMBOL tls_anti_replay final
+{
+public:
+	typedef std::function<bool(std::vector<uint8_t> const& key, datetime const& expiration)> store_function;
+
+	explicit tls_anti_replay(duration const& window = duration::from_seconds(10), store_function const& store = store_function());
+	~tls_anti_replay();
+
+	tls_anti_replay(tls_anti_replay const&) = delete;
+	tls_anti_replay& operator=(tls_anti_replay const&) = delete;
+
+private:
+	friend class tls_layer;
+	friend class tls_layer_impl;
+	std::unique_ptr<tls_anti_replay_impl> impl_;
+};
 
 /**
  * \brief A Transport Layer Security (TLS) layer
@@ -113,6 +169,35 @@ public:
 	 */
 	bool server_handshake(std::vector<uint8_t> const& session_to_resume = {}, std::string_view const& preamble = {}, tls_server_flags flags = {});
 
+	/**
+	 * \brief Sets data for the client to send as TLS 1.3 early data (0-RTT)
+	 *
+	 * Must be called before \ref client_handshake. If the resumed session permits early data,
+	 * the data is sent along with the first handshake message, saving a round trip.
+	 *
+	 * If the server does not accept the early data, e.g. if the session cannot be resumed,
+	 * the data is sent once the handshake has completed. Either way, the data is sent before
+	 * anything passed to \ref write. Use \ref early_data_accepted after receiving the
+	 * connection event to find out which one was the case.
+	 *
+	 * Early data can be replayed by attackers, only send idempotent requests.
+	 */
+	bool set_early_data(std::string_view const& data);
+
+	/**
+	 * \brief Allows the server to accept TLS 1.3 early data (0-RTT)
+	 *
+	 * Must be called before \ref server_handshake, both for the session that issues session
+	 * tickets and for the sessions resuming them.
+	 *
+	 * Clients can send up to max_size bytes of early data. It is delivered through \ref read,
+	 * possibly before the connection event is sent.
+	 */
+	bool set_early_data_limit(uint32_t max_size, tls_anti_replay & anti_replay);
+
+	/// After a successful handshake, returns whether early data has been sent and accepted.
+	bool early_data_accepted() const;
+
 	/// Gets session parameters for resumption
 	std::vector<uint8_t> get_session_parameters() const;
 
@@ -169,9 +254,21 @@ public:
 	 * If the password is non-empty, the private key gets encrypted using it.
 	 *
 	 * The output pair is in PEM, first element is the key and the second the certificate.
+	 *
+	 * Generating keys can take a while, in particular for RSA. See \ref fz::certificate_generator
+	 * to create certificates without blocking the calling thread.
+	 *
+	 * Creates an ECDSA P-256 key unless a different key type is passed.
 	 */
 	static std::pair<std::string, std::string> generate_selfsigned_certificate(native_string const& password, std::string const& distinguished_name, std::vector<std::string> const& hostnames);
+	static std::pair<std::string, std::string> generate_selfsigned_certificate(native_string const& password, std::string const& distinguished_name, std::vector<std::string> const& hostnames, tls_key_type key_type);
+
+	/** \brief Creates a new private key and a certificate signing request.
+	 *
+	 * Like \ref generate_selfsigned_certificate, but the second element of the pair is the CSR, in DER if csr_as_pem is false.
+	 */
 	static std::pair<std::string, std::string> generate_csr(native_string const& password, std::string const& distinguished_name, std::vector<std::string> const& hostnames, bool csr_as_pem = true);
+	static std::pair<std::string, std::string> generate_csr(native_string const& password, std::string const& distinguished_name, std::vector<std::string> const& hostnames, bool csr_as_pem, tls_key_type key_type);
 
 	/** \brief Negotiate application protocol
 	 *
@@ -201,9 +298,51 @@ public:
 	/// After a successful handshake, returns which protocol, if any, has been negotiated
 	std::string get_alpn() const;
 
+	/** \brief Staple OCSP responses cached by the passed \ref ocsp_stapler
+	 *
+	 * If running as server and the client requests the certificate status, the
+	 * response cached for the server certificate is sent along with the certificate.
+	 * If there is no valid response cached, no status is sent.
+	 *
+	 * Needs to be called prior to handshaking. The stapler must outlive the layer.
+	 */
+	void set_ocsp_stapler(ocsp_stapler * stapler);
+
+	/// If running as client, returns the OCSP response stapled by the server, if any.
+	std::vector<uint8_t> get_stapled_ocsp_response() const;
+
 	/// If running as server, get the SNI sent by the client
 	native_string get_hostname() const;
 
+	/** \brief Borrow staging buffers from the passed pool
+	 *
+	 * By default, each layer keeps its own buffers for data that cannot be passed on immediately,
+	 * and keeps their memory for the lifetime of the layer. With a pool, buffers are acquired when
+	 * data needs to be staged and released as soon as they have been drained, so idle connections
+	 * do not hold on to any buffer memory.
+	 *
+	 * Needs to be called prior to handshaking. The pool must outlive the layer.
+	 */
+	bool set_buffer_pool(buffer_pool * pool);
+
+	/** \brief Account staging buffers to the passed budget and stop reading while it is under pressure
+	 *
+	 * Data already decrypted can still be read while under pressure. Once the pressure subsides,
+	 * a read event is sent.
+	 *
+	 * Needs to be called prior to handshaking. The budget must outlive the layer.
+	 */
+	bool set_memory_budget(memory_budget * budget);
+
+	/// Returns the counters of this layer, see \ref tls_statistics.
+	tls_statistics get_statistics() const;
+
+	/** \brief Aggregate the counters of this layer into the passed metrics
+	 *
+	 * Counters accumulated so far are added to the previous metrics, if any. The metrics must outlive the layer.
+	 */
+	void set_metrics(tls_metrics * metrics);
+
 	bool is_server() const;
 
 	/** \brief If running as server with TLS1.3, send out a new session ticket before the next data payload.
@@ -239,6 +378,18 @@ public:
 	virtual int read(void *buffer, unsigned int size, int& error) override;
 	virtual int write(void const* buffer, unsigned int size, int& error) override;
 
+	/**
+	 * \brief Reads the decrypted payload of the next TLS record without copying it
+	 *
+	 * Instead of copying the data into a caller-supplied buffer, the data is decrypted in place
+	 * and a view of it is returned. The view remains valid until the next call to \ref read,
+	 * \ref read_record or until the layer is destroyed.
+	 *
+	 * Like \ref read, returns the size of the view, 0 on EOF, or -1 with error set. Both
+	 * functions can be mixed freely.
+	 */
+	int read_record(std::basic_string_view<uint8_t> & data, int& error);
+
 	virtual int shutdown() override;
 
 	virtual int shutdown_read() override;
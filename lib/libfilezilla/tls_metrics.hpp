@@ -0,0 +1,72 @@
+#ifndef LIBFILEZILLA_TLS_METRICS_HEADER
+#define LIBFILEZILLA_TLS_METRICS_HEADER
+
+/** \file
+ * \brief Counters describing the cost of TLS connections
+ */
+
+#include "mutex.hpp"
+#include "time.hpp"
+
+namespace fz {
+
+/// Counters of a single \ref tls_layer or, aggregated, of many.
+struct FZ_PUBLIC_SYMBOL tls_statistics final
+{
+	/// Number of handshakes that have completed
+	uint64_t handshakes{};
+
+	/// Number of completed handshakes that resumed a previous session
+	uint64_t resumed_handshakes{};
+
+	/// Number of handshakes that failed or got aborted
+	uint64_t failed_handshakes{};
+
+	/// Time from starting until completing the handshakes, including network latency
+	duration handshake_time;
+
+	/// Time spent inside GnuTLS, which includes passing data from and to the next layer.
+	duration gnutls_time;
+
+	/// Payload bytes encrypted and passed to the next layer
+	uint64_t bytes_encrypted{};
+
+	/// Payload bytes decrypted from records read from the next layer
+	uint64_t bytes_decrypted{};
+
+	uint64_t records_sent{};
+	uint64_t records_received{};
+
+	tls_statistics& operator+=(tls_statistics const& op);
+};
+
+/**
+ * \brief Aggregates the statistics of many \ref tls_layer instances
+ *
+ * Pass it to \ref tls_layer::set_metrics. Layers accumulate their counters locally and
+ * add them to the metrics whenever a handshake finishes, at regular intervals of records
+ * processed, and once the layer is closed or destroyed.
+ *
+ * This class is thread-safe. It must outlive all layers using it.
+ */
+class FZ_PUBLIC_SYMBOL tls_metrics final
+{
+public:
+	void add(tls_statistics const& stats);
+
+	tls_statistics get() const;
+
+	/// Returns the aggregated statistics and resets them
+	tls_statistics reset();
+
+	/// Fraction of completed handshakes that resumed a session, 0 if there have been none.
+	double resumption_rate() const;
+
+private:
+	mutable mutex mtx_{false};
+	tls_statistics stats_;
+};
+
+}
+
+#endif
@@ -17,6 +17,8 @@
 #include <utime.h>
 #endif
 
+#include <algorithm>
+
 namespace fz {
 
 namespace {
@@ -1120,48 +1122,124 @@ result remove_dir(native_string const& absolute_path)
 
 #ifndef FZ_WINDOWS
 namespace {
-static result do_copy(native_string const& source, native_string const& dest, bool & dest_opened)
+result io_error(int err)
 {
-	fz::file in(source, fz::file::reading, fz::file::existing);
+	switch (err) {
+	case EPERM:
+	case EACCES:
+		return {result::noperm, err};
+	case ENOSPC:
+	case EDQUOT:
+		return {result::nospace, err};
+	default:
+		return {result::other, err};
+	}
+}
 
-	if (!in.opened()) {
-		// TODO error codes
-		return {result::other};
+// Copies the range [offset, end), or up to the end of the file if end is -1
+result copy_range(file & in, file & out, int64_t offset, int64_t end, buffer & buf)
+{
+	if (in.seek(offset, file::begin) != offset || out.seek(offset, file::begin) != offset) {
+		return io_error(errno);
 	}
 
-	fz::file out(dest, fz::file::writing, fz::file::empty);
-	if (!out.opened()) {
-		// TODO error codes
-		return {result::other};
+	while (end == -1 || offset < end) {
+		size_t chunk = 256 * 1024;
+		if (end != -1 && static_cast<uint64_t>(end - offset) < chunk) {
+			chunk = static_cast<size_t>(end - offset);
+		}
+
+		auto read = in.read(buf.get(chunk), static_cast<int64_t>(chunk));
+		if (read < 0) {
+			return io_error(errno);
+		}
+		if (!read) {
+			// Source might have been truncated in the meantime
+			break;
+		}
+		buf.add(read);
+		offset += read;
+
+		while (!buf.empty()) {
+			auto written = out.write(buf.get(), static_cast<int64_t>(buf.size()));
+			if (written <= 0) {
+				return io_error(errno);
+			}
+			buf.consume(static_cast<size_t>(written));
+		}
+	}
+
+	return {result::ok};
+}
+
+result do_copy(native_string const& source, native_string const& dest, bool & dest_opened)
+{
+	file in;
+	auto res = in.open(source, file::reading, file::existing);
+	if (!res) {
+		return res;
+	}
+
+	file out;
+	res = out.open(dest, file::writing, file::empty);
+	if (!res) {
+		return res;
 	}
 
 	dest_opened = true;
 
-	fz::buffer buffer;
-	while (true) {
-		if (buffer.empty()) {
-			auto read = in.read(buffer.get(64 * 1024), 64 * 1024);
-			if (read < 0) {
-				return {result::other};
+	buffer buf;
+	bool sparse{};
+
+#ifdef SEEK_DATA
+	// Only copy the data extents, seeking over holes recreates them in the copy.
+	int64_t const size = in.size();
+	if (size > 0) {
+		sparse = true;
+		int64_t pos = 0;
+		while (pos < size) {
+			off_t const data = lseek(in.fd(), static_cast<off_t>(pos), SEEK_DATA);
+			if (data == -1) {
+				int const err = errno;
+				if (err == ENXIO) {
+					// Only a hole remains
+					break;
+				}
+				if (!pos && err == EINVAL) {
+					// Not supported by the filesystem
+					sparse = false;
+					break;
+				}
+				return io_error(err);
 			}
-			else if (read) {
-				buffer.add(read);
+			off_t const hole = lseek(in.fd(), data, SEEK_HOLE);
+			if (hole == -1) {
+				return io_error(errno);
 			}
-			else {
-				if (buffer.empty()) {
-					return {result::ok};
-				}
+
+			res = copy_range(in, out, data, std::min(static_cast<int64_t>(hole), size), buf);
+			if (!res) {
+				return res;
 			}
+			pos = hole;
 		}
-		auto written = out.write(buffer.get(), buffer.size());
-		if (written <= 0) {
-			return {result::other};
+
+		// Trailing hole
+		if (sparse && (out.seek(size, file::begin) != size || !out.truncate())) {
+			return io_error(errno);
 		}
+	}
+#endif
 
-		buffer.consume(written);
+	if (!sparse) {
+		res = copy_range(in, out, 0, -1, buf);
+		if (!res) {
+			return res;
+		}
 	}
+
 	if (!out.fsync()) {
-		return {result::other};
+		return io_error(errno);
 	}
 
 	return {result::ok};
@@ -1169,6 +1247,36 @@ static result do_copy(native_string const& source, native_string const& dest, bo
 }
 #endif
 
+result copy_file(native_string const& source, native_string const& dest)
+{
+#ifdef FZ_WINDOWS
+	if (CopyFileW(source.c_str(), dest.c_str(), FALSE)) {
+		return {result::ok};
+	}
+
+	DWORD const err = GetLastError();
+	switch (err) {
+		case ERROR_FILE_NOT_FOUND:
+			return {result::nofile, err};
+		case ERROR_PATH_NOT_FOUND:
+			return {result::nodir, err};
+		case ERROR_ACCESS_DENIED:
+			return {result::noperm, err};
+		case ERROR_DISK_FULL:
+			return {result::nospace, err};
+		default:
+			return {result::other, err};
+	}
+#else
+	bool dest_opened{};
+	auto ret = do_copy(source, dest, dest_opened);
+	if (!ret && dest_opened) {
+		unlink(dest.c_str());
+	}
+	return ret;
+#endif
+}
+
 result rename_file(native_string const& source, native_string const& dest, bool allow_copy)
 {
 #ifdef FZ_WINDOWS
@@ -1186,7 +1294,7 @@ result rename_file(native_string const& source, native_string const& dest, bool
 		case ERROR_FILE_NOT_FOUND:
 			return {result::nofile, err};
 		case ERROR_PATH_NOT_FOUND:
-		return {result::nodir, err};
+			return {result::nodir, err};
 		case ERROR_ACCESS_DENIED:
 			return {result::noperm, err};
 		case ERROR_DISK_FULL:
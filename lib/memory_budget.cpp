@@ -0,0 +1,140 @@
+#include "libfilezilla/memory_budget.hpp"
+
+#include <algorithm>
+
+namespace fz {
+
+namespace {
+size_t low_watermark(size_t limit)
+{
+	return limit - limit / 8;
+}
+}
+
+memory_budget::memory_budget(size_t limit)
+	: limit_(limit)
+{
+}
+
+void memory_budget::set_limit(size_t limit)
+{
+	limit_ = limit;
+	if (usage_ > limit) {
+		if (!pressure_.exchange(true) && usage_ <= low_watermark(limit)) {
+			relieve();
+		}
+	}
+	else if (pressure_) {
+		relieve();
+	}
+}
+
+void memory_budget::charge(size_t bytes, memory_category::type c)
+{
+	if (!bytes) {
+		return;
+	}
+	if (c < memory_category::count) {
+		categories_[c] += bytes;
+	}
+	size_t const usage = usage_.fetch_add(bytes) + bytes;
+	if (usage > limit_ && !pressure_.exchange(true)) {
+		// A concurrent release may have dropped the usage below the low watermark
+		// before the pressure flag was set, without relieving anything.
+		if (usage_ <= low_watermark(limit_)) {
+			relieve();
+		}
+	}
+}
+
+void memory_budget::release(size_t bytes, memory_category::type c)
+{
+	if (!bytes) {
+		return;
+	}
+	if (c < memory_category::count) {
+		categories_[c] -= bytes;
+	}
+	size_t const usage = usage_.fetch_sub(bytes) - bytes;
+	if (pressure_ && usage <= low_watermark(limit_)) {
+		relieve();
+	}
+}
+
+size_t memory_budget::usage(memory_category::type c) const
+{
+	if (c >= memory_category::count) {
+		return 0;
+	}
+	return categories_[c];
+}
+
+void memory_budget::relieve()
+{
+	scoped_lock l(mtx_);
+
+	// Concurrent charges may have pushed the usage up again
+	if (usage_ > low_watermark(limit_) || !pressure_.exchange(false)) {
+		return;
+	}
+
+	auto waiters = std::move(waiters_);
+	waiters_.clear();
+	for (auto * w : waiters) {
+		w->on_memory_relief();
+	}
+}
+
+bool memory_budget::wait(memory_waiter & w)
+{
+	scoped_lock l(mtx_);
+	if (!pressure_) {
+		return false;
+	}
+	if (std::find(waiters_.cbegin(), waiters_.cend(), &w) == waiters_.cend()) {
+		waiters_.push_back(&w);
+	}
+	return true;
+}
+
+void memory_budget::remove_waiter(memory_waiter & w)
+{
+	scoped_lock l(mtx_);
+	waiters_.erase(std::remove(waiters_.begin(), waiters_.end(), &w), waiters_.end());
+}
+
+memory_charge::memory_charge(memory_charge && op) noexcept
+	: budget_(op.budget_)
+	, category_(op.category_)
+	, charged_(op.charged_)
+{
+	op.charged_ = 0;
+}
+
+memory_charge& memory_charge::operator=(memory_charge && op) noexcept
+{
+	if (this != &op) {
+		update(0);
+		budget_ = op.budget_;
+		category_ = op.category_;
+		charged_ = op.charged_;
+		op.charged_ = 0;
+	}
+	return *this;
+}
+
+void memory_charge::update(size_t bytes)
+{
+	if (!budget_ || bytes == charged_) {
+		return;
+	}
+	if (bytes > charged_) {
+		budget_->charge(bytes - charged_, category_);
+	}
+	else {
+		budget_->release(charged_ - bytes, category_);
+	}
+	charged_ = bytes;
+}
+
+}
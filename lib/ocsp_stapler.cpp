@@ -0,0 +1,379 @@
+#include "libfilezilla/ocsp_stapler.hpp"
+#include "libfilezilla/logger.hpp"
+#include "libfilezilla/thread_pool.hpp"
+#include "libfilezilla/translate.hpp"
+
+#include "tls_layer_impl.hpp"
+
+#include <gnutls/ocsp.h>
+
+#include <map>
+#include <tuple>
+
+namespace fz {
+
+namespace {
+// Retry interval after failed fetches
+duration const retry_interval = duration::from_minutes(1);
+
+gnutls_datum_t to_datum(std::vector<uint8_t> const& in)
+{
+	gnutls_datum_t d;
+	d.data = const_cast<unsigned char*>(in.data());
+	d.size = static_cast<unsigned int>(in.size());
+	return d;
+}
+
+struct crt_holder final
+{
+	crt_holder() = default;
+	~crt_holder() {
+		if (crt) {
+			gnutls_x509_crt_deinit(crt);
+		}
+	}
+
+	crt_holder(crt_holder const&) = delete;
+	crt_holder& operator=(crt_holder const&) = delete;
+
+	bool import(std::vector<uint8_t> const& der) {
+		if (gnutls_x509_crt_init(&crt) != GNUTLS_E_SUCCESS) {
+			crt = nullptr;
+			return false;
+		}
+		auto d = to_datum(der);
+		return gnutls_x509_crt_import(crt, &d, GNUTLS_X509_FMT_DER) == GNUTLS_E_SUCCESS;
+	}
+
+	gnutls_x509_crt_t crt{};
+};
+
+std::vector<uint8_t> export_der(gnutls_x509_crt_t crt)
+{
+	std::vector<uint8_t> ret;
+
+	gnutls_datum_t d{};
+	if (gnutls_x509_crt_export2(crt, GNUTLS_X509_FMT_DER, &d) == GNUTLS_E_SUCCESS) {
+		ret.assign(d.data, d.data + d.size);
+	}
+	gnutls_free(d.data);
+
+	return ret;
+}
+
+std::string get_responder_url(gnutls_x509_crt_t crt)
+{
+	std::string ret;
+
+	for (unsigned int seq = 0; ret.empty(); ++seq) {
+		gnutls_datum_t d{};
+		int res = gnutls_x509_crt_get_authority_info_access(crt, seq, GNUTLS_IA_OCSP_URI, &d, nullptr);
+		if (res == GNUTLS_E_UNKNOWN_ALGORITHM) {
+			// Different access method
+			continue;
+		}
+		else if (res < 0) {
+			break;
+		}
+		ret.assign(d.data, d.data + d.size);
+		gnutls_free(d.data);
+	}
+
+	return ret;
+}
+
+std::vector<uint8_t> create_request(gnutls_x509_crt_t crt, gnutls_x509_crt_t issuer)
+{
+	std::vector<uint8_t> ret;
+
+	gnutls_ocsp_req_t req{};
+	if (gnutls_ocsp_req_init(&req) != GNUTLS_E_SUCCESS) {
+		return ret;
+	}
+
+	if (gnutls_ocsp_req_add_cert(req, GNUTLS_DIG_SHA1, issuer, crt) == GNUTLS_E_SUCCESS) {
+		gnutls_datum_t d{};
+		if (gnutls_ocsp_req_export(req, &d) == GNUTLS_E_SUCCESS) {
+			ret.assign(d.data, d.data + d.size);
+		}
+		gnutls_free(d.data);
+	}
+
+	gnutls_ocsp_req_deinit(req);
+	return ret;
+}
+}
+
+class ocsp_stapler_impl final
+{
+public:
+	ocsp_stapler_impl(thread_pool & pool, ocsp_stapler::fetch_function const& fetch, logger_interface & logger, duration const& refresh_interval);
+	~ocsp_stapler_impl();
+
+	void run();
+
+	// Checks the response, returns expiration and when to refresh it
+	std::tuple<bool, datetime, duration> check_response(std::vector<uint8_t> const& cert, std::vector<uint8_t> const& issuer, std::vector<uint8_t> const& response);
+
+	struct entry final
+	{
+		std::string url_;
+		std::vector<uint8_t> request_;
+
+		// DER of the issuer, the response needs to be signed by it or a responder it delegated to
+		std::vector<uint8_t> issuer_;
+
+		std::vector<uint8_t> response_;
+		datetime expiration_;
+
+		monotonic_clock next_fetch_;
+	};
+
+	ocsp_stapler::fetch_function const fetch_;
+	logger_interface & logger_;
+	duration const refresh_interval_;
+
+	mutable mutex mtx_{false};
+	condition cond_;
+
+	// Keyed by DER of the certificate
+	std::map<std::vector<uint8_t>, entry> entries_;
+
+	bool quit_{};
+	async_task task_;
+};
+
+ocsp_stapler_impl::ocsp_stapler_impl(thread_pool & pool, ocsp_stapler::fetch_function const& fetch, logger_interface & logger, duration const& refresh_interval)
+	: fetch_(fetch)
+	, logger_(logger)
+	, refresh_interval_(refresh_interval)
+{
+	if (fetch_) {
+		task_ = pool.spawn([this]() { run(); });
+	}
+}
+
+ocsp_stapler_impl::~ocsp_stapler_impl()
+{
+	{
+		scoped_lock l(mtx_);
+		quit_ = true;
+		cond_.signal(l);
+	}
+	task_.join();
+}
+
+void ocsp_stapler_impl::run()
+{
+	scoped_lock l(mtx_);
+	while (!quit_) {
+		auto const now = monotonic_clock::now();
+
+		monotonic_clock next;
+		auto it = entries_.begin();
+		for (; it != entries_.end(); ++it) {
+			if (it->second.next_fetch_ <= now) {
+				break;
+			}
+			if (!next || it->second.next_fetch_ < next) {
+				next = it->second.next_fetch_;
+			}
+		}
+
+		if (it == entries_.end()) {
+			if (next) {
+				cond_.wait(l, next - now);
+			}
+			else {
+				cond_.wait(l);
+			}
+			continue;
+		}
+
+		auto const cert = it->first;
+		auto const url = it->second.url_;
+		auto const request = it->second.request_;
+		auto const issuer = it->second.issuer_;
+		it->second.next_fetch_ = now + retry_interval;
+
+		l.unlock();
+		auto const response = fetch_(url, request);
+		auto [valid, expiration, refresh] = check_response(cert, issuer, response);
+		l.lock();
+
+		it = entries_.find(cert);
+		if (it == entries_.end()) {
+			continue;
+		}
+
+		if (valid) {
+			logger_.log(logmsg::debug_info, L"Got OCSP response for stapling, next refresh in %d seconds", refresh.get_seconds());
+			it->second.response_ = response;
+			it->second.expiration_ = expiration;
+			it->second.next_fetch_ = monotonic_clock::now() + refresh;
+		}
+		else {
+			logger_.log(logmsg::debug_warning, L"Could not fetch valid OCSP response for stapling from %s", url);
+		}
+	}
+}
+
+std::tuple<bool, datetime, duration> ocsp_stapler_impl::check_response(std::vector<uint8_t> const& cert, std::vector<uint8_t> const& issuer, std::vector<uint8_t> const& response)
+{
+	std::tuple<bool, datetime, duration> ret{false, datetime(), retry_interval};
+	if (response.empty()) {
+		return ret;
+	}
+
+	crt_holder crt;
+	if (!crt.import(cert)) {
+		return ret;
+	}
+
+	crt_holder issuer_crt;
+	if (!issuer_crt.import(issuer)) {
+		return ret;
+	}
+
+	gnutls_ocsp_resp_t resp{};
+	if (gnutls_ocsp_resp_init(&resp) != GNUTLS_E_SUCCESS) {
+		return ret;
+	}
+
+	// Clients reject responses not signed by the issuer or its delegated responder, don't staple those.
+	unsigned int verify{};
+	auto d = to_datum(response);
+	if (gnutls_ocsp_resp_import(resp, &d) == GNUTLS_E_SUCCESS &&
+		gnutls_ocsp_resp_get_status(resp) == GNUTLS_OCSP_RESP_SUCCESSFUL &&
+		gnutls_ocsp_resp_check_crt(resp, 0, crt.crt) == GNUTLS_E_SUCCESS &&
+		gnutls_ocsp_resp_verify_direct(resp, issuer_crt.crt, &verify, 0) == GNUTLS_E_SUCCESS && !verify)
+	{
+		unsigned int cert_status{};
+		time_t this_update{};
+		time_t next_update{};
+		time_t revocation_time{};
+		unsigned int reason{};
+		if (gnutls_ocsp_resp_get_single(resp, 0, nullptr, nullptr, nullptr, nullptr, &cert_status, &this_update, &next_update, &revocation_time, &reason) == GNUTLS_E_SUCCESS) {
+			if (next_update == static_cast<time_t>(-1)) {
+				// No expiration, responder has newer information at any time
+				ret = {true, datetime(), refresh_interval_};
+			}
+			else {
+				datetime const expiration(next_update, datetime::seconds);
+				duration const remaining = expiration - datetime::now();
+				if (remaining > duration()) {
+					duration refresh = duration::from_milliseconds(remaining.get_milliseconds() / 2);
+					if (refresh > refresh_interval_) {
+						refresh = refresh_interval_;
+					}
+					if (refresh < retry_interval) {
+						refresh = retry_interval;
+					}
+					ret = {true, expiration, refresh};
+				}
+			}
+		}
+	}
+
+	gnutls_ocsp_resp_deinit(resp);
+	return ret;
+}
+
+
+ocsp_stapler::ocsp_stapler(thread_pool & pool, fetch_function const& fetch, logger_interface & logger, duration const& refresh_interval)
+	: impl_(std::make_unique<ocsp_stapler_impl>(pool, fetch, logger, refresh_interval))
+{
+}
+
+ocsp_stapler::~ocsp_stapler()
+{
+}
+
+bool ocsp_stapler::add_certificate(std::string_view const& certs, bool pem, std::string const& responder_url)
+{
+	cert_list_holder chain;
+	bool sort{};
+	if (tls_layer_impl::load_certificates(certs, pem, chain.certs, chain.certs_size, sort) != GNUTLS_E_SUCCESS || !chain.certs_size) {
+		impl_->logger_.log(logmsg::error, fztranslate("Could not load certificate chain for OCSP stapling"));
+		return false;
+	}
+
+	gnutls_x509_crt_t crt = chain.certs[0];
+	gnutls_x509_crt_t issuer{};
+	if (chain.certs_size > 1) {
+		issuer = chain.certs[1];
+	}
+	else if (gnutls_x509_crt_check_issuer(crt, crt)) {
+		issuer = crt;
+	}
+	else {
+		impl_->logger_.log(logmsg::error, fztranslate("Certificate chain for OCSP stapling lacks the issuer"));
+		return false;
+	}
+
+	std::string url = responder_url.empty() ? get_responder_url(crt) : responder_url;
+	if (url.empty()) {
+		impl_->logger_.log(logmsg::error, fztranslate("Certificate does not specify an OCSP responder"));
+		return false;
+	}
+
+	auto request = create_request(crt, issuer);
+	auto der = export_der(crt);
+	auto issuer_der = export_der(issuer);
+	if (request.empty() || der.empty() || issuer_der.empty()) {
+		impl_->logger_.log(logmsg::error, fztranslate("Could not create OCSP request"));
+		return false;
+	}
+
+	scoped_lock l(impl_->mtx_);
+	auto & e = impl_->entries_[std::move(der)];
+	e.url_ = std::move(url);
+	e.request_ = std::move(request);
+	e.issuer_ = std::move(issuer_der);
+	e.next_fetch_ = monotonic_clock::now();
+	impl_->cond_.signal(l);
+
+	return true;
+}
+
+void ocsp_stapler::remove_certificate(std::string_view const& certs, bool pem)
+{
+	cert_list_holder chain;
+	bool sort{};
+	if (tls_layer_impl::load_certificates(certs, pem, chain.certs, chain.certs_size, sort) != GNUTLS_E_SUCCESS || !chain.certs_size) {
+		return;
+	}
+
+	auto const der = export_der(chain.certs[0]);
+
+	scoped_lock l(impl_->mtx_);
+	impl_->entries_.erase(der);
+}
+
+std::vector<uint8_t> ocsp_stapler::get_response(std::vector<uint8_t> const& certificate) const
+{
+	scoped_lock l(impl_->mtx_);
+	auto it = impl_->entries_.find(certificate);
+	if (it == impl_->entries_.end()) {
+		return {};
+	}
+
+	auto const& e = it->second;
+	if (e.expiration_ && e.expiration_ <= datetime::now()) {
+		return {};
+	}
+
+	return e.response_;
+}
+
+void ocsp_stapler::refresh()
+{
+	scoped_lock l(impl_->mtx_);
+	auto const now = monotonic_clock::now();
+	for (auto & e : impl_->entries_) {
+		e.second.next_fetch_ = now;
+	}
+	impl_->cond_.signal(l);
+}
+
+}
@@ -10,7 +10,7 @@ bool FZ_PRIVATE_SYMBOL has_pending_event(event_handler * handler, socket_event_s
 
 namespace fz {
 
-rate_limited_layer::rate_limited_layer(event_handler* handler, socket_interface& next_layer, rate_limiter * limiter)
+rate_limited_layer_base::rate_limited_layer_base(event_handler* handler, socket_interface& next_layer, rate_limiter * limiter)
 	: socket_layer(handler, next_layer, true)
 {
 	next_layer.set_event_handler(handler);
@@ -19,13 +19,16 @@ rate_limited_layer::rate_limited_layer(event_handler* handler, socket_interface&
 	}
 }
 
-rate_limited_layer::~rate_limited_layer()
+rate_limited_layer_base::~rate_limited_layer_base()
 {
+	if (memory_budget_) {
+		memory_budget_->remove_waiter(*this);
+	}
 	remove_bucket();
 	next_layer_.set_event_handler(nullptr);
 }
 
-void rate_limited_layer::wakeup(direction::type d)
+void rate_limited_layer_base::wakeup(direction::type d)
 {
 	// mtx_ is held by the caller, no need to lock here.
 
@@ -41,43 +44,27 @@ void rate_limited_layer::wakeup(direction::type d)
 	}
 }
 
-int rate_limited_layer::read(void* buffer, unsigned int size, int& error)
+rate::type rate_limited_layer_base::limit(direction::type d, unsigned int & size, int & error)
 {
 #if DEBUG_SOCKETEVENTS
-	assert(!has_pending_event(event_handler_, this, socket_event_flag::read));
-	assert(!has_pending_event(event_handler_, &next_layer_, socket_event_flag::read));
+	auto const flag = (d == direction::inbound) ? socket_event_flag::read : socket_event_flag::write;
+	assert(!has_pending_event(event_handler_, this, flag));
+	assert(!has_pending_event(event_handler_, &next_layer_, flag));
 #endif
 
-	auto const max = available(direction::inbound);
-	if (!max) {
-		error = EAGAIN;
-		return -1;
-	}
-
-	static_assert(sizeof(size) <= sizeof(max));
-	if (max < static_cast<std::decay_t<decltype(max)>>(size)) {
-		size = static_cast<unsigned int>(max);
-	}
-
-	int read = next_layer_.read(buffer, size, error);
-	if (read > 0 && max != rate::unlimited) {
-		consume(direction::inbound, read);
+	if (d == direction::inbound && memory_budget_ && memory_budget_->under_pressure()) {
+		memory_waiting_ = true;
+		if (memory_budget_->wait(*this)) {
+			error = EAGAIN;
+			return 0;
+		}
+		memory_waiting_ = false;
 	}
 
-	return read;
-}
-
-int rate_limited_layer::write(void const* buffer, unsigned int size, int& error)
-{
-#if DEBUG_SOCKETEVENTS
-	assert(!has_pending_event(event_handler_, this, socket_event_flag::write));
-	assert(!has_pending_event(event_handler_, &next_layer_, socket_event_flag::write));
-#endif
-
-	auto const max = available(direction::outbound);
+	auto const max = available(d);
 	if (!max) {
 		error = EAGAIN;
-		return -1;
+		return 0;
 	}
 
 	static_assert(sizeof(size) <= sizeof(max));
@@ -85,20 +72,14 @@ int rate_limited_layer::write(void const* buffer, unsigned int size, int& error)
 		size = static_cast<unsigned int>(max);
 	}
 
-	int written = next_layer_.write(buffer, size, error);
-	if (written > 0 && max != rate::unlimited) {
-		consume(direction::outbound, written);
-	}
-
-	return written;
+	return max;
 }
 
-
-void rate_limited_layer::set_event_handler(event_handler* handler, fz::socket_event_flag retrigger_block)
+void rate_limited_layer_base::set_event_handler(event_handler* handler, fz::socket_event_flag retrigger_block)
 {
 	scoped_lock l(mtx_);
 
-	if (waiting(l, direction::inbound)) {
+	if (waiting(l, direction::inbound) || memory_waiting_) {
 		retrigger_block |= socket_event_flag::read;
 	}
 	if (waiting(l, direction::outbound)) {
@@ -108,6 +89,27 @@ void rate_limited_layer::set_event_handler(event_handler* handler, fz::socket_ev
 	socket_layer::set_event_handler(handler, retrigger_block);
 }
 
+void rate_limited_layer_base::set_memory_budget(memory_budget * budget)
+{
+	if (memory_budget_) {
+		memory_budget_->remove_waiter(*this);
+	}
+	memory_budget_ = budget;
+
+	if (memory_waiting_.exchange(false)) {
+		on_memory_relief();
+	}
+}
+
+void rate_limited_layer_base::on_memory_relief()
+{
+	scoped_lock l(mtx_);
+	memory_waiting_ = false;
+	if (event_handler_) {
+		event_handler_->send_event<socket_event>(this, socket_event_flag::read, 0);
+	}
+}
+
 
 class compound_rate_limited_layer::crll_bucket : public bucket
 {
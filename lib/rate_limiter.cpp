@@ -25,7 +25,13 @@ std::array<direction::type, 2> directions { direction::inbound, direction::outbo
 }
 
 rate_limit_manager::rate_limit_manager(event_loop & loop)
+	: rate_limit_manager(loop, false)
+{
+}
+
+rate_limit_manager::rate_limit_manager(event_loop & loop, bool tickless)
 	: event_handler(loop)
+	, tickless_(tickless)
 {
 }
 
@@ -127,6 +133,11 @@ void rate_limit_manager::set_burst_tolerance(rate::type tolerance)
 	burst_tolerance_ = tolerance;
 }
 
+bool rate_limit_manager::timer_running() const
+{
+	return timer_ != 0;
+}
+
 void bucket_base::remove_bucket()
 {
 	scoped_lock l(mtx_);
@@ -159,6 +170,10 @@ void bucket_base::remove_bucket()
 					parent->data_[i].debt_ -= std::min(parent->data_[i].debt_, unspent[i]);
 				}
 				parent->mtx_.unlock();
+				if (mgr_ && mgr_->tickless_) {
+					// The shares of the remaining buckets have grown
+					mgr_->record_activity();
+				}
 				break;
 			}
 		}
@@ -240,6 +255,12 @@ rate::type rate_limiter::limit(direction::type const d)
 	return data_[d ? 1 : 0].limit_;
 }
 
+size_t rate_limiter::waiting_buckets(direction::type const d)
+{
+	scoped_lock l(mtx_);
+	return data_[d ? 1 : 0].unsaturated_;
+}
+
 void rate_limiter::add(bucket_base* bucket)
 {
 	if (!bucket) {
@@ -259,7 +280,8 @@ void rate_limiter::add(bucket_base* bucket)
 
 	bool active{};
 	bucket->update_stats(active);
-	if (active && mgr_) {
+	if (mgr_ && (active || mgr_->tickless_)) {
+		// In tickless mode the shares need to be recomputed
 		mgr_->record_activity();
 	}
 
@@ -449,9 +471,9 @@ rate::type rate_limiter::distribute_overflow(direction::type const d, rate::type
 		return remaining + overflow - usable_external_overflow;
 	}
 	else {
-		// Internal overflow not exhausted
-		data.overflow_ = remaining - usable_external_overflow;
-		return overflow;
+		// Internal overflow not exhausted, pass it on so that siblings can use it
+		data.overflow_ = 0;
+		return overflow + remaining - usable_external_overflow;
 	}
 }
 
@@ -507,9 +529,17 @@ rate::type bucket::add_tokens(direction::type const d, rate::type tokens, rate::
 	if (limit == rate::unlimited) {
 		data.bucket_size_ = rate::unlimited;
 		data.available_ = rate::unlimited;
+		data.rate_ = 0;
 		return 0;
 	}
 	else {
+		bool const tickless = mgr_ && mgr_->tickless_;
+		if (tickless) {
+			// Bring the bucket up to date at the old rate before switching to the new one
+			refill(d, monotonic_clock::now());
+			data.rate_ = limit;
+		}
+
 		data.bucket_size_ = limit * data.overflow_multiplier_;
 		if (mgr_) {
 			data.bucket_size_ *= mgr_->burst_tolerance_;
@@ -532,6 +562,12 @@ rate::type bucket::add_tokens(direction::type const d, rate::type tokens, rate::
 					data.overflow_multiplier_ *= 2;
 				}
 			}
+			if (tickless) {
+				// Tokens accrue lazily, only those lost to a full bucket are overflow
+				rate::type ret = std::min(tokens, data.discarded_);
+				data.discarded_ = 0;
+				return ret;
+			}
 			rate::type added = std::min(tokens, capacity);
 			rate::type ret = tokens - added;
 			data.available_ += added;
@@ -540,6 +576,47 @@ rate::type bucket::add_tokens(direction::type const d, rate::type tokens, rate::
 	}
 }
 
+void bucket::refill(direction::type const d, monotonic_clock const& now)
+{
+	auto & data = data_[d];
+	if (!data.last_refill_) {
+		data.last_refill_ = now;
+		return;
+	}
+
+	int64_t ms = (now - data.last_refill_).get_milliseconds();
+	if (ms <= 0) {
+		return;
+	}
+	data.last_refill_ = now;
+
+	if (!data.rate_ || data.available_ == rate::unlimited) {
+		data.refill_carry_ = 0;
+		return;
+	}
+
+	// Overflow is never redistributed for more than a tick, no need to look further back
+	int64_t const max_ms = 60 * 1000;
+	if (ms > max_ms) {
+		ms = max_ms;
+	}
+
+	rate::type tokens;
+	if (data.rate_ > (rate::unlimited - 1000) / static_cast<rate::type>(ms)) {
+		tokens = data.bucket_size_;
+	}
+	else {
+		tokens = data.rate_ * static_cast<rate::type>(ms) + data.refill_carry_;
+		data.refill_carry_ = tokens % 1000;
+		tokens /= 1000;
+	}
+
+	rate::type const capacity = (data.bucket_size_ > data.available_) ? (data.bucket_size_ - data.available_) : 0;
+	rate::type const added = std::min(tokens, capacity);
+	data.available_ += added;
+	data.discarded_ += tokens - added;
+}
+
 rate::type bucket::distribute_overflow(direction::type const d, rate::type tokens)
 {
 	auto & data = data_[d];
@@ -586,12 +663,14 @@ void bucket::update_stats(bool & active)
 				data.overflow_multiplier_ /= 2;
 			}
 			else {
-				data.unsaturated_ = data.waiting_;
-				if (data.waiting_) {
+				// With lazy refills, a bucket under contention rarely gets observed empty.
+				data.unsaturated_ = data.waiting_ || data.drained_;
+				if (data.unsaturated_) {
 					active = true;
 				}
 			}
 		}
+		data.drained_ = false;
 	}
 }
 
@@ -603,6 +682,9 @@ rate::type bucket::available(direction::type const d)
 
 	scoped_lock l(mtx_);
 	auto & data = data_[d];
+	if (mgr_ && mgr_->tickless_) {
+		refill(d, monotonic_clock::now());
+	}
 	if (!data.available_) {
 		data.waiting_ = true;
 		if (mgr_) {
@@ -624,13 +706,22 @@ void bucket::consume(direction::type const d, rate::type amount)
 	auto & data = data_[d];
 	if (data.available_ != rate::unlimited) {
 		if (mgr_) {
-			mgr_->record_activity();
+			if (mgr_->tickless_) {
+				refill(d, monotonic_clock::now());
+			}
+			else {
+				mgr_->record_activity();
+			}
 		}
 		if (data.available_ > amount) {
 			data.available_ -= amount;
 		}
 		else {
 			data.available_ = 0;
+			if (mgr_ && mgr_->tickless_ && !data.drained_) {
+				data.drained_ = true;
+				mgr_->record_activity();
+			}
 		}
 	}
 }
@@ -0,0 +1,548 @@
+#include "libfilezilla/libfilezilla.hpp"
+
+#include "libfilezilla/shm_ring.hpp"
+#include "libfilezilla/buffer.hpp"
+#include "libfilezilla/encode.hpp"
+#include "libfilezilla/glue/unix.hpp"
+#include "libfilezilla/process.hpp"
+#include "libfilezilla/util.hpp"
+
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <unistd.h>
+
+#include <string.h>
+
+namespace fz {
+
+namespace {
+uint64_t const magic = 0x676e69726d68737aull; // "zshmring"
+
+void close_fd(int & fd)
+{
+	if (fd != -1) {
+		::close(fd);
+		fd = -1;
+	}
+}
+
+bool set_nonblocking(int fd)
+{
+	int flags = fcntl(fd, F_GETFL);
+	return flags != -1 && fcntl(fd, F_SETFL, flags | O_NONBLOCK) != -1;
+}
+
+void signal_fd(int fd)
+{
+	uint64_t const v = 1;
+	ssize_t res;
+	do {
+		res = ::write(fd, &v, sizeof(v));
+	} while (res == -1 && errno == EINTR);
+}
+
+void drain_fd(int fd)
+{
+	uint8_t buf[64];
+	ssize_t res;
+	do {
+		res = ::read(fd, buf, sizeof(buf));
+	} while (res > 0 || (res == -1 && errno == EINTR));
+}
+
+// Creates a pair of descriptors, the first one is to wait on, the second one to signal it.
+// A pipe rather than an eventfd: Once the only process holding the signalling end goes
+// away, the waiting end reports a hangup, even if the process crashed.
+bool create_notifier(int fds[2])
+{
+	if (!create_pipe(fds)) {
+		return false;
+	}
+	if (!set_nonblocking(fds[0]) || !set_nonblocking(fds[1])) {
+		close_fd(fds[0]);
+		close_fd(fds[1]);
+		return false;
+	}
+	return true;
+}
+
+int create_memory(size_t size)
+{
+	int fd = -1;
+#ifdef MFD_CLOEXEC
+	fd = memfd_create("fz_shm_ring", MFD_CLOEXEC);
+#endif
+	if (fd == -1) {
+		// Unlinked right away, the name is only needed to create it.
+		for (int i = 0; i < 10 && fd == -1; ++i) {
+			std::string const name = "/fz_shm_ring_" + hex_encode<std::string>(random_bytes(8));
+			forkblock b;
+			fd = shm_open(name.c_str(), O_RDWR | O_CREAT | O_EXCL, 0600);
+			if (fd != -1) {
+				shm_unlink(name.c_str());
+				set_cloexec(fd);
+			}
+			else if (errno != EEXIST) {
+				break;
+			}
+		}
+	}
+	if (fd != -1 && ftruncate(fd, static_cast<off_t>(size)) != 0) {
+		close_fd(fd);
+	}
+	return fd;
+}
+}
+
+// Lives at the start of the shared memory. Head and tail are on separate cache lines
+// so that producer and consumer do not contend.
+struct shm_ring::header
+{
+	uint64_t magic_;
+	uint64_t capacity_;
+
+	std::atomic<uint32_t> closed_;
+
+	alignas(64) std::atomic<uint64_t> head_;
+	std::atomic<uint32_t> consumer_waiting_;
+
+	alignas(64) std::atomic<uint64_t> tail_;
+	std::atomic<uint32_t> producer_waiting_;
+};
+
+static_assert(std::atomic<uint64_t>::is_always_lock_free, "Shared memory requires lock-free atomics");
+static_assert(std::atomic<uint32_t>::is_always_lock_free, "Shared memory requires lock-free atomics");
+
+shm_ring::shm_ring(thread_pool & pool, event_handler * handler, role r)
+	: role_(r)
+	, handler_(handler)
+	, pool_(pool)
+{
+}
+
+shm_ring::~shm_ring()
+{
+	if (header_) {
+		header_->closed_.fetch_or(role_ == role::producer ? 1 : 2);
+		if (notify_fd_ != -1) {
+			signal_fd(notify_fd_);
+		}
+	}
+
+	if (quit_fds_[1] != -1) {
+		signal_fd(quit_fds_[1]);
+	}
+	task_.join();
+
+	if (handler_) {
+		auto event_filter = [this](event_loop::Events::value_type const& ev) -> bool {
+			if (ev.first != handler_ || ev.second->derived_type() != shm_ring_event::type()) {
+				return false;
+			}
+			return std::get<0>(static_cast<shm_ring_event const&>(*ev.second).v_) == this;
+		};
+		handler_->event_loop_.filter_events(event_filter);
+	}
+
+	if (mapping_) {
+		munmap(mapping_, mapping_size_);
+	}
+
+	close_fd(mem_fd_);
+	close_fd(wait_fd_);
+	close_fd(notify_fd_);
+	close_fd(peer_wait_fd_);
+	close_fd(peer_notify_fd_);
+	close_fd(quit_fds_[0]);
+	close_fd(quit_fds_[1]);
+}
+
+std::unique_ptr<shm_ring> shm_ring::create(thread_pool & pool, event_handler * handler, size_t capacity, role r, int & error)
+{
+	size_t const page = static_cast<size_t>(sysconf(_SC_PAGESIZE));
+	size_t cap = page;
+	while (cap < capacity) {
+		if (cap > (static_cast<size_t>(-1) >> 2)) {
+			error = EINVAL;
+			return nullptr;
+		}
+		cap <<= 1;
+	}
+
+	std::unique_ptr<shm_ring> ret(new shm_ring(pool, handler, r));
+
+	int fd = create_memory(page + cap);
+	if (fd == -1) {
+		error = errno;
+		return nullptr;
+	}
+
+	error = ret->map(fd, true);
+	if (error) {
+		return nullptr;
+	}
+
+	// Data notifies the consumer, space notifies the producer
+	int data[2]{-1, -1};
+	int space[2]{-1, -1};
+	if (!create_notifier(data) || !create_notifier(space)) {
+		error = errno;
+		close_fd(data[0]);
+		close_fd(data[1]);
+		return nullptr;
+	}
+	if (r == role::producer) {
+		ret->wait_fd_ = space[0];
+		ret->notify_fd_ = data[1];
+		ret->peer_wait_fd_ = data[0];
+		ret->peer_notify_fd_ = space[1];
+	}
+	else {
+		ret->wait_fd_ = data[0];
+		ret->notify_fd_ = space[1];
+		ret->peer_wait_fd_ = space[0];
+		ret->peer_notify_fd_ = data[1];
+	}
+
+	if (!ret->start()) {
+		error = ENOMEM;
+		return nullptr;
+	}
+
+	return ret;
+}
+
+int shm_ring::send(int socket)
+{
+	if (mem_fd_ == -1 || peer_wait_fd_ == -1 || peer_notify_fd_ == -1) {
+		return EINVAL;
+	}
+
+	// The role of the receiver, followed by the descriptors it needs.
+	char const tags[3] = { role_ == role::producer ? 'c' : 'p', 'w', 'n' };
+	int const fds[3] = { mem_fd_, peer_wait_fd_, peer_notify_fd_ };
+	for (size_t i = 0; i < 3; ++i) {
+		buffer buf;
+		buf.append(static_cast<uint8_t>(tags[i]));
+		int error;
+		if (send_fd(socket, buf, fds[i], error) != 1) {
+			return error ? error : EIO;
+		}
+	}
+
+	close_fd(peer_wait_fd_);
+	close_fd(peer_notify_fd_);
+	return 0;
+}
+
+std::unique_ptr<shm_ring> shm_ring::receive(thread_pool & pool, event_handler * handler, int socket, int & error)
+{
+	int fds[3]{-1, -1, -1};
+	buffer tags;
+
+	auto close_all = [&fds]() {
+		for (auto & fd : fds) {
+			close_fd(fd);
+		}
+	};
+
+	size_t received{};
+	while (received < 3) {
+		int fd = -1;
+		int res = read_fd(socket, tags, fd, error);
+		if (res <= 0 || fd == -1) {
+			if (fd != -1) {
+				::close(fd);
+			}
+			if (!res || !error) {
+				error = EPROTO;
+			}
+			close_all();
+			return nullptr;
+		}
+		fds[received++] = fd;
+	}
+
+	if (tags.size() != 3 || (tags[0] != 'p' && tags[0] != 'c') || tags[1] != 'w' || tags[2] != 'n') {
+		error = EPROTO;
+		close_all();
+		return nullptr;
+	}
+
+	std::unique_ptr<shm_ring> ret(new shm_ring(pool, handler, tags[0] == 'p' ? role::producer : role::consumer));
+	ret->wait_fd_ = fds[1];
+	ret->notify_fd_ = fds[2];
+	fds[1] = -1;
+	fds[2] = -1;
+
+	if (!set_nonblocking(ret->wait_fd_) || !set_nonblocking(ret->notify_fd_)) {
+		error = errno;
+		close_all();
+		return nullptr;
+	}
+
+	error = ret->map(fds[0], false);
+	fds[0] = -1;
+	if (error) {
+		return nullptr;
+	}
+
+	if (!ret->start()) {
+		error = ENOMEM;
+		return nullptr;
+	}
+
+	return ret;
+}
+
+int shm_ring::map(int fd, bool init)
+{
+	mem_fd_ = fd;
+
+	size_t const page = static_cast<size_t>(sysconf(_SC_PAGESIZE));
+
+	struct stat st{};
+	if (fstat(fd, &st) != 0) {
+		return errno;
+	}
+	size_t const size = static_cast<size_t>(st.st_size);
+	if (size <= page) {
+		return EPROTO;
+	}
+	size_t const cap = size - page;
+	if ((cap & (cap - 1)) || cap % page) {
+		return EPROTO;
+	}
+
+	// Reserve address space for the header and two copies of the data area, then
+	// map the data area twice back to back.
+	mapping_size_ = page + 2 * cap;
+	mapping_ = mmap(nullptr, mapping_size_, PROT_NONE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+	if (mapping_ == MAP_FAILED) {
+		mapping_ = nullptr;
+		return errno;
+	}
+
+	uint8_t * base = static_cast<uint8_t*>(mapping_);
+	if (mmap(base, page + cap, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_FIXED, fd, 0) == MAP_FAILED) {
+		return errno;
+	}
+	if (mmap(base + page + cap, cap, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_FIXED, fd, static_cast<off_t>(page)) == MAP_FAILED) {
+		return errno;
+	}
+
+	header_ = new (base) header;
+	data_ = base + page;
+	capacity_ = cap;
+
+	if (init) {
+		header_->magic_ = magic;
+		header_->capacity_ = cap;
+		header_->closed_ = 0;
+		header_->head_ = 0;
+		header_->tail_ = 0;
+		header_->consumer_waiting_ = 0;
+		header_->producer_waiting_ = 0;
+	}
+	else if (header_->magic_ != magic || header_->capacity_ != cap) {
+		return EPROTO;
+	}
+
+	return 0;
+}
+
+bool shm_ring::start()
+{
+	if (!create_pipe(quit_fds_)) {
+		return false;
+	}
+	task_ = pool_.spawn([this]() { entry(); });
+	return static_cast<bool>(task_);
+}
+
+void shm_ring::entry()
+{
+	pollfd fds[2]{};
+	fds[0].fd = wait_fd_;
+	fds[0].events = POLLIN;
+	fds[1].fd = quit_fds_[0];
+	fds[1].events = POLLIN;
+
+	while (true) {
+		int res = poll(fds, 2, -1);
+		if (res == -1) {
+			if (errno == EINTR) {
+				continue;
+			}
+			break;
+		}
+		if (fds[1].revents) {
+			break;
+		}
+		if (fds[0].revents) {
+			drain_fd(wait_fd_);
+
+			bool const hangup = (fds[0].revents & (POLLHUP | POLLERR)) != 0;
+			if (hangup) {
+				// The peer process has gone away, possibly without marking its end as closed
+				peer_gone_ = true;
+			}
+			if (handler_ && !signalled_.exchange(true)) {
+				handler_->send_event<shm_ring_event>(this);
+			}
+			if (hangup) {
+				break;
+			}
+		}
+	}
+}
+
+void shm_ring::notify()
+{
+	signal_fd(notify_fd_);
+}
+
+nonowning_buffer shm_ring::get_write_buffer()
+{
+	offered_ = 0;
+	if (role_ != role::producer || !header_ || broken_) {
+		return nonowning_buffer();
+	}
+
+	uint64_t const head = header_->head_.load(std::memory_order_relaxed);
+	uint64_t used = head - header_->tail_.load(std::memory_order_acquire);
+	if (used > capacity_) {
+		set_broken();
+		return nonowning_buffer();
+	}
+	if (used == capacity_) {
+		signalled_ = false;
+		header_->producer_waiting_.store(1);
+
+		// Check again, the consumer might have released data before seeing the flag
+		used = head - header_->tail_.load();
+		if (used > capacity_) {
+			set_broken();
+			return nonowning_buffer();
+		}
+		if (used == capacity_) {
+			return nonowning_buffer();
+		}
+	}
+
+	offered_ = capacity_ - used;
+	return nonowning_buffer(data_ + (head & (capacity_ - 1)), offered_);
+}
+
+int shm_ring::commit(size_t bytes)
+{
+	if (bytes > offered_) {
+		// Committing more than obtained through get_write_buffer is a bug in the caller
+		abort();
+	}
+	if (broken_) {
+		return EPROTO;
+	}
+	if (role_ != role::producer || !header_ || !bytes) {
+		return 0;
+	}
+
+	// The consumer only ever moves the tail forward, so there is at least as much free space as offered.
+	uint64_t const head = header_->head_.load(std::memory_order_relaxed);
+	uint64_t const used = head - header_->tail_.load(std::memory_order_acquire);
+	if (used > capacity_ || bytes > capacity_ - used) {
+		set_broken();
+		return EPROTO;
+	}
+
+	offered_ -= bytes;
+	header_->head_.store(head + bytes);
+	if (header_->consumer_waiting_.exchange(0)) {
+		notify();
+	}
+	return 0;
+}
+
+nonowning_buffer shm_ring::get_read_buffer()
+{
+	offered_ = 0;
+	if (role_ != role::consumer || !header_ || broken_) {
+		return nonowning_buffer();
+	}
+
+	uint64_t const tail = header_->tail_.load(std::memory_order_relaxed);
+	uint64_t available = header_->head_.load(std::memory_order_acquire) - tail;
+	if (available > capacity_) {
+		set_broken();
+		return nonowning_buffer();
+	}
+	if (!available) {
+		signalled_ = false;
+		header_->consumer_waiting_.store(1);
+
+		// Check again, the producer might have committed data before seeing the flag
+		available = header_->head_.load() - tail;
+		if (available > capacity_) {
+			set_broken();
+			return nonowning_buffer();
+		}
+		if (!available) {
+			return nonowning_buffer();
+		}
+	}
+
+	offered_ = available;
+	return nonowning_buffer(data_ + (tail & (capacity_ - 1)), available, available);
+}
+
+int shm_ring::release(size_t bytes)
+{
+	if (bytes > offered_) {
+		// Releasing more than obtained through get_read_buffer is a bug in the caller
+		abort();
+	}
+	if (broken_) {
+		return EPROTO;
+	}
+	if (role_ != role::consumer || !header_ || !bytes) {
+		return 0;
+	}
+
+	// The producer only ever moves the head forward, so there is at least as much data as offered.
+	uint64_t const tail = header_->tail_.load(std::memory_order_relaxed);
+	uint64_t const available = header_->head_.load(std::memory_order_acquire) - tail;
+	if (available > capacity_ || bytes > available) {
+		set_broken();
+		return EPROTO;
+	}
+
+	offered_ -= bytes;
+	header_->tail_.store(tail + bytes);
+	if (header_->producer_waiting_.exchange(0)) {
+		notify();
+	}
+	return 0;
+}
+
+void shm_ring::set_broken()
+{
+	broken_ = true;
+	offered_ = 0;
+}
+
+bool shm_ring::peer_closed() const
+{
+	if (!header_ || broken_ || peer_gone_) {
+		return true;
+	}
+	return (header_->closed_.load() & (role_ == role::producer ? 2 : 1)) != 0;
+}
+
+bool shm_ring::broken() const
+{
+	return broken_;
+}
+
+}
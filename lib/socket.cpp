@@ -89,6 +89,11 @@ int get_rcv_wscale(int fd) {
 }
 
 #endif
+
+socket_event_flag without(socket_event_flag flags, socket_event_flag remove)
+{
+	return static_cast<socket_event_flag>(static_cast<std::underlying_type_t<socket_event_flag>>(flags) & ~static_cast<std::underlying_type_t<socket_event_flag>>(remove));
+}
 }
 
 void remove_socket_events(event_handler * handler, socket_event_source const* const source)
@@ -136,13 +141,18 @@ socket_event_flag change_socket_event_handler(event_handler * old_handler, event
 			if (ev.second->derived_type() == socket_event::type()) {
 				auto & sev = static_cast<socket_event const&>(*ev.second);
 				if (std::get<0>(sev.v_) == source) {
-					auto const flag = std::get<1>(sev.v_);
+					auto flag = std::get<1>(sev.v_);
 #if DEBUG_SOCKETEVENTS
 					assert(!(flag & seen));
 					seen |= flag;
 #endif
 					if (flag & remove) {
-						return true;
+						// Coalesced events may carry flags that are to be kept
+						flag = without(flag, remove);
+						if (flag == socket_event_flag{}) {
+							return true;
+						}
+						std::get<1>(sev.v_) = flag;
 					}
 					ret |= flag;
 					ev.first = new_handler;
@@ -1070,18 +1080,41 @@ protected:
 		}
 	}
 
+	// Readiness events are edge-triggered: Another read (write) event is only triggered after
+	// read (write) has returned EAGAIN, which the handler can only observe after having received
+	// the previous read (write) event. Usually the previous event thus is no longer in use and
+	// can be reused. It still is while the handler has yet to return from processing it though,
+	// so check with the loop and fall back to a new event. Only this thread sends these events,
+	// once not pending, the event cannot become pending behind our back.
+	void send_readiness_event(socket_event & ev, socket_event_flag flag, int error)
+	{
+		auto * handler = socket_->evt_handler_;
+		if (handler->event_loop_.persistent_event_pending(&ev)) {
+			handler->send_event<socket_event>(socket_->ev_source_, flag, error);
+		}
+		else {
+			ev.v_ = socket_event::tuple_type(socket_->ev_source_, flag, error);
+			handler->send_persistent_event(&ev);
+		}
+	}
+
 	void send_events()
 	{
 		if (!socket_ || !socket_->evt_handler_) {
 			return;
 		}
 
+		if (coalesce_events_ && (triggered_ & (WAIT_READ | WAIT_WRITE)) == (WAIT_READ | WAIT_WRITE)) {
+			int const error = triggered_errors_[1] ? triggered_errors_[1] : triggered_errors_[2];
+			send_readiness_event(read_event_, socket_event_flag::read | socket_event_flag::write, error);
+			triggered_ &= ~(WAIT_READ | WAIT_WRITE);
+		}
 		if (triggered_ & WAIT_READ) {
-			socket_->evt_handler_->send_event<socket_event>(socket_->ev_source_, socket_event_flag::read, triggered_errors_[1]);
+			send_readiness_event(read_event_, socket_event_flag::read, triggered_errors_[1]);
 			triggered_ &= ~WAIT_READ;
 		}
 		if (triggered_ & WAIT_WRITE) {
-			socket_->evt_handler_->send_event<socket_event>(socket_->ev_source_, socket_event_flag::write, triggered_errors_[2]);
+			send_readiness_event(write_event_, socket_event_flag::write, triggered_errors_[2]);
 			triggered_ &= ~WAIT_WRITE;
 		}
 		if (triggered_ & WAIT_ACCEPT) {
@@ -1189,6 +1222,13 @@ protected:
 	int triggered_{};
 	int triggered_errors_[WAIT_EVENTCOUNT];
 
+	// Preallocated readiness events, see send_readiness_event
+	socket_event read_event_;
+	socket_event write_event_;
+
+	// Whether simultaneous read and write readiness is sent as single event
+	bool coalesce_events_{};
+
 	bool quit_{};
 
 	// Thread waits for instructions
@@ -1432,6 +1472,18 @@ socket_descriptor::~socket_descriptor()
 	close_socket_fd(fd_);
 }
 
+std::string socket_descriptor::peer_ip(bool strip_zone_index) const
+{
+	sockaddr_storage addr;
+	socklen_t addr_len = sizeof(addr);
+	int res = getpeername(fd_, (sockaddr*)&addr, &addr_len);
+	if (res) {
+		return std::string();
+	}
+
+	return socket_base::address_to_string((sockaddr *)&addr, addr_len, false, strip_zone_index);
+}
+
 
 listen_socket::listen_socket(thread_pool & pool, event_handler* evt_handler)
 	: socket_base(pool, evt_handler, this)
@@ -1883,6 +1935,28 @@ int socket::ideal_send_buffer_size()
 	return size;
 }
 
+int socket::round_trip_time()
+{
+	if (!socket_thread_) {
+		return -1;
+	}
+
+	int rtt = -1;
+#if HAVE_TCP_INFO
+	scoped_lock l(socket_thread_->mutex_);
+
+	if (fd_ != -1) {
+		tcp_info i{};
+		socklen_t len = sizeof(tcp_info);
+		if (!getsockopt(fd_, IPPROTO_TCP, TCP_INFO, &i, &len)) {
+			rtt = static_cast<int>(i.tcpi_rtt);
+		}
+	}
+#endif
+
+	return rtt;
+}
+
 native_string socket::peer_host() const
 {
 	return host_;
@@ -1910,6 +1984,11 @@ int socket::shutdown()
 }
 
 void socket::set_event_handler(event_handler* pEvtHandler, fz::socket_event_flag retrigger_block)
+{
+	set_event_handler(pEvtHandler, retrigger_block, false);
+}
+
+void socket::set_event_handler(event_handler* pEvtHandler, fz::socket_event_flag retrigger_block, bool coalesce_events)
 {
 	if (!socket_thread_) {
 		return;
@@ -1919,15 +1998,29 @@ void socket::set_event_handler(event_handler* pEvtHandler, fz::socket_event_flag
 
 	fz::socket_event_flag const pending = change_socket_event_handler(evt_handler_, pEvtHandler, ev_source_, retrigger_block);
 	evt_handler_ = pEvtHandler;
+	socket_thread_->coalesce_events_ = coalesce_events;
 
 	if (pEvtHandler) {
+		socket_event_flag retrigger{};
 		if (state_ == socket_state::connected && !(socket_thread_->waiting_ & WAIT_WRITE) && !(pending & (socket_event_flag::connection | socket_event_flag::write)) && !(retrigger_block & socket_event_flag::write)) {
 			socket_thread_->triggered_ &= ~WAIT_WRITE;
-			pEvtHandler->send_event<socket_event>(ev_source_, socket_event_flag::write, 0);
+			retrigger |= socket_event_flag::write;
 		}
 		if ((state_ == socket_state::connected || state_ == socket_state::shut_down) && !(socket_thread_->waiting_ & WAIT_READ) && !(pending & socket_event_flag::read) && !(retrigger_block & socket_event_flag::read)) {
 			socket_thread_->triggered_ &= ~WAIT_READ;
-			pEvtHandler->send_event<socket_event>(ev_source_, socket_event_flag::read, 0);
+			retrigger |= socket_event_flag::read;
+		}
+
+		if (coalesce_events && retrigger == (socket_event_flag::read | socket_event_flag::write)) {
+			pEvtHandler->send_event<socket_event>(ev_source_, retrigger, 0);
+		}
+		else {
+			if (retrigger & socket_event_flag::write) {
+				pEvtHandler->send_event<socket_event>(ev_source_, socket_event_flag::write, 0);
+			}
+			if (retrigger & socket_event_flag::read) {
+				pEvtHandler->send_event<socket_event>(ev_source_, socket_event_flag::read, 0);
+			}
 		}
 	}
 }
@@ -44,7 +44,7 @@ x509_certificate::x509_certificate(
 	bool const self_signed)
 	: activation_time_(activation_time)
 	, expiration_time_(expiration_time)
-	, raw_cert_(rawData)
+	, raw_cert_(std::move(rawData))
 	, serial_(serial)
 	, pkalgoname_(pkalgoname)
 	, pkalgobits_(bits)
@@ -53,11 +53,126 @@ x509_certificate::x509_certificate(
 	, fingerprint_sha1_(fingerprint_sha1)
 	, issuer_(issuer)
 	, subject_(subject)
-	, alt_subject_names_(alt_subject_names)
+	, alt_subject_names_(std::move(alt_subject_names))
 	, self_signed_(self_signed)
 {
 }
 
+std::string const& x509_certificate::get_fingerprint_sha256() const
+{
+	return deferred_ ? deferred_->fingerprint_sha256(raw_cert_) : fingerprint_sha256_;
+}
+
+std::string const& x509_certificate::get_fingerprint_sha1() const
+{
+	return deferred_ ? deferred_->fingerprint_sha1(raw_cert_) : fingerprint_sha1_;
+}
+
+std::string const& x509_certificate::get_subject() const
+{
+	return deferred_ ? deferred_->subject(raw_cert_) : subject_;
+}
+
+std::string const& x509_certificate::get_issuer() const
+{
+	return deferred_ ? deferred_->issuer(raw_cert_) : issuer_;
+}
+
+std::vector<x509_certificate::subject_name> const& x509_certificate::get_alt_subject_names() const
+{
+	return deferred_ ? deferred_->alt_subject_names(raw_cert_) : alt_subject_names_;
+}
+
+x509_certificate_fields::~x509_certificate_fields()
+{
+	if (crt_) {
+		gnutls_x509_crt_deinit(crt_);
+	}
+}
+
+gnutls_x509_crt_t x509_certificate_fields::get_crt(std::vector<uint8_t> const& der)
+{
+	if (!crt_ && !crt_failed_) {
+		gnutls_datum_t d;
+		d.data = const_cast<unsigned char*>(der.data());
+		d.size = static_cast<unsigned int>(der.size());
+
+		if (gnutls_x509_crt_init(&crt_) != GNUTLS_E_SUCCESS) {
+			crt_ = nullptr;
+		}
+		else if (gnutls_x509_crt_import(crt_, &d, GNUTLS_X509_FMT_DER) != GNUTLS_E_SUCCESS) {
+			gnutls_x509_crt_deinit(crt_);
+			crt_ = nullptr;
+		}
+		crt_failed_ = !crt_;
+	}
+	return crt_;
+}
+
+void x509_certificate_fields::extract(field f, std::vector<uint8_t> const& der)
+{
+	if (done_.load(std::memory_order_acquire) & f) {
+		return;
+	}
+
+	scoped_lock l(mtx_);
+	if (done_.load(std::memory_order_relaxed) & f) {
+		return;
+	}
+
+	switch (f) {
+	case sha256:
+		fingerprint_sha256_ = tls_layer_impl::get_fingerprint(GNUTLS_DIG_SHA256, der);
+		break;
+	case sha1:
+		fingerprint_sha1_ = tls_layer_impl::get_fingerprint(GNUTLS_DIG_SHA1, der);
+		break;
+	case subject_dn:
+	case issuer_dn:
+		if (auto crt = get_crt(der)) {
+			(f == subject_dn ? subject_ : issuer_) = tls_layer_impl::get_cert_dn(crt, f == issuer_dn, nullptr);
+		}
+		break;
+	case alt_names:
+		if (auto crt = get_crt(der)) {
+			alt_subject_names_ = tls_layer_impl::get_cert_subject_alt_names(crt);
+		}
+		break;
+	}
+
+	done_.fetch_or(f, std::memory_order_release);
+}
+
+std::string const& x509_certificate_fields::fingerprint_sha256(std::vector<uint8_t> const& der)
+{
+	extract(sha256, der);
+	return fingerprint_sha256_;
+}
+
+std::string const& x509_certificate_fields::fingerprint_sha1(std::vector<uint8_t> const& der)
+{
+	extract(sha1, der);
+	return fingerprint_sha1_;
+}
+
+std::string const& x509_certificate_fields::subject(std::vector<uint8_t> const& der)
+{
+	extract(subject_dn, der);
+	return subject_;
+}
+
+std::string const& x509_certificate_fields::issuer(std::vector<uint8_t> const& der)
+{
+	extract(issuer_dn, der);
+	return issuer_;
+}
+
+std::vector<x509_certificate::subject_name> const& x509_certificate_fields::alt_subject_names(std::vector<uint8_t> const& der)
+{
+	extract(alt_names, der);
+	return alt_subject_names_;
+}
+
 tls_session_info::tls_session_info(std::string const& host, unsigned int port,
 		std::string const& protocol,
 		std::string const& key_exchange,
@@ -101,7 +216,7 @@ std::vector<x509_certificate> load_certificates(std::string_view const& certdata
 	certificates.reserve(certs.certs_size);
 	for (unsigned int i = 0; i < certs.certs_size; ++i) {
 		x509_certificate cert;
-		if (tls_layer_impl::extract_cert(certs.certs[i], cert, i + 1 == certs.certs_size, logger)) {
+		if (tls_layer_impl::extract_cert(certs.certs[i], cert, i + 1 == certs.certs_size, logger, true)) {
 			certificates.emplace_back(std::move(cert));
 		}
 		else {
@@ -3,6 +3,15 @@
 
 namespace fz {
 
+tls_anti_replay::tls_anti_replay(duration const& window, store_function const& store)
+	: impl_(std::make_unique<tls_anti_replay_impl>(window, store))
+{
+}
+
+tls_anti_replay::~tls_anti_replay()
+{
+}
+
 tls_layer::tls_layer(event_loop& event_loop, event_handler* evt_handler, socket_interface & next_layer, tls_system_trust_store* system_trust_store, logger_interface & logger)
 	: event_handler(event_loop)
 	, socket_layer(evt_handler, next_layer, false)
@@ -36,6 +45,11 @@ int tls_layer::read(void *buffer, unsigned int size, int& error)
 	return impl_->read(buffer, size, error);
 }
 
+int tls_layer::read_record(std::basic_string_view<uint8_t> & data, int& error)
+{
+	return impl_->read_record(data, error);
+}
+
 int tls_layer::write(void const* buffer, unsigned int size, int& error)
 {
 	return impl_->write(buffer, size, error);
@@ -111,6 +125,33 @@ std::string tls_layer::get_gnutls_version()
 	return tls_layer_impl::get_gnutls_version();
 }
 
+bool tls_layer::set_early_data(std::string_view const& data)
+{
+	if (!impl_ || impl_->state_ != socket_state::none) {
+		return false;
+	}
+
+	impl_->early_data_.clear();
+	impl_->early_data_.append(data);
+	return true;
+}
+
+bool tls_layer::set_early_data_limit(uint32_t max_size, tls_anti_replay & anti_replay)
+{
+	if (!impl_ || impl_->state_ != socket_state::none || !anti_replay.impl_->anti_replay_) {
+		return false;
+	}
+
+	impl_->max_early_data_ = max_size;
+	impl_->anti_replay_ = &anti_replay;
+	return true;
+}
+
+bool tls_layer::early_data_accepted() const
+{
+	return impl_ && impl_->early_data_accepted();
+}
+
 std::vector<uint8_t> tls_layer::get_session_parameters() const
 {
 	return impl_->get_session_parameters();
@@ -128,12 +169,22 @@ int tls_layer::connect(native_string const& host, unsigned int port, address_typ
 
 std::pair<std::string, std::string> tls_layer::generate_selfsigned_certificate(native_string const& password, std::string const& distinguished_name, std::vector<std::string> const& hostnames)
 {
-	return tls_layer_impl::generate_selfsigned_certificate(password, distinguished_name, hostnames);
+	return tls_layer_impl::generate_selfsigned_certificate(password, distinguished_name, hostnames, tls_key_type::ecdsa_p256);
+}
+
+std::pair<std::string, std::string> tls_layer::generate_selfsigned_certificate(native_string const& password, std::string const& distinguished_name, std::vector<std::string> const& hostnames, tls_key_type key_type)
+{
+	return tls_layer_impl::generate_selfsigned_certificate(password, distinguished_name, hostnames, key_type);
 }
 
 std::pair<std::string, std::string> tls_layer::generate_csr(native_string const& password, std::string const& distinguished_name, std::vector<std::string> const& hostnames, bool csr_as_pem)
 {
-	return tls_layer_impl::generate_csr(password, distinguished_name, hostnames, csr_as_pem);
+	return tls_layer_impl::generate_csr(password, distinguished_name, hostnames, csr_as_pem, tls_key_type::ecdsa_p256);
+}
+
+std::pair<std::string, std::string> tls_layer::generate_csr(native_string const& password, std::string const& distinguished_name, std::vector<std::string> const& hostnames, bool csr_as_pem, tls_key_type key_type)
+{
+	return tls_layer_impl::generate_csr(password, distinguished_name, hostnames, csr_as_pem, key_type);
 }
 
 int tls_layer::shutdown_read()
@@ -178,6 +229,60 @@ std::string tls_layer::get_alpn() const
 	return impl_->get_alpn();
 }
 
+void tls_layer::set_ocsp_stapler(ocsp_stapler * stapler)
+{
+	if (impl_) {
+		impl_->ocsp_stapler_ = stapler;
+	}
+}
+
+std::vector<uint8_t> tls_layer::get_stapled_ocsp_response() const
+{
+	if (!impl_) {
+		return {};
+	}
+
+	return impl_->get_stapled_ocsp_response();
+}
+
+bool tls_layer::set_buffer_pool(buffer_pool * pool)
+{
+	if (!impl_ || impl_->state_ != socket_state::none) {
+		return false;
+	}
+
+	impl_->buffer_pool_ = pool;
+	return true;
+}
+
+bool tls_layer::set_memory_budget(memory_budget * budget)
+{
+	if (!impl_ || impl_->state_ != socket_state::none) {
+		return false;
+	}
+
+	impl_->memory_budget_ = budget;
+	impl_->memory_charge_ = memory_charge(budget, memory_category::tls);
+	impl_->update_memory_charge();
+	return true;
+}
+
+tls_statistics tls_layer::get_statistics() const
+{
+	if (!impl_) {
+		return {};
+	}
+
+	return impl_->get_statistics();
+}
+
+void tls_layer::set_metrics(tls_metrics * metrics)
+{
+	if (impl_) {
+		impl_->set_metrics(metrics);
+	}
+}
+
 native_string tls_layer::get_hostname() const
 {
 	if (!impl_) {
@@ -1,7 +1,9 @@
 #include "libfilezilla/tls_layer.hpp"
 #include "tls_layer_impl.hpp"
+#include "libfilezilla/buffer_pool.hpp"
 #include "libfilezilla/tls_info.hpp"
 #include "tls_system_trust_store_impl.hpp"
+#include "libfilezilla/ocsp_stapler.hpp"
 
 #include "libfilezilla/file.hpp"
 #include "libfilezilla/iputils.hpp"
@@ -183,6 +185,37 @@ extern "C" gnutls_datum_t db_retr_func(void *ptr, gnutls_datum_t key)
 {
 	return tls_layerCallbacks::retrieve_session(ptr, key);
 }
+extern "C" int c_ocsp_status_func(gnutls_session_t session, void* ptr, gnutls_datum_t* ocsp_response)
+{
+	auto const* ours = gnutls_certificate_get_ours(session);
+	if (!ptr || !ours || !ours->data) {
+		return GNUTLS_E_NO_CERTIFICATE_STATUS;
+	}
+
+	// Only looks up the cached response, never blocks on fetching
+	auto const response = static_cast<ocsp_stapler*>(ptr)->get_response(std::vector<uint8_t>(ours->data, ours->data + ours->size));
+	if (response.empty()) {
+		return GNUTLS_E_NO_CERTIFICATE_STATUS;
+	}
+
+	ocsp_response->data = static_cast<unsigned char*>(gnutls_malloc(response.size()));
+	if (!ocsp_response->data) {
+		return GNUTLS_E_MEMORY_ERROR;
+	}
+	memcpy(ocsp_response->data, response.data(), response.size());
+	ocsp_response->size = static_cast<unsigned int>(response.size());
+
+	return 0;
+}
+
+extern "C" int c_anti_replay_add_func(void* ptr, time_t exp_time, gnutls_datum_t const* key, gnutls_datum_t const*)
+{
+	if (!ptr || !key) {
+		return GNUTLS_E_DB_ENTRY_EXISTS;
+	}
+	return static_cast<tls_anti_replay_impl*>(ptr)->add(exp_time, *key);
+}
+
 extern "C" int c_verify_output_cb(gnutls_x509_crt_t cert, gnutls_x509_crt_t issuer, gnutls_x509_crl_t crl, unsigned int verification_output)
 {
 	tls_layerCallbacks::verify_output_cb(cert, issuer, crl, verification_output);
@@ -205,6 +238,28 @@ std::string_view to_view(gnutls_datum_t const& d)
 	return {};
 }
 
+// Adds the time spent in its scope to the passed duration
+class gnutls_call_timer final
+{
+public:
+	explicit gnutls_call_timer(duration & d)
+		: d_(d)
+		, start_(monotonic_clock::now())
+	{}
+
+	~gnutls_call_timer()
+	{
+		d_ += monotonic_clock::now() - start_;
+	}
+
+	gnutls_call_timer(gnutls_call_timer const&) = delete;
+	gnutls_call_timer& operator=(gnutls_call_timer const&) = delete;
+
+private:
+	duration & d_;
+	monotonic_clock const start_;
+};
+
 struct datum_holder final : gnutls_datum_t
 {
 	datum_holder() {
@@ -253,6 +308,62 @@ void clone_cert(gnutls_x509_crt_t in, gnutls_x509_crt_t &out)
 }
 }
 
+tls_anti_replay_impl::tls_anti_replay_impl(duration const& window, tls_anti_replay::store_function const& store)
+	: store_(store)
+{
+	if (gnutls_anti_replay_init(&anti_replay_)) {
+		anti_replay_ = nullptr;
+		return;
+	}
+
+	gnutls_anti_replay_set_window(anti_replay_, static_cast<unsigned int>(window.get_milliseconds()));
+	gnutls_anti_replay_set_add_function(anti_replay_, &c_anti_replay_add_func);
+	gnutls_anti_replay_set_ptr(anti_replay_, this);
+}
+
+tls_anti_replay_impl::~tls_anti_replay_impl()
+{
+	if (anti_replay_) {
+		gnutls_anti_replay_deinit(anti_replay_);
+	}
+}
+
+int tls_anti_replay_impl::add(time_t expiration, gnutls_datum_t const& key)
+{
+	std::vector<uint8_t> k(key.data, key.data + key.size);
+	if (store_) {
+		return store_(k, datetime(expiration, datetime::seconds)) ? 0 : GNUTLS_E_DB_ENTRY_EXISTS;
+	}
+
+	scoped_lock l(mtx_);
+
+	time_t const now = datetime::now().get_time_t();
+	auto const res = seen_.emplace(std::move(k), expiration);
+	if (!res.second) {
+		if (res.first->second >= now) {
+			return GNUTLS_E_DB_ENTRY_EXISTS;
+		}
+		// Expired, but not swept yet
+		res.first->second = expiration;
+	}
+
+	// Entries only need to be remembered for the duration of the window. Sweep them
+	// once the map has doubled in size since the last sweep, keeping it amortized O(1).
+	if (seen_.size() >= sweep_at_) {
+		for (auto it = seen_.begin(); it != seen_.end(); ) {
+			if (it->second < now) {
+				it = seen_.erase(it);
+			}
+			else {
+				++it;
+			}
+		}
+		sweep_at_ = std::max(min_sweep_size, seen_.size() * 2);
+	}
+
+	return 0;
+}
+
 tls_layer_impl::tls_layer_impl(tls_layer& layer, tls_system_trust_store* systemTrustStore, logger_interface & logger)
 	: tls_layer_(layer)
 	, logger_(logger)
@@ -262,6 +373,9 @@ tls_layer_impl::tls_layer_impl(tls_layer& layer, tls_system_trust_store* systemT
 
 tls_layer_impl::~tls_layer_impl()
 {
+	if (memory_budget_) {
+		memory_budget_->remove_waiter(*this);
+	}
 	deinit();
 }
 
@@ -395,6 +509,11 @@ bool tls_layer_impl::init_session(bool client, int extra_flags)
 
 	int flags = client ? GNUTLS_CLIENT : GNUTLS_SERVER;
 	flags |= extra_flags;
+
+	bool const early_data = client ? !early_data_.empty() : (max_early_data_ && anti_replay_);
+	if (early_data) {
+		flags |= GNUTLS_ENABLE_EARLY_DATA;
+	}
 	int res = gnutls_init(&session_, flags);
 	if (res) {
 		log_error(res, L"gnutls_init");
@@ -423,6 +542,16 @@ bool tls_layer_impl::init_session(bool client, int extra_flags)
 			deinit();
 			return false;
 		}
+
+		if (early_data) {
+			gnutls_anti_replay_enable(session_, anti_replay_->impl_->anti_replay_);
+			res = gnutls_record_set_max_early_data_size(session_, max_early_data_);
+			if (res) {
+				log_error(res, L"gnutls_record_set_max_early_data_size");
+				deinit();
+				return false;
+			}
+		}
 	}
 
 	// For use in callbacks
@@ -481,6 +610,14 @@ bool tls_layer_impl::init_session(bool client, int extra_flags)
 
 	gnutls_dh_set_prime_bits(session_, 1024);
 
+	if (!client && ocsp_stapler_) {
+		// The credentials only ever hold a single certificate chain
+		res = gnutls_certificate_set_ocsp_status_request_function2(cert_credentials_, 0, &c_ocsp_status_func, ocsp_stapler_);
+		if (res) {
+			log_error(res, L"gnutls_certificate_set_ocsp_status_request_function2", logmsg::debug_warning);
+		}
+	}
+
 	gnutls_credentials_set(session_, GNUTLS_CRD_CERTIFICATE, cert_credentials_);
 
 	// Setup transport functions
@@ -498,8 +635,22 @@ bool tls_layer_impl::init_session(bool client, int extra_flags)
 
 void tls_layer_impl::deinit()
 {
+	if (state_ == socket_state::connecting && session_) {
+		++pending_stats_.failed_handshakes;
+	}
+	flush_stats();
+
 	deinit_session();
 
+	if (server_) {
+		early_data_.clear();
+		return_buffer(early_data_);
+		early_data_held_.clear();
+		return_buffer(early_data_held_);
+	}
+	send_buffer_.clear();
+	return_buffer(send_buffer_);
+
 	if (cert_credentials_) {
 		gnutls_certificate_free_credentials(cert_credentials_);
 		cert_credentials_ = nullptr;
@@ -527,6 +678,7 @@ void tls_layer_impl::deinit()
 
 void tls_layer_impl::deinit_session()
 {
+	release_record();
 	if (session_) {
 		gnutls_deinit(session_);
 		session_ = nullptr;
@@ -668,9 +820,10 @@ ssize_t tls_layer_impl::pull_function(void* data, size_t len)
 
 void tls_layer_impl::operator()(event_base const& ev)
 {
-	dispatch<socket_event, hostaddress_event>(ev, this
+	dispatch<socket_event, hostaddress_event, memory_relief_event>(ev, this
 		, &tls_layer_impl::on_socket_event
-		, &tls_layer_impl::forward_hostaddress_event);
+		, &tls_layer_impl::forward_hostaddress_event
+		, &tls_layer_impl::on_memory_relief_event);
 }
 
 void tls_layer_impl::forward_hostaddress_event(socket_event_source* source, std::string const& address)
@@ -731,6 +884,10 @@ void tls_layer_impl::on_read()
 	if (state_ == socket_state::connecting) {
 		continue_handshake();
 	}
+	else if (memory_waiting_) {
+		// A read event follows once memory pressure subsides
+		return;
+	}
 	else if (state_ == socket_state::connected || state_ == socket_state::shutting_down || state_ == socket_state::shut_down) {
 #if DEBUG_SOCKETEVENTS
 		assert(!debug_can_read_);
@@ -777,8 +934,11 @@ int tls_layer_impl::continue_write()
 {
 	while (!send_buffer_.empty()) {
 		ssize_t res = GNUTLS_E_AGAIN;
-		while ((res == GNUTLS_E_INTERRUPTED || res == GNUTLS_E_AGAIN) && can_write_to_socket_) {
-			res = gnutls_record_send(session_, send_buffer_.get(), send_buffer_.size());
+		{
+			gnutls_call_timer timer(pending_stats_.gnutls_time);
+			while ((res == GNUTLS_E_INTERRUPTED || res == GNUTLS_E_AGAIN) && can_write_to_socket_) {
+				res = gnutls_record_send(session_, send_buffer_.get(), send_buffer_.size());
+			}
 		}
 
 		if (res == GNUTLS_E_INTERRUPTED || res == GNUTLS_E_AGAIN) {
@@ -798,11 +958,15 @@ int tls_layer_impl::continue_write()
 
 		send_buffer_.consume(static_cast<size_t>(res));
 	}
+	return_buffer(send_buffer_);
 
 	if (send_new_ticket_) {
 		int res = GNUTLS_E_AGAIN;
-		while ((res == GNUTLS_E_INTERRUPTED || res == GNUTLS_E_AGAIN) && can_write_to_socket_) {
-			res = gnutls_session_ticket_send(session_, 1, 0);
+		{
+			gnutls_call_timer timer(pending_stats_.gnutls_time);
+			while ((res == GNUTLS_E_INTERRUPTED || res == GNUTLS_E_AGAIN) && can_write_to_socket_) {
+				res = gnutls_session_ticket_send(session_, 1, 0);
+			}
 		}
 
 		if (res == GNUTLS_E_INTERRUPTED || res == GNUTLS_E_AGAIN) {
@@ -839,6 +1003,134 @@ bool tls_layer_impl::resumed_session() const
 	return gnutls_session_is_resumed(session_) != 0;
 }
 
+tls_statistics tls_layer_impl::get_statistics() const
+{
+	tls_statistics ret = stats_;
+	ret += pending_stats_;
+	return ret;
+}
+
+void tls_layer_impl::set_metrics(tls_metrics * metrics)
+{
+	flush_stats();
+	metrics_ = metrics;
+}
+
+void tls_layer_impl::borrow_buffer(buffer & b)
+{
+	if (buffer_pool_ && !b.capacity()) {
+		b = buffer_pool_->acquire();
+	}
+}
+
+void tls_layer_impl::return_buffer(buffer & b)
+{
+	if (buffer_pool_ && b.empty() && b.capacity()) {
+		buffer_pool_->release(std::move(b));
+	}
+	update_memory_charge();
+}
+
+void tls_layer_impl::update_memory_charge()
+{
+	if (memory_budget_) {
+		memory_charge_.update(send_buffer_.capacity() + early_data_.capacity() + early_data_held_.capacity());
+	}
+}
+
+bool tls_layer_impl::wait_for_memory()
+{
+	if (!memory_budget_ || !memory_budget_->under_pressure() || gnutls_record_check_pending(session_)) {
+		return false;
+	}
+
+	// Data already decrypted by GnuTLS can still be read, but no more is pulled from the socket
+	if (!memory_budget_->wait(*this)) {
+		return false;
+	}
+	memory_waiting_ = true;
+	return true;
+}
+
+void tls_layer_impl::on_memory_relief()
+{
+	// Called from whichever thread released memory, continue in the event loop
+	tls_layer_.send_event<memory_relief_event>();
+}
+
+void tls_layer_impl::on_memory_relief_event()
+{
+	if (!memory_waiting_) {
+		return;
+	}
+	memory_waiting_ = false;
+
+	if (state_ == socket_state::connected || state_ == socket_state::shutting_down || state_ == socket_state::shut_down) {
+#if DEBUG_SOCKETEVENTS
+		debug_can_read_ = true;
+#endif
+		if (tls_layer_.event_handler_) {
+			tls_layer_.event_handler_->send_event<socket_event>(&tls_layer_, socket_event_flag::read, 0);
+		}
+	}
+}
+
+void tls_layer_impl::flush_stats()
+{
+	if (metrics_) {
+		metrics_->add(pending_stats_);
+	}
+	stats_ += pending_stats_;
+	pending_stats_ = tls_statistics();
+}
+
+void tls_layer_impl::count_sent(size_t bytes)
+{
+	pending_stats_.bytes_encrypted += bytes;
+	if (++pending_stats_.records_sent + pending_stats_.records_received >= 64) {
+		flush_stats();
+	}
+}
+
+void tls_layer_impl::count_received(size_t bytes)
+{
+	pending_stats_.bytes_decrypted += bytes;
+	if (++pending_stats_.records_received + pending_stats_.records_sent >= 64) {
+		flush_stats();
+	}
+}
+
+bool tls_layer_impl::early_data_accepted() const
+{
+	return session_ && handshake_successful_ && (gnutls_session_get_flags(session_) & GNUTLS_SFLAGS_EARLY_DATA);
+}
+
+bool tls_layer_impl::receive_early_data()
+{
+	if (!max_early_data_ || !anti_replay_) {
+		return false;
+	}
+
+	// The caller may still hold a view of early_data_ returned by read_record, it must not be reallocated
+	buffer & target = early_data_record_ ? early_data_held_ : early_data_;
+	borrow_buffer(target);
+
+	bool received{};
+	while (true) {
+		size_t const chunk = 16 * 1024;
+		ssize_t res = gnutls_record_recv_early_data(session_, target.get(chunk), chunk);
+		if (res <= 0) {
+			break;
+		}
+		target.add(static_cast<size_t>(res));
+		pending_stats_.bytes_decrypted += static_cast<uint64_t>(res);
+		received = true;
+	}
+	return_buffer(target);
+
+	return received;
+}
+
 bool tls_layer_impl::client_handshake(std::vector<uint8_t> const& session_to_resume, native_string const& session_hostname, std::vector<uint8_t> const& required_certificate, event_handler *const verification_handler)
 {
 	logger_.log(logmsg::debug_verbose, L"tls_layer_impl::client_handshake()");
@@ -855,6 +1147,7 @@ bool tls_layer_impl::client_handshake(std::vector<uint8_t> const& session_to_res
 	}
 
 	state_ = socket_state::connecting;
+	handshake_start_ = monotonic_clock::now();
 
 	if (!required_certificate.empty()) {
 		std::string_view v(reinterpret_cast<char const*>(required_certificate.data()), required_certificate.size());
@@ -890,6 +1183,19 @@ bool tls_layer_impl::client_handshake(std::vector<uint8_t> const& session_to_res
 		}
 		else {
 			logger_.log(logmsg::debug_info, L"Trying to resume existing TLS session.");
+
+			// Only possible if the session ticket permits early data. If not sent now,
+			// the early data gets sent after the handshake instead.
+			size_t const max_early_data = gnutls_record_get_max_early_data_size(session_);
+			if (!early_data_.empty() && early_data_.size() <= max_early_data) {
+				ssize_t sent = gnutls_record_send_early_data(session_, early_data_.get(), early_data_.size());
+				if (sent < 0) {
+					log_error(static_cast<int>(sent), L"gnutls_record_send_early_data", logmsg::debug_warning);
+				}
+				else {
+					logger_.log(logmsg::debug_info, L"Sending %d bytes of early data.", sent);
+				}
+			}
 		}
 	}
 
@@ -974,6 +1280,7 @@ bool tls_layer_impl::server_handshake(std::vector<uint8_t> const& session_to_res
 	}
 
 	state_ = socket_state::connecting;
+	handshake_start_ = monotonic_clock::now();
 
 	if (logger_.should_log(logmsg::debug_debug)) {
 		gnutls_handshake_set_hook_function(session_, GNUTLS_HANDSHAKE_ANY, GNUTLS_HOOK_BOTH, &handshake_hook_func);
@@ -1018,19 +1325,55 @@ int tls_layer_impl::continue_handshake()
 		preamble_.consume(static_cast<size_t>(written));
 	}
 
-	int res = gnutls_handshake(session_);
-	while (res == GNUTLS_E_AGAIN || res == GNUTLS_E_INTERRUPTED) {
-		if (!(gnutls_record_get_direction(session_) ? can_write_to_socket_ : can_read_from_socket_)) {
-			break;
-		}
+	int res;
+	{
+		gnutls_call_timer timer(pending_stats_.gnutls_time);
 		res = gnutls_handshake(session_);
+		while (res == GNUTLS_E_AGAIN || res == GNUTLS_E_INTERRUPTED) {
+			if (!(gnutls_record_get_direction(session_) ? can_write_to_socket_ : can_read_from_socket_)) {
+				break;
+			}
+			res = gnutls_handshake(session_);
+		}
+	}
+
+	if (server_ && (!res || res == GNUTLS_E_AGAIN || res == GNUTLS_E_INTERRUPTED) && receive_early_data() && res && !early_data_read_signalled_) {
+		// Early data can be read before the handshake has completed
+		early_data_read_signalled_ = true;
+#if DEBUG_SOCKETEVENTS
+		assert(!debug_can_read_);
+		debug_can_read_ = true;
+#endif
+		if (tls_layer_.event_handler_) {
+			tls_layer_.event_handler_->send_event<socket_event>(&tls_layer_, socket_event_flag::read, 0);
+		}
 	}
+
 	if (!res) {
 		logger_.log(logmsg::debug_info, L"TLS Handshake successful");
 		handshake_successful_ = true;
 
+		++pending_stats_.handshakes;
+		pending_stats_.handshake_time += monotonic_clock::now() - handshake_start_;
 		if (resumed_session()) {
 			logger_.log(logmsg::debug_info, L"TLS Session resumed");
+			++pending_stats_.resumed_handshakes;
+		}
+		flush_stats();
+
+		if (!server_ && !early_data_.empty()) {
+			if (early_data_accepted()) {
+				logger_.log(logmsg::debug_info, L"Early data accepted");
+			}
+			else {
+				// Needs to be sent as regular data ahead of anything else
+				logger_.log(logmsg::debug_info, L"Early data not accepted, sending it after handshake");
+				borrow_buffer(send_buffer_);
+				send_buffer_.append(early_data_);
+				update_memory_charge();
+				count_sent(early_data_.size());
+			}
+			early_data_.clear();
 		}
 
 		std::string const protocol = get_protocol();
@@ -1046,8 +1389,10 @@ int tls_layer_impl::continue_handshake()
 		else {
 			state_ = socket_state::connected;
 
+			// Unless already done for pending early data
+			bool const signal_read = (can_read_from_socket_ || !early_data_.empty()) && !early_data_read_signalled_;
 #if DEBUG_SOCKETEVENTS
-			if (can_read_from_socket_) {
+			if (signal_read) {
 				assert(!debug_can_read_);
 				debug_can_read_ = true;
 			}
@@ -1056,7 +1401,7 @@ int tls_layer_impl::continue_handshake()
 #endif
 			if (tls_layer_.event_handler_) {
 				tls_layer_.event_handler_->send_event<socket_event>(&tls_layer_, socket_event_flag::connection, 0);
-				if (can_read_from_socket_) {
+				if (signal_read) {
 					tls_layer_.event_handler_->send_event<socket_event>(&tls_layer_, socket_event_flag::read, 0);
 				}
 			}
@@ -1081,7 +1426,23 @@ int tls_layer_impl::continue_handshake()
 
 int tls_layer_impl::read(void *buffer, unsigned int len, int& error)
 {
+	release_record();
+
+	// Early data remains readable after shutting down the write side
+	if (server_ && !early_data_.empty() && len && state_ >= socket_state::connecting && state_ <= socket_state::shut_down) {
+		size_t const n = std::min(static_cast<size_t>(len), early_data_.size());
+		memcpy(buffer, early_data_.get(), n);
+		early_data_.consume(n);
+		return_buffer(early_data_);
+		error = 0;
+		return static_cast<int>(n);
+	}
+
 	if (state_ == socket_state::connecting) {
+#if DEBUG_SOCKETEVENTS
+		debug_can_read_ = false;
+#endif
+		early_data_read_signalled_ = false;
 		error = EAGAIN;
 		return -1;
 	}
@@ -1095,7 +1456,18 @@ int tls_layer_impl::read(void *buffer, unsigned int len, int& error)
 	assert(!has_pending_event(tls_layer_.event_handler_, &tls_layer_, socket_event_flag::read));
 #endif
 
+	if (wait_for_memory()) {
+#if DEBUG_SOCKETEVENTS
+		debug_can_read_ = false;
+#endif
+		error = EAGAIN;
+		return -1;
+	}
+
 	int res = do_call_gnutls_record_recv(buffer, len);
+	if (res > 0) {
+		count_received(res);
+	}
 	if (res >= 0) {
 		error = 0;
 		return res;
@@ -1104,6 +1476,7 @@ int tls_layer_impl::read(void *buffer, unsigned int len, int& error)
 #if DEBUG_SOCKETEVENTS
 		debug_can_read_ = false;
 #endif
+		early_data_read_signalled_ = false;
 		error = EAGAIN;
 	}
 	else {
@@ -1114,6 +1487,95 @@ int tls_layer_impl::read(void *buffer, unsigned int len, int& error)
 	return -1;
 }
 
+int tls_layer_impl::read_record(std::basic_string_view<uint8_t> & data, int& error)
+{
+	release_record();
+	data = {};
+
+	if (server_ && !early_data_.empty() && state_ >= socket_state::connecting && state_ <= socket_state::shut_down) {
+		early_data_record_ = early_data_.size();
+		data = std::basic_string_view<uint8_t>(early_data_.get(), early_data_.size());
+		error = 0;
+		return static_cast<int>(data.size());
+	}
+
+	if (state_ == socket_state::connecting) {
+#if DEBUG_SOCKETEVENTS
+		debug_can_read_ = false;
+#endif
+		early_data_read_signalled_ = false;
+		error = EAGAIN;
+		return -1;
+	}
+	else if (state_ != socket_state::connected && state_ != socket_state::shutting_down && state_ != socket_state::shut_down) {
+		error = ENOTCONN;
+		return -1;
+	}
+
+#if DEBUG_SOCKETEVENTS
+	assert(debug_can_read_);
+	assert(!has_pending_event(tls_layer_.event_handler_, &tls_layer_, socket_event_flag::read));
+#endif
+
+	if (wait_for_memory()) {
+#if DEBUG_SOCKETEVENTS
+		debug_can_read_ = false;
+#endif
+		error = EAGAIN;
+		return -1;
+	}
+
+	gnutls_packet_t packet{};
+	int res = do_call_gnutls_record_recv_packet(packet);
+	if (res > 0 && packet) {
+		count_received(res);
+		gnutls_datum_t d{};
+		gnutls_packet_get(packet, &d, nullptr);
+		record_ = packet;
+		data = std::basic_string_view<uint8_t>(d.data, d.size);
+		error = 0;
+		return static_cast<int>(d.size);
+	}
+
+	if (packet) {
+		gnutls_packet_deinit(packet);
+	}
+
+	if (res >= 0) {
+		error = 0;
+		return 0;
+	}
+	else if (res == GNUTLS_E_INTERRUPTED || res == GNUTLS_E_AGAIN) {
+#if DEBUG_SOCKETEVENTS
+		debug_can_read_ = false;
+#endif
+		early_data_read_signalled_ = false;
+		error = EAGAIN;
+	}
+	else {
+		failure(res, false, L"gnutls_record_recv_packet");
+		error = socket_error_ ? socket_error_ : ECONNABORTED;
+	}
+
+	return -1;
+}
+
+void tls_layer_impl::release_record()
+{
+	if (record_) {
+		gnutls_packet_deinit(record_);
+		record_ = nullptr;
+	}
+	if (early_data_record_) {
+		// The record spans all of early_data_, continue with the data received since
+		early_data_.consume(early_data_record_);
+		early_data_record_ = 0;
+		std::swap(early_data_, early_data_held_);
+		return_buffer(early_data_held_);
+		return_buffer(early_data_);
+	}
+}
+
 int tls_layer_impl::write(void const* buffer, unsigned int len, int& error)
 {
 //	for(size_t i = 0; i < 20; ++i) {logger_.log(logmsg::error, "Why not Zoidberg?");}
@@ -1144,13 +1606,18 @@ int tls_layer_impl::write(void const* buffer, unsigned int len, int& error)
 		return -1;
 	}
 
-	ssize_t res = gnutls_record_send(session_, buffer, len);
+	ssize_t res;
+	{
+		gnutls_call_timer timer(pending_stats_.gnutls_time);
+		res = gnutls_record_send(session_, buffer, len);
 
-	while ((res == GNUTLS_E_INTERRUPTED || res == GNUTLS_E_AGAIN) && can_write_to_socket_) {
-		res = gnutls_record_send(session_, nullptr, 0);
+		while ((res == GNUTLS_E_INTERRUPTED || res == GNUTLS_E_AGAIN) && can_write_to_socket_) {
+			res = gnutls_record_send(session_, nullptr, 0);
+		}
 	}
 
 	if (res >= 0) {
+		count_sent(static_cast<size_t>(res));
 		error = 0;
 		return static_cast<int>(res);
 	}
@@ -1164,7 +1631,10 @@ int tls_layer_impl::write(void const* buffer, unsigned int len, int& error)
 			if (len > max) {
 				len = max;
 			}
+			borrow_buffer(send_buffer_);
 			send_buffer_.append(reinterpret_cast<unsigned char const*>(buffer), len);
+			update_memory_charge();
+			count_sent(len);
 			return static_cast<int>(len);
 		}
 
@@ -1246,9 +1716,13 @@ int tls_layer_impl::continue_shutdown()
 	logger_.log(logmsg::debug_verbose, L"tls_layer_impl::continue_shutdown()");
 
 	if (!sent_closure_alert_) {
-		int res = gnutls_bye(session_, GNUTLS_SHUT_WR);
-		while ((res == GNUTLS_E_INTERRUPTED || res == GNUTLS_E_AGAIN) && can_write_to_socket_) {
+		int res;
+		{
+			gnutls_call_timer timer(pending_stats_.gnutls_time);
 			res = gnutls_bye(session_, GNUTLS_SHUT_WR);
+			while ((res == GNUTLS_E_INTERRUPTED || res == GNUTLS_E_AGAIN) && can_write_to_socket_) {
+				res = gnutls_bye(session_, GNUTLS_SHUT_WR);
+			}
 		}
 		if (res == GNUTLS_E_INTERRUPTED || res == GNUTLS_E_AGAIN) {
 			if (!socket_error_) {
@@ -1296,6 +1770,13 @@ void tls_layer_impl::set_verification_result(bool trusted)
 	if (trusted) {
 		state_ = socket_state::connected;
 
+		if (!send_buffer_.empty()) {
+			// Early data the server has not accepted
+			if (continue_write() == ECONNABORTED) {
+				return;
+			}
+		}
+
 #if DEBUG_SOCKETEVENTS
 		if (can_read_from_socket_) {
 			assert(!debug_can_read_);
@@ -1334,7 +1815,42 @@ static std::string bin2hex(unsigned char const* in, size_t size)
 }
 
 
-bool tls_layer_impl::extract_cert(gnutls_x509_crt_t const& cert, x509_certificate& out, bool last, logger_interface * logger)
+std::string tls_layer_impl::get_cert_dn(gnutls_x509_crt_t cert, bool issuer, logger_interface * logger)
+{
+	std::string ret;
+
+	datum_holder raw;
+	int res = issuer ? gnutls_x509_crt_get_issuer_dn3(cert, &raw, 0) : gnutls_x509_crt_get_dn3(cert, &raw, 0);
+	if (!res) {
+		ret = raw.to_string_view();
+	}
+	else {
+		if (logger) {
+			logger->log(logmsg::debug_warning, issuer ? "gnutls_x509_crt_get_issuer_dn3 failed with %d" : "gnutls_x509_crt_get_dn3 failed with %d", res);
+		}
+	}
+
+	return ret;
+}
+
+std::string tls_layer_impl::get_fingerprint(gnutls_digest_algorithm_t algo, std::vector<uint8_t> const& der)
+{
+	std::string ret;
+
+	gnutls_datum_t d;
+	d.data = const_cast<unsigned char*>(der.data());
+	d.size = static_cast<unsigned int>(der.size());
+
+	unsigned char digest[100];
+	size_t size = sizeof(digest);
+	if (!gnutls_fingerprint(algo, &d, digest, &size)) {
+		ret = bin2hex(digest, size);
+	}
+
+	return ret;
+}
+
+bool tls_layer_impl::extract_cert(gnutls_x509_crt_t const& cert, x509_certificate& out, bool last, logger_interface * logger, bool deferred)
 {
 	datetime expiration_time(gnutls_x509_crt_get_expiration_time(cert), datetime::seconds);
 	datetime activation_time(gnutls_x509_crt_get_activation_time(cert), datetime::seconds);
@@ -1375,18 +1891,32 @@ bool tls_layer_impl::extract_cert(gnutls_x509_crt_t const& cert, x509_certificat
 		}
 	}
 
-	std::string subject, issuer;
-
-	datum_holder raw_subject;
-	res = gnutls_x509_crt_get_dn3(cert, &raw_subject, 0);
-	if (!res) {
-		subject = raw_subject.to_string_view();
-	}
-	else {
+	datum_holder der;
+	if (gnutls_x509_crt_export2(cert, GNUTLS_X509_FMT_DER, &der) != GNUTLS_E_SUCCESS || !der.data || !der.size) {
 		if (logger) {
-			logger->log(logmsg::debug_warning, "gnutls_x509_crt_get_dn3 failed with %d", res);
+			logger->log(logmsg::error, L"gnutls_x509_crt_export2");
 		}
+		return false;
 	}
+	std::vector<uint8_t> data(der.data, der.data + der.size);
+
+	bool const self_signed = last ? gnutls_x509_crt_check_issuer(cert, cert) : false;
+
+	if (deferred) {
+		out = x509_certificate(
+			std::move(data),
+			activation_time, expiration_time,
+			serial,
+			pk_algo_name, pk_bits,
+			signAlgoName,
+			std::string(), std::string(), std::string(), std::string(),
+			std::vector<x509_certificate::subject_name>(),
+			self_signed);
+		out.deferred_ = std::make_shared<x509_certificate_fields>();
+		return true;
+	}
+
+	std::string subject = get_cert_dn(cert, false, logger);
 	if (subject.empty()) {
 		if (logger) {
 			logger->log(logmsg::error, fztranslate("Could not get distinguished name of certificate subject, gnutls_x509_get_dn failed"));
@@ -1396,16 +1926,7 @@ bool tls_layer_impl::extract_cert(gnutls_x509_crt_t const& cert, x509_certificat
 
 	std::vector<x509_certificate::subject_name> alt_subject_names = get_cert_subject_alt_names(cert);
 
-	datum_holder raw_issuer;
-	res = gnutls_x509_crt_get_issuer_dn3(cert, &raw_issuer, 0);
-	if (!res) {
-		issuer = raw_issuer.to_string_view();
-	}
-	else {
-		if (logger) {
-			logger->log(logmsg::debug_warning, "gnutls_x509_crt_get_issuer_dn3 failed with %d", res);
-		}
-	}
+	std::string issuer = get_cert_dn(cert, true, logger);
 	if (issuer.empty() ) {
 		if (logger) {
 			logger->log(logmsg::error, fztranslate("Could not get distinguished name of certificate issuer, gnutls_x509_get_issuer_dn failed"));
@@ -1413,29 +1934,8 @@ bool tls_layer_impl::extract_cert(gnutls_x509_crt_t const& cert, x509_certificat
 		return false;
 	}
 
-	std::string fingerprint_sha256;
-	std::string fingerprint_sha1;
-
-	unsigned char digest[100];
-	size = sizeof(digest) - 1;
-	if (!gnutls_x509_crt_get_fingerprint(cert, GNUTLS_DIG_SHA256, digest, &size)) {
-		digest[size] = 0;
-		fingerprint_sha256 = bin2hex(digest, size);
-	}
-	size = sizeof(digest) - 1;
-	if (!gnutls_x509_crt_get_fingerprint(cert, GNUTLS_DIG_SHA1, digest, &size)) {
-		digest[size] = 0;
-		fingerprint_sha1 = bin2hex(digest, size);
-	}
-
-	datum_holder der;
-	if (gnutls_x509_crt_export2(cert, GNUTLS_X509_FMT_DER, &der) != GNUTLS_E_SUCCESS || !der.data || !der.size) {
-		if (logger) {
-			logger->log(logmsg::error, L"gnutls_x509_crt_get_issuer_dn");
-		}
-		return false;
-	}
-	std::vector<uint8_t> data(der.data, der.data + der.size);
+	std::string fingerprint_sha256 = get_fingerprint(GNUTLS_DIG_SHA256, data);
+	std::string fingerprint_sha1 = get_fingerprint(GNUTLS_DIG_SHA1, data);
 
 	out = x509_certificate(
 		std::move(data),
@@ -1448,7 +1948,7 @@ bool tls_layer_impl::extract_cert(gnutls_x509_crt_t const& cert, x509_certificat
 		issuer,
 		subject,
 		std::move(alt_subject_names),
-		last ? gnutls_x509_crt_check_issuer(cert, cert) : false);
+		self_signed);
 
 	return true;
 }
@@ -2090,6 +2590,8 @@ std::string tls_layer_impl::list_tls_ciphers(std::string const& priority)
 
 int tls_layer_impl::do_call_gnutls_record_recv(void* data, size_t len)
 {
+	gnutls_call_timer timer(pending_stats_.gnutls_time);
+
 	ssize_t res = gnutls_record_recv(session_, data, len);
 	while ((res == GNUTLS_E_AGAIN || res == GNUTLS_E_INTERRUPTED) && can_read_from_socket_ && !gnutls_record_get_direction(session_)) {
 		// Spurious EAGAIN. Can happen if GnuTLS gets a partial
@@ -2109,6 +2611,24 @@ int tls_layer_impl::do_call_gnutls_record_recv(void* data, size_t len)
 	return static_cast<int>(res);
 }
 
+int tls_layer_impl::do_call_gnutls_record_recv_packet(gnutls_packet_t & packet)
+{
+	// Same as do_call_gnutls_record_recv, but GnuTLS decrypts the record in place
+	gnutls_call_timer timer(pending_stats_.gnutls_time);
+
+	ssize_t res = gnutls_record_recv_packet(session_, &packet);
+	while ((res == GNUTLS_E_AGAIN || res == GNUTLS_E_INTERRUPTED) && can_read_from_socket_ && !gnutls_record_get_direction(session_)) {
+		logger_.log(logmsg::debug_verbose, L"gnutls_record_recv_packet returned spurious EAGAIN");
+		res = gnutls_record_recv_packet(session_, &packet);
+	}
+
+	if ((res == GNUTLS_E_AGAIN || res == GNUTLS_E_INTERRUPTED) && socket_error_) {
+		res = GNUTLS_E_PULL_ERROR;
+	}
+
+	return static_cast<int>(res);
+}
+
 std::string tls_layer_impl::get_gnutls_version()
 {
 	char const* v = gnutls_check_version(nullptr);
@@ -2221,23 +2741,92 @@ std::vector<uint8_t> tls_layer_impl::get_raw_certificate() const
 	return ret;
 }
 
-std::pair<std::string, std::string> tls_layer_impl::generate_selfsigned_certificate(native_string const& password, std::string const& distinguished_name, std::vector<std::string> const& hostnames)
+namespace {
+int generate_privkey(gnutls_x509_privkey_t priv, tls_key_type key_type)
 {
-	std::pair<std::string, std::string> ret;
+	gnutls_pk_algorithm_t algo = GNUTLS_PK_ECDSA;
+	unsigned int bits{};
+	switch (key_type) {
+	case tls_key_type::ecdsa_p384:
+		bits = GNUTLS_CURVE_TO_BITS(GNUTLS_ECC_CURVE_SECP384R1);
+		break;
+	case tls_key_type::ed25519:
+		algo = GNUTLS_PK_EDDSA_ED25519;
+		bits = GNUTLS_CURVE_TO_BITS(GNUTLS_ECC_CURVE_ED25519);
+		break;
+	case tls_key_type::rsa:
+		algo = GNUTLS_PK_RSA;
+		bits = gnutls_sec_param_to_pk_bits(algo, GNUTLS_SEC_PARAM_HIGH);
+		if (bits < 2048) {
+			bits = 2048;
+		}
+		break;
+	default:
+		bits = GNUTLS_CURVE_TO_BITS(GNUTLS_ECC_CURVE_SECP256R1);
+		break;
+	}
 
+	return gnutls_x509_privkey_generate(priv, algo, bits, 0);
+}
+
+int import_privkey(gnutls_x509_privkey_t priv, std::string_view const& key)
+{
+	gnutls_datum_t d;
+	d.data = const_cast<unsigned char*>(reinterpret_cast<unsigned char const*>(key.data()));
+	d.size = static_cast<unsigned int>(key.size());
+	return gnutls_x509_privkey_import(priv, &d, GNUTLS_X509_FMT_PEM);
+}
+
+int export_privkey(gnutls_x509_privkey_t priv, native_string const& password, gnutls_datum_t & out)
+{
+	if (!password.empty()) {
+		return gnutls_x509_privkey_export2_pkcs8(priv, GNUTLS_X509_FMT_PEM, to_utf8(password).c_str(), 0, &out);
+	}
+	else if (gnutls_x509_privkey_get_pk_algorithm(priv) == GNUTLS_PK_EDDSA_ED25519) {
+		// There is no legacy format for Ed25519 keys
+		return gnutls_x509_privkey_export2_pkcs8(priv, GNUTLS_X509_FMT_PEM, nullptr, GNUTLS_PKCS_PLAIN, &out);
+	}
+	else {
+		return gnutls_x509_privkey_export2(priv, GNUTLS_X509_FMT_PEM, &out);
+	}
+}
+
+// Ed25519 mandates SHA-512
+gnutls_digest_algorithm_t sign_digest(gnutls_x509_privkey_t priv)
+{
+	return gnutls_x509_privkey_get_pk_algorithm(priv) == GNUTLS_PK_EDDSA_ED25519 ? GNUTLS_DIG_SHA512 : GNUTLS_DIG_SHA256;
+}
+}
+
+std::string tls_layer_impl::generate_key(tls_key_type key_type)
+{
 	gnutls_x509_privkey_t priv;
 	int res = gnutls_x509_privkey_init(&priv);
 	if (res) {
-		return ret;
+		return {};
 	}
 
-	auto fmt = GNUTLS_PK_ECDSA;
-	unsigned int bits = gnutls_sec_param_to_pk_bits(fmt, GNUTLS_SEC_PARAM_HIGH);
-	if (fmt == GNUTLS_PK_RSA && bits < 2048) {
-		bits = 2048;
+	datum_holder kh;
+	res = generate_privkey(priv, key_type);
+	if (!res) {
+		res = export_privkey(priv, native_string(), kh);
+	}
+	gnutls_x509_privkey_deinit(priv);
+
+	return res ? std::string() : kh.to_string();
+}
+
+std::pair<std::string, std::string> tls_layer_impl::generate_selfsigned_certificate(native_string const& password, std::string const& distinguished_name, std::vector<std::string> const& hostnames, tls_key_type key_type, std::string_view const& key)
+{
+	std::pair<std::string, std::string> ret;
+
+	gnutls_x509_privkey_t priv;
+	int res = gnutls_x509_privkey_init(&priv);
+	if (res) {
+		return ret;
 	}
 
-	res = gnutls_x509_privkey_generate(priv, fmt, bits, 0);
+	res = key.empty() ? generate_privkey(priv, key_type) : import_privkey(priv, key);
 	if (res) {
 		gnutls_x509_privkey_deinit(priv);
 		return ret;
@@ -2245,12 +2834,7 @@ std::pair<std::string, std::string> tls_layer_impl::generate_selfsigned_certific
 
 	datum_holder kh;
 
-	if (password.empty()) {
-		res = gnutls_x509_privkey_export2(priv, GNUTLS_X509_FMT_PEM, &kh);
-	}
-	else {
-		res = gnutls_x509_privkey_export2_pkcs8(priv, GNUTLS_X509_FMT_PEM, to_utf8(password).c_str(), 0, &kh);
-	}
+	res = export_privkey(priv, password, kh);
 	if (res) {
 		gnutls_x509_privkey_deinit(priv);
 		return ret;
@@ -2330,7 +2914,7 @@ std::pair<std::string, std::string> tls_layer_impl::generate_selfsigned_certific
 		return ret;
 	}
 
-	res = gnutls_x509_crt_sign2(crt, crt, priv, GNUTLS_DIG_SHA256, 0);
+	res = gnutls_x509_crt_sign2(crt, crt, priv, sign_digest(priv), 0);
 	if (res) {
 		gnutls_x509_privkey_deinit(priv);
 		gnutls_x509_crt_deinit(crt);
@@ -2353,7 +2937,7 @@ std::pair<std::string, std::string> tls_layer_impl::generate_selfsigned_certific
 	return ret;
 }
 
-std::pair<std::string, std::string> tls_layer_impl::generate_csr(native_string const& password, std::string const& distinguished_name, std::vector<std::string> const& hostnames, bool csr_as_pem)
+std::pair<std::string, std::string> tls_layer_impl::generate_csr(native_string const& password, std::string const& distinguished_name, std::vector<std::string> const& hostnames, bool csr_as_pem, tls_key_type key_type, std::string_view const& key)
 {
 	std::pair<std::string, std::string> ret;
 
@@ -2363,13 +2947,7 @@ std::pair<std::string, std::string> tls_layer_impl::generate_csr(native_string c
 		return ret;
 	}
 
-	auto fmt = GNUTLS_PK_ECDSA;
-	unsigned int bits = gnutls_sec_param_to_pk_bits(fmt, GNUTLS_SEC_PARAM_HIGH);
-	if (fmt == GNUTLS_PK_RSA && bits < 2048) {
-		bits = 2048;
-	}
-
-	res = gnutls_x509_privkey_generate(priv, fmt, bits, 0);
+	res = key.empty() ? generate_privkey(priv, key_type) : import_privkey(priv, key);
 	if (res) {
 		gnutls_x509_privkey_deinit(priv);
 		return ret;
@@ -2377,12 +2955,7 @@ std::pair<std::string, std::string> tls_layer_impl::generate_csr(native_string c
 
 	datum_holder kh;
 
-	if (password.empty()) {
-		res = gnutls_x509_privkey_export2(priv, GNUTLS_X509_FMT_PEM, &kh);
-	}
-	else {
-		res = gnutls_x509_privkey_export2_pkcs8(priv, GNUTLS_X509_FMT_PEM, to_utf8(password).c_str(), 0, &kh);
-	}
+	res = export_privkey(priv, password, kh);
 	if (res) {
 		gnutls_x509_privkey_deinit(priv);
 		return ret;
@@ -2440,7 +3013,7 @@ std::pair<std::string, std::string> tls_layer_impl::generate_csr(native_string c
 		return ret;
 	}
 
-	res = gnutls_x509_crq_sign2(crq, priv, GNUTLS_DIG_SHA256, 0);
+	res = gnutls_x509_crq_sign2(crq, priv, sign_digest(priv), 0);
 	if (res) {
 		gnutls_x509_privkey_deinit(priv);
 		gnutls_x509_crq_deinit(crq);
@@ -2540,6 +3113,18 @@ bool tls_layer_impl::do_set_alpn()
 	return res == 0;
 }
 
+std::vector<uint8_t> tls_layer_impl::get_stapled_ocsp_response() const
+{
+	std::vector<uint8_t> ret;
+	if (session_ && !server_) {
+		gnutls_datum_t d{};
+		if (gnutls_ocsp_status_request_get(session_, &d) == GNUTLS_E_SUCCESS && d.data) {
+			ret.assign(d.data, d.data + d.size);
+		}
+	}
+	return ret;
+}
+
 std::string tls_layer_impl::get_alpn() const
 {
 	if (session_) {
@@ -10,16 +10,63 @@ typedef std::make_signed_t<size_t> ssize_t;
 
 #include "libfilezilla/buffer.hpp"
 #include "libfilezilla/logger.hpp"
+#include "libfilezilla/memory_budget.hpp"
+#include "libfilezilla/mutex.hpp"
 #include "libfilezilla/socket.hpp"
 #include "libfilezilla/tls_info.hpp"
 #include "libfilezilla/tls_layer.hpp"
+#include "libfilezilla/tls_metrics.hpp"
 
+#include <atomic>
+#include <map>
 #include <optional>
 
 namespace fz {
+class buffer_pool;
 class tls_system_trust_store;
 class logger_interface;
 
+// Fields of x509_certificate that get extracted on first use
+class x509_certificate_fields final
+{
+public:
+	x509_certificate_fields() = default;
+	~x509_certificate_fields();
+
+	x509_certificate_fields(x509_certificate_fields const&) = delete;
+	x509_certificate_fields& operator=(x509_certificate_fields const&) = delete;
+
+	std::string const& fingerprint_sha256(std::vector<uint8_t> const& der);
+	std::string const& fingerprint_sha1(std::vector<uint8_t> const& der);
+	std::string const& subject(std::vector<uint8_t> const& der);
+	std::string const& issuer(std::vector<uint8_t> const& der);
+	std::vector<x509_certificate::subject_name> const& alt_subject_names(std::vector<uint8_t> const& der);
+
+private:
+	enum field : unsigned {
+		sha256 = 0x1,
+		sha1 = 0x2,
+		subject_dn = 0x4,
+		issuer_dn = 0x8,
+		alt_names = 0x10
+	};
+
+	void extract(field f, std::vector<uint8_t> const& der);
+	gnutls_x509_crt_t get_crt(std::vector<uint8_t> const& der);
+
+	mutex mtx_{false};
+	std::atomic<unsigned int> done_{};
+
+	gnutls_x509_crt_t crt_{};
+	bool crt_failed_{};
+
+	std::string fingerprint_sha256_;
+	std::string fingerprint_sha1_;
+	std::string subject_;
+	std::string issuer_;
+	std::vector<x509_certificate::subject_name> alt_subject_names_;
+};
+
 struct cert_list_holder final
 {
 	cert_list_holder() = default;
@@ -37,8 +84,33 @@ struct cert_list_holder final
 	unsigned int certs_size{};
 };
 
+class tls_anti_replay_impl final
+{
+public:
+	tls_anti_replay_impl(duration const& window, tls_anti_replay::store_function const& store);
+	~tls_anti_replay_impl();
+
+	// Returns 0 or GNUTLS_E_DB_ENTRY_EXISTS
+	int add(time_t expiration, gnutls_datum_t const& key);
+
+	gnutls_anti_replay_t anti_replay_{};
+
+private:
+	tls_anti_replay::store_function store_;
+
+	static constexpr size_t min_sweep_size = 64;
+
+	mutex mtx_{false};
+	std::map<std::vector<uint8_t>, time_t> seen_;
+	size_t sweep_at_{min_sweep_size};
+};
+
 class tls_layer;
-class tls_layer_impl final
+/// \private
+struct memory_relief_event_type{};
+typedef simple_event<memory_relief_event_type> memory_relief_event;
+
+class tls_layer_impl final : private memory_waiter
 {
 public:
 	tls_layer_impl(tls_layer& layer, tls_system_trust_store * systemTrustStore, logger_interface & logger);
@@ -51,6 +123,7 @@ public:
 	int connect(native_string const& host, unsigned int port, address_type family);
 
 	int read(void *buffer, unsigned int size, int& error);
+	int read_record(std::basic_string_view<uint8_t> & data, int& error);
 	int write(void const* buffer, unsigned int size, int& error);
 
 	int shutdown();
@@ -71,6 +144,10 @@ public:
 	int get_algorithm_warnings() const;
 
 	bool resumed_session() const;
+	bool early_data_accepted() const;
+
+	tls_statistics get_statistics() const;
+	void set_metrics(tls_metrics * metrics);
 
 	static std::string list_tls_ciphers(std::string const& priority);
 
@@ -83,18 +160,25 @@ public:
 	ssize_t push_function(void const* data, size_t len);
 	ssize_t pull_function(void* data, size_t len);
 
-	static std::pair<std::string, std::string> generate_selfsigned_certificate(native_string const& password, std::string const& distinguished_name, std::vector<std::string> const& hostnames);
-	static std::pair<std::string, std::string> generate_csr(native_string const& password, std::string const& distinguished_name, std::vector<std::string> const& hostnames, bool csr_as_pem);
+	// If key is non-empty, it is used instead of generating a new one
+	static std::pair<std::string, std::string> generate_selfsigned_certificate(native_string const& password, std::string const& distinguished_name, std::vector<std::string> const& hostnames, tls_key_type key_type, std::string_view const& key = {});
+	static std::pair<std::string, std::string> generate_csr(native_string const& password, std::string const& distinguished_name, std::vector<std::string> const& hostnames, bool csr_as_pem, tls_key_type key_type, std::string_view const& key = {});
+
+	// Returns unencrypted private key in PEM, empty on error
+	static std::string generate_key(tls_key_type key_type);
 
 	int shutdown_read();
 
 	void set_event_handler(event_handler* pEvtHandler, fz::socket_event_flag retrigger_block);
 
 	std::string get_alpn() const;
+
+	std::vector<uint8_t> get_stapled_ocsp_response() const;
 	native_string get_hostname() const;
 
 	static int load_certificates(std::string_view const& in, bool pem, gnutls_x509_crt_t *& certs, unsigned int & certs_size, bool & sort);
-	static bool extract_cert(gnutls_x509_crt_t const& cert, x509_certificate& out, bool last, logger_interface * logger);
+	// If deferred is set, fingerprints and names are only extracted once queried.
+	static bool extract_cert(gnutls_x509_crt_t const& cert, x509_certificate& out, bool last, logger_interface * logger, bool deferred = false);
 
 	void set_min_tls_ver(tls_ver ver);
 	void set_max_tls_ver(tls_ver ver);
@@ -123,6 +207,29 @@ private:
 	void failure(int code, bool send_close, std::wstring const& function = std::wstring());
 
 	int do_call_gnutls_record_recv(void* data, size_t len);
+	int do_call_gnutls_record_recv_packet(gnutls_packet_t & packet);
+
+	// Releases the data last returned by read_record
+	void release_record();
+
+	// Record counters are approximate: GnuTLS returns data of at most one record per call
+	void count_sent(size_t bytes);
+	void count_received(size_t bytes);
+
+	// Moves pending statistics into stats_ and the shared metrics
+	void flush_stats();
+
+	// With a buffer pool, staging buffers are only borrowed while holding data
+	void borrow_buffer(buffer & b);
+	void return_buffer(buffer & b);
+
+	// Charges the staging buffers to the memory budget, if any
+	void update_memory_charge();
+
+	// Returns true if reading has to wait for memory pressure to subside
+	bool wait_for_memory();
+	virtual void on_memory_relief() override;
+	void on_memory_relief_event();
 
 	void operator()(event_base const& ev);
 	void on_socket_event(socket_event_source* source, socket_event_flag t, int error);
@@ -134,6 +241,8 @@ private:
 	bool get_sorted_peer_certificates(gnutls_x509_crt_t *& certs, unsigned int & certs_size);
 
 	static std::vector<x509_certificate::subject_name> get_cert_subject_alt_names(gnutls_x509_crt_t cert);
+	static std::string get_cert_dn(gnutls_x509_crt_t cert, bool issuer, logger_interface * logger);
+	static std::string get_fingerprint(gnutls_digest_algorithm_t algo, std::vector<uint8_t> const& der);
 
 	void log_verification_error(int status);
 
@@ -143,6 +252,9 @@ private:
 
 	int new_session_ticket();
 
+	// Moves early data received so far from GnuTLS into early_data_
+	bool receive_early_data();
+
 	tls_layer& tls_layer_;
 
 	logger_interface & logger_;
@@ -180,14 +292,40 @@ private:
 	// Sent out just before the handshake itself
 	buffer preamble_;
 
+	// Client: Data to send as early data. Server: Early data received, but not yet read.
+	buffer early_data_;
+
+	// Server: Early data received while read_record's view of early_data_ is in use
+	buffer early_data_held_;
+	uint32_t max_early_data_{};
+	tls_anti_replay* anti_replay_{};
+	bool early_data_read_signalled_{};
+
+	// Last record returned by read_record, either a packet or a view of the early data
+	gnutls_packet_t record_{};
+	size_t early_data_record_{};
+
+	buffer_pool * buffer_pool_{};
+
+	memory_budget * memory_budget_{};
+	memory_charge memory_charge_;
+	bool memory_waiting_{};
+
+	tls_metrics * metrics_{};
+	tls_statistics stats_;
+	tls_statistics pending_stats_;
+	monotonic_clock handshake_start_;
+
 	std::vector<uint8_t> required_certificate_;
 
 	friend class tls_layer;
 	friend class tls_layerCallbacks;
+	friend class x509_certificate_fields;
 
 	native_string hostname_;
 
 	tls_system_trust_store* system_trust_store_{};
+	ocsp_stapler* ocsp_stapler_{};
 
 	event_handler * verification_handler_{};
 
@@ -0,0 +1,48 @@
+#include "libfilezilla/tls_metrics.hpp"
+
+namespace fz {
+
+tls_statistics& tls_statistics::operator+=(tls_statistics const& op)
+{
+	handshakes += op.handshakes;
+	resumed_handshakes += op.resumed_handshakes;
+	failed_handshakes += op.failed_handshakes;
+	handshake_time += op.handshake_time;
+	gnutls_time += op.gnutls_time;
+	bytes_encrypted += op.bytes_encrypted;
+	bytes_decrypted += op.bytes_decrypted;
+	records_sent += op.records_sent;
+	records_received += op.records_received;
+	return *this;
+}
+
+void tls_metrics::add(tls_statistics const& stats)
+{
+	scoped_lock l(mtx_);
+	stats_ += stats;
+}
+
+tls_statistics tls_metrics::get() const
+{
+	scoped_lock l(mtx_);
+	return stats_;
+}
+
+tls_statistics tls_metrics::reset()
+{
+	scoped_lock l(mtx_);
+	tls_statistics ret = stats_;
+	stats_ = tls_statistics();
+	return ret;
+}
+
+double tls_metrics::resumption_rate() const
+{
+	scoped_lock l(mtx_);
+	if (!stats_.handshakes) {
+		return 0;
+	}
+	return static_cast<double>(stats_.resumed_handshakes) / stats_.handshakes;
+}
+
+}
@@ -1,4 +1,7 @@
 #include "../lib/libfilezilla/buffer.hpp"
+#include "../lib/libfilezilla/buffer_pool.hpp"
+#include "../lib/libfilezilla/memory_budget.hpp"
+#include "../lib/libfilezilla/small_buffer.hpp"
 
 #include "test_utils.hpp"
 
@@ -9,6 +12,9 @@ class buffer_test final : public CppUnit::TestFixture
 	CPPUNIT_TEST_SUITE(buffer_test);
 	CPPUNIT_TEST(test_simple);
 	CPPUNIT_TEST(test_append);
+	CPPUNIT_TEST(test_pool);
+	CPPUNIT_TEST(test_small);
+	CPPUNIT_TEST(test_memory_budget);
 	CPPUNIT_TEST_SUITE_END();
 
 public:
@@ -17,6 +23,9 @@ public:
 
 	void test_simple();
 	void test_append();
+	void test_pool();
+	void test_small();
+	void test_memory_budget();
 };
 
 CPPUNIT_TEST_SUITE_REGISTRATION(buffer_test);
@@ -62,3 +71,147 @@ void buffer_test::test_append()
 		CPPUNIT_ASSERT(buf[cap - 5 + i] == static_cast<unsigned char>(i + 5));
 	}
 }
+
+void buffer_test::test_pool()
+{
+	fz::buffer_pool pool(2048, 1024);
+
+	auto a = pool.acquire();
+	auto b = pool.acquire();
+	ASSERT_EQUAL(size_t(2), pool.outstanding());
+
+	a.append(std::string(500, 'a'));
+	size_t const capacity = a.capacity();
+	unsigned char const* data = a.get();
+	pool.release(std::move(a));
+	ASSERT_EQUAL(size_t(1), pool.outstanding());
+	ASSERT_EQUAL(capacity, pool.idle_memory());
+
+	// The released memory gets reused
+	auto c = pool.acquire();
+	CPPUNIT_ASSERT(c.empty());
+	ASSERT_EQUAL(capacity, c.capacity());
+	CPPUNIT_ASSERT(c.get() == data);
+	ASSERT_EQUAL(size_t(0), pool.idle_memory());
+
+	// Oversized buffers are not kept
+	b.append(std::string(2000, 'b'));
+	pool.release(std::move(b));
+	ASSERT_EQUAL(size_t(0), pool.idle_memory());
+
+	pool.release(std::move(c));
+	ASSERT_EQUAL(size_t(0), pool.outstanding());
+	ASSERT_EQUAL(capacity, pool.idle_memory());
+}
+
+void buffer_test::test_small()
+{
+	fz::small_buffer<16> buf;
+	buf.append("foo");
+	buf.append("bar");
+	ASSERT_EQUAL(size_t(6), buf.size());
+	ASSERT_EQUAL(size_t(16), buf.capacity());
+
+	buf.consume(3);
+	memcpy(buf.get(13), "bazquxquuxcor", 13);
+	buf.add(13);
+	CPPUNIT_ASSERT(!buf.spilled());
+	CPPUNIT_ASSERT(buf == std::string_view("barbazquxquuxcor"));
+
+	// Appending from itself
+	buf.consume(10);
+	buf.append(buf.get(), 3);
+	CPPUNIT_ASSERT(buf == std::string_view("uuxcoruux"));
+
+	fz::buffer copy = buf.to_buffer();
+	CPPUNIT_ASSERT(buf == copy);
+
+	// Outgrowing the inline storage
+	buf.append(buf.get(), buf.size());
+	buf.append(buf.get(), buf.size());
+	CPPUNIT_ASSERT(buf.spilled());
+	ASSERT_EQUAL(size_t(36), buf.size());
+	CPPUNIT_ASSERT(buf == std::string_view("uuxcoruuxuuxcoruuxuuxcoruuxuuxcoruux"));
+
+	fz::small_buffer<16> buf2 = buf;
+	CPPUNIT_ASSERT(buf2 == buf);
+
+	// Moving out of a spilled buffer does not copy
+	unsigned char const* data = buf.get();
+	fz::buffer moved = std::move(buf).to_buffer();
+	CPPUNIT_ASSERT(moved.get() == data);
+	CPPUNIT_ASSERT(buf.empty());
+	CPPUNIT_ASSERT(buf2 == moved);
+
+	fz::small_buffer<16> buf3(std::move(buf2));
+	CPPUNIT_ASSERT(buf2.empty());
+	CPPUNIT_ASSERT(buf3 == moved);
+
+	buf3.resize(0);
+	CPPUNIT_ASSERT(buf3.empty());
+}
+
+namespace {
+struct memory_waiter final : public fz::memory_waiter
+{
+	virtual void on_memory_relief() override {
+		++relieved_;
+	}
+
+	int relieved_{};
+};
+}
+
+void buffer_test::test_memory_budget()
+{
+	fz::memory_budget budget(8000);
+
+	{
+		fz::buffer buf;
+		fz::memory_charge charge(&budget, fz::memory_category::socket);
+		buf.append(std::string(100, 'a'));
+		charge.track(buf);
+		ASSERT_EQUAL(buf.capacity(), budget.usage());
+		ASSERT_EQUAL(buf.capacity(), budget.usage(fz::memory_category::socket));
+		ASSERT_EQUAL(size_t(0), budget.usage(fz::memory_category::tls));
+		CPPUNIT_ASSERT(!budget.under_pressure());
+	}
+	ASSERT_EQUAL(size_t(0), budget.usage());
+
+	memory_waiter w;
+	CPPUNIT_ASSERT(!budget.wait(w));
+
+	fz::memory_charge a(&budget, fz::memory_category::tls);
+	fz::memory_charge b(&budget, fz::memory_category::user);
+	a.update(5000);
+	b.update(4000);
+	CPPUNIT_ASSERT(budget.under_pressure());
+	CPPUNIT_ASSERT(budget.wait(w));
+
+	// Pressure persists until usage falls to 7/8 of the limit
+	b.update(2500);
+	CPPUNIT_ASSERT(budget.under_pressure());
+	ASSERT_EQUAL(0, w.relieved_);
+
+	fz::memory_charge moved(std::move(b));
+	ASSERT_EQUAL(size_t(0), b.charged());
+	ASSERT_EQUAL(size_t(7500), budget.usage());
+
+	moved.update(1000);
+	CPPUNIT_ASSERT(!budget.under_pressure());
+	ASSERT_EQUAL(1, w.relieved_);
+
+	// Waiters are notified only once per registration
+	moved.update(4000);
+	CPPUNIT_ASSERT(budget.under_pressure());
+	moved.update(0);
+	ASSERT_EQUAL(1, w.relieved_);
+
+	// Raising the limit relieves pressure
+	moved.update(4000);
+	CPPUNIT_ASSERT(budget.wait(w));
+	budget.set_limit(20000);
+	CPPUNIT_ASSERT(!budget.under_pressure());
+	ASSERT_EQUAL(2, w.relieved_);
+	ASSERT_EQUAL(size_t(9000), budget.usage());
+}
@@ -0,0 +1,227 @@
+#include "../lib/libfilezilla/certificate_generator.hpp"
+#include "../lib/libfilezilla/certificate_store.hpp"
+#include "../lib/libfilezilla/file.hpp"
+#include "../lib/libfilezilla/logger.hpp"
+#include "../lib/libfilezilla/thread_pool.hpp"
+#include "../lib/libfilezilla/tls_layer.hpp"
+#include "../lib/libfilezilla/util.hpp"
+
+#include "test_utils.hpp"
+
+#include <map>
+
+class certificates_test final : public CppUnit::TestFixture
+{
+	CPPUNIT_TEST_SUITE(certificates_test);
+	CPPUNIT_TEST(test_deferred);
+	CPPUNIT_TEST(test_store);
+	CPPUNIT_TEST(test_key_types);
+	CPPUNIT_TEST(test_generator);
+	CPPUNIT_TEST_SUITE_END();
+
+public:
+	void setUp() {}
+	void tearDown() {}
+
+	void test_deferred();
+	void test_store();
+	void test_key_types();
+	void test_generator();
+};
+
+CPPUNIT_TEST_SUITE_REGISTRATION(certificates_test);
+
+namespace {
+std::string const& get_cert(size_t i)
+{
+	static std::vector<std::string> certs = [] {
+		std::vector<std::string> ret;
+		for (size_t i = 0; i < 3; ++i) {
+			auto const name = "libfilezilla test " + std::to_string(i);
+			ret.push_back(fz::tls_layer::generate_selfsigned_certificate(fz::native_string(), "CN=" + name, {"test" + std::to_string(i) + ".example.com"}).second);
+		}
+		return ret;
+	}();
+	return certs[i];
+}
+
+struct null_logger : public fz::logger_interface
+{
+	virtual void do_log(fz::logmsg::type, std::wstring &&) {}
+};
+
+class generation_handler final : public fz::event_handler
+{
+public:
+	generation_handler(fz::event_loop & l)
+		: fz::event_handler(l)
+	{}
+
+	virtual ~generation_handler()
+	{
+		remove_handler();
+	}
+
+	void operator()(fz::event_base const& ev) override
+	{
+		fz::dispatch<fz::certificate_generation_event>(ev, this, &generation_handler::on_result);
+	}
+
+	void on_result(fz::certificate_generator*, uint64_t id, std::pair<std::string, std::string> const& result)
+	{
+		fz::scoped_lock l(m_);
+		results_[id] = result;
+		cond_.signal(l);
+	}
+
+	bool wait(size_t count)
+	{
+		fz::scoped_lock l(m_);
+		while (results_.size() < count) {
+			if (!cond_.wait(l, fz::duration::from_seconds(30))) {
+				return false;
+			}
+		}
+		return true;
+	}
+
+	fz::mutex m_;
+	fz::condition cond_;
+	std::map<uint64_t, std::pair<std::string, std::string>> results_;
+};
+
+bool write_file(fz::native_string const& name, std::string const& data)
+{
+	fz::file f;
+	if (!f.open(name, fz::file::writing, fz::file::empty)) {
+		return false;
+	}
+	return f.write(data.data(), data.size()) == static_cast<int64_t>(data.size());
+}
+}
+
+void certificates_test::test_deferred()
+{
+	auto certs = fz::load_certificates(get_cert(0), true, false);
+	CPPUNIT_ASSERT_EQUAL(size_t(1), certs.size());
+
+	// Copies share the fields extracted on first use
+	auto const copy = certs[0];
+	ASSERT_EQUAL(std::string("CN=libfilezilla test 0"), copy.get_subject());
+	ASSERT_EQUAL(certs[0].get_subject(), certs[0].get_issuer());
+	CPPUNIT_ASSERT(certs[0].self_signed());
+
+	auto const& sans = certs[0].get_alt_subject_names();
+	CPPUNIT_ASSERT_EQUAL(size_t(1), sans.size());
+	ASSERT_EQUAL(std::string("test0.example.com"), sans[0].name);
+	CPPUNIT_ASSERT(sans[0].is_dns);
+
+	// 32 bytes hex-encoded with separators
+	ASSERT_EQUAL(size_t(95), copy.get_fingerprint_sha256().size());
+	ASSERT_EQUAL(size_t(59), copy.get_fingerprint_sha1().size());
+	ASSERT_EQUAL(copy.get_fingerprint_sha256(), certs[0].get_fingerprint_sha256());
+}
+
+void certificates_test::test_store()
+{
+	std::vector<fz::native_string> files;
+	for (size_t i = 0; i < 3; ++i) {
+		files.push_back(fzT("certificates_test_") + fz::to_native(std::to_string(i)) + fzT(".pem"));
+		CPPUNIT_ASSERT(write_file(files.back(), get_cert(i)));
+	}
+	// Duplicates and missing files are skipped
+	files.push_back(files.front());
+	files.push_back(fzT("certificates_test_nonexisting.pem"));
+
+	fz::thread_pool pool;
+	fz::certificate_store store;
+	ASSERT_EQUAL(size_t(3), store.load_files(pool, files, true, 3));
+
+	for (size_t i = 0; i < 3; ++i) {
+		fz::remove_file(files[i]);
+	}
+
+	ASSERT_EQUAL(size_t(3), store.size());
+	for (size_t i = 0; i < 3; ++i) {
+		auto const& cert = store.certificates()[i];
+		ASSERT_EQUAL("CN=libfilezilla test " + std::to_string(i), cert.get_subject());
+		CPPUNIT_ASSERT(store.find_by_fingerprint(cert.get_fingerprint_sha256()) == &cert);
+
+		auto issuers = store.find_issuers(cert);
+		CPPUNIT_ASSERT_EQUAL(size_t(1), issuers.size());
+		CPPUNIT_ASSERT(issuers[0] == &cert);
+		ASSERT_EQUAL(size_t(1), store.find_by_issuer(cert.get_issuer()).size());
+	}
+	CPPUNIT_ASSERT(store.find_by_subject("CN=nonexisting").empty());
+	CPPUNIT_ASSERT(!store.find_by_fingerprint("00"));
+
+	CPPUNIT_ASSERT(!store.add(store.certificates()[0]));
+	auto other = fz::load_certificates(get_cert(1), true, false);
+	CPPUNIT_ASSERT(!store.add(other[0]));
+
+	store.clear();
+	CPPUNIT_ASSERT(store.empty());
+	CPPUNIT_ASSERT(store.add(other[0]));
+}
+
+void certificates_test::test_key_types()
+{
+	fz::thread_pool pool;
+	fz::event_loop loop;
+	null_logger log;
+
+	for (auto key_type : {fz::tls_key_type::ecdsa_p256, fz::tls_key_type::ecdsa_p384, fz::tls_key_type::ed25519}) {
+		auto const key_and_cert = fz::tls_layer::generate_selfsigned_certificate(fz::native_string(), "CN=libfilezilla test", {}, key_type);
+		CPPUNIT_ASSERT(!key_and_cert.first.empty());
+
+		auto const certs = fz::load_certificates(key_and_cert.second, true, false);
+		CPPUNIT_ASSERT_EQUAL(size_t(1), certs.size());
+		CPPUNIT_ASSERT(certs[0].self_signed());
+
+		// Key and certificate need to match
+		fz::socket s(pool, nullptr);
+		fz::tls_layer tls(loop, nullptr, s, nullptr, log);
+		CPPUNIT_ASSERT(tls.set_certificate(key_and_cert.first, key_and_cert.second, fz::native_string()));
+
+		auto const csr = fz::tls_layer::generate_csr(fzT("secret"), "CN=libfilezilla test", {"example.com"}, true, key_type);
+		CPPUNIT_ASSERT(csr.first.find("ENCRYPTED PRIVATE KEY") != std::string::npos);
+		CPPUNIT_ASSERT(csr.second.find("CERTIFICATE REQUEST") != std::string::npos);
+	}
+}
+
+void certificates_test::test_generator()
+{
+	fz::thread_pool pool;
+	fz::tls_key_pool keys(pool, fz::tls_key_type::ed25519, 2);
+	for (int i = 0; i < 100 && keys.available() < 2; ++i) {
+		fz::sleep(fz::duration::from_milliseconds(50));
+	}
+	CPPUNIT_ASSERT_EQUAL(size_t(2), keys.available());
+
+	auto const key = keys.take();
+	CPPUNIT_ASSERT(key.find("PRIVATE KEY") != std::string::npos);
+	CPPUNIT_ASSERT(key != keys.take());
+
+	fz::event_loop loop;
+	generation_handler h(loop);
+
+	fz::certificate_generator generator(pool, &keys);
+	uint64_t const cert_id = generator.generate_selfsigned_certificate(h, fz::native_string(), "CN=libfilezilla test", {"example.com"}, fz::tls_key_type::ed25519);
+	uint64_t const csr_id = generator.generate_csr(h, fz::native_string(), "CN=libfilezilla test", {"example.com"}, false);
+	CPPUNIT_ASSERT(cert_id && csr_id && cert_id != csr_id);
+
+	CPPUNIT_ASSERT(h.wait(2));
+
+	auto const& cert = h.results_[cert_id];
+	CPPUNIT_ASSERT(!cert.first.empty());
+	auto const certs = fz::load_certificates(cert.second, true, false);
+	CPPUNIT_ASSERT_EQUAL(size_t(1), certs.size());
+	ASSERT_EQUAL(std::string("CN=libfilezilla test"), certs[0].get_subject());
+
+	// DER-encoded CSR starts with a SEQUENCE
+	auto const& csr = h.results_[csr_id];
+	CPPUNIT_ASSERT(!csr.first.empty());
+	CPPUNIT_ASSERT(!csr.second.empty() && csr.second[0] == 0x30);
+
+	generator.cancel(h);
+}
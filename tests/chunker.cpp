@@ -0,0 +1,200 @@
+#include "../lib/libfilezilla/chunk_store.hpp"
+#include "../lib/libfilezilla/util.hpp"
+
+#ifndef FZ_WINDOWS
+#include <stdlib.h>
+#include <unistd.h>
+#endif
+
+#include <set>
+
+#include "test_utils.hpp"
+
+class chunker_test final : public CppUnit::TestFixture
+{
+	CPPUNIT_TEST_SUITE(chunker_test);
+	CPPUNIT_TEST(test_chunker);
+#ifndef FZ_WINDOWS
+	CPPUNIT_TEST(test_store);
+#endif
+	CPPUNIT_TEST_SUITE_END();
+
+public:
+	void setUp() {}
+	void tearDown() {}
+
+	void test_chunker();
+#ifndef FZ_WINDOWS
+	void test_store();
+#endif
+};
+
+CPPUNIT_TEST_SUITE_REGISTRATION(chunker_test);
+
+namespace {
+std::vector<std::vector<uint8_t>> split(std::vector<uint8_t> const& data, fz::content_chunker & chunker, size_t max_piece)
+{
+	std::vector<std::vector<uint8_t>> ret;
+
+	fz::buffer in;
+	fz::buffer chunk;
+	size_t pos{};
+	while (true) {
+		size_t const piece = std::min(data.size() - pos, static_cast<size_t>(fz::random_number(1, static_cast<int64_t>(max_piece))));
+		in.append(data.data() + pos, piece);
+		pos += piece;
+		bool const final = pos == data.size();
+		while (chunker.next(in, chunk, final)) {
+			ret.emplace_back(chunk.get(), chunk.get() + chunk.size());
+		}
+		if (final) {
+			break;
+		}
+	}
+	CPPUNIT_ASSERT(in.empty());
+
+	return ret;
+}
+}
+
+void chunker_test::test_chunker()
+{
+	fz::content_chunker chunker(4000);
+	CPPUNIT_ASSERT_EQUAL(size_t(4096), chunker.average_size());
+	CPPUNIT_ASSERT_EQUAL(size_t(1024), chunker.min_size());
+	CPPUNIT_ASSERT_EQUAL(size_t(32768), chunker.max_size());
+
+	auto const data = fz::random_bytes(1024 * 1024);
+
+	// Boundaries do not depend on how the data is passed in
+	auto const chunks = split(data, chunker, 100000);
+	CPPUNIT_ASSERT(split(data, chunker, 100) == chunks);
+
+	std::vector<uint8_t> joined;
+	for (size_t i = 0; i < chunks.size(); ++i) {
+		CPPUNIT_ASSERT(chunks[i].size() <= chunker.max_size());
+		if (i + 1 < chunks.size()) {
+			CPPUNIT_ASSERT(chunks[i].size() >= chunker.min_size());
+		}
+		joined.insert(joined.end(), chunks[i].cbegin(), chunks[i].cend());
+	}
+	CPPUNIT_ASSERT(joined == data);
+	CPPUNIT_ASSERT(chunks.size() > 128 && chunks.size() < 512);
+
+	// Edits only affect nearby chunks
+	auto modified = data;
+	modified.insert(modified.begin() + 1000, 7, 'x');
+	modified.erase(modified.begin() + 500000, modified.begin() + 500100);
+	auto const modified_chunks = split(modified, chunker, 100000);
+
+	std::set<std::vector<uint8_t>> const original(chunks.cbegin(), chunks.cend());
+	size_t shared{};
+	for (auto const& c : modified_chunks) {
+		if (original.count(c)) {
+			++shared;
+		}
+	}
+	CPPUNIT_ASSERT(shared + 12 >= modified_chunks.size());
+
+	// Long runs of identical bytes are cut at the maximum size
+	std::vector<uint8_t> zeros(100000);
+	auto const zero_chunks = split(zeros, chunker, 100000);
+	CPPUNIT_ASSERT_EQUAL(size_t(4), zero_chunks.size());
+	CPPUNIT_ASSERT_EQUAL(chunker.max_size(), zero_chunks[0].size());
+
+	CPPUNIT_ASSERT(split({}, chunker, 1).empty());
+}
+
+#ifndef FZ_WINDOWS
+namespace {
+void write_file(std::string const& name, std::vector<uint8_t> const& data)
+{
+	fz::file f(name, fz::file::writing, fz::file::empty);
+	CPPUNIT_ASSERT(f.opened());
+	CPPUNIT_ASSERT_EQUAL(static_cast<int64_t>(data.size()), f.write(data.data(), static_cast<int64_t>(data.size())));
+}
+
+std::vector<uint8_t> read_file(std::string const& name)
+{
+	std::vector<uint8_t> ret;
+	fz::file f(name, fz::file::reading);
+	if (f.opened()) {
+		uint8_t buf[4096];
+		int64_t read;
+		while ((read = f.read(buf, sizeof(buf))) > 0) {
+			ret.insert(ret.end(), buf, buf + read);
+		}
+	}
+	return ret;
+}
+}
+
+void chunker_test::test_store()
+{
+	char tmpl[] = "/tmp/fzchunksXXXXXX";
+	CPPUNIT_ASSERT(mkdtemp(tmpl));
+	std::string const dir = tmpl;
+
+	// Two files sharing most of their data
+	auto const first = fz::random_bytes(500000);
+	auto second = first;
+	second.insert(second.begin() + 250000, 10, 'x');
+	write_file(dir + "/first", first);
+	write_file(dir + "/second", second);
+
+	fz::content_chunker chunker;
+	std::vector<fz::chunk_store::id> first_chunks;
+	std::vector<fz::chunk_store::id> second_chunks;
+	fz::chunk_store::id last;
+	uint64_t stored{};
+	{
+		fz::chunk_store store;
+		CPPUNIT_ASSERT(store.open(dir));
+
+		fz::file f(dir + "/first", fz::file::reading);
+		CPPUNIT_ASSERT(store.store_file(f, first_chunks, chunker));
+		CPPUNIT_ASSERT_EQUAL(static_cast<uint64_t>(first.size()), store.stored_bytes());
+
+		CPPUNIT_ASSERT(store.missing(first_chunks).empty());
+
+		// Only the chunks around the insertion are new
+		fz::file f2(dir + "/second", fz::file::reading);
+		CPPUNIT_ASSERT(store.store_file(f2, second_chunks, chunker));
+		CPPUNIT_ASSERT(store.stored_bytes() < first.size() + 100000);
+		CPPUNIT_ASSERT(store.deduplicated_bytes() > second.size() - 100000);
+
+		CPPUNIT_ASSERT(store.flush());
+
+		// Closing the store flushes it as well
+		bool added{};
+		std::string const s = "unflushed";
+		CPPUNIT_ASSERT(store.add(reinterpret_cast<uint8_t const*>(s.data()), s.size(), last, &added));
+		CPPUNIT_ASSERT(added);
+		CPPUNIT_ASSERT(store.add(reinterpret_cast<uint8_t const*>(s.data()), s.size(), last, &added));
+		CPPUNIT_ASSERT(!added);
+		stored = store.stored_bytes();
+	}
+
+	{
+		fz::chunk_store store;
+		CPPUNIT_ASSERT(store.open(dir));
+		CPPUNIT_ASSERT_EQUAL(stored, store.stored_bytes());
+		CPPUNIT_ASSERT(store.missing(second_chunks).empty());
+		CPPUNIT_ASSERT(store.contains(last));
+
+		fz::file out(dir + "/out", fz::file::writing, fz::file::empty);
+		CPPUNIT_ASSERT(store.restore_file(second_chunks, out));
+		out.close();
+		CPPUNIT_ASSERT(read_file(dir + "/out") == second);
+
+		fz::buffer buf;
+		CPPUNIT_ASSERT(!store.get(fz::chunk_store::compute_id(nullptr, 0), buf));
+		CPPUNIT_ASSERT(buf.empty());
+	}
+
+	for (auto const& name : {"/first", "/second", "/out", "/data", "/index"}) {
+		unlink((dir + name).c_str());
+	}
+	rmdir(tmpl);
+}
+#endif
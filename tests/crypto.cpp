@@ -1,9 +1,13 @@
+#include "../lib/libfilezilla/encode.hpp"
 #include "../lib/libfilezilla/encryption.hpp"
+#include "../lib/libfilezilla/hash.hpp"
 #include "../lib/libfilezilla/signature.hpp"
 #include "../lib/libfilezilla/util.hpp"
 
 #include "test_utils.hpp"
 
+#include <algorithm>
+
 #include <string.h>
 
 class crypto_test final : public CppUnit::TestFixture
@@ -12,6 +16,8 @@ class crypto_test final : public CppUnit::TestFixture
 	CPPUNIT_TEST(test_encryption);
 	CPPUNIT_TEST(test_encryption_with_password);
 	CPPUNIT_TEST(test_signature);
+	CPPUNIT_TEST(test_hmac);
+	CPPUNIT_TEST(test_ciphers);
 	CPPUNIT_TEST_SUITE_END();
 
 public:
@@ -21,6 +27,8 @@ public:
 	void test_encryption();
 	void test_encryption_with_password();
 	void test_signature();
+	void test_hmac();
+	void test_ciphers();
 };
 
 CPPUNIT_TEST_SUITE_REGISTRATION(crypto_test);
@@ -107,3 +115,116 @@ void crypto_test::test_signature()
 	CPPUNIT_ASSERT(!fz::verify(sig, pub));
 	CPPUNIT_ASSERT(!fz::verify("Hello", sig2v, pub));
 }
+
+void crypto_test::test_hmac()
+{
+	// RFC 4231 test case 2
+	std::string const key = "Jefe";
+	std::string const data = "what do ya want for nothing?";
+	auto const expected = fz::hex_decode("5bdcc146bf60754e6a042426089575c75a003f089d2739839dec58b964ec3843");
+
+	fz::hmac_accumulator acc(fz::hash_algorithm::sha256, key);
+	CPPUNIT_ASSERT_EQUAL(size_t(32), acc.digest_size());
+
+	// Streaming, the key schedule is reused across messages
+	for (int i = 0; i < 3; ++i) {
+		acc << std::string_view(data).substr(0, 10) << std::string_view(data).substr(10);
+		CPPUNIT_ASSERT(acc.digest() == expected);
+	}
+
+	// Copies carry the state over
+	acc.update(std::string_view(data).substr(0, 5));
+	fz::hmac_accumulator copy = acc;
+	acc.update(std::string_view(data).substr(5));
+	copy.update(std::string_view(data).substr(5));
+	CPPUNIT_ASSERT(acc.digest() == expected);
+	CPPUNIT_ASSERT(copy.digest() == expected);
+
+	// Digest into caller storage, truncated
+	uint8_t mac[16];
+	acc.update(data);
+	acc.digest(mac, sizeof(mac));
+	CPPUNIT_ASSERT(std::vector<uint8_t>(mac, mac + sizeof(mac)) == std::vector<uint8_t>(expected.cbegin(), expected.cbegin() + 16));
+
+	acc.update(std::string_view("garbage"));
+	acc.reinit();
+	acc.update(data);
+	CPPUNIT_ASSERT(acc.verify(expected.data(), expected.size()));
+	acc.update(data);
+	CPPUNIT_ASSERT(!acc.verify(expected.data(), expected.size() - 1));
+
+	// Truncated MACs only if explicitly allowed, and never shorter than half the digest
+	acc.update(data);
+	CPPUNIT_ASSERT(!acc.verify(mac, sizeof(mac)));
+	acc.update(data);
+	CPPUNIT_ASSERT(acc.verify(mac, sizeof(mac), 16));
+	acc.update(data);
+	CPPUNIT_ASSERT(!acc.verify(mac, 8, 8));
+	acc.update(data);
+	CPPUNIT_ASSERT(!acc.verify(mac, 1, 0));
+	mac[3] ^= 1;
+	acc.update(data);
+	CPPUNIT_ASSERT(!acc.verify(mac, sizeof(mac), 16));
+	acc.update(data);
+	CPPUNIT_ASSERT(!acc.verify(mac, 0));
+
+	// Same results as the one-shot functions, also with keys longer than the block size
+	auto const long_key = fz::random_bytes(200);
+	auto const message = fz::random_bytes(1000);
+	fz::hmac_accumulator sha1(fz::hash_algorithm::sha1, long_key);
+	sha1.update(message);
+	CPPUNIT_ASSERT(sha1.digest() == fz::hmac_sha1(long_key, message));
+	fz::hmac_accumulator sha256(fz::hash_algorithm::sha256, long_key);
+	sha256.update(message);
+	CPPUNIT_ASSERT(sha256.digest() == fz::hmac_sha256(long_key, message));
+
+	fz::hmac_accumulator sha512(fz::hash_algorithm::sha512, std::string_view());
+	CPPUNIT_ASSERT_EQUAL(size_t(64), sha512.digest().size());
+}
+
+void crypto_test::test_ciphers()
+{
+	CPPUNIT_ASSERT(fz::preferred_aead_cipher() != fz::aead_cipher::automatic);
+
+	auto const plain = fz::random_bytes(1000);
+	std::string const ad = "associated";
+	auto const* adp = reinterpret_cast<uint8_t const*>(ad.data());
+
+	auto const key = fz::symmetric_key::generate();
+	auto const priv = fz::private_key::generate();
+	auto const pub = priv.pubkey();
+
+	std::vector<uint8_t> const header{'F', 'Z', 'E', 1, 2};
+
+	for (auto const cipher : {fz::aead_cipher::aes256_gcm, fz::aead_cipher::chacha20_poly1305}) {
+		bool const versioned = cipher == fz::aead_cipher::chacha20_poly1305;
+
+		// Symmetric
+		auto c = fz::encrypt(plain.data(), plain.size(), key, adp, ad.size(), cipher);
+		CPPUNIT_ASSERT_EQUAL(plain.size() + fz::symmetric_key::encryption_overhead(cipher), c.size());
+		CPPUNIT_ASSERT_EQUAL(versioned, std::equal(header.cbegin(), header.cend(), c.cbegin()));
+		CPPUNIT_ASSERT(fz::decrypt(c.data(), c.size(), key, adp, ad.size()) == plain);
+		CPPUNIT_ASSERT(fz::decrypt(c, key).empty());
+
+		c[c.size() / 2] ^= 1;
+		CPPUNIT_ASSERT(fz::decrypt(c.data(), c.size(), key, adp, ad.size()).empty());
+
+		// Asymmetric
+		c = fz::encrypt(plain.data(), plain.size(), pub, adp, ad.size(), cipher);
+		CPPUNIT_ASSERT_EQUAL(plain.size() + fz::public_key::key_size + fz::public_key::salt_size + 16 + (versioned ? header.size() : 0), c.size());
+		CPPUNIT_ASSERT_EQUAL(versioned, std::equal(header.cbegin(), header.cend(), c.cbegin()));
+		CPPUNIT_ASSERT(fz::decrypt(c.data(), c.size(), priv, adp, ad.size()) == plain);
+		CPPUNIT_ASSERT(fz::decrypt(c, priv).empty());
+		CPPUNIT_ASSERT(fz::decrypt(c.data(), c.size(), fz::private_key::generate(), adp, ad.size()).empty());
+
+		c[c.size() / 2] ^= 1;
+		CPPUNIT_ASSERT(fz::decrypt(c.data(), c.size(), priv, adp, ad.size()).empty());
+	}
+
+	// The automatically chosen cipher
+	auto const c = fz::encrypt(plain, key);
+	CPPUNIT_ASSERT_EQUAL(plain.size() + fz::symmetric_key::encryption_overhead(fz::aead_cipher::automatic), c.size());
+	CPPUNIT_ASSERT(fz::decrypt(c, key) == plain);
+
+	CPPUNIT_ASSERT_EQUAL(fz::symmetric_key::encryption_overhead(fz::aead_cipher::aes256_gcm), fz::symmetric_key::encryption_overhead());
+}
@@ -0,0 +1,184 @@
+#include "../lib/libfilezilla/delta.hpp"
+#include "../lib/libfilezilla/util.hpp"
+
+#ifndef FZ_WINDOWS
+#include <stdlib.h>
+#include <unistd.h>
+#endif
+
+#include "test_utils.hpp"
+
+class delta_test final : public CppUnit::TestFixture
+{
+	CPPUNIT_TEST_SUITE(delta_test);
+#ifndef FZ_WINDOWS
+	CPPUNIT_TEST(test_delta);
+	CPPUNIT_TEST(test_empty_base);
+#endif
+	CPPUNIT_TEST_SUITE_END();
+
+public:
+	void setUp() {}
+	void tearDown() {}
+
+#ifndef FZ_WINDOWS
+	void test_delta();
+	void test_empty_base();
+#endif
+};
+
+CPPUNIT_TEST_SUITE_REGISTRATION(delta_test);
+
+#ifndef FZ_WINDOWS
+namespace {
+void write_file(std::string const& name, std::vector<uint8_t> const& data)
+{
+	fz::file f(name, fz::file::writing, fz::file::empty);
+	CPPUNIT_ASSERT(f.opened());
+	CPPUNIT_ASSERT_EQUAL(static_cast<int64_t>(data.size()), f.write(data.data(), static_cast<int64_t>(data.size())));
+}
+
+std::vector<uint8_t> read_file(std::string const& name)
+{
+	std::vector<uint8_t> ret;
+	fz::file f(name, fz::file::reading);
+	if (f.opened()) {
+		uint8_t buf[4096];
+		int64_t read;
+		while ((read = f.read(buf, sizeof(buf))) > 0) {
+			ret.insert(ret.end(), buf, buf + read);
+		}
+	}
+	return ret;
+}
+
+// Transfers new_data to the side holding base_data, returns the size of the delta
+size_t transfer(std::string const& dir, std::vector<uint8_t> const& base_data, std::vector<uint8_t> const& new_data, size_t block_size)
+{
+	std::string const base_name = dir + "/base";
+	std::string const out_name = dir + "/out";
+	write_file(base_name, base_data);
+
+	// Signature computed from the file and sent over
+	fz::buffer sig_data;
+	{
+		fz::file base(base_name, fz::file::reading);
+		fz::delta_signature sig;
+		CPPUNIT_ASSERT(sig.compute(base, block_size));
+		CPPUNIT_ASSERT_EQUAL(static_cast<uint64_t>(base_data.size()), sig.size());
+		sig.append_to(sig_data);
+	}
+
+	fz::delta_signature sig;
+	CPPUNIT_ASSERT(sig.load(sig_data.get(), sig_data.size()));
+	CPPUNIT_ASSERT(!sig.load(sig_data.get(), sig_data.size() - 1));
+	CPPUNIT_ASSERT(sig.load(sig_data.get(), sig_data.size()));
+
+	// Delta generated from data arriving in pieces of random size
+	fz::buffer delta;
+	fz::delta_generator gen(sig);
+	size_t pos{};
+	while (pos < new_data.size()) {
+		size_t const chunk = std::min(new_data.size() - pos, static_cast<size_t>(fz::random_number(1, 20000)));
+		gen.update(new_data.data() + pos, chunk, delta);
+		pos += chunk;
+	}
+	gen.finalize(delta);
+	CPPUNIT_ASSERT_EQUAL(static_cast<uint64_t>(new_data.size()), gen.matched_bytes() + gen.literal_bytes());
+
+	// Applied in pieces as well
+	{
+		fz::file base(base_name, fz::file::reading);
+		fz::file out(out_name, fz::file::writing, fz::file::empty);
+		fz::delta_applier applier(base, out);
+		size_t pos{};
+		while (pos < delta.size()) {
+			size_t const chunk = std::min(delta.size() - pos, static_cast<size_t>(fz::random_number(1, 1000)));
+			CPPUNIT_ASSERT(applier.update(delta.get() + pos, chunk));
+			pos += chunk;
+		}
+		CPPUNIT_ASSERT(applier.finalize());
+	}
+	CPPUNIT_ASSERT(read_file(out_name) == new_data);
+
+	// Corrupted deltas are detected
+	{
+		fz::buffer corrupt = delta;
+		corrupt[corrupt.size() - 1] ^= 1;
+		fz::file base(base_name, fz::file::reading);
+		fz::file out(out_name, fz::file::writing, fz::file::empty);
+		fz::delta_applier applier(base, out);
+		CPPUNIT_ASSERT(!applier.apply(corrupt));
+	}
+
+	unlink(base_name.c_str());
+	unlink(out_name.c_str());
+
+	return delta.size();
+}
+}
+
+void delta_test::test_delta()
+{
+	char tmpl[] = "/tmp/fzdeltaXXXXXX";
+	CPPUNIT_ASSERT(mkdtemp(tmpl));
+
+	auto const base = fz::random_bytes(1024 * 1024 + 123);
+
+	// Insertion, modification, deletion and appended data
+	auto modified = base;
+	auto const inserted = fz::random_bytes(100);
+	modified.insert(modified.begin() + 1000, inserted.begin(), inserted.end());
+	modified[500000] ^= 0xff;
+	modified.erase(modified.begin() + 700000, modified.begin() + 703000);
+	auto const appended = fz::random_bytes(5000);
+	modified.insert(modified.end(), appended.begin(), appended.end());
+
+	size_t const delta_size = transfer(tmpl, base, modified, 4096);
+	CPPUNIT_ASSERT(delta_size < 30000);
+
+	// Unchanged file, the short last block matches as well
+	CPPUNIT_ASSERT(transfer(tmpl, base, base, 0) < 1000);
+
+	// Unrelated data gets sent literally
+	auto const other = fz::random_bytes(100000);
+	CPPUNIT_ASSERT(transfer(tmpl, base, other, 4096) > other.size());
+
+	// Repetitive data
+	std::vector<uint8_t> zeros(200000);
+	CPPUNIT_ASSERT(transfer(tmpl, zeros, zeros, 4096) < 1000);
+
+	// Pending data exceeding the literal size limit gets split into several literals
+	CPPUNIT_ASSERT(transfer(tmpl, fz::random_bytes(100000), fz::random_bytes(600000), 1024 * 1024) > 600000);
+
+	// Overlong literals are rejected
+	{
+		std::string const base_name = std::string(tmpl) + "/base";
+		std::string const out_name = std::string(tmpl) + "/out";
+		write_file(base_name, {});
+
+		uint8_t const overlong[] = {'F', 'Z', 'D', 'D', 1, 0, 0, 0x10, 0, 'L', 0, 4, 0, 1};
+		fz::file base(base_name, fz::file::reading);
+		fz::file out(out_name, fz::file::writing, fz::file::empty);
+		fz::delta_applier applier(base, out);
+		CPPUNIT_ASSERT(!applier.update(overlong, sizeof(overlong)));
+
+		unlink(base_name.c_str());
+		unlink(out_name.c_str());
+	}
+
+	rmdir(tmpl);
+}
+
+void delta_test::test_empty_base()
+{
+	char tmpl[] = "/tmp/fzdeltaXXXXXX";
+	CPPUNIT_ASSERT(mkdtemp(tmpl));
+
+	transfer(tmpl, {}, fz::random_bytes(70000), 0);
+	transfer(tmpl, fz::random_bytes(70000), {}, 0);
+	transfer(tmpl, {}, {}, 0);
+
+	rmdir(tmpl);
+}
+#endif
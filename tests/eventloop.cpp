@@ -10,6 +10,7 @@ class EventloopTest final : public CppUnit::TestFixture
 	CPPUNIT_TEST(testFilter);
 	CPPUNIT_TEST(testCondition);
 	CPPUNIT_TEST(testTimer);
+	CPPUNIT_TEST(testPersistent);
 	CPPUNIT_TEST_SUITE_END();
 
 public:
@@ -20,6 +21,7 @@ public:
 	void testFilter();
 	void testCondition();
 	void testTimer();
+	void testPersistent();
 };
 
 CPPUNIT_TEST_SUITE_REGISTRATION(EventloopTest);
@@ -254,3 +256,59 @@ void EventloopTest::testTimer()
 
 	CPPUNIT_ASSERT(handler.cond_.wait(l, fz::duration::from_seconds(1)));
 }
+
+void EventloopTest::testPersistent()
+{
+	T1 ev1;
+	T3 ev3;
+
+	{
+		fz::event_loop loop;
+		target t(loop);
+
+		for (int i = 0; i < 10; ++i) {
+			fz::scoped_lock l(t.m_);
+			t.send_persistent_event(&ev1);
+			t.send_persistent_event(&ev3);
+			CPPUNIT_ASSERT(t.cond_.wait(l, fz::duration::from_seconds(1)));
+		}
+
+		CPPUNIT_ASSERT_EQUAL(t.a_, 10);
+		CPPUNIT_ASSERT_EQUAL(t.b_, 10);
+	}
+
+	{
+		// Removing persistent events from the queue must not delete them
+		fz::event_loop loop(fz::event_loop::threadless);
+		target t(loop);
+
+		t.send_persistent_event(&ev1);
+		t.send_persistent_event(&ev3);
+		t.send_event<T3>();
+
+		int removed{};
+		loop.filter_events([&](fz::event_loop::Events::value_type & ev) {
+			if (ev.second == &ev1) {
+				++removed;
+				return true;
+			}
+			return false;
+		});
+		CPPUNIT_ASSERT_EQUAL(removed, 1);
+		CPPUNIT_ASSERT(!loop.persistent_event_pending(&ev1));
+		CPPUNIT_ASSERT(loop.persistent_event_pending(&ev3));
+
+		// Sending a pending event again does not queue it twice
+		t.send_persistent_event(&ev1);
+		t.send_persistent_event(&ev3);
+
+		int queued{};
+		loop.filter_events([&](fz::event_loop::Events::value_type & ev) {
+			if (ev.second == &ev1 || ev.second == &ev3) {
+				++queued;
+			}
+			return false;
+		});
+		CPPUNIT_ASSERT_EQUAL(queued, 2);
+	}
+}
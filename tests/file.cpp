@@ -0,0 +1,327 @@
+#include "../lib/libfilezilla/atomic_file_writer.hpp"
+#include "../lib/libfilezilla/event_loop.hpp"
+#include "../lib/libfilezilla/file.hpp"
+#include "../lib/libfilezilla/hashing_layer.hpp"
+#include "../lib/libfilezilla/local_filesys.hpp"
+#include "../lib/libfilezilla/thread_pool.hpp"
+#include "../lib/libfilezilla/util.hpp"
+
+#ifndef FZ_WINDOWS
+#include <sys/stat.h>
+#include <errno.h>
+#include <stdlib.h>
+#include <unistd.h>
+#endif
+
+#include "test_utils.hpp"
+
+#include <algorithm>
+#include <atomic>
+
+class file_test final : public CppUnit::TestFixture
+{
+	CPPUNIT_TEST_SUITE(file_test);
+#ifndef FZ_WINDOWS
+	CPPUNIT_TEST(test_atomic_writer);
+	CPPUNIT_TEST(test_copy_sparse);
+	CPPUNIT_TEST(test_rename_across);
+	CPPUNIT_TEST(test_hashing_file);
+#endif
+	CPPUNIT_TEST_SUITE_END();
+
+public:
+	void setUp() {}
+	void tearDown() {}
+
+#ifndef FZ_WINDOWS
+	void test_atomic_writer();
+	void test_copy_sparse();
+	void test_rename_across();
+	void test_hashing_file();
+#endif
+};
+
+CPPUNIT_TEST_SUITE_REGISTRATION(file_test);
+
+#ifndef FZ_WINDOWS
+namespace {
+std::string read_file(std::string const& path)
+{
+	fz::file f(path, fz::file::reading);
+	std::string ret;
+	if (f.opened()) {
+		char buf[1024];
+		int64_t read;
+		while ((read = f.read(buf, sizeof(buf))) > 0) {
+			ret.append(buf, static_cast<size_t>(read));
+		}
+	}
+	return ret;
+}
+
+fz::buffer make_buffer(std::string const& s)
+{
+	fz::buffer b;
+	b.append(s);
+	return b;
+}
+
+std::vector<std::string> list_dir(std::string const& path)
+{
+	std::vector<std::string> ret;
+	fz::local_filesys fs;
+	if (fs.begin_find_files(path)) {
+		std::string name;
+		while (fs.get_next_file(name)) {
+			ret.push_back(name);
+		}
+	}
+	std::sort(ret.begin(), ret.end());
+	return ret;
+}
+
+struct write_handler final : public fz::event_handler
+{
+	write_handler(fz::event_loop & loop)
+		: fz::event_handler(loop)
+	{}
+
+	virtual ~write_handler()
+	{
+		remove_handler();
+	}
+
+	virtual void operator()(fz::event_base const& ev) override
+	{
+		fz::dispatch<fz::atomic_file_write_event>(ev, this, &write_handler::on_written);
+	}
+
+	void on_written(std::string const& path, fz::result const& res)
+	{
+		fz::scoped_lock l(mtx_);
+		results_.emplace_back(path, res);
+		cond_.signal(l);
+	}
+
+	fz::mutex mtx_;
+	fz::condition cond_;
+	std::vector<std::pair<std::string, fz::result>> results_;
+};
+}
+
+void file_test::test_atomic_writer()
+{
+	char tmpl[] = "/tmp/fzfileXXXXXX";
+	CPPUNIT_ASSERT(mkdtemp(tmpl));
+	std::string const root = tmpl;
+
+	fz::thread_pool pool;
+	fz::event_loop loop(pool);
+	write_handler h(loop);
+
+	{
+		fz::atomic_file_writer w(pool, fz::duration::from_milliseconds(5));
+
+		// Concurrent writes from many threads
+		std::vector<fz::async_task> tasks;
+		std::atomic<int> failures{};
+		for (int t = 0; t < 8; ++t) {
+			tasks.emplace_back(pool.spawn([&, t]() {
+				for (int i = 0; i < 10; ++i) {
+					std::string const name = root + "/f" + std::to_string(t);
+					std::string content = "thread " + std::to_string(t) + " iteration " + std::to_string(i);
+					if (!w.write(name, make_buffer(content))) {
+						++failures;
+					}
+					else if (read_file(name) != content) {
+						++failures;
+					}
+				}
+			}));
+		}
+		for (auto & t : tasks) {
+			t.join();
+		}
+		CPPUNIT_ASSERT_EQUAL(0, failures.load());
+
+		// Replacing with shorter content
+		CPPUNIT_ASSERT(w.write(root + "/f0", make_buffer("short")));
+		CPPUNIT_ASSERT_EQUAL(std::string("short"), read_file(root + "/f0"));
+
+		// Asynchronous writes, applied in order
+		w.write(root + "/async", make_buffer("first"), h);
+		w.write(root + "/async", make_buffer("second"), h);
+		{
+			fz::scoped_lock l(h.mtx_);
+			while (h.results_.size() < 2) {
+				CPPUNIT_ASSERT(h.cond_.wait(l, fz::duration::from_seconds(10)));
+			}
+			CPPUNIT_ASSERT_EQUAL(root + "/async", h.results_[0].first);
+			CPPUNIT_ASSERT(h.results_[0].second);
+			CPPUNIT_ASSERT(h.results_[1].second);
+		}
+		CPPUNIT_ASSERT_EQUAL(std::string("second"), read_file(root + "/async"));
+
+		// Errors are reported, without leaving temporary files behind
+		CPPUNIT_ASSERT(!w.write(root + "/nonexisting/file", make_buffer("data")));
+	}
+
+	auto const names = list_dir(root);
+	std::vector<std::string> expected{"async", "f0", "f1", "f2", "f3", "f4", "f5", "f6", "f7"};
+	CPPUNIT_ASSERT(names == expected);
+
+	loop.stop(true);
+
+	for (auto const& name : names) {
+		fz::remove_file(fz::to_native(root + "/" + name));
+	}
+	rmdir(root.c_str());
+}
+
+namespace {
+int64_t allocated(std::string const& path)
+{
+	struct stat s{};
+	if (stat(path.c_str(), &s)) {
+		return -1;
+	}
+	return static_cast<int64_t>(s.st_blocks) * 512;
+}
+}
+
+void file_test::test_copy_sparse()
+{
+	char tmpl[] = "/tmp/fzfileXXXXXX";
+	CPPUNIT_ASSERT(mkdtemp(tmpl));
+	std::string const root = tmpl;
+	std::string const source = root + "/source";
+	std::string const dest = root + "/dest";
+
+	int64_t const size = 8 * 1024 * 1024;
+	{
+		// Two small data extents, everything else is holes
+		fz::file f(source, fz::file::writing, fz::file::empty);
+		CPPUNIT_ASSERT(f.opened());
+		CPPUNIT_ASSERT_EQUAL(int64_t(1024 * 1024), f.seek(1024 * 1024, fz::file::begin));
+		CPPUNIT_ASSERT_EQUAL(int64_t(5), f.write("hello", 5));
+		CPPUNIT_ASSERT_EQUAL(int64_t(5 * 1024 * 1024), f.seek(5 * 1024 * 1024, fz::file::begin));
+		CPPUNIT_ASSERT_EQUAL(int64_t(5), f.write("world", 5));
+		CPPUNIT_ASSERT_EQUAL(size, f.seek(size, fz::file::begin));
+		CPPUNIT_ASSERT(f.truncate());
+	}
+
+	CPPUNIT_ASSERT(fz::copy_file(source, dest));
+
+	std::string const expected = read_file(source);
+	CPPUNIT_ASSERT_EQUAL(static_cast<size_t>(size), expected.size());
+	CPPUNIT_ASSERT(read_file(dest) == expected);
+
+	if (allocated(source) < size / 2) {
+		// Filesystem supports holes, the copy needs to preserve them
+		CPPUNIT_ASSERT(allocated(dest) < size / 2);
+	}
+
+	// Moving across filesystems copies the same way. Within one it just renames.
+	CPPUNIT_ASSERT(fz::rename_file(dest, root + "/moved"));
+	CPPUNIT_ASSERT(read_file(root + "/moved") == expected);
+
+	CPPUNIT_ASSERT(!fz::copy_file(root + "/nonexisting", dest));
+
+	fz::remove_file(fz::to_native(source));
+	fz::remove_file(fz::to_native(root + "/moved"));
+	rmdir(root.c_str());
+}
+
+void file_test::test_rename_across()
+{
+	// Needs a second filesystem, tmpfs usually is one
+	struct stat tmp{};
+	struct stat shm{};
+	if (stat("/tmp", &tmp) || stat("/dev/shm", &shm) || tmp.st_dev == shm.st_dev || access("/dev/shm", W_OK)) {
+		return;
+	}
+
+	char tmpl[] = "/tmp/fzfileXXXXXX";
+	CPPUNIT_ASSERT(mkdtemp(tmpl));
+	std::string const root = tmpl;
+	std::string const source = root + "/source";
+
+	char other_tmpl[] = "/dev/shm/fzfileXXXXXX";
+	CPPUNIT_ASSERT(mkdtemp(other_tmpl));
+	std::string const other = other_tmpl;
+	std::string const dest = other + "/dest";
+
+	auto const data = fz::random_bytes(300000);
+	{
+		fz::file f(source, fz::file::writing, fz::file::empty);
+		CPPUNIT_ASSERT(f.opened());
+		CPPUNIT_ASSERT_EQUAL(static_cast<int64_t>(data.size()), f.write(data.data(), data.size()));
+	}
+	std::string const expected(data.begin(), data.end());
+
+	// Without copying, moving across filesystems fails and leaves the source alone
+	auto res = fz::rename_file(source, dest, false);
+	CPPUNIT_ASSERT(!res);
+	CPPUNIT_ASSERT_EQUAL(fz::result::other, res.error_);
+	CPPUNIT_ASSERT_EQUAL(int(EXDEV), static_cast<int>(res.raw_));
+	CPPUNIT_ASSERT(read_file(source) == expected);
+
+	// Otherwise the file gets copied and the source removed
+	CPPUNIT_ASSERT(fz::rename_file(source, dest));
+	CPPUNIT_ASSERT(read_file(dest) == expected);
+	CPPUNIT_ASSERT_EQUAL(fz::local_filesys::unknown, fz::local_filesys::get_file_type(fz::to_native(source)));
+
+	fz::remove_file(fz::to_native(dest));
+	rmdir(other.c_str());
+	rmdir(root.c_str());
+}
+
+void file_test::test_hashing_file()
+{
+	char tmpl[] = "/tmp/fzfileXXXXXX";
+	CPPUNIT_ASSERT(mkdtemp(tmpl));
+	std::string const name = std::string(tmpl) + "/hashed";
+
+	auto const data = fz::random_bytes(100000);
+	auto const expected = fz::sha256(data);
+
+	{
+		fz::file f(name, fz::file::writing, fz::file::empty);
+		CPPUNIT_ASSERT(f.opened());
+
+		fz::hash_accumulator sha256(fz::hash_algorithm::sha256);
+		fz::hash_accumulator md5(fz::hash_algorithm::md5);
+		fz::hashing_file hf(f);
+		hf.add_hash(sha256);
+		hf.add_hash(md5);
+
+		size_t pos{};
+		while (pos < data.size()) {
+			size_t const chunk = std::min(data.size() - pos, size_t(4097));
+			CPPUNIT_ASSERT_EQUAL(static_cast<int64_t>(chunk), hf.write(data.data() + pos, static_cast<int64_t>(chunk)));
+			pos += chunk;
+		}
+		CPPUNIT_ASSERT_EQUAL(static_cast<uint64_t>(data.size()), hf.get_bytes());
+		CPPUNIT_ASSERT(sha256.digest() == expected);
+		CPPUNIT_ASSERT(md5.digest() == fz::md5(data));
+	}
+
+	{
+		fz::file f(name, fz::file::reading);
+		CPPUNIT_ASSERT(f.opened());
+
+		fz::hash_accumulator sha256(fz::hash_algorithm::sha256);
+		fz::hashing_file hf(f);
+		hf.add_hash(sha256);
+
+		uint8_t buf[1000];
+		while (hf.read(buf, sizeof(buf)) > 0) {
+		}
+		CPPUNIT_ASSERT_EQUAL(static_cast<uint64_t>(data.size()), hf.get_bytes());
+		CPPUNIT_ASSERT(sha256.digest() == expected);
+	}
+
+	fz::remove_file(fz::to_native(name));
+	rmdir(tmpl);
+}
+#endif
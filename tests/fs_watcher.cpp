@@ -0,0 +1,254 @@
+#include "../lib/libfilezilla/event_loop.hpp"
+#include "../lib/libfilezilla/fs_watcher.hpp"
+#include "../lib/libfilezilla/local_filesys.hpp"
+#include "../lib/libfilezilla/util.hpp"
+
+#ifdef __linux__
+#include <fcntl.h>
+#include <stdlib.h>
+#include <unistd.h>
+#endif
+
+#include "test_utils.hpp"
+
+#include <map>
+
+class fs_watcher_test final : public CppUnit::TestFixture
+{
+	CPPUNIT_TEST_SUITE(fs_watcher_test);
+#ifdef __linux__
+	CPPUNIT_TEST(test_watch);
+	CPPUNIT_TEST(test_nested);
+	CPPUNIT_TEST(test_move);
+#endif
+	CPPUNIT_TEST_SUITE_END();
+
+public:
+	void setUp() {}
+	void tearDown() {}
+
+#ifdef __linux__
+	void test_watch();
+	void test_nested();
+	void test_move();
+#endif
+};
+
+CPPUNIT_TEST_SUITE_REGISTRATION(fs_watcher_test);
+
+#ifdef __linux__
+namespace {
+struct watch_handler final : public fz::event_handler
+{
+	watch_handler(fz::event_loop & loop)
+		: fz::event_handler(loop)
+	{}
+
+	virtual ~watch_handler()
+	{
+		remove_handler();
+	}
+
+	virtual void operator()(fz::event_base const& ev) override
+	{
+		fz::dispatch<fz::fs_watcher_event>(ev, this, &watch_handler::on_changes);
+	}
+
+	void on_changes(fz::fs_watcher * w)
+	{
+		auto changes = w->fetch_changes();
+
+		fz::scoped_lock l(mtx_);
+		for (auto const& c : changes) {
+			changes_[c.path] |= c.changes;
+		}
+		++events_;
+		cond_.signal(l);
+	}
+
+	// Waits until the path has seen the passed changes
+	bool wait(std::string const& path, unsigned int changes)
+	{
+		fz::scoped_lock l(mtx_);
+		while ((changes_[path] & changes) != changes) {
+			if (!cond_.wait(l, fz::duration::from_seconds(10))) {
+				return false;
+			}
+		}
+		return true;
+	}
+
+	fz::mutex mtx_;
+	fz::condition cond_;
+	std::map<std::string, unsigned int> changes_;
+	int events_{};
+};
+
+void write_file(std::string const& path, std::string const& data)
+{
+	int fd = open(path.c_str(), O_WRONLY | O_CREAT | O_APPEND, 0600);
+	CPPUNIT_ASSERT(fd != -1);
+	CPPUNIT_ASSERT_EQUAL(static_cast<ssize_t>(data.size()), write(fd, data.c_str(), data.size()));
+	close(fd);
+}
+
+bool wait_count(fz::fs_watcher const& w, size_t count)
+{
+	for (int i = 0; i < 1000 && w.watch_count() != count; ++i) {
+		fz::sleep(fz::duration::from_milliseconds(10));
+	}
+	return w.watch_count() == count;
+}
+}
+
+void fs_watcher_test::test_watch()
+{
+	char tmpl[] = "/tmp/fzwatchXXXXXX";
+	CPPUNIT_ASSERT(mkdtemp(tmpl));
+	std::string const root = tmpl;
+
+	CPPUNIT_ASSERT(fz::mkdir(root + "/a/b", true));
+
+	fz::thread_pool pool;
+	fz::event_loop loop(pool);
+	watch_handler h(loop);
+
+	{
+		fz::fs_watcher w(pool, h, fz::duration::from_milliseconds(50), 4);
+
+		CPPUNIT_ASSERT_EQUAL(ENOENT, w.add(root + "/nonexisting"));
+		CPPUNIT_ASSERT_EQUAL(0, w.add(root + "/", true));
+		CPPUNIT_ASSERT_EQUAL(size_t(3), w.watch_count());
+
+		// A burst of changes to the same file is coalesced
+		for (int i = 0; i < 20; ++i) {
+			write_file(root + "/a/b/f", "data");
+		}
+		CPPUNIT_ASSERT(h.wait(root + "/a/b/f", fz::fs_change::created | fz::fs_change::modified));
+		{
+			fz::scoped_lock l(h.mtx_);
+			CPPUNIT_ASSERT(h.events_ < 5);
+		}
+
+		// New subdirectories get watched
+		CPPUNIT_ASSERT(fz::mkdir(root + "/c", false));
+		CPPUNIT_ASSERT(h.wait(root + "/c", fz::fs_change::created));
+		CPPUNIT_ASSERT_EQUAL(size_t(4), w.watch_count());
+
+		write_file(root + "/c/g", "data");
+		CPPUNIT_ASSERT(h.wait(root + "/c/g", fz::fs_change::created));
+
+		CPPUNIT_ASSERT_EQUAL(0, unlink((root + "/c/g").c_str()));
+		CPPUNIT_ASSERT(h.wait(root + "/c/g", fz::fs_change::removed));
+
+		// Exceeding the limit on watches is reported as overflow
+		CPPUNIT_ASSERT(fz::mkdir(root + "/d", false));
+		CPPUNIT_ASSERT(h.wait(std::string(), fz::fs_change::overflow));
+		CPPUNIT_ASSERT_EQUAL(size_t(4), w.watch_count());
+
+		w.remove(root);
+		CPPUNIT_ASSERT_EQUAL(size_t(0), w.watch_count());
+	}
+
+	loop.stop(true);
+
+	unlink((root + "/a/b/f").c_str());
+	rmdir((root + "/a/b").c_str());
+	rmdir((root + "/a").c_str());
+	rmdir((root + "/c").c_str());
+	rmdir((root + "/d").c_str());
+	rmdir(root.c_str());
+}
+
+void fs_watcher_test::test_nested()
+{
+	char tmpl[] = "/tmp/fzwatchXXXXXX";
+	CPPUNIT_ASSERT(mkdtemp(tmpl));
+	std::string const root = tmpl;
+
+	CPPUNIT_ASSERT(fz::mkdir(root + "/a/b/c", true));
+
+	fz::thread_pool pool;
+	fz::event_loop loop(pool);
+	watch_handler h(loop);
+
+	{
+		fz::fs_watcher w(pool, h, fz::duration::from_milliseconds(50));
+
+		CPPUNIT_ASSERT_EQUAL(0, w.add(root, true));
+		CPPUNIT_ASSERT_EQUAL(0, w.add(root + "/a/b", true));
+		CPPUNIT_ASSERT_EQUAL(0, w.add(root + "/a"));
+		CPPUNIT_ASSERT_EQUAL(size_t(4), w.watch_count());
+
+		// Separately added subdirectories remain watched
+		w.remove(root);
+		CPPUNIT_ASSERT_EQUAL(size_t(3), w.watch_count());
+
+		write_file(root + "/a/b/c/f", "data");
+		CPPUNIT_ASSERT(h.wait(root + "/a/b/c/f", fz::fs_change::created));
+
+		// Still covered by the recursive parent
+		CPPUNIT_ASSERT_EQUAL(0, w.add(root, true));
+		w.remove(root + "/a/b");
+		CPPUNIT_ASSERT_EQUAL(size_t(4), w.watch_count());
+
+		w.remove(root);
+		CPPUNIT_ASSERT_EQUAL(size_t(1), w.watch_count());
+
+		w.remove(root + "/a");
+		CPPUNIT_ASSERT_EQUAL(size_t(0), w.watch_count());
+	}
+
+	loop.stop(true);
+
+	unlink((root + "/a/b/c/f").c_str());
+	rmdir((root + "/a/b/c").c_str());
+	rmdir((root + "/a/b").c_str());
+	rmdir((root + "/a").c_str());
+	rmdir(root.c_str());
+}
+
+void fs_watcher_test::test_move()
+{
+	char tmpl[] = "/tmp/fzwatchXXXXXX";
+	CPPUNIT_ASSERT(mkdtemp(tmpl));
+	std::string const root = tmpl;
+
+	CPPUNIT_ASSERT(fz::mkdir(root + "/w/a/b", true));
+
+	fz::thread_pool pool;
+	fz::event_loop loop(pool);
+	watch_handler h(loop);
+
+	{
+		fz::fs_watcher w(pool, h, fz::duration::from_milliseconds(50));
+
+		CPPUNIT_ASSERT_EQUAL(0, w.add(root + "/w", true));
+		CPPUNIT_ASSERT_EQUAL(size_t(3), w.watch_count());
+
+		// Moved within the watched tree, watched under the new path
+		CPPUNIT_ASSERT_EQUAL(0, rename((root + "/w/a").c_str(), (root + "/w/e").c_str()));
+		CPPUNIT_ASSERT(h.wait(root + "/w/e", fz::fs_change::created));
+		write_file(root + "/w/e/b/f", "data");
+		CPPUNIT_ASSERT(h.wait(root + "/w/e/b/f", fz::fs_change::created));
+		CPPUNIT_ASSERT_EQUAL(size_t(3), w.watch_count());
+		{
+			fz::scoped_lock l(h.mtx_);
+			CPPUNIT_ASSERT(h.changes_.find(root + "/w/a/b/f") == h.changes_.end());
+		}
+
+		// Moved elsewhere, no longer watched
+		CPPUNIT_ASSERT_EQUAL(0, rename((root + "/w/e").c_str(), (root + "/e").c_str()));
+		CPPUNIT_ASSERT(h.wait(root + "/w/e", fz::fs_change::removed));
+		CPPUNIT_ASSERT(wait_count(w, 1));
+	}
+
+	loop.stop(true);
+
+	unlink((root + "/e/b/f").c_str());
+	rmdir((root + "/e/b").c_str());
+	rmdir((root + "/e").c_str());
+	rmdir((root + "/w").c_str());
+	rmdir(root.c_str());
+}
+#endif
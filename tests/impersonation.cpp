@@ -0,0 +1,181 @@
+#include "../lib/libfilezilla/impersonation.hpp"
+#include "../lib/libfilezilla/thread_pool.hpp"
+
+#include <cppunit/extensions/HelperMacros.h>
+
+#include <map>
+
+#if !FZ_WINDOWS
+#include <pwd.h>
+#include <unistd.h>
+#endif
+
+class ImpersonationTest final : public CppUnit::TestFixture
+{
+	CPPUNIT_TEST_SUITE(ImpersonationTest);
+#if !FZ_WINDOWS
+	CPPUNIT_TEST(testService);
+	CPPUNIT_TEST(testCancel);
+#endif
+	CPPUNIT_TEST_SUITE_END();
+
+public:
+	void setUp() {}
+	void tearDown() {}
+
+#if !FZ_WINDOWS
+	void testService();
+	void testCancel();
+#endif
+};
+
+CPPUNIT_TEST_SUITE_REGISTRATION(ImpersonationTest);
+
+#if !FZ_WINDOWS
+namespace {
+fz::native_string current_user()
+{
+	auto pwd = getpwuid(geteuid());
+	return pwd ? fz::native_string(pwd->pw_name) : fz::native_string();
+}
+
+class auth_handler final : public fz::event_handler
+{
+public:
+	auth_handler(fz::event_loop & l)
+		: fz::event_handler(l)
+	{}
+
+	virtual ~auth_handler()
+	{
+		remove_handler();
+	}
+
+	void operator()(fz::event_base const& ev) override
+	{
+		fz::dispatch<fz::impersonation_event>(ev, this, &auth_handler::on_result);
+	}
+
+	void on_result(fz::impersonation_service*, uint64_t id, std::unique_ptr<fz::impersonation_token> const& token)
+	{
+		fz::scoped_lock l(m_);
+		results_[id] = std::move(*token);
+		cond_.signal(l);
+	}
+
+	bool wait(size_t count)
+	{
+		fz::scoped_lock l(m_);
+		while (results_.size() < count) {
+			if (!cond_.wait(l, fz::duration::from_seconds(5))) {
+				return false;
+			}
+		}
+		return true;
+	}
+
+	fz::mutex m_;
+	fz::condition cond_;
+	std::map<uint64_t, fz::impersonation_token> results_;
+};
+
+struct block_event_type;
+typedef fz::simple_event<block_event_type> block_event;
+
+// Keeps the event loop busy until released
+class blocker final : public fz::event_handler
+{
+public:
+	blocker(fz::event_loop & l)
+		: fz::event_handler(l)
+	{}
+
+	virtual ~blocker()
+	{
+		release();
+		remove_handler();
+	}
+
+	void operator()(fz::event_base const&) override
+	{
+		fz::scoped_lock l(m_);
+		while (!released_) {
+			cond_.wait(l);
+		}
+	}
+
+	void release()
+	{
+		fz::scoped_lock l(m_);
+		released_ = true;
+		cond_.signal(l);
+	}
+
+	fz::mutex m_;
+	fz::condition cond_;
+	bool released_{};
+};
+}
+
+void ImpersonationTest::testService()
+{
+	auto const user = current_user();
+	CPPUNIT_ASSERT(!user.empty());
+
+	fz::thread_pool pool;
+	fz::event_loop loop(pool);
+	auth_handler h(loop);
+
+	fz::impersonation_service service(pool, 2);
+
+	uint64_t const first = service.authenticate(h, user, fz::impersonation_flag::pwless);
+	uint64_t const second = service.authenticate(h, user, fz::impersonation_flag::pwless);
+	uint64_t const unknown = service.authenticate(h, fzT("no such user, really"), fz::impersonation_flag::pwless);
+	CPPUNIT_ASSERT(first && second && unknown);
+	CPPUNIT_ASSERT(first != second);
+
+	CPPUNIT_ASSERT(h.wait(3));
+
+	fz::scoped_lock l(h.m_);
+	auto const& t1 = h.results_[first];
+	auto const& t2 = h.results_[second];
+	CPPUNIT_ASSERT(t1);
+	CPPUNIT_ASSERT(t1.username() == user);
+
+	// Second request may have been served from the cache, must not matter.
+	fz::impersonation_token direct(user, fz::impersonation_flag::pwless);
+	CPPUNIT_ASSERT(t1 == t2);
+	CPPUNIT_ASSERT(t1 == direct);
+
+	CPPUNIT_ASSERT(!h.results_[unknown]);
+}
+
+void ImpersonationTest::testCancel()
+{
+	auto const user = current_user();
+
+	fz::thread_pool pool;
+	fz::event_loop loop(pool);
+	auth_handler h(loop);
+	auth_handler h2(loop);
+	blocker b(loop);
+
+	fz::impersonation_service service(pool, 1, fz::duration());
+
+	// Results already sent must get discarded as well
+	b.send_event<block_event>();
+	for (int i = 0; i < 10; ++i) {
+		service.authenticate(h, user, fz::impersonation_flag::pwless);
+	}
+	uint64_t const id = service.authenticate(h2, user, fz::impersonation_flag::pwless);
+	service.cancel(h);
+	b.release();
+
+	CPPUNIT_ASSERT(h2.wait(1));
+	CPPUNIT_ASSERT(h2.results_[id]);
+
+	// All of h's requests were queued before h2's, nothing can arrive anymore.
+	fz::scoped_lock l(h.m_);
+	CPPUNIT_ASSERT(h.results_.empty());
+}
+#endif
@@ -1,3 +1,4 @@
+#include "../lib/libfilezilla/background_rate_limiter.hpp"
 #include "../lib/libfilezilla/rate_limiter.hpp"
 
 #include <array>
@@ -5,10 +6,10 @@
 
 struct handler : public fz::event_handler
 {
-	handler(fz::event_loop & loop)
+	handler(fz::event_loop & loop, bool tickless)
 	    : fz::event_handler(loop)
 	    , loop_(loop)
-	    , mgr_(loop)
+	    , mgr_(loop, tickless)
 	    , start_(fz::monotonic_clock::now())
 	{
 		mgr_.add(&limiter_);
@@ -97,13 +98,190 @@ struct handler : public fz::event_handler
 	fz::monotonic_clock start_;
 };
 
+// Background traffic first uses the spare capacity, then yields once there is foreground traffic
+struct background_handler : public fz::event_handler
+{
+	background_handler(fz::event_loop & loop)
+	    : fz::event_handler(loop)
+	    , loop_(loop)
+	    , mgr_(loop)
+	    , background_(loop, fz::rate::unlimited, 100)
+	    , start_(fz::monotonic_clock::now())
+	{
+		mgr_.add(&limiter_);
+		limiter_.set_limits(10000, fz::rate::unlimited);
+		limiter_.add(&foreground_);
+		limiter_.add(&background_.limiter());
+		foreground_.add(&buckets_[0]);
+		background_.limiter().add(&buckets_[1]);
+		background_.add_foreground(foreground_);
+
+		add_timer(fz::duration::from_milliseconds(10), false);
+	}
+
+	~background_handler()
+	{
+		background_.remove_foreground(foreground_);
+		remove_handler();
+	}
+
+	void operator()(fz::event_base const& ev)
+	{
+		fz::dispatch<fz::timer_event>(ev, this, &background_handler::on_timer);
+	}
+
+	void on_timer(fz::timer_id const&)
+	{
+		auto const now = fz::monotonic_clock::now();
+		int64_t const elapsed = (now - start_).get_milliseconds();
+
+		int const phase = static_cast<int>(elapsed / 5000);
+		if (phase >= 2) {
+			std::cout << "Background rate alone is " << consumed_[0][1] / 2 << " bytes/s\n";
+			std::cout << "Foreground rate is " << consumed_[1][0] / 2 << " bytes/s, background rate is " << consumed_[1][1] / 2 << " bytes/s\n";
+
+			if (consumed_[0][1] < 2 * 8000) {
+				std::cout << "Background traffic did not use spare capacity" << std::endl;
+				exit(1);
+			}
+			if (consumed_[1][1] * 10 > consumed_[1][0]) {
+				std::cout << "Background traffic did not yield" << std::endl;
+				exit(1);
+			}
+			loop_.stop();
+			return;
+		}
+
+		for (size_t i = 0; i < buckets_.size(); ++i) {
+			if (!i && !phase) {
+				// No foreground traffic yet
+				continue;
+			}
+			fz::rate::type amount = 1000;
+			fz::rate::type available = buckets_[i].available(fz::direction::inbound);
+			if (available < amount) {
+				amount = available;
+			}
+			if (elapsed % 5000 >= 3000) {
+				// Measure after the limits have settled
+				consumed_[phase][i] += amount;
+			}
+			buckets_[i].consume(fz::direction::inbound, amount);
+		}
+	}
+
+	fz::event_loop & loop_;
+
+	fz::rate_limit_manager mgr_;
+	fz::rate_limiter limiter_;
+	fz::rate_limiter foreground_;
+	fz::background_rate_limiter background_;
+
+	std::array<fz::bucket, 2> buckets_;
+	fz::rate::type consumed_[2][2]{};
+
+	fz::monotonic_clock start_;
+};
+
+// In tickless mode, the manager's timer only runs while buckets are waiting for tokens
+struct tickless_handler : public fz::event_handler
+{
+	tickless_handler(fz::event_loop & loop)
+	    : fz::event_handler(loop)
+	    , loop_(loop)
+	    , mgr_(loop, true)
+	    , start_(fz::monotonic_clock::now())
+	{
+		mgr_.add(&limiter_);
+		limiter_.set_limits(1000, fz::rate::unlimited);
+		limiter_.add(&bucket_);
+
+		add_timer(fz::duration::from_milliseconds(100), false);
+	}
+
+	~tickless_handler()
+	{
+		remove_handler();
+	}
+
+	void operator()(fz::event_base const& ev)
+	{
+		fz::dispatch<fz::timer_event>(ev, this, &tickless_handler::on_timer);
+	}
+
+	void on_timer(fz::timer_id const&)
+	{
+		auto const now = fz::monotonic_clock::now();
+		int64_t const elapsed = (now - start_).get_milliseconds();
+
+		// Traffic below the limit, then saturating traffic, then below the limit again
+		int const phase = static_cast<int>(elapsed / 1500);
+		if (phase >= 3) {
+			if (mgr_.timer_running()) {
+				std::cout << "Timer still running after contention ended" << std::endl;
+				exit(1);
+			}
+			loop_.stop();
+			return;
+		}
+
+		if (phase == 1) {
+			fz::rate::type const available = bucket_.available(fz::direction::inbound);
+			bucket_.consume(fz::direction::inbound, available);
+			if (!mgr_.timer_running()) {
+				std::cout << "Timer not running while bucket is waiting" << std::endl;
+				exit(1);
+			}
+		}
+		else {
+			if (phase == 0 && elapsed >= 1000 && mgr_.timer_running()) {
+				std::cout << "Timer running while buckets are idle" << std::endl;
+				exit(1);
+			}
+			bucket_.consume(fz::direction::inbound, 10);
+		}
+	}
+
+	fz::event_loop & loop_;
+
+	fz::rate_limit_manager mgr_;
+	fz::rate_limiter limiter_;
+	fz::bucket bucket_;
+
+	fz::monotonic_clock start_;
+};
+
 int main()
 {
-	fz::event_loop loop(fz::event_loop::threadless);
+	for (bool tickless : {false, true}) {
+		std::cout << (tickless ? "Tickless buckets\n" : "Periodically refilled buckets\n");
+
+		fz::event_loop loop(fz::event_loop::threadless);
 
-	handler h(loop);
+		handler h(loop, tickless);
 
-	loop.run();
+		loop.run();
+	}
+
+	{
+		std::cout << "Tickless timer\n";
+
+		fz::event_loop loop(fz::event_loop::threadless);
+
+		tickless_handler h(loop);
+
+		loop.run();
+	}
+
+	{
+		std::cout << "Background limiter\n";
+
+		fz::event_loop loop(fz::event_loop::threadless);
+
+		background_handler h(loop);
+
+		loop.run();
+	}
 
 	return 0;
 }
@@ -0,0 +1,217 @@
+#include "../lib/libfilezilla/libfilezilla.hpp"
+
+#if !FZ_WINDOWS
+#include "../lib/libfilezilla/event_loop.hpp"
+#include "../lib/libfilezilla/hash.hpp"
+#include "../lib/libfilezilla/shm_ring.hpp"
+#include "../lib/libfilezilla/thread_pool.hpp"
+
+#include <sys/socket.h>
+#include <unistd.h>
+#endif
+
+#include "test_utils.hpp"
+
+class shm_ring_test final : public CppUnit::TestFixture
+{
+	CPPUNIT_TEST_SUITE(shm_ring_test);
+#if !FZ_WINDOWS
+	CPPUNIT_TEST(test_transfer);
+#endif
+	CPPUNIT_TEST_SUITE_END();
+
+public:
+	void setUp() {}
+	void tearDown() {}
+
+#if !FZ_WINDOWS
+	void test_transfer();
+#endif
+};
+
+CPPUNIT_TEST_SUITE_REGISTRATION(shm_ring_test);
+
+#if !FZ_WINDOWS
+namespace {
+size_t const total = 8 * 1024 * 1024;
+
+struct base : public fz::event_handler
+{
+	base(fz::event_loop & loop)
+		: fz::event_handler(loop)
+	{}
+
+	// Odd chunk sizes, so that spans frequently wrap around the end of the ring
+	size_t next_chunk()
+	{
+		chunk_ = (chunk_ * 7 + 13) % 3001 + 1;
+		return chunk_;
+	}
+
+	std::unique_ptr<fz::shm_ring> ring_;
+
+	fz::hash_accumulator hash_{fz::hash_algorithm::sha256};
+	size_t transferred_{};
+	size_t chunk_{};
+
+	fz::mutex mtx_;
+	fz::condition cond_;
+	bool done_{};
+	bool peer_closed_{};
+};
+
+struct producer final : public base
+{
+	producer(fz::event_loop & loop)
+		: base(loop)
+	{}
+
+	virtual ~producer()
+	{
+		remove_handler();
+	}
+
+	virtual void operator()(fz::event_base const& ev) override
+	{
+		fz::dispatch<fz::shm_ring_event>(ev, this, &producer::on_ring);
+	}
+
+	void on_ring(fz::shm_ring*)
+	{
+		while (transferred_ < total) {
+			auto buf = ring_->get_write_buffer();
+			if (!buf.capacity()) {
+				return;
+			}
+			size_t const len = std::min({buf.capacity(), next_chunk(), total - transferred_});
+			uint8_t * p = buf.get(len);
+			for (size_t i = 0; i < len; ++i) {
+				p[i] = static_cast<uint8_t>((transferred_ + i) * 31 + 7);
+			}
+			hash_.update(p, len);
+			CPPUNIT_ASSERT_EQUAL(0, ring_->commit(len));
+			transferred_ += len;
+		}
+
+		fz::scoped_lock l(mtx_);
+		if (!done_) {
+			done_ = true;
+			cond_.signal(l);
+		}
+	}
+};
+
+struct consumer final : public base
+{
+	consumer(fz::event_loop & loop)
+		: base(loop)
+	{}
+
+	virtual ~consumer()
+	{
+		remove_handler();
+	}
+
+	virtual void operator()(fz::event_base const& ev) override
+	{
+		fz::dispatch<fz::shm_ring_event>(ev, this, &consumer::on_ring);
+	}
+
+	void on_ring(fz::shm_ring*)
+	{
+		while (true) {
+			auto buf = ring_->get_read_buffer();
+			if (buf.empty()) {
+				break;
+			}
+			size_t const len = std::min(buf.size(), next_chunk());
+			hash_.update(buf.get(), len);
+			CPPUNIT_ASSERT_EQUAL(0, ring_->release(len));
+			transferred_ += len;
+		}
+
+		fz::scoped_lock l(mtx_);
+		if (!done_ && transferred_ == total) {
+			done_ = true;
+			cond_.signal(l);
+		}
+		if (!peer_closed_ && ring_->peer_closed()) {
+			peer_closed_ = true;
+			cond_.signal(l);
+		}
+	}
+};
+}
+
+void shm_ring_test::test_transfer()
+{
+	fz::thread_pool pool;
+	fz::event_loop producer_loop(pool);
+	fz::event_loop consumer_loop(pool);
+
+	producer p(producer_loop);
+	consumer c(consumer_loop);
+
+	int fds[2];
+	CPPUNIT_ASSERT(!socketpair(AF_UNIX, SOCK_STREAM, 0, fds));
+
+	int error{};
+	p.ring_ = fz::shm_ring::create(pool, &p, 6000, fz::shm_ring::role::producer, error);
+	CPPUNIT_ASSERT(p.ring_);
+	CPPUNIT_ASSERT_EQUAL(0, error);
+	CPPUNIT_ASSERT(p.ring_->capacity() >= 6000);
+	CPPUNIT_ASSERT(!(p.ring_->capacity() & (p.ring_->capacity() - 1)));
+
+	CPPUNIT_ASSERT_EQUAL(0, p.ring_->send(fds[0]));
+
+	auto ring = fz::shm_ring::receive(pool, &c, fds[1], error);
+	CPPUNIT_ASSERT(ring);
+	CPPUNIT_ASSERT(ring->get_role() == fz::shm_ring::role::consumer);
+	CPPUNIT_ASSERT_EQUAL(p.ring_->capacity(), ring->capacity());
+
+	::close(fds[0]);
+	::close(fds[1]);
+
+	{
+		fz::scoped_lock l(c.mtx_);
+		c.ring_ = std::move(ring);
+	}
+
+	// Roles are enforced
+	CPPUNIT_ASSERT(!c.ring_->get_write_buffer().capacity());
+	CPPUNIT_ASSERT(p.ring_->get_read_buffer().empty());
+
+	p.send_event<fz::shm_ring_event>(p.ring_.get());
+	c.send_event<fz::shm_ring_event>(c.ring_.get());
+
+	{
+		fz::scoped_lock l(p.mtx_);
+		while (!p.done_) {
+			CPPUNIT_ASSERT(p.cond_.wait(l, fz::duration::from_minutes(1)));
+		}
+	}
+	{
+		fz::scoped_lock l(c.mtx_);
+		while (!c.done_) {
+			CPPUNIT_ASSERT(c.cond_.wait(l, fz::duration::from_minutes(1)));
+		}
+	}
+
+	CPPUNIT_ASSERT_EQUAL(total, c.transferred_);
+	CPPUNIT_ASSERT(p.hash_.digest() == c.hash_.digest());
+	CPPUNIT_ASSERT(!p.ring_->broken());
+	CPPUNIT_ASSERT(!c.ring_->broken());
+
+	// Consumer gets notified if the producer goes away
+	producer_loop.stop(true);
+	p.ring_.reset();
+	{
+		fz::scoped_lock l(c.mtx_);
+		while (!c.peer_closed_) {
+			CPPUNIT_ASSERT(c.cond_.wait(l, fz::duration::from_seconds(10)));
+		}
+	}
+	consumer_loop.stop(true);
+	c.ring_.reset();
+}
+#endif